@@ -93,4 +93,43 @@
  * x86 pagesize again. */
 #define VIRTIO_PCI_VRING_ALIGN		4096
 
+/* Modern (virtio 1.0) transport. The device structures are in memory BARs,
+ * found through vendor specific PCI capabilities of these types */
+#define VIRTIO_PCI_CAP_COMMON_CFG	1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define VIRTIO_PCI_CAP_ISR_CFG		3
+#define VIRTIO_PCI_CAP_DEVICE_CFG	4
+
+/* Fields of the vendor capability */
+#define VIRTIO_PCI_CAP_CFG_TYPE		3
+#define VIRTIO_PCI_CAP_BAR		4
+#define VIRTIO_PCI_CAP_OFFSET		8
+#define VIRTIO_PCI_NOTIFY_CAP_MULT	16
+
+/* Common configuration structure */
+typedef struct {
+	/* About the whole device */
+	uint32_t device_feature_select;
+	uint32_t device_feature;
+	uint32_t guest_feature_select;
+	uint32_t guest_feature;
+	uint16_t msix_config;
+	uint16_t num_queues;
+	uint8_t device_status;
+	uint8_t config_generation;
+
+	/* About the selected virtqueue */
+	uint16_t queue_select;
+	uint16_t queue_size;
+	uint16_t queue_msix_vector;
+	uint16_t queue_enable;
+	uint16_t queue_notify_off;
+	uint32_t queue_desc_lo;
+	uint32_t queue_desc_hi;
+	uint32_t queue_avail_lo;
+	uint32_t queue_avail_hi;
+	uint32_t queue_used_lo;
+	uint32_t queue_used_hi;
+} VirtIOPCICommonCfg;
+
 #endif /* __VIRTIO_H__ */
@@ -36,10 +36,23 @@ const uint32_t feature_table[] = {
 	VIRTIO_NET_F_MAC,
 	VIRTIO_NET_F_MRG_RXBUF, 
 	VIRTIO_NET_F_CTRL_VQ,
+	VIRTIO_NET_F_MQ,
+	VIRTIO_NET_F_CSUM,
+	VIRTIO_NET_F_GUEST_CSUM,
+	VIRTIO_NET_F_HOST_TSO4,
+	VIRTIO_NET_F_HOST_TSO6,
+	VIRTIO_NET_F_GUEST_TSO4,
+	VIRTIO_NET_F_GUEST_TSO6,
+	VIRTIO_RING_F_INDIRECT_DESC,	// Chained frames are sent through indirect tables
+	VIRTIO_RING_F_EVENT_IDX,	// Notifications only when the other side asks for them
+	VIRTIO_F_RING_PACKED,		// Descriptors written back in place, one cache line per buffer
+	VIRTIO_F_IN_ORDER,		// Buffers used in order, completed in batches
+	VIRTIO_F_VERSION_1,		// Modern transport, the only one offering bits above 31
 };
 
 typedef struct {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM	1	// Use csum_start, csum_offset
+#define VIRTIO_NET_HDR_F_DATA_VALID	2	// Checksum of the received frame is verified
 	uint8_t flags;
 #define VIRTIO_NET_HDR_GSO_NONE		0	// Not a GSO frame
 #define VIRTIO_NET_HDR_GSO_TCPV4	1	// GSO frame, IPv4 TCP (TSO)
@@ -59,6 +72,8 @@ typedef struct {
 	uint8_t mac[6];
 	/* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
 	uint16_t status;
+	/* Maximum number of each of transmit and receive queues (if VIRTIO_NET_F_MQ) */
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed)) VirtIONetConfig;
 
 /* Packet Structure that PacketNgin uses */
@@ -77,7 +92,7 @@ typedef struct {
 typedef struct {
 	uint8_t class;
 	uint8_t cmd;
-	uint8_t cmd_specific_data;
+	uint8_t cmd_specific_data[2];
 	uint8_t ack;
 } __attribute__((packed)) VirtIONetCtrlPacket;
 
@@ -140,4 +155,20 @@ typedef struct {
 #define VIRTIO_NET_CTRL_VLAN_ADD        0
 #define VIRTIO_NET_CTRL_VLAN_DEL        1
 
+/*
+ * Control Receive Flow Steering
+ *
+ * The command VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET enables receive flow steering,
+ * specifying the number of the transmit and receive queues that will be used.
+ * After the command is consumed and acked by the device, the device will not
+ * steer new packets on receive virtqueues other than specified nor read from
+ * transmit virtqueues other than specified. Receive queue i is virtqueue 2i,
+ * transmit queue i is virtqueue 2i + 1 and the control queue follows the
+ * last pair, at 2 * max_virtqueue_pairs.
+ */
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN		1
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX		0x8000
+
 #endif /* _VIRTIO_NET_H_ */
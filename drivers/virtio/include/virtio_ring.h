@@ -59,6 +59,25 @@
 /* Arbitrary descriptor layouts. */ 
 #define VIRTIO_F_ANY_LAYOUT		27 
 
+/* Support for the packed virtqueue layout */
+#define VIRTIO_F_RING_PACKED		34
+
+/* Buffers are used in the order they were made available */
+#define VIRTIO_F_IN_ORDER		35
+
+/* Packed ring descriptor flags, on top of the ones above: a descriptor is
+ * available when AVAIL matches the driver wrap counter and USED does not,
+ * and used when both match the wrap counter of the device. */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+/* Event suppression flags of a packed ring */
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	1
+/* Only if VIRTIO_RING_F_EVENT_IDX: notify at the descriptor in off_wrap */
+#define VRING_PACKED_EVENT_FLAG_DESC	2
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
 /* Virtio ring descriptors: 16 bytes. 
  * These can chain together via "next". */ 
 typedef struct { 
@@ -102,6 +121,37 @@ typedef struct {
 	VringUsed *used; 
 } Vring; 
 
+/* Packed ring descriptor: 16 bytes. The device writes used descriptors
+ * back in place, so there is no avail or used ring. */
+typedef struct {
+	/* Address (guest-physical). */
+	uint64_t addr;
+	/* Length. */
+	uint32_t len;
+	/* Buffer ID, the same on all descriptors of a buffer. */
+	uint16_t id;
+	/* The flags as indicated above, written last on the head descriptor. */
+	volatile uint16_t flags;
+} VringPackedDesc;
+
+/* Event suppression area of a driver or device */
+typedef struct {
+	/* Descriptor ring offset and wrap counter in the top bit */
+	volatile uint16_t off_wrap;
+	/* VRING_PACKED_EVENT_FLAG_* */
+	volatile uint16_t flags;
+} VringPackedEvent;
+
+typedef struct {
+	unsigned int num;
+
+	VringPackedDesc *desc;
+	/* Written by the driver: when to interrupt it */
+	VringPackedEvent *driver;
+	/* Written by the device: when to notify it */
+	VringPackedEvent *device;
+} VringPacked;
+
 /* The standard layout for the ring is a continuous chunk of memory which 
  * looks like this.  We assume num is a power of 2. 
  * 
@@ -131,15 +181,32 @@ typedef struct {
 #define VIRTIO_TX_QUEUE_IDX 	1
 #define VIRTIO_CTRL_QUEUE_IDX 	2
 
+/* Buffer of a packed ring */
+typedef struct {
+	/* Descriptors the buffer takes in the ring */
+	uint16_t num;
+	/* Next free buffer ID, when the buffer is free */
+	uint16_t next;
+	/* Bytes the device may write, the length of a buffer used in an in-order batch */
+	uint32_t len;
+} VringPackedState;
+
 typedef struct {
 	/* Queue index */
 	uint16_t index;
+	/* Kind of queue, the VIRTIO_*_QUEUE_IDX it would have with one queue pair */
+	uint16_t type;
 
-	/* Actual memory layout for this queue */
-	Vring vring;
+	/* Actual memory layout for this queue, by the ring format */
+	union {
+		Vring vring;
+		VringPacked packed_ring;
+	};
 
 	/* I/O Address for kick */
 	uint32_t ioaddr;
+	/* Notification address for kick, modern transport only */
+	volatile uint16_t* notify;
 
 	/* Size of queue */
 	uint32_t size;
@@ -152,6 +219,25 @@ typedef struct {
 
 	/* Last used index we've seen. */
 	uint16_t last_used_idx;
+	/* VIRTIO_RING_F_EVENT_IDX is negotiated: notifications follow the event indices */
+	uint8_t event_idx;
+
+	/* VIRTIO_F_RING_PACKED is negotiated: free_head is the free buffer ID
+	 * list and last_used_idx the ring slot the device uses next */
+	uint8_t packed;
+	/* VIRTIO_F_IN_ORDER is negotiated: the buffer ID is the slot of the
+	 * head descriptor, and one used descriptor may end a batch */
+	uint8_t in_order;
+	/* Packed ring: slot of the next available descriptor and wrap counters */
+	uint16_t avail_idx;
+	uint8_t avail_wrap;
+	uint8_t used_wrap;
+	/* Packed ring, in order: head slot of the last buffer of the batch being used, and its length */
+	uint8_t in_batch;
+	uint16_t batch_last;
+	uint32_t batch_len;
+	/* Packed ring: per buffer ID state */
+	VringPackedState* state;
 
 	/* Tokens for callbacks. For PacketNgin, it's only used by send queue */
 	void *data[];
@@ -167,8 +253,32 @@ static inline void vring_init(Vring* vr, uint32_t num, void* p, uint64_t align)
 
 static inline uint32_t vring_size(uint32_t num, unsigned long align) { 
 	return ((sizeof(VringDesc)*num + 
-		sizeof(uint16_t) * (2 + num) + align - 1) & ~(align - 1)) +
-		sizeof(uint16_t) * 2 + sizeof(VringUsedElem) * num;
+		sizeof(uint16_t) * (3 + num) + align - 1) & ~(align - 1)) +
+		sizeof(uint16_t) * 3 + sizeof(VringUsedElem) * num;
 } 
 
+/* The packed layout: descriptors, then the driver and device event areas */
+static inline void vring_packed_init(VringPacked* vr, uint32_t num, void* p) {
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = p + num * sizeof(VringPackedDesc);
+	vr->device = (void*)vr->driver + sizeof(VringPackedEvent);
+}
+
+static inline uint32_t vring_packed_size(uint32_t num) {
+	return sizeof(VringPackedDesc) * num + sizeof(VringPackedEvent) * 2;
+}
+
+/* The event indices follow the rings, only if VIRTIO_RING_F_EVENT_IDX.
+ * used_event: the driver wants an interrupt once the device used past it.
+ * avail_event: the device wants a notification once the driver made
+ * buffers available past it. */
+#define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
+#define vring_avail_event(vr) (*(volatile uint16_t*)&(vr)->used->ring[(vr)->num])
+
+/* Whether moving an index from old to new_idx crosses event_idx */
+static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old) {
+	return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
 #endif /* __VIRTIO_RING_H__ */
@@ -7,8 +7,11 @@
 #include <driver/nicdev.h>
 #include <vnic.h>
 #include <timer.h>
+#include <util/event.h>
 #include <net/vlan.h>
 #include <net/ether.h>
+#include <mp.h>
+#include <icc.h>
 // Virtio driver header
 #include "virtio.h"
 #include "virtio_config.h"
@@ -19,8 +22,13 @@
 #define MAX_DEVICE_COUNT	8
 #define PAGE_SIZE		4096
 #define MAX_BUF_SIZE		1526 // MTU + VNET_HDR_LEN
+#define RECV_BUF_SIZE		PAGE_SIZE // Static receive buffers are a page apart
+#define MAX_FRAME_SIZE		65536 // Largest frame merged from receive buffers
+#define MAX_SEND_SEGMENTS	48 // Indirect descriptors of a chained frame, the header included
 
 #define BUDGET_SIZE		64
+#define RECV_REFILL_BATCH	16 // Consumed receive buffers given back to the device at once
+#define TX_RECLAIM_SHIFT	1 // Sent frames are reclaimed once less than size >> shift descriptors are free
 
 //extern int printf (const char *__restrict __format, ...);
 
@@ -33,46 +41,332 @@ typedef struct {
 	/* Specified structure */
 	  /* VirtI/O over PCI */
 	PCI_Device* dev;
+	  /* Modern transport: NULL common configuration on a legacy device */
+	volatile VirtIOPCICommonCfg* common;
+	volatile uint8_t* notify;
+	uint32_t notify_multiplier;
+	volatile uint8_t* device_config;
 	  /* VirtI/O network device */
 	VirtIONetConfig config;
 } VirtIODevice;
 
+struct _VirtNetPriv;
+
+/* Receive/transmit queue pair. Only the core owning it touches its virtqueues */
 typedef struct {
+	VirtQueue *rvq, *svq;
+	uint8_t* merge;		// Frames spread over static buffers are copied here
+	uint16_t index;		// Queue pair index, also the tx queue of the NICDevice
+	uint8_t core;		// APIC ID of the core polling the pair
+	struct _VirtNetPriv* priv;
+} VirtNetQueue;
+
+typedef struct _VirtNetPriv {
 	VirtIODevice vdev;
-	VirtQueue *rvq, *svq, *cvq;
+	VirtNetQueue queues[NICDEV_MAX_QUEUE_COUNT];
+	uint16_t queue_count;	// Queue pairs in use
+	VirtQueue *cvq;
 	NICDevice* priv;
 } VirtNetPriv;
 
-/* Pseudo header used by add_buf for transmit */
-// TODO: Partial checksum, GSO needs to be implemented. At that time, real virtio header replaces it
-static void* pseudo_vnet_hdr;
+/* Transmit slot after the vring: header of the frame and the indirect table of a chained frame */
+typedef struct {
+	VirtIONetHDR hdr;
+	VringDesc sg[MAX_SEND_SEGMENTS] __attribute__((aligned(16)));
+} VirtNetSendSlot;
+
+/* Page aligned size of the ring of a virtqueue */
+static inline uint32_t vq_ring_size(uint32_t num, bool packed) {
+	uint32_t size = packed ? vring_packed_size(num) : vring_size(num, VIRTIO_PCI_VRING_ALIGN);
+
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+/* Memory after the vring in the 2MB block of a virtqueue. Both ring formats start with the descriptors */
+static inline void* vq_area(VirtQueue* vq) {
+	return (void*)((uint64_t)vq->vring.desc + vq_ring_size(vq->vring.num, vq->packed));
+}
+
+/* Transmit slot: by descriptor pair on a split ring, by buffer ID on a packed ring */
+static inline VirtNetSendSlot* send_slot(VirtQueue* vq, uint32_t slot) {
+	return (VirtNetSendSlot*)vq_area(vq) + slot;
+}
+
+/* Indirect table of a chained frame in its slot, the header first. Returns the number of descriptors */
+static uint32_t send_table(VirtQueue* vq, VirtNetSendSlot* slot, Packet* packet) {
+	uint32_t count = 0;
+	if(vq->packed) {
+		// Descriptors of a packed table follow each other and have no flags
+		VringPackedDesc* sg = (VringPackedDesc*)slot->sg;
+		sg[count].addr = (uint64_t)&slot->hdr;
+		sg[count].len = VNET_HDR_LEN;
+		sg[count++].flags = 0;
+
+		for(Packet* segment = packet; segment; segment = packet_next(segment), count++) {
+			sg[count].addr = (uint64_t)(segment->buffer + segment->start);
+			sg[count].len = segment->end - segment->start;
+			sg[count].flags = 0;
+		}
+
+		return count;
+	}
+
+	slot->sg[0].addr = (uint64_t)&slot->hdr;
+	slot->sg[0].len = VNET_HDR_LEN;
+	slot->sg[0].flags = VRING_DESC_F_NEXT;
+	slot->sg[0].next = 1;
+
+	count = 1;
+	for(Packet* segment = packet; segment; segment = packet_next(segment), count++) {
+		slot->sg[count].addr = (uint64_t)(segment->buffer + segment->start);
+		slot->sg[count].len = segment->end - segment->start;
+		slot->sg[count].flags = VRING_DESC_F_NEXT;
+		slot->sg[count].next = count + 1;
+	}
+	slot->sg[count - 1].flags = 0;
+
+	return count;
+}
+
+/* Virtio header of a frame from its offload flags */
+static void send_hdr(VirtIONetHDR* hdr, Packet* packet) {
+	*hdr = (VirtIONetHDR){ 0 };
+	if(likely(!(packet->meta.flags & PACKET_META_OFFLOAD)))
+		return;
+
+	// Offsets count from the frame start, VLAN tag included
+	PacketMeta* meta = nic_parse(packet);
+	if(!meta->payload || (meta->protocol != 6 && meta->protocol != 17))
+		return;
+
+	if(meta->flags & PACKET_META_CSUM_PARTIAL) {
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = meta->l4 - packet->start;
+		hdr->csum_offset = meta->protocol == 6 ? 16 : 6;
+	}
+
+	if((meta->flags & PACKET_META_GSO) && meta->protocol == 6) {
+		hdr->gso_type = meta->flags & PACKET_META_IPV4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+		hdr->gso_size = meta->gso_size;
+		hdr->hdr_len = meta->payload - packet->start;
+	}
+}
+
+/* Whether the device wrote back the packed descriptor at the next used slot */
+static inline bool packed_used(VirtQueue* vq) {
+	uint16_t flags = vq->packed_ring.desc[vq->last_used_idx].flags;
+	bool avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+	bool used = !!(flags & VRING_PACKED_DESC_F_USED);
+
+	return avail == used && used == vq->used_wrap;
+}
 
 /* Check whether device used avail buffer */
 static inline bool hasUsedIdx(VirtQueue* vq) {
+	if(vq->packed)
+		return vq->in_batch || packed_used(vq);
+
 	return vq->vring.used->idx != vq->last_used_idx;
 }
 
-/* Let other side know about buffer changed */
-static void kick(VirtQueue* vq) {
-	// Data in guest OS need to be set before we update avail ring index
-	asm volatile("sfence" ::: "memory"); // wmb()
-
-	vq->vring.avail->idx += vq->num_added;
+/* Whether the device of a packed ring asked to be notified of the descriptors added since the last kick */
+static bool packed_need_notify(VirtQueue* vq) {
+	uint16_t new = vq->avail_idx;
+	uint16_t old = new - vq->num_added;
 	vq->num_added = 0;
 
-	// Need to update avail index before notify otherside
+	// Need to make the descriptors available before reading what the other side wants
 	asm volatile("mfence" ::: "memory"); // mb()
 
-	// We force to notify here in that VRING_USED_F_NO_NOTIFY is simply an optimzation
-	port_out16(vq->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+	// Offset and flags are read at once
+	uint32_t event = *(volatile uint32_t*)vq->packed_ring.device;
+	uint16_t off_wrap = event & 0xffff;
+	uint16_t flags = event >> 16;
+	if(flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	// An event offset of the previous lap counts one ring size back
+	uint16_t event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->avail_wrap)
+		event_idx -= vq->packed_ring.num;
+
+	return vring_need_event(event_idx, new, old);
+}
+
+/*
+ * Let other side know about buffer changed. The new buffers are always
+ * published, but the notify register is only written when the device asked
+ * for it: each write is a VM exit.
+ *
+ * @return true if the device was notified
+ */
+static bool kick(VirtQueue* vq) {
+	bool notify;
+	if(vq->packed) {
+		// Packed descriptors were made available as they were added
+		notify = packed_need_notify(vq);
+	} else {
+		// Data in guest OS need to be set before we update avail ring index
+		asm volatile("sfence" ::: "memory"); // wmb()
+
+		uint16_t old = vq->vring.avail->idx;
+		uint16_t new = old + vq->num_added;
+		vq->vring.avail->idx = new;
+		vq->num_added = 0;
+
+		// Need to update avail index before reading what the other side wants
+		asm volatile("mfence" ::: "memory"); // mb()
+
+		if(vq->event_idx)
+			notify = vring_need_event(vring_avail_event(&vq->vring), new, old);
+		else
+			notify = !(vq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
+	}
+
+	if(notify) {
+		if(vq->notify)
+			*vq->notify = vq->index;
+		else
+			port_out16(vq->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+	}
+
+	return notify;
+}
+
+/* Keep the device from interrupting a polled queue: the used event trails what was seen. Packed rings disable driver events once */
+static inline void suppress_interrupts(VirtQueue* vq) {
+	if(vq->event_idx && !vq->packed)
+		vring_used_event(&vq->vring) = vq->last_used_idx - 1;
+}
+
+/* Buffer ID the next buffer added to a packed ring gets */
+static inline uint16_t packed_next_id(VirtQueue* vq) {
+	return vq->in_order ? vq->avail_idx : vq->free_head;
+}
+
+/* Make a buffer of count descriptors available on a packed ring. Only
+ * WRITE and INDIRECT of the flags in sg are used */
+static void packed_add(VirtQueue* vq, const VringDesc* sg, uint16_t count, void* token) {
+	VringPacked* vr = &vq->packed_ring;
+	uint16_t id = packed_next_id(vq);
+	if(!vq->in_order)
+		vq->free_head = vq->state[id].next;
+	vq->state[id].num = count;
+	vq->data[id] = token;
+
+	uint16_t head = vq->avail_idx;
+	uint16_t head_flags = 0;
+	uint16_t index = head;
+	vq->state[id].len = 0;
+	for(uint16_t i = 0; i < count; i++) {
+		uint16_t flags = sg[i].flags & (VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT);
+		if(flags & VRING_DESC_F_WRITE)
+			vq->state[id].len += sg[i].len;
+		if(i + 1 < count)
+			flags |= VRING_DESC_F_NEXT;
+		flags |= vq->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+
+		VringPackedDesc* desc = &vr->desc[index];
+		desc->addr = sg[i].addr;
+		desc->len = sg[i].len;
+		desc->id = id;
+		if(i)
+			desc->flags = flags;
+		else
+			head_flags = flags;
+
+		if(++index == vr->num) {
+			index = 0;
+			vq->avail_wrap ^= 1;
+		}
+	}
+
+	vq->avail_idx = index;
+	vq->num_free -= count;
+	vq->num_added += count;
+
+	// The device may take the buffer as soon as its head descriptor is available
+	asm volatile("sfence" ::: "memory"); // wmb()
+	vr->desc[head].flags = head_flags;
+}
+
+/* Add available buffer to a packed ring */
+static int add_buf_packed(VirtQueue* vq, void* buffer, uint32_t len) {
+	VringDesc sg[3];
+	uint16_t count;
+
+	switch(vq->type) {
+		case VIRTIO_RX_QUEUE_IDX : 
+			sg[0].addr = (uint64_t)buffer;
+			sg[0].len = len;
+			sg[0].flags = VRING_DESC_F_WRITE;
+			count = 1;
+
+			break;
+
+		case VIRTIO_TX_QUEUE_IDX : {
+			// Header of the slot, then the frame
+			Packet* packet = (Packet*)buffer;
+			VirtNetSendSlot* slot = send_slot(vq, packed_next_id(vq));
+			send_hdr(&slot->hdr, packet);
+
+			if(packet->next) {
+				sg[0].addr = (uint64_t)slot->sg;
+				sg[0].len = send_table(vq, slot, packet) * sizeof(VringPackedDesc);
+				sg[0].flags = VRING_DESC_F_INDIRECT;
+				count = 1;
+			} else {
+				sg[0].addr = (uint64_t)&slot->hdr;
+				sg[0].len = VNET_HDR_LEN;
+				sg[0].flags = 0;
+				sg[1].addr = (uint64_t)(packet->buffer + packet->start);
+				sg[1].len = len;
+				sg[1].flags = 0;
+				count = 2;
+			}
+
+			break;
+		}
+
+		case VIRTIO_CTRL_QUEUE_IDX : {
+			// Header, len bytes of command data and ack
+			VirtIONetCtrlPacket* ctrl = buffer;
+			sg[0].addr = (uint64_t)ctrl;
+			sg[0].len = 2;
+			sg[0].flags = 0;
+			sg[1].addr = (uint64_t)ctrl->cmd_specific_data;
+			sg[1].len = len;
+			sg[1].flags = 0;
+			sg[2].addr = (uint64_t)&ctrl->ack;
+			sg[2].len = 1;
+			sg[2].flags = VRING_DESC_F_WRITE;
+			count = 3;
+
+			break;
+		}
+
+		default : 
+			return -1;
+	}
+
+	if(vq->num_free < count)
+		return -1;
+
+	packed_add(vq, sg, count, buffer);
+
+	// Must notify other side of new buffers after add_buf by kick
+	return 0;
 }
 
 /* Add available buffer which host OS can use */
 static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
+	if(vq->packed)
+		return add_buf_packed(vq, buffer, len);
+
 	uint32_t head = vq->free_head;
 	Vring* vr = &vq->vring;
 
-	switch(vq->index) {
+	switch(vq->type) {
 		case VIRTIO_RX_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 1) % vr->num;
 
@@ -87,30 +381,46 @@ static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
 		case VIRTIO_TX_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 2) % vr->num;
 
-			// Add real packet next
+			// Header of the slot, then the frame
 			Packet* packet = (Packet*)buffer;
-			vr->desc[head + 1].addr = (uint64_t)(packet->buffer + packet->start);
-			vr->desc[head + 1].len = len;
-
-			vq->num_free--;
+			VirtNetSendSlot* slot = send_slot(vq, head / 2);
+			send_hdr(&slot->hdr, packet);
+
+			if(packet->next) {
+				// The header and the segments go in the indirect table of the slot
+				vr->desc[head].flags = VRING_DESC_F_INDIRECT;
+				vr->desc[head].addr = (uint64_t)slot->sg;
+				vr->desc[head].len = send_table(vq, slot, packet) * sizeof(VringDesc);
+			} else {
+				vr->desc[head].flags = VRING_DESC_F_NEXT;
+				vr->desc[head].addr = (uint64_t)&slot->hdr;
+				vr->desc[head].len = VNET_HDR_LEN;
+
+				vr->desc[head + 1].addr = (uint64_t)(packet->buffer + packet->start);
+				vr->desc[head + 1].len = len;
+			}
+
+			// A frame takes a descriptor pair either way
+			vq->num_free -= 2;
 
 			break;
 
 		case VIRTIO_CTRL_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 3) % vr->num;
 
+			// Header, len bytes of command data and ack
+			VirtIONetCtrlPacket* ctrl = buffer;
+
 			vr->desc[head].flags = VRING_DESC_F_NEXT;
-			vr->desc[head].addr = (uint64_t)buffer;
+			vr->desc[head].addr = (uint64_t)ctrl;
 			vr->desc[head].len = 2;
 
-			uint8_t* ptr = (uint8_t*)buffer;
-
 			vr->desc[head + 1].flags = VRING_DESC_F_NEXT;
-			vr->desc[head + 1].addr = (uint64_t)&ptr[2];
-			vr->desc[head + 1].len = 1;
+			vr->desc[head + 1].addr = (uint64_t)ctrl->cmd_specific_data;
+			vr->desc[head + 1].len = len;
 
 			vr->desc[head + 2].flags = VRING_DESC_F_WRITE;
-			vr->desc[head + 2].addr = (uint64_t)&ptr[3];
+			vr->desc[head + 2].addr = (uint64_t)&ctrl->ack;
 			vr->desc[head + 2].len = 1;
 
 			break;
@@ -130,8 +440,67 @@ static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
 	return 0;
 }
 
+/* Get used buffer of a packed ring */
+static void* get_buf_packed(VirtQueue* vq, uint32_t* len) {
+	VringPacked* vr = &vq->packed_ring;
+	uint16_t id;
+	uint32_t used_len;
+
+	if(vq->in_batch) {
+		// Buffers of an in-order batch before the last one are not written back.
+		// The device filled them, and the first slot holds the used descriptor
+		id = vq->last_used_idx;
+		used_len = vq->state[id].len;
+		if(id == vq->batch_last) {
+			used_len = vq->batch_len;
+			vq->in_batch = 0;
+		}
+	} else {
+		if(!packed_used(vq))
+			return NULL;
+
+		// Data in host OS should be exposed before guest OS reads
+		asm volatile("lfence" ::: "memory"); //rmb();
+
+		VringPackedDesc* desc = &vr->desc[vq->last_used_idx];
+		id = desc->id;
+		used_len = desc->len;
+
+		// In order, the ID of a later buffer ends a batch starting here
+		if(vq->in_order && id != vq->last_used_idx) {
+			vq->in_batch = 1;
+			vq->batch_last = id;
+			vq->batch_len = used_len;
+			id = vq->last_used_idx;
+			used_len = vq->state[id].len;
+		}
+	}
+
+	if(len)
+		*len = used_len;
+
+	// The device skips the other descriptors of the buffer
+	uint16_t num = vq->state[id].num;
+	vq->num_free += num;
+	vq->last_used_idx += num;
+	if(vq->last_used_idx >= vr->num) {
+		vq->last_used_idx -= vr->num;
+		vq->used_wrap ^= 1;
+	}
+
+	if(!vq->in_order) {
+		vq->state[id].next = vq->free_head;
+		vq->free_head = id;
+	}
+
+	return vq->data[id];
+}
+
 /* Get used buffer which host OS used */
 static void* get_buf(VirtQueue* vq, uint32_t* len) {
+	if(vq->packed)
+		return get_buf_packed(vq, len);
+
 	if(!hasUsedIdx(vq)) {
 		return NULL;
 	}
@@ -151,32 +520,65 @@ static void* get_buf(VirtQueue* vq, uint32_t* len) {
 	return vq->data[used];
 }
 
-/* Get virtio configuration */
-static void get_config(uint32_t ioaddr, uint32_t offset, void *buf, uint32_t len) {
-	void* ioaddr_offset = (void*)(uint64_t)(ioaddr + 20 + offset);
-
+/* Get virtio configuration. A field of 2 bytes is read at once */
+static void get_config(VirtIODevice* vdev, uint32_t offset, void *buf, uint32_t len) {
 	uint8_t *ptr = buf;
+	if(vdev->common) {
+		// The generation changes when the device changes the configuration during the read
+		uint8_t generation;
+		do {
+			generation = vdev->common->config_generation;
+			if(len == 2) {
+				*(uint16_t*)buf = *(volatile uint16_t*)(vdev->device_config + offset);
+			} else {
+				for(uint32_t i = 0; i < len; i++)
+					ptr[i] = vdev->device_config[offset + i];
+			}
+		} while(generation != vdev->common->config_generation);
+
+		return;
+	}
+
+	void* ioaddr_offset = (void*)(uint64_t)(vdev->ioaddr + 20 + offset);
+
 	for (uint32_t i = 0; i < len; i++) 
 		ptr[i] = port_in8((uint16_t)(uint64_t)ioaddr_offset + i);
 }
 
 /* Check whether virtio device has specific features */
 static bool device_has_feature(const VirtIODevice* vdev, uint32_t fbit) {
-	if(fbit > 32) {
-		printf("Feature bit needs to be under 32\n");
+	if(fbit >= 64) {
+		printf("Feature bit needs to be under 64\n");
 		return 0;
 	}
 
 	return 1UL & (vdev->features >> fbit);
 }
 
+/* Add status to virtio configuration status space */
+static void add_status(VirtIODevice* vdev, uint8_t status) {
+	vdev->status |= status;
+	if(vdev->common)
+		vdev->common->device_status = vdev->status;
+	else
+		port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
+}
+
 /* Synchronize and determine features with host */
 static int synchronize_features(VirtIODevice* vdev) {
 	uint64_t device_features;
 	uint64_t driver_features;
 
-	// Figure out what features device supports
-	device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);	
+	// Figure out what features device supports. The legacy registers only
+	// have bits 0 to 31, so the packed ring is only offered by modern devices
+	if(vdev->common) {
+		vdev->common->device_feature_select = 0;
+		device_features = vdev->common->device_feature;
+		vdev->common->device_feature_select = 1;
+		device_features |= (uint64_t)vdev->common->device_feature << 32;
+	} else {
+		device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);
+	}
 
 	// Features supported by both device and driver
 	uint32_t fbit;
@@ -185,33 +587,55 @@ static int synchronize_features(VirtIODevice* vdev) {
 
 	for(int i = 0; i < count; i++) {
 		fbit = feature_table[i];
-		if(fbit > 32) {
-			printf("We only support 32 feature bits\n");
+		if(fbit >= 64) {
+			printf("We only support 64 feature bits\n");
 			return -1;
 		}
 		driver_features |= (1ULL << fbit);
 	}
 	driver_features &= device_features;
 
+	// Segmentation needs the checksum offload of its direction, and coalesced
+	// frames are only received over merged buffers
+	if(!(driver_features & (1ULL << VIRTIO_NET_F_CSUM)))
+		driver_features &= ~(1ULL << VIRTIO_NET_F_HOST_TSO4 | 1ULL << VIRTIO_NET_F_HOST_TSO6);
+	if(!(driver_features & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) || !(driver_features & (1ULL << VIRTIO_NET_F_MRG_RXBUF)))
+		driver_features &= ~(1ULL << VIRTIO_NET_F_GUEST_TSO4 | 1ULL << VIRTIO_NET_F_GUEST_TSO6);
+
+	// Split rings reclaim one used entry per buffer, so in-order batches are only taken on packed rings
+	if(!(driver_features & (1ULL << VIRTIO_F_RING_PACKED)))
+		driver_features &= ~(1ULL << VIRTIO_F_IN_ORDER);
+
 	// Finally determine features that we are going to use 
-	port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
 	vdev->features |= driver_features;
+	if(!vdev->common) {
+		port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
+		return 0;
+	}
 
-	return 0;
-}
+	vdev->common->guest_feature_select = 0;
+	vdev->common->guest_feature = (uint32_t)driver_features;
+	vdev->common->guest_feature_select = 1;
+	vdev->common->guest_feature = (uint32_t)(driver_features >> 32);
 
-/* Add status to virtio configuration status space */
-static void add_status(VirtIODevice* vdev, uint8_t status) {
-	vdev->status |= status;
-	port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
+	// A modern device checks the features before any queue is set
+	add_status(vdev, VIRTIO_CONFIG_S_FEATURES_OK);
+	if(!(vdev->common->device_status & VIRTIO_CONFIG_S_FEATURES_OK)) {
+		printf("Device rejected the features\n");
+		return -2;
+	}
+
+	return 0;
 }
 
-/* Prepare pseudo header in the empty send buffers */
+/* Point the header descriptors of the empty send buffers at their slots. Packed rings write them per frame */
 static int prepare_send_buf(VirtQueue* vq, uint32_t num) {
-	// Add virtio_net_hdr - virtio_net_hdr is always 0, so we just use pseudo header
+	if(vq->packed)
+		return 0;
+
 	Vring* vr = &vq->vring;
 	for(uint32_t i = 0; i < num / 2; i++) {
-		vr->desc[2 * i].addr = (uint64_t)pseudo_vnet_hdr;
+		vr->desc[2 * i].addr = (uint64_t)&send_slot(vq, i)->hdr;
 		vr->desc[2 * i].flags = VRING_DESC_F_NEXT;
 		vr->desc[2 * i].len = VNET_HDR_LEN;
 	}
@@ -219,19 +643,27 @@ static int prepare_send_buf(VirtQueue* vq, uint32_t num) {
 	return 0;
 }
 
+/* Static receive buffer of a descriptor, used whenever frames are copied */
+static inline void* recv_static_buf(VirtQueue* vq, uint32_t index) {
+	return vq_area(vq) + PAGE_SIZE * index;
+}
+
+/* Whether a used receive buffer is a static one rather than a VNIC packet */
+static inline bool recv_is_static(VirtQueue* vq, void* buf) {
+	return buf >= recv_static_buf(vq, 0) && buf < recv_static_buf(vq, vq->vring.num);
+}
+
 /* Prepare in the empty receive buffers */
 static int prepare_recv_buf(VirtQueue* vq, uint32_t num) {
 	void* buffer[num]; 
-	//int size = PAGE_ALIGN(vring_size(num, VIRTIO_PCI_VRING_ALIGN)); // check
-	int size = (vring_size(num, VIRTIO_PCI_VRING_ALIGN) + PAGE_SIZE) & ~PAGE_SIZE;
 
 	for(uint32_t i = 0; i < num; i++) {
-		buffer[i] = (void*)((uint64_t)vq->vring.desc + size + PAGE_SIZE * i);
+		buffer[i] = recv_static_buf(vq, i);
 		if(!buffer[i]) {
 			return -1;
 		}
 
-		if(add_buf(vq, buffer[i], MAX_BUF_SIZE))
+		if(add_buf(vq, buffer[i], RECV_BUF_SIZE))
 			return -2;
 
 	}
@@ -242,18 +674,35 @@ static int prepare_recv_buf(VirtQueue* vq, uint32_t num) {
 	return 0;
 }
 
-/* Initializing function for virtqueues */
-static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
-	// Select the queue we're interested in
-	port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_SEL, index);
-
-	// Check if queue is either not available or already active
-	int num = port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_NUM);
-	if (!num || port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN))
-		return -1;
+/* Give the rings of the selected queue to a modern device, and find where its notifications go */
+static void enable_vq(VirtIODevice* vdev, VirtQueue* vq, void* desc, void* driver, void* device) {
+	volatile VirtIOPCICommonCfg* common = vdev->common;
+	common->queue_desc_lo = (uint32_t)(uint64_t)desc;
+	common->queue_desc_hi = (uint64_t)desc >> 32;
+	common->queue_avail_lo = (uint32_t)(uint64_t)driver;
+	common->queue_avail_hi = (uint64_t)driver >> 32;
+	common->queue_used_lo = (uint32_t)(uint64_t)device;
+	common->queue_used_hi = (uint64_t)device >> 32;
+
+	vq->notify = (volatile uint16_t*)(vdev->notify + common->queue_notify_off * vdev->notify_multiplier);
+	common->queue_enable = 1;
+}
 
-	//int size = PAGE_ALIGN(vring_size(num, VIRTIO_PCI_VRING_ALIGN)); // check
-	int size = (vring_size(num, VIRTIO_PCI_VRING_ALIGN) + PAGE_SIZE) & ~PAGE_SIZE;
+/* Initializing function for virtqueues */
+static int init_vq(VirtIODevice* vdev, uint32_t index, uint16_t type, VirtQueue* vqs[]) {
+	// Select the queue we're interested in, and check if it is either not available or already active
+	int num;
+	if(vdev->common) {
+		vdev->common->queue_select = index;
+		num = vdev->common->queue_size;
+		if(!num || vdev->common->queue_enable)
+			return -1;
+	} else {
+		port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_SEL, index);
+		num = port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_NUM);
+		if (!num || port_in32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN))
+			return -1;
+	}
 
 	// Alloc and initialize virtqueue 
 	vqs[index] = gmalloc(sizeof(VirtQueue) + sizeof(void*) * num /* For token data */);
@@ -262,9 +711,17 @@ static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
 	vqs[index]->last_used_idx = 0;
 	vqs[index]->num_added = 0;
 	vqs[index]->index = index;
+	vqs[index]->type = type;
 	vqs[index]->ioaddr = vdev->ioaddr;
-
-	// Assign vring memory space. It must be aligned by page size (4096)
+	vqs[index]->event_idx = device_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+	vqs[index]->packed = device_has_feature(vdev, VIRTIO_F_RING_PACKED);
+	vqs[index]->in_order = device_has_feature(vdev, VIRTIO_F_IN_ORDER);
+
+	// Assign vring memory space. It must be aligned by page size (4096).
+	// Send slots go by descriptor pair on a split ring, by buffer ID on a packed one
+	int size = vq_ring_size(num, vqs[index]->packed);
+	if(type == VIRTIO_TX_QUEUE_IDX)
+		size += (vqs[index]->packed ? num : num / 2) * sizeof(VirtNetSendSlot);
 	if(size > 0x200000 /* 2MB */) {
 		printf("VirtQueue size is over 2MB\n");
 		return -2;
@@ -277,39 +734,138 @@ static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
 	}
 	memset(queue, 0x0, 0x200000); 
 
-	// Activate the queue
-	port_out32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(uint64_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+	// Activate a legacy queue. The descriptors start the block in both formats.
+	// A modern queue is enabled once its rings are set
+	if(!vdev->common)
+		port_out32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(uint64_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+	// Put everything in free lists 
+	vqs[index]->num_free = num;
+	vqs[index]->free_head = 0;
+
+	if(vqs[index]->packed) {
+		vqs[index]->state = gmalloc(sizeof(VringPackedState) * num);
+		if(!vqs[index]->state)
+			return -3;
+
+		// Create the vring. Both wrap counters start at 1
+		vring_packed_init(&vqs[index]->packed_ring, num, queue);
+		vqs[index]->avail_wrap = 1;
+		vqs[index]->used_wrap = 1;
+
+		// We don't have interrupt handler. Tell otherside not to interrupt us
+		vqs[index]->packed_ring.driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+		for(int i = 0; i < num; i++) {
+			vqs[index]->state[i].next = i + 1;
+		}
+
+		if(vdev->common)
+			enable_vq(vdev, vqs[index], vqs[index]->packed_ring.desc, vqs[index]->packed_ring.driver, vqs[index]->packed_ring.device);
+
+		return 0;
+	}
 
 	// Create the vring 
 	vring_init(&vqs[index]->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
 
 	// We don't have interrupt handler. Tell otherside not to interrupt us
 	vqs[index]->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
-
-	// Put everything in free lists 
-	vqs[index]->num_free = num;
-	vqs[index]->free_head = 0;
+	suppress_interrupts(vqs[index]);
 
 	for(int i = 0; i < num; i++) {
 		vqs[index]->vring.desc[i].next = i + 1;
 	}
 
+	if(vdev->common)
+		enable_vq(vdev, vqs[index], vqs[index]->vring.desc, vqs[index]->vring.avail, vqs[index]->vring.used);
+
 	return 0;
 }
 
+/* Address of a memory BAR. Physical memory is mapped one to one */
+static volatile uint8_t* pci_bar(PCI_Device* dev, uint8_t bar) {
+	if(bar > 5)
+		return NULL;
+
+	uint32_t reg = PCI_BASE_ADDRESS_0 + bar * 4;
+	uint32_t low = pci_read32(dev, reg);
+	if(low & PCI_BASE_ADDRESS_SPACE_IO)
+		return NULL;
+
+	uint64_t addr = low & PCI_BASE_ADDRESS_MEM_MASK;
+	if(low & PCI_BASE_ADDRESS_MEM_TYPE_64)
+		addr |= (uint64_t)pci_read32(dev, reg + 4) << 32;
+
+	return (volatile uint8_t*)addr;
+}
+
+/* Find the structures of the modern transport in the vendor capabilities. The first usable one of a type is taken */
+static bool virtio_pci_modern(VirtIODevice* vdev) {
+	PCI_Device* dev = vdev->dev;
+	if(!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+		return false;
+
+	int reg = PCI_CAPABILITY_LIST;
+	for(int i = 0; i < 48; i++) { // TTL is 48 (from Linux)
+		reg = pci_read8(dev, reg);
+		if(reg < 0x40)
+			break;
+
+		reg &= ~3;
+		if(pci_read8(dev, reg + PCI_CAP_LIST_ID) == PCI_CAP_ID_VNDR) {
+			volatile uint8_t* base = pci_bar(dev, pci_read8(dev, reg + VIRTIO_PCI_CAP_BAR));
+			if(base) {
+				base += pci_read32(dev, reg + VIRTIO_PCI_CAP_OFFSET);
+
+				switch(pci_read8(dev, reg + VIRTIO_PCI_CAP_CFG_TYPE)) {
+					case VIRTIO_PCI_CAP_COMMON_CFG : 
+						if(!vdev->common)
+							vdev->common = (volatile VirtIOPCICommonCfg*)base;
+						break;
+
+					case VIRTIO_PCI_CAP_NOTIFY_CFG : 
+						if(!vdev->notify) {
+							vdev->notify = base;
+							vdev->notify_multiplier = pci_read32(dev, reg + VIRTIO_PCI_NOTIFY_CAP_MULT);
+						}
+						break;
+
+					case VIRTIO_PCI_CAP_DEVICE_CFG : 
+						if(!vdev->device_config)
+							vdev->device_config = base;
+						break;
+				}
+			}
+		}
+
+		reg += PCI_CAP_LIST_NEXT;
+	}
+
+	if(vdev->common && vdev->notify && vdev->device_config)
+		return true;
+
+	vdev->common = NULL;
+	return false;
+}
+
 /* Probing function for PCI device */
 static int virtio_pci_probe(VirtIODevice* vdev) {
-	// Read I/O address
-	vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0) & ~3;
+	// Modern devices are set through memory, legacy ones through I/O ports
+	if(!virtio_pci_modern(vdev)) {
+		vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0) & ~3;
 
-	if(!vdev->ioaddr) 
-		return -1;
+		if(!vdev->ioaddr) 
+			return -1;
+	}
 
 	// Enable device
 	pci_enable(vdev->dev);
 
-	// Reset device 
+	// Reset device. A modern device reads back 0 once the reset is done
 	add_status(vdev, 0);
+	while(vdev->common && vdev->common->device_status)
+		asm volatile("pause");
 
 	// OS notice device from now
 	add_status(vdev, VIRTIO_CONFIG_S_ACKNOWLEDGE);
@@ -323,42 +879,76 @@ static int virtio_pci_probe(VirtIODevice* vdev) {
 /* Probing function for VirtI/O network device */
 static int virtnet_probe(VirtNetPriv* priv) {
 	VirtIODevice* vdev = &priv->vdev;
-	// VirtI/O network device has three queues (receive, transmit, control)
-	VirtQueue* vqs[3];
+	// VirtI/O network device has receive/transmit queue pairs and a control queue
+	VirtQueue* vqs[NICDEV_MAX_QUEUE_COUNT * 2 + 1];
 
 	// Confiuration may specify what MAC to use. Otherwise set designated MAC
-	get_config(vdev->ioaddr, 0, vdev->config.mac, ETH_ALEN);
-	if(!vdev->ioaddr) {
+	get_config(vdev, 0, vdev->config.mac, ETH_ALEN);
+	if(!vdev->ioaddr && !vdev->common) {
 		memcpy(vdev->config.mac, "\0GURUM", ETH_ALEN);
 	}
 
 	// Get link status 
-	get_config(vdev->ioaddr, 6, &vdev->config.status, 2);
+	get_config(vdev, 6, &vdev->config.status, 2);
 	
-	// Check whether we supports control queue 
-	int nvqs = device_has_feature(&priv->vdev, VIRTIO_NET_F_CTRL_VQ) ? 3 : 2;
+	// Pair 0 is polled by this core, every other pair by a core taken from VMs.
+	// At most half the cores are taken
+	uint16_t max_pairs = 1;
+	priv->queue_count = 1;
+	priv->queues[0].core = mp_apic_id();
+	if(device_has_feature(vdev, VIRTIO_NET_F_MQ) && device_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ)) {
+		get_config(vdev, 8, &vdev->config.max_virtqueue_pairs, 2);
+		max_pairs = vdev->config.max_virtqueue_pairs;
+
+		while(priv->queue_count < max_pairs && priv->queue_count < NICDEV_MAX_QUEUE_COUNT &&
+				priv->queue_count < mp_processor_count() / 2) {
+			extern int vm_core_reserve();
+			int core = vm_core_reserve();
+			if(core < 0)
+				break;
+
+			priv->queues[priv->queue_count++].core = core;
+		}
+	}
 
-	// Set for queues
-	for(int i = 0; i < nvqs; i++) 
-		if(init_vq(vdev, i, vqs))
+	// Set for queues: receive queue i is 2i, transmit queue 2i + 1
+	for(int i = 0; i < priv->queue_count; i++) {
+		if(init_vq(vdev, 2 * i, VIRTIO_RX_QUEUE_IDX, vqs) ||
+				init_vq(vdev, 2 * i + 1, VIRTIO_TX_QUEUE_IDX, vqs))
 			return -1;
 
-	priv->rvq = vqs[0];
-	priv->svq = vqs[1];
-	if(nvqs == 3)
-		priv->cvq = vqs[2];
+		priv->queues[i].rvq = vqs[2 * i];
+		priv->queues[i].svq = vqs[2 * i + 1];
+		priv->queues[i].index = i;
+		priv->queues[i].priv = priv;
+	}
 
-	// Make pseudo header for transmit
-	pseudo_vnet_hdr = gmalloc(sizeof(VirtIONetHDR));
-	bzero(pseudo_vnet_hdr, sizeof(VirtIONetHDR));
+	// Control queue follows the last pair the device has
+	if(device_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ)) {
+		if(init_vq(vdev, 2 * max_pairs, VIRTIO_CTRL_QUEUE_IDX, vqs))
+			return -1;
 
-	// Prepare receive buffers in advance  
-	if(prepare_recv_buf(priv->rvq, priv->rvq->size))
-		return -2;
-	
-	// Prepare pseudo header in send buffers in advance  
-	if(prepare_send_buf(priv->svq, priv->rvq->size))
-		return -3;
+		priv->cvq = vqs[2 * max_pairs];
+	}
+
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+
+		// Jumbo frames are spread over several receive buffers
+		if(device_has_feature(vdev, VIRTIO_NET_F_MRG_RXBUF)) {
+			queue->merge = gmalloc(MAX_FRAME_SIZE);
+			if(!queue->merge)
+				return -4;
+		}
+
+		// Prepare receive buffers in advance  
+		if(prepare_recv_buf(queue->rvq, queue->rvq->size))
+			return -2;
+		
+		// Prepare headers in send buffers in advance  
+		if(prepare_send_buf(queue->svq, queue->rvq->size))
+			return -3;
+	}
 
 	// Device is alive at this point
 	add_status(vdev, VIRTIO_CONFIG_S_DRIVER_OK);
@@ -367,23 +957,26 @@ static int virtnet_probe(VirtNetPriv* priv) {
 }
 
 /* Send control command to VirtI/O network device */
-static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd, void* data) {
-	VirtIONetCtrlPacket* ctrl = gmalloc(sizeof(VirtIONetCtrlPacket));
-	memset(ctrl, 0, sizeof(VirtIONetCtrlPacket));
+static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd, void* data, uint32_t len) {
+	if(!priv->cvq)
+		return false;
 
-	// Controlling RX mode is only available now 
-	if(class != VIRTIO_NET_CTRL_RX) {
+	// Controlling RX mode and queue pairs is only available now 
+	if((class != VIRTIO_NET_CTRL_RX && class != VIRTIO_NET_CTRL_MQ) || len > sizeof(((VirtIONetCtrlPacket*)0)->cmd_specific_data)) {
 		printf("[%02d] Class command not supported\n", class);
 		return false;
 	}
+
+	VirtIONetCtrlPacket* ctrl = gmalloc(sizeof(VirtIONetCtrlPacket));
+	memset(ctrl, 0, sizeof(VirtIONetCtrlPacket));
 	ctrl->class = class;
 	ctrl->cmd = cmd;
 	ctrl->ack = ~0;
 
 	// TODO: Other classes need to be implemented. e.g VLAN, MAC Filtering...
-	ctrl->cmd_specific_data = *(uint8_t*)data;
+	memcpy(ctrl->cmd_specific_data, data, len);
 
-	if(add_buf(priv->cvq, ctrl, 4))
+	if(add_buf(priv->cvq, ctrl, len))
 		return false;
 
 	// Notify otherside of new buffer
@@ -410,15 +1003,162 @@ static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd,
 	return true;
 }
 
-/* Function for packet receive */
-static int virtnet_receive(VirtNetPriv* priv, void* buf, uint32_t len) {
-	// Instead of calling add_buf, we just notify that buffer index is updated 
-	VirtQueue* vq = priv->rvq;
-	vq->num_added++; 
-	VirtIONetPacket* vp = (VirtIONetPacket*)buf;
-	NICDevice* nicdev = priv->priv;
+/*
+ * Collect the rest of a frame spread over count receive buffers. Frames
+ * received in place are chained; otherwise the frame is copied to the merge
+ * buffer and *packet is NULL.
+ *
+ * @return false if the frame is dropped
+ */
+static bool virtnet_merge(VirtNetQueue* queue, Packet** packet, uint8_t** data, uint32_t* len, uint16_t count, uint32_t* received) {
+	VirtQueue* vq = queue->rvq;
+	Packet* head = *packet;
+	Packet* last = head;
+	uint32_t total = *len;
+
+	// The first part is copied once a static buffer shows up
+	bool copy = !head;
+	if(copy) {
+		memcpy(queue->merge, *data, total);
+		*data = queue->merge;
+	}
+
+	bool drop = false;
+	for(uint16_t i = 1; i < count; i++) {
+		uint32_t size;
+		void* buf = get_buf(vq, &size);
+		if(!buf) {
+			drop = true;
+			break;
+		}
+
+		(*received)++;
+
+		// Buffers after the first have no header
+		Packet* segment = NULL;
+		uint8_t* part = buf;
+		if(!recv_is_static(vq, buf)) {
+			segment = buf;
+			segment->start -= VNET_HDR_LEN;
+			segment->end = segment->start + size;
+			part = segment->buffer + segment->start;
+		}
+
+		if(total + size > MAX_FRAME_SIZE)
+			drop = true;
+
+		if(!drop && !copy && !segment) {
+			// Static buffer: move what is chained so far to the merge buffer
+			uint32_t offset = 0;
+			for(Packet* p = head; p; p = packet_next(p)) {
+				memcpy(queue->merge + offset, p->buffer + p->start, p->end - p->start);
+				offset += p->end - p->start;
+			}
+			nic_free(head);
+			head = NULL;
+			*data = queue->merge;
+			copy = true;
+		}
+
+		if(drop) {
+			if(segment)
+				nic_free(segment);
+		} else if(copy) {
+			memcpy(queue->merge + total, part, size);
+			if(segment)
+				nic_free(segment);
+		} else {
+			packet_append(head, last, segment);
+			last = segment;
+		}
+
+		total += size;
+	}
+
+	if(drop) {
+		if(head)
+			nic_free(head);
+		*packet = NULL;
+		return false;
+	}
+
+	*packet = head;
+	*len = total;
+	return true;
+}
+
+/* Complete the partial checksum of a frame which is copied out of the receive buffers */
+static void virtnet_csum(uint8_t* data, uint32_t len, VirtIONetHDR* hdr) {
+	uint32_t offset = hdr->csum_start + hdr->csum_offset;
+	if(offset + 2 > len)
+		return;
+
+	uint64_t sum = 0;
+	uint8_t* p = data + hdr->csum_start;
+	uint32_t size = len - hdr->csum_start;
+	for(; size >= 2; p += 2, size -= 2)
+		sum += p[0] << 8 | p[1];
+	if(size)
+		sum += p[0] << 8;
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	// 0 is the same sum for TCP and means no checksum for UDP
+	uint16_t check = ~sum ? : 0xffff;
+	data[offset] = check >> 8;
+	data[offset + 1] = check;
+}
+
+/* Offload state of a frame received in place */
+static void virtnet_rx_meta(Packet* packet, VirtIONetHDR* hdr) {
+	if(hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)
+		packet->meta.flags |= PACKET_META_CSUM_VERIFIED;
+	if(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		packet->meta.flags |= PACKET_META_CSUM_PARTIAL;
+
+	if((hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_NONE) {
+		packet->meta.flags |= PACKET_META_GSO;
+		packet->meta.gso_size = hdr->gso_size;
+	}
+}
+
+/* Function for packet receive. Returns the packet if it can be queued without copying */
+static Packet* virtnet_receive(VirtNetQueue* queue, void* buf, uint32_t len, uint32_t* received) {
+	VirtQueue* vq = queue->rvq;
+	NICDevice* nicdev = queue->priv->priv;
+	Packet* packet = NULL;
+	VirtIONetHDR* hdr;
+
+	if(recv_is_static(vq, buf)) {
+		hdr = &((VirtIONetPacket*)buf)->vhdr;
+	} else {
+		// Device wrote the frame in place into a VNIC packet
+		packet = buf;
+		packet->end = packet->start + len - VNET_HDR_LEN;
+		hdr = (VirtIONetHDR*)(packet->buffer + packet->start - VNET_HDR_LEN);
+	}
+
+	// Merging may free the buffer of the header
+	VirtIONetHDR vhdr = *hdr;
+	uint8_t* data = (uint8_t*)hdr + VNET_HDR_LEN;
+	len -= VNET_HDR_LEN;
+	if(queue->merge && vhdr.num_buffers > 1) {
+		if(!virtnet_merge(queue, &packet, &data, &len, vhdr.num_buffers, received))
+			return NULL;
+	}
+	Ether* ether = (Ether*)data;
+
+	// Frames which are copied lose their offload state, so partial checksums are completed
+	if(vhdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		if(!packet) {
+			virtnet_csum(data, len, &vhdr);
+		} else if(ether->type == endian16(ETHER_TYPE_8021Q)) {
+			packet->meta.flags = PACKET_META_CSUM_PARTIAL;
+			nic_csum_complete(packet);
+		}
+	}
 
-	Ether* ether = (Ether*)vp->data;
 	if(ether->type == endian16(ETHER_TYPE_8021Q)) {
 		VLAN* vlan = (VLAN*)ether->payload;
 		for(nicdev = nicdev->next; nicdev; nicdev = nicdev->next) {
@@ -432,17 +1172,98 @@ static int virtnet_receive(VirtNetPriv* priv, void* buf, uint32_t len) {
 		}
 	}
 
-	if(nicdev)
-		nicdev_rx(nicdev, ether, len - VNET_HDR_LEN);
+	// VLAN frames go to another device whose VNICs own other pools
+	if(packet && nicdev == queue->priv->priv) {
+		virtnet_rx_meta(packet, &vhdr);
+		return packet;
+	}
 
-	return 0;
+	if(nicdev) {
+		if(packet && packet->next) {
+			// A chain is given to the VLAN device in one piece
+			uint32_t offset = 0;
+			for(Packet* p = packet; p; p = packet_next(p)) {
+				uint8_t* part = p == packet ? (uint8_t*)ether : p->buffer + p->start;
+				uint32_t size = p == packet ? p->buffer + p->end - (uint8_t*)ether : p->end - p->start;
+				memcpy(queue->merge + offset, part, size);
+				offset += size;
+			}
+			nicdev_rx(nicdev, queue->merge, offset);
+		} else {
+			nicdev_rx(nicdev, ether, len);
+		}
+	}
+
+	if(packet)
+		nic_free(packet);
+
+	return NULL;
+}
+
+/* Give consumed receive descriptors new buffers, from the VNIC pool if frames can be received in place */
+static void refill_recv_buf(VirtNetQueue* queue, uint16_t first, uint32_t count) {
+	VirtQueue* vq = queue->rvq;
+	Packet* packets[BUDGET_SIZE];
+	uint32_t allocated = 0;
+
+	VNIC* vnic = nicdev_get_rx_vnic(queue->priv->priv);
+	if(vnic)
+		allocated = vnic_alloc_burst(vnic, MAX_BUF_SIZE, packets, count);
+
+	// Split ring descriptors are used in order, so descriptor index equals ring
+	// slot. Packed ring buffers go by buffer ID, which also picks the static buffer
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t index = vq->packed ? packed_next_id(vq) : (uint16_t)(first + i) % vq->vring.num;
+		VringDesc desc = { .flags = VRING_DESC_F_WRITE };
+		void* token;
+
+		if(i < allocated) {
+			Packet* packet = packets[i];
+			packet->start = VNET_HDR_LEN;
+			desc.addr = (uint64_t)(packet->buffer + packet->start - VNET_HDR_LEN);
+			desc.len = MAX_BUF_SIZE;
+			token = packet;
+		} else {
+			// Pool is empty or shared by several VNICs: fall back to copying
+			token = recv_static_buf(vq, index);
+			desc.addr = (uint64_t)token;
+			desc.len = RECV_BUF_SIZE;
+		}
+
+		if(vq->packed) {
+			packed_add(vq, &desc, 1, token);
+		} else {
+			vq->vring.desc[index].addr = desc.addr;
+			vq->vring.desc[index].len = desc.len;
+			vq->data[index] = token;
+		}
+	}
+
+	// Instead of calling add_buf, we just notify that buffer index is updated 
+	if(!vq->packed) {
+		vq->num_added += count;
+		vq->num_free -= count;
+	}
+}
+
+/* Whether the pair has a free slot and the indirect table holds the segments of packet */
+static inline bool virtnet_send_fits(VirtNetQueue* queue, Packet* packet) {
+	// A frame takes two descriptors, or one indirect for a chain on a packed ring
+	if(queue->svq->num_free < 2)
+		return false;
+
+	uint32_t count = 1;
+	for(Packet* segment = packet_next(packet); segment; segment = packet_next(segment))
+		count++;
+
+	return count < MAX_SEND_SEGMENTS;
 }
 
 /* Function for packet send */
-static int virtnet_send(VirtNetPriv* priv, Packet* packet) {
+static int virtnet_send(VirtNetQueue* queue, Packet* packet) {
 	// Check whether free descriptor exists to prevent buffer overflow 
-	VirtQueue* vq = priv->svq;
-	if(vq->num_free == 0) {
+	VirtQueue* vq = queue->svq;
+	if(!virtnet_send_fits(queue, packet)) {
 		nic_free(packet);
 
 		return -1;
@@ -455,28 +1276,143 @@ static int virtnet_send(VirtNetPriv* priv, Packet* packet) {
 	return 0;
 }
 
-static bool poll(NICDevice* nicdev) {
+/*
+ * Free the frames the device has sent, in bursts grouped by pool. A split
+ * ring is read at one used index; frames are used in order.
+ *
+ * @return number of frames reclaimed
+ */
+static uint32_t virtnet_reclaim(VirtQueue* vq) {
+	Packet* packets[BUDGET_SIZE];
+	uint32_t count = 0;
+	uint32_t total = 0;
+
+	if(vq->packed) {
+		void* buf;
+		while((buf = get_buf_packed(vq, NULL))) {
+			packets[count++] = buf;
+			if(count == BUDGET_SIZE) {
+				nic_free_burst(packets, count);
+				total += count;
+				count = 0;
+			}
+		}
+	} else {
+		uint16_t used = vq->vring.used->idx;
+
+		// Data in host OS should be exposed before guest OS reads
+		asm volatile("lfence" ::: "memory"); //rmb();
+
+		for(uint16_t i = vq->last_used_idx; i != used; i++) {
+			packets[count++] = vq->data[i % vq->vring.num];
+			if(count == BUDGET_SIZE) {
+				nic_free_burst(packets, count);
+				total += count;
+				count = 0;
+			}
+		}
+
+		// Every frame took a descriptor pair
+		vq->num_free += 2 * (uint16_t)(used - vq->last_used_idx);
+		vq->last_used_idx = used;
+	}
+
+	if(count)
+		nic_free_burst(packets, count);
+
+	suppress_interrupts(vq);
+
+	return total + count;
+}
+
+/* Receive on a queue pair, a busy event of the core owning it */
+static bool virtnet_poll(void* context) {
 	uint32_t len;
-	int received = 0;
+	uint32_t received = 0;
 	void* buf;
+	Packet* packets[BUDGET_SIZE];
+	uint32_t count = 0;
 
- 	VirtNetPriv* priv = nicdev->priv;
-	VirtQueue* vq = priv->rvq;
+	VirtNetQueue* queue = context;
+	NICDevice* nicdev = queue->priv->priv;
+	VirtQueue* vq = queue->rvq;
 	while((BUDGET_SIZE > received) && (buf = get_buf(vq, &len))) {
-		virtnet_receive(priv, buf, len);
 		received++;
+
+		// A buffer without a full header carries no frame
+		if(len < VNET_HDR_LEN) {
+			if(!recv_is_static(vq, buf))
+				nic_free(buf);
+			continue;
+		}
+
+		// Continuation buffers of a jumbo frame are counted in received too
+		Packet* packet = virtnet_receive(queue, buf, len, &received);
+		if(packet)
+			packets[count++] = packet;
 	}
- 
-	if(vq->num_free > vq->size / 2) {
-		kick(vq);
-		vq->num_free = 0;
+
+	if(count)
+		nicdev_rx_burst(nicdev, packets, count);
+
+	if(received)
+		event_busy_progress();
+
+	// Consumed buffers go back in batches, published with one kick
+	if(vq->num_free >= RECV_REFILL_BATCH) {
+		uint16_t first = vq->last_used_idx - vq->num_free;
+		while(vq->num_free) {
+			uint32_t n = vq->num_free < BUDGET_SIZE ? vq->num_free : BUDGET_SIZE;
+			refill_recv_buf(queue, first, n);
+			first += n;
+		}
+
+		NICDeviceQueue* stats = &nicdev->queues[queue->index];
+		if(kick(vq))
+			stats->rx_kicks++;
+		else
+			stats->kicks_saved++;
 	}
+
+	suppress_interrupts(vq);
  
 	return true;
 }
 
+static bool poll(NICDevice* nicdev) {
+	VirtNetPriv* priv = nicdev->priv;
+
+	return virtnet_poll(&priv->queues[0]);
+}
+
+/* Offloads of the negotiated features */
+static uint8_t virtnet_offloads(VirtIODevice* vdev) {
+	uint8_t offloads = 0;
+	if(device_has_feature(vdev, VIRTIO_NET_F_CSUM))
+		offloads |= NIC_OFFLOAD_TX_CSUM;
+	if(device_has_feature(vdev, VIRTIO_NET_F_HOST_TSO4))
+		offloads |= NIC_OFFLOAD_TSO4;
+	if(device_has_feature(vdev, VIRTIO_NET_F_HOST_TSO6))
+		offloads |= NIC_OFFLOAD_TSO6;
+	if(device_has_feature(vdev, VIRTIO_NET_F_GUEST_CSUM))
+		offloads |= NIC_OFFLOAD_RX_CSUM;
+	if(device_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO4) || device_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO6))
+		offloads |= NIC_OFFLOAD_GRO;
+	if(device_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC))
+		offloads |= NIC_OFFLOAD_SG;
+
+	return offloads;
+}
+
+/* Transmit context: a NICDevice, which may be a VLAN device, and the pair sending its frames */
+typedef struct {
+	NICDevice* nicdev;
+	VirtNetQueue* queue;
+} VirtNetTxContext;
+
 static bool process(Packet* packet, void* context) {
-	NICDevice* nicdev = context;
+	VirtNetTxContext* tx_context = context;
+	NICDevice* nicdev = tx_context->nicdev;
 	if(nicdev->vlan_proto == ETHER_TYPE_8021Q) { //Vlan Tagging
 		Ether* ether = (Ether*)(packet->buffer + packet->start);
 		if(packet->start < 4) {
@@ -489,50 +1425,78 @@ static bool process(Packet* packet, void* context) {
 		VLAN* vlan = (VLAN*)ether->payload;
 		vlan->tci = nicdev->vlan_tci;
 	}
-	return virtnet_send(nicdev->priv, packet) == 0 ? true : false;
+	return virtnet_send(tx_context->queue, packet) == 0 ? true : false;
+}
+
+static uint32_t process_burst(Packet** packets, uint32_t count, void* context) {
+	VirtNetTxContext* tx_context = context;
+
+	for(uint32_t i = 0; i < count; i++) {
+		// Stop before virtnet_send() drops the packet on a full ring
+		if(!virtnet_send_fits(tx_context->queue, packets[i]) || !process(packets[i], tx_context))
+			return i;
+	}
+
+	return count;
 }
 
 static bool virtio_xmit(NICDevice* nicdev, Packet* packet) {
  	VirtNetPriv* priv = nicdev->priv;
-	VirtQueue* vq;
+	VirtNetTxContext tx_context = { .nicdev = nicdev, .queue = &priv->queues[0] };
+	VirtQueue* vq = tx_context.queue->svq;
  
- 	// Free used buffer
- 	void* buf;
- 	while((buf = get_buf(priv->svq, NULL))) {
- 		nic_free(buf);
- 	}
+	// Free used buffers once the ring runs low
+	if(vq->num_free < vq->size >> TX_RECLAIM_SHIFT)
+		virtnet_reclaim(vq);
  
  	// TX
-	if(process(packet, nicdev)) {
-		vq = priv->svq;
+	if(process(packet, &tx_context))
 		kick(vq);
-	}
 
 	return true;
 }
 
-static bool virtio_tx(NICDevice* nicdev) {
- 	VirtNetPriv* priv = nicdev->priv;
-	VirtQueue* vq;
+/* Transmit the frames of a tx queue of nicdev on a queue pair */
+static bool virtnet_tx(NICDevice* nicdev, VirtNetQueue* queue) {
+	VirtNetTxContext tx_context = { .nicdev = nicdev, .queue = queue };
+	VirtQueue* vq = queue->svq;
  
- 	// Free used buffer
- 	void* buf;
- 	while((buf = get_buf(priv->svq, NULL))) {
- 		nic_free(buf);
- 	}
+	// Used buffers are freed in bulk once the ring runs low, not on every call
+	if(vq->num_free < vq->size >> TX_RECLAIM_SHIFT)
+		virtnet_reclaim(vq);
  
- 	// TX
- 	int nicdev_tx(NICDevice* dev,
- 			bool (*process)(Packet* packet, void* context), void* context);
- 	int count = nicdev_tx(nicdev, process, nicdev);
-	if(count) {
-		vq = priv->svq;
-		kick(vq);
+ 	// TX, one kick for the burst. Kicks are counted on the device, VLAN devices included
+	int count = nicdev_tx_burst_queue(nicdev, queue->index, process_burst, &tx_context);
+	if(vq->num_added) {
+		NICDeviceQueue* stats = &queue->priv->priv->queues[queue->index];
+		if(kick(vq))
+			stats->tx_kicks++;
+		else
+			stats->kicks_saved++;
 	}
 
+	if(count)
+		event_busy_progress();
+	else if(vq->num_free < vq->size)
+		virtnet_reclaim(vq);	// Idle: frames left in the ring go back to their pools
+
 	return true;
 }
 
+/* Transmit on a queue pair, a busy event of the core owning it */
+static bool virtnet_tx_poll(void* context) {
+	VirtNetQueue* queue = context;
+
+	return virtnet_tx(queue->priv->priv, queue);
+}
+
+/* VLAN devices only have one tx queue, sent on pair 0 by this core */
+static bool virtio_tx(NICDevice* nicdev) {
+	VirtNetPriv* priv = nicdev->priv;
+
+	return virtnet_tx(nicdev, &priv->queues[0]);
+}
+
 
 int init(void* device, void* data) {
 	int err;
@@ -566,11 +1530,22 @@ int init(void* device, void* data) {
 
 	// Set promiscuos mode
 	uint8_t promisc = 1; // 1 means ON for the command
-	if(virtnet_send_command(priv, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &promisc))
+	if(virtnet_send_command(priv, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &promisc, 1))
 		printf("Promiscuos mode ON\n");
 	else
 		printf("Promiscous mode OFF\n");
 
+	// The device only uses pair 0 until told otherwise
+	if(priv->queue_count > 1) {
+		uint16_t pairs = priv->queue_count;
+		if(virtnet_send_command(priv, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, 2)) {
+			printf("Queue pairs: %d\n", pairs);
+		} else {
+			printf("Queue pairs: 1\n");
+			priv->queue_count = 1;
+		}
+	}
+
 	//Register NICDevice
 	NICDevice* nicdev = gmalloc(sizeof(NICDevice));
 	if(!nicdev)
@@ -588,14 +1563,26 @@ int init(void* device, void* data) {
 	extern NICDriver device_driver;
 	nicdev->driver = (void*)&device_driver;
 	nicdev->priv = priv;
+	nicdev->queue_count = priv->queue_count;
+	nicdev->offloads = virtnet_offloads(&priv->vdev);
+	nicdev->ring = priv->queues[0].rvq->packed ? NICDEV_RING_PACKED : NICDEV_RING_SPLIT;
+	if(priv->queues[0].rvq->in_order)
+		nicdev->ring |= NICDEV_RING_IN_ORDER;
+	for(int i = 0; i < priv->queue_count; i++)
+		nicdev->queues[i].core = priv->queues[i].core;
 	priv->priv = nicdev;
 
 	extern int nicdev_register(NICDevice* dev);
 	//TODO check return value
 	nicdev_register(nicdev);
 
-	event_busy_add(poll, nicdev);
-	event_busy_add(virtio_tx, nicdev);
+	// Each pair is polled by its core. The device writes the used index of rx on the next frame;
+	// a packed ring has no such fixed line
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+		icc_busy_add(queue->core, virtnet_poll, queue, queue->rvq->packed ? NULL : &queue->rvq->vring.used->idx);
+		icc_busy_add(queue->core, virtnet_tx_poll, queue, NULL);
+	}
 
 	return 0;
 error: 
@@ -606,10 +1593,7 @@ error:
 }
 
 void destroy(int id) {
-	// Destory pseudo header 
-// 	gfree(pseudo_vnet_hdr);
-// 
-// 	// Destroy virtqueues
+	// Destroy virtqueues
 // 	bfree(priv[id]->rvq->vring.desc);
 // 	gfree(priv[id]->rvq);
 // 
@@ -646,6 +1630,7 @@ DeviceType device_type = DEVICE_TYPE_NIC;
 
 static PCI_ID pci_ids[] = {
 	PCI_DEVICE(0x1af4, 0x1000, "virtio", NULL), 
+	PCI_DEVICE(0x1af4, 0x1041, "virtio", NULL), // Modern only
 	{ 0 }
 };
 
@@ -673,6 +1658,21 @@ bool virtnet_vlan_rx_kill_vid(NICDevice* nicdev, uint16_t vid) {
 	return true;
 }
 
+static void virtnet_quiesce_call(void* context) {
+}
+
+/* A round trip to the core of every pair, so none of them is still inside a poll */
+static void virtnet_quiesce(NICDevice* nicdev) {
+	VirtNetPriv* priv = nicdev->priv;
+	volatile uint32_t pending = priv->queue_count;
+
+	for(int i = 0; i < priv->queue_count; i++)
+		icc_call(priv->queues[i].core, virtnet_quiesce_call, NULL, &pending);
+
+	while(pending)
+		asm volatile("pause");
+}
+
 NICDriver device_driver = {
 	.init = init,
 	.destroy = destroy,
@@ -684,5 +1684,6 @@ NICDriver device_driver = {
 	.get_info = get_info,
 
 	.add_vid = virtnet_vlan_rx_add_vid,
-	.remove_vid = virtnet_vlan_rx_kill_vid
+	.remove_vid = virtnet_vlan_rx_kill_vid,
+	.quiesce = virtnet_quiesce
 };
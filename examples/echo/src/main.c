@@ -16,11 +16,14 @@ void init(int argc, char** argv) {
 
 static uint32_t address = 0xc0a8640a;	// 192.168.100.10
 
-void process(NIC* ni) {
-	Packet* packet = nic_rx(ni);
-	if(!packet)
-		return;
-
+#define BURST_SIZE	32
+
+/**
+ * Rewrite the packet into its reply in place
+ *
+ * @return true if the packet is a reply to send back
+ */
+static bool echo(NIC* ni, Packet* packet) {
 	Ether* ether = (Ether*)(packet->buffer + packet->start);
 	if(endian16(ether->type) == ETHER_TYPE_ARP) {
 		ARP* arp = (ARP*)ether->payload;
@@ -33,8 +36,7 @@ void process(NIC* ni) {
 			arp->sha = ether->smac;
 			arp->spa = endian32(address);
 
-			nic_tx(ni, packet);
-			packet = NULL;
+			return true;
 		}
 	} else if(endian16(ether->type) == ETHER_TYPE_IPv4) {
 		IP* ip = (IP*)ether->payload;
@@ -54,8 +56,7 @@ void process(NIC* ni) {
 			ether->dmac = ether->smac;
 			ether->smac = endian48(ni->mac);
 
-			nic_tx(ni, packet);
-			packet = NULL;
+			return true;
 		} else if(ip->protocol == IP_PROTOCOL_UDP) {
 			UDP* udp = (UDP*)ip->body;
 			if(endian16(udp->destination) == 7) {
@@ -75,14 +76,37 @@ void process(NIC* ni) {
 				ether->dmac = ether->smac;
 				ether->smac = t3;
 
-				nic_tx(ni, packet);
-				packet = NULL;
+				return true;
 			}
 		}
 	}
 
-	if(packet)
-		nic_free(packet);
+	return false;
+}
+
+/**
+ * @param queue queue pair owned by this thread, -1 to share the NIC with other threads
+ */
+void process(NIC* ni, int queue) {
+	Packet* packets[BURST_SIZE];
+	Packet* replies[BURST_SIZE];
+	uint32_t reply_count = 0;
+
+	uint32_t count = queue >= 0 ? nic_rx_queue_burst(ni, queue, packets, BURST_SIZE) :
+			nic_rx_burst(ni, packets, BURST_SIZE);
+	for(uint32_t i = 0; i < count; i++) {
+		if(echo(ni, packets[i]))
+			replies[reply_count++] = packets[i];
+		else
+			nic_free(packets[i]);
+	}
+
+	if(reply_count) {
+		if(queue >= 0)
+			nic_tx_queue_burst(ni, queue, replies, reply_count);
+		else
+			nic_tx_burst(ni, replies, reply_count);
+	}
 }
 
 void destroy() {
@@ -110,8 +134,12 @@ int main(int argc, char** argv) {
 			i = (i + 1) % count;
 
 			NIC* ni = nic_get(i);
-			if(nic_has_rx(ni)) {
-				process(ni);
+			// Poll without locking when every thread has a queue pair of its own
+			if(nic_queue_count(ni) >= thread_count()) {
+				if(nic_has_rx_queue(ni, thread_id()))
+					process(ni, thread_id());
+			} else if(nic_has_rx(ni)) {
+				process(ni, -1);
 			}
 		}
 	}
@@ -55,6 +55,9 @@
 #define APIC_IRR_EOI			(0x01 << 14)
 #define APIC_PP_ACTIVEHIGH		(0x00 << 13)
 #define APIC_PP_ACTIVELOW		(0x01 << 13)
+#define APIC_TIMER_ONESHOT		(0x00 << 17)	// LVT timer mode
+#define APIC_TIMER_PERIODIC		(0x01 << 17)
+#define APIC_TIMER_TSC_DEADLINE		(0x02 << 17)
 
 typedef void (*APIC_Handler)(uint64_t,uint64_t);
 
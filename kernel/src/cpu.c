@@ -2,13 +2,18 @@
 #include <string.h>
 #include <timer.h>
 #include <util/cmd.h>
+#include <util/types.h>
+#include <util/event.h>
 #include "port.h"
 #include "cpu.h"
 #include "msr.h"
+#include "asm.h"
+#include "apic.h"
 
 char cpu_brand[4 * 4 * 3 + 1];
 
 static int cmd_turbo(int argc, char** argv, void(*callback)(char* result, int exit_status));
+static int cmd_poll(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static Command commands[] = {
 	{
 		.name = "turbo",
@@ -18,8 +23,25 @@ static Command commands[] = {
 		.args = "[switch: str{on|off}]",
 		.func = cmd_turbo
 	},
+	{
+		.name = "poll",
+		.desc = "Manage adaptive polling of this core's event loop.\n"
+			"Busy events are polled for spin us after they made progress, then the core\n"
+			"sleeps with MWAIT (hint, e.g. 0 for C1) until the monitored queue is written,\n"
+			"an interrupt arrives or max us passed. Without arguments the status is printed.",
+		.args = "[on | off | spin:u32 [max:u32] [hint:u8]]",
+		.func = cmd_poll
+	},
 };
 
+static struct {
+	bool	enabled;
+	clock_t	spin;
+	clock_t	max;
+	uint8_t	hint;
+	uint8_t	line;	///< Monitored when no busy event has a line of its own
+} poll;
+
 int cpu_init() {
 	uint32_t* p = (uint32_t*)cpu_brand;
 
@@ -72,6 +94,9 @@ bool cpu_has_feature(int feature) {
 		case CPU_FEATURE_INVARIANT_TSC:
 			EXT(0x07);
 			return !!(d & 0x100);
+		case CPU_FEATURE_TSC_DEADLINE:
+			INFO(0x01);
+			return !!(c & 0x1000000);
 		default:
 			return false;
 	}
@@ -132,3 +157,57 @@ static int cmd_turbo(int argc, char** argv, void(*callback)(char* result, int ex
 
 	return 0;
 }
+
+// The TSC deadline timer ends the wait, MWAIT breaks on it even with interrupts masked
+static void poll_wait(volatile void* line, uint64_t deadline, void* context) {
+	msr_write(deadline * __timer_us, MSR_IA32_TSC_DEADLINE);
+	monitor(line ? (void*)line : &poll.line);
+	mwait(1, poll.hint);
+	msr_write(0, MSR_IA32_TSC_DEADLINE);
+}
+
+static int cmd_poll(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc > 4)
+		return CMD_STATUS_WRONG_NUMBER;
+
+	if(argc == 1) {
+		if(poll.enabled)
+			printf("Adaptive polling: spin %lu us, max %lu us, hint 0x%02x\n", poll.spin, poll.max, poll.hint);
+		else
+			printf("Adaptive polling: off\n");
+
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "off")) {
+		event_wait_set(0, 0, NULL, NULL);
+		apic_write32(APIC_REG_LVT_TR, apic_read32(APIC_REG_LVT_TR) | APIC_IM_DISABLED);
+		poll.enabled = false;
+		printf("Adaptive polling: off\n");
+
+		return 0;
+	}
+
+	if(!cpu_has_feature(CPU_FEATURE_MONITOR_MWAIT) || !cpu_has_feature(CPU_FEATURE_MWAIT_INTERRUPT) ||
+			!cpu_has_feature(CPU_FEATURE_TSC_DEADLINE)) {
+		printf("Not Support MONITOR/MWAIT with TSC deadline timer\n");
+
+		return -1;
+	}
+
+	bool on = !strcmp(argv[1], "on");
+	if((!on && !is_uint32(argv[1])) || (argc > 2 && !is_uint32(argv[2])) || (argc > 3 && !is_uint8(argv[3])))
+		return -1;
+
+	poll.spin = on ? CPU_POLL_SPIN : parse_uint32(argv[1]);
+	poll.max = argc > 2 ? parse_uint32(argv[2]) : CPU_POLL_MAX;
+	poll.hint = argc > 3 ? parse_uint8(argv[3]) : 0;
+
+	// Vector 32 is the dummy timer handler of apic_init
+	apic_write32(APIC_REG_LVT_TR, 32 | APIC_TIMER_TSC_DEADLINE);
+	event_wait_set(poll.spin, poll.max, poll_wait, NULL);
+	poll.enabled = true;
+	printf("Adaptive polling: spin %lu us, max %lu us, hint 0x%02x\n", poll.spin, poll.max, poll.hint);
+
+	return 0;
+}
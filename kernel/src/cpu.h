@@ -10,6 +10,10 @@
 #define CPU_FEATURE_MWAIT_INTERRUPT	4
 #define CPU_FEATURE_TURBO_BOOST		5
 #define CPU_FEATURE_INVARIANT_TSC	6
+#define CPU_FEATURE_TSC_DEADLINE	7
+
+#define CPU_POLL_SPIN			100	// us the event loop polls after the last progress
+#define CPU_POLL_MAX			1000	// us a wait of the event loop lasts at most
 
 int cpu_init();
 bool cpu_has_feature(int feature);
@@ -14,6 +14,8 @@
 #define endian48(v)		(__builtin_bswap64((v)) >> 16)	///< Change endianness for 48 bits
 
 #define ETHER_MULTICAST		((uint64_t)1 << 40)	///< MAC address is multicast
+#define ETHER_BROADCAST		0xffffffffffff		///< Broadcast MAC address
+#define NICDEV_MAC_TABLE_LIMIT	(NICDEV_MAC_TABLE_SIZE / 4 * 3)	///< Used MAC table entries at most
 #define ID_BUFFER_SIZE		(MAX_NIC_DEVICE_COUNT * 8)
 
 
@@ -176,45 +178,314 @@ NICDevice* nicdev_get_by_idx(int _index) {
 	return NULL;
 }
 
+static inline uint32_t nicdev_mac_index(uint64_t mac) {
+	// Fibonacci hashing, scaled to the table size without a division
+	uint32_t hash = (mac * 0x9e3779b97f4a7c15ull) >> 32;
+	return ((uint64_t)hash * NICDEV_MAC_TABLE_SIZE) >> 32;
+}
+
+static inline uint32_t nicdev_mac_next(uint32_t index) {
+	return index + 1 == NICDEV_MAC_TABLE_SIZE ? 0 : index + 1;
+}
+
+/*
+ * Find the next entry of mac (and vnic if not NULL) starting at *index, which
+ * is advanced past it. All entries of an address are on the probe sequence
+ * from nicdev_mac_index(), which ends at the first empty entry.
+ */
+static NICDeviceMAC* nicdev_mac_find(NICDevice* nicdev, uint64_t mac, VNIC* vnic, uint32_t* index) {
+	for(uint32_t i = *index; nicdev->macs[i].vnic; i = nicdev_mac_next(i)) {
+		NICDeviceMAC* entry = &nicdev->macs[i];
+		if(entry->mac == mac && (!vnic || entry->vnic == vnic)) {
+			*index = nicdev_mac_next(i);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static bool nicdev_mac_add(NICDevice* nicdev, uint64_t mac, VNIC* vnic, uint16_t slot) {
+	if(nicdev->mac_count >= NICDEV_MAC_TABLE_LIMIT)
+		return false;
+
+	uint32_t i = nicdev_mac_index(mac);
+	while(nicdev->macs[i].vnic)
+		i = nicdev_mac_next(i);
+
+	nicdev->macs[i].mac = mac;
+	nicdev->macs[i].slot = slot;
+	nicdev->macs[i].vnic = vnic;
+	nicdev->mac_count++;
+
+	return true;
+}
+
+static void nicdev_mac_remove(NICDevice* nicdev, NICDeviceMAC* entry) {
+	// Backward shift deletion: move up the entries whose probe sequence crosses the hole
+	uint32_t i = entry - nicdev->macs;
+	uint32_t j = i;
+	while(true) {
+		j = nicdev_mac_next(j);
+		if(!nicdev->macs[j].vnic)
+			break;
+
+		uint32_t home = nicdev_mac_index(nicdev->macs[j].mac);
+		bool reachable = i < j ? (home > i && home <= j) : (home > i || home <= j);
+		if(!reachable) {
+			nicdev->macs[i] = nicdev->macs[j];
+			i = j;
+		}
+	}
+
+	nicdev->macs[i].mac = 0;
+	nicdev->macs[i].slot = 0;
+	nicdev->macs[i].vnic = NULL;
+	nicdev->mac_count--;
+}
+
+// Renumber the MAC table after the VNICs from slot on moved by delta
+static void nicdev_update_slots(NICDevice* nicdev, uint16_t slot, int delta) {
+	for(uint32_t i = 0; i < NICDEV_MAC_TABLE_SIZE; i++) {
+		if(nicdev->macs[i].vnic && nicdev->macs[i].slot >= slot)
+			nicdev->macs[i].slot += delta;
+	}
+
+	for(int i = 0; i < NICDEV_VNIC_WORDS; i++)
+		nicdev->mirrors[i] = 0;
+
+	for(int i = 0; i < nicdev->vnic_count; i++) {
+		if(nicdev->vnics[i]->mirror)
+			nicdev->mirrors[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+}
+
+static void nicdev_tx_ready(NICDeviceQueue* queue, VNIC* vnic) {
+	NICDeviceClass* class = &queue->classes[vnic->tx_class];
+	vnic->tx_next = NULL;
+	if(class->tail)
+		class->tail->tx_next = vnic;
+	else
+		class->head = vnic;
+	class->tail = vnic;
+	class->count++;
+
+	vnic->tx_ready = true;
+	vnic->tx_ready_class = vnic->tx_class;
+}
+
+static VNIC* nicdev_tx_next(NICDeviceClass* class) {
+	VNIC* vnic = class->head;
+	class->head = vnic->tx_next;
+	if(!class->head)
+		class->tail = NULL;
+	class->count--;
+
+	vnic->tx_ready = false;
+	vnic->tx_next = NULL;
+
+	return vnic;
+}
+
+static void nicdev_wait_set(NICDeviceQueue* queue, uint16_t index, VNIC* vnic) {
+	queue->waits[index] = vnic;
+	vnic->tx_wait_index = index;
+}
+
+static void nicdev_wait_up(NICDeviceQueue* queue, uint16_t index) {
+	VNIC* vnic = queue->waits[index];
+	while(index > 0) {
+		uint16_t parent = (index - 1) / 2;
+		if(queue->waits[parent]->tx_wait_time <= vnic->tx_wait_time)
+			break;
+
+		nicdev_wait_set(queue, index, queue->waits[parent]);
+		index = parent;
+	}
+	nicdev_wait_set(queue, index, vnic);
+}
+
+static void nicdev_wait_down(NICDeviceQueue* queue, uint16_t index) {
+	VNIC* vnic = queue->waits[index];
+	for(;;) {
+		uint32_t child = (uint32_t)index * 2 + 1;
+		if(child >= queue->wait_count)
+			break;
+		if(child + 1 < queue->wait_count && queue->waits[child + 1]->tx_wait_time < queue->waits[child]->tx_wait_time)
+			child++;
+		if(vnic->tx_wait_time <= queue->waits[child]->tx_wait_time)
+			break;
+
+		nicdev_wait_set(queue, index, queue->waits[child]);
+		index = child;
+	}
+	nicdev_wait_set(queue, index, vnic);
+}
+
+// Park a paced VNIC on the pacing timer until it may send
+static void nicdev_tx_wait(NICDeviceQueue* queue, VNIC* vnic, uint64_t time) {
+	vnic->tx_waiting = true;
+	vnic->tx_wait_time = time;
+	queue->waits[queue->wait_count] = vnic;
+	nicdev_wait_up(queue, queue->wait_count++);
+}
+
+static void nicdev_tx_unwait(NICDeviceQueue* queue, VNIC* vnic) {
+	uint16_t index = vnic->tx_wait_index;
+	vnic->tx_waiting = false;
+
+	VNIC* last = queue->waits[--queue->wait_count];
+	queue->waits[queue->wait_count] = NULL;
+	if(last == vnic)
+		return;
+
+	nicdev_wait_set(queue, index, last);
+	nicdev_wait_up(queue, index);
+	nicdev_wait_down(queue, last->tx_wait_index);
+}
+
+// Move the paced VNICs whose time has come to their ready lists
+static void nicdev_tx_release(NICDeviceQueue* queue, uint64_t t) {
+	while(queue->wait_count && queue->waits[0]->tx_wait_time <= t) {
+		VNIC* vnic = queue->waits[0];
+		nicdev_tx_unwait(queue, vnic);
+		vnic->tx_deficit = 0;
+		vnic->tx_ready_time = t;
+		nicdev_tx_ready(queue, vnic);
+	}
+}
+
+uint64_t nicdev_tx_time(NICDevice* nicdev, uint16_t index) {
+	NICDeviceQueue* queue = &nicdev->queues[index];
+	return queue->wait_count ? queue->waits[0]->tx_wait_time : (uint64_t)-1;
+}
+
+static void nicdev_tx_remove(NICDevice* nicdev, VNIC* vnic) {
+	NICDeviceQueue* queue = &nicdev->queues[vnic->tx_dev_queue];
+	if(vnic->tx_waiting)
+		nicdev_tx_unwait(queue, vnic);
+
+	if(!vnic->tx_ready)
+		return;
+
+	NICDeviceClass* class = &queue->classes[vnic->tx_ready_class];
+	VNIC* prev = NULL;
+	VNIC** link = &class->head;
+	while(*link != vnic) {
+		prev = *link;
+		link = &prev->tx_next;
+	}
+
+	*link = vnic->tx_next;
+	if(class->tail == vnic)
+		class->tail = prev;
+	class->count--;
+
+	vnic->tx_ready = false;
+	vnic->tx_next = NULL;
+}
+
+/*
+ * Keep the queue cores out of the device while its VNIC arrays change. Once
+ * the driver's quiesce returned no core is still inside rx or tx, and every
+ * later poll sees paused and leaves the device alone until it is resumed.
+ */
+static void nicdev_pause(NICDevice* nicdev) {
+	nicdev->paused = true;
+	__sync_synchronize();
+
+	NICDriver* driver = nicdev->driver;
+	if(driver && driver->quiesce)
+		driver->quiesce(nicdev);
+}
+
+static void nicdev_resume(NICDevice* nicdev) {
+	__sync_synchronize();
+	nicdev->paused = false;
+}
+
 int nicdev_register_vnic(NICDevice* nicdev, VNIC* vnic) {
-	int i;
-	for(i = 0; i < MAX_VNIC_COUNT; i++) {
-		if(!nicdev->vnics[i]) {
-			nicdev->vnics[i] = vnic;
-			vnic->vlan_proto = nicdev->vlan_proto;
-			vnic->vlan_tci = nicdev->vlan_tci;
+	uint32_t index = nicdev_mac_index(vnic->mac);
+	if(nicdev_mac_find(nicdev, vnic->mac, NULL, &index))
+		return -1;
 
-			return vnic->id;
+	if(nicdev->vnic_count >= MAX_VNIC_COUNT || nicdev->mac_count >= NICDEV_MAC_TABLE_LIMIT)
+		return -2;
+
+	// Keep a domain together so that fan-out can share one copy among it
+	uint16_t slot = nicdev->vnic_count;
+	for(int i = nicdev->vnic_count - 1; vnic->domain && i >= 0; i--) {
+		if(nicdev->vnics[i]->domain == vnic->domain) {
+			slot = i + 1;
+			break;
 		}
+	}
 
-		if(nicdev->vnics[i]->mac == vnic->mac)
-			return -1;
+	nicdev_pause(nicdev);
+
+	for(int i = nicdev->vnic_count; i > slot; i--)
+		nicdev->vnics[i] = nicdev->vnics[i - 1];
+	nicdev->vnics[slot] = vnic;
+	nicdev->vnic_count++;
+
+	vnic->vlan_proto = nicdev->vlan_proto;
+	vnic->vlan_tci = nicdev->vlan_tci;
+	vnic->tx_ready = false;
+	if(vnic->mirror)
+		nicdev->mirror_count++;
+
+	// The least loaded tx queue serves the VNIC
+	uint16_t queue_count = nicdev->queue_count ? : 1;
+	vnic->tx_dev_queue = 0;
+	for(uint16_t i = 1; i < queue_count; i++) {
+		if(nicdev->queues[i].vnic_count < nicdev->queues[vnic->tx_dev_queue].vnic_count)
+			vnic->tx_dev_queue = i;
 	}
+	nicdev->queues[vnic->tx_dev_queue].vnic_count++;
 
-	return -2;
+	nicdev_update_slots(nicdev, slot, 1);
+	nicdev_mac_add(nicdev, vnic->mac, vnic, slot);
+
+	nicdev_resume(nicdev);
+
+	return vnic->id;
 }
 
 VNIC* nicdev_unregister_vnic(NICDevice* nicdev, uint32_t id) {
-	VNIC* vnic;
-	int i, j;
+	for(uint16_t slot = 0; slot < nicdev->vnic_count; slot++) {
+		VNIC* vnic = nicdev->vnics[slot];
+		if(vnic->id != id)
+			continue;
 
-	for(i = 0; i < MAX_VNIC_COUNT; i++) {
-		if(!nicdev->vnics[i])
-			return NULL;
+		nicdev_pause(nicdev);
 
-		if(nicdev->vnics[i]->id == id) {
-			//Shift
-			vnic = nicdev->vnics[i];
-			nicdev->vnics[i] = NULL;
-			for(j = i; j + 1 < MAX_VNIC_COUNT; j++) {
-				if(nicdev->vnics[j + 1]) {
-					nicdev->vnics[j] = nicdev->vnics[j + 1];
-					nicdev->vnics[j + 1] = NULL;
-				}
-			}
+		// Unicast address and multicast memberships
+		for(uint32_t i = 0; i < NICDEV_MAC_TABLE_SIZE; i++) {
+			while(nicdev->macs[i].vnic == vnic)
+				nicdev_mac_remove(nicdev, &nicdev->macs[i]);
+		}
 
-			return vnic;
+		nicdev_tx_remove(nicdev, vnic);
+
+		//Shift
+		nicdev->vnic_count--;
+		for(uint16_t i = slot; i < nicdev->vnic_count; i++)
+			nicdev->vnics[i] = nicdev->vnics[i + 1];
+		nicdev->vnics[nicdev->vnic_count] = NULL;
+
+		if(vnic->mirror)
+			nicdev->mirror_count--;
+		nicdev->queues[vnic->tx_dev_queue].vnic_count--;
+
+		nicdev_update_slots(nicdev, slot, -1);
+		for(int i = 0; i < NICDEV_MAX_QUEUE_COUNT; i++) {
+			if(nicdev->queues[i].round >= nicdev->vnic_count)
+				nicdev->queues[i].round = 0;
 		}
+
+		nicdev_resume(nicdev);
+
+		return vnic;
 	}
 
 	return NULL;
@@ -224,10 +495,7 @@ VNIC* nicdev_get_vnic(NICDevice* nicdev, uint32_t id) {
 	if(!nicdev)
 		return NULL;
 
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
-		if(!nicdev->vnics[i])
-			return NULL;
-
+	for(int i = 0; i < nicdev->vnic_count; i++) {
 		if(nicdev->vnics[i]->id == id)
 			return nicdev->vnics[i];
 	}
@@ -239,26 +507,18 @@ VNIC* nicdev_get_vnic_mac(NICDevice* nicdev, uint64_t mac) {
 	if(!nicdev)
 		return NULL;
 
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
-		if(!nicdev->vnics[i])
-			return NULL;
-
-		if(nicdev->vnics[i]->mac == mac)
-			return nicdev->vnics[i];
-	}
+	uint32_t index = nicdev_mac_index(mac);
+	NICDeviceMAC* entry = nicdev_mac_find(nicdev, mac, NULL, &index);
 
-	return NULL;
+	return entry && !(mac & ETHER_MULTICAST) ? entry->vnic : NULL;
 }
 
 extern int strcmp(const char *s1, const char *s2);
 VNIC* nicdev_get_vnic_name(NICDevice* nicdev, char* name) {
 	if(!nicdev || !name) return NULL;
 
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
+	for(int i = 0; i < nicdev->vnic_count; i++) {
 		VNIC* vnic = nicdev->vnics[i];
-		if(!vnic)
-			break;
-
 		if(strcmp(vnic->name, name) == 0)
 			return vnic;
 	}
@@ -275,23 +535,210 @@ VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic) {
 		if(nicdev_get_vnic_mac(nicdev, src_vnic->mac))
 			return NULL;
 
+		uint32_t index = nicdev_mac_index(dst_vnic->mac);
+		NICDeviceMAC* entry = nicdev_mac_find(nicdev, dst_vnic->mac, dst_vnic, &index);
+		uint16_t slot = entry->slot;
+		nicdev_pause(nicdev);
+		nicdev_mac_remove(nicdev, entry);
+		nicdev_mac_add(nicdev, src_vnic->mac, dst_vnic, slot);
+
 		dst_vnic->mac = src_vnic->mac;
+		nicdev_resume(nicdev);
 	}
 
-	//TODO fix bandwidth
-	dst_vnic->rx_bandwidth = dst_vnic->nic->rx_bandwidth = src_vnic->rx_bandwidth;
-	dst_vnic->tx_bandwidth = dst_vnic->nic->tx_bandwidth = src_vnic->tx_bandwidth;
-	dst_vnic->padding_head = dst_vnic->nic->padding_head = src_vnic->padding_head;
-	dst_vnic->padding_tail = dst_vnic->nic->padding_tail = src_vnic->padding_tail;
+	uint64_t attrs[] = {
+		VNIC_RX_BANDWIDTH, src_vnic->rx_bandwidth,
+		VNIC_TX_BANDWIDTH, src_vnic->tx_bandwidth,
+		VNIC_PADDING_HEAD, src_vnic->padding_head,
+		VNIC_PADDING_TAIL, src_vnic->padding_tail,
+		VNIC_NONE
+	};
+	if(vnic_update(dst_vnic, attrs) != VNIC_ERROR_NOERROR)
+		return NULL;
 
 	return dst_vnic;
 }
 
+bool nicdev_set_class(NICDevice* nicdev, uint8_t class, uint64_t bandwidth, uint32_t burst) {
+	if(class >= VNIC_TX_CLASS_COUNT)
+		return false;
+
+	// Each queue gets an even share
+	uint16_t queue_count = nicdev->queue_count ? : 1;
+	bandwidth /= queue_count;
+	burst = (burst ? : bandwidth * queue_count / 8 / 1000) / queue_count;
+	for(uint16_t i = 0; i < queue_count; i++) {
+		nicdev->queues[i].classes[class].bandwidth = bandwidth;
+		vnic_bucket_init(&nicdev->queues[i].classes[class].bucket, bandwidth, burst);
+	}
+
+	return true;
+}
+
+bool nicdev_get_class_stats(NICDevice* nicdev, uint8_t class, NICDeviceClassStats* stats) {
+	if(class >= VNIC_TX_CLASS_COUNT)
+		return false;
+
+	*stats = (NICDeviceClassStats){ 0 };
+	for(int i = 0; i < NICDEV_MAX_QUEUE_COUNT; i++) {
+		NICDeviceClassStats* queue_stats = &nicdev->queues[i].classes[class].stats;
+		stats->packets += queue_stats->packets;
+		stats->bytes += queue_stats->bytes;
+		stats->drop_packets += queue_stats->drop_packets;
+		stats->drop_bytes += queue_stats->drop_bytes;
+		stats->overlimits += queue_stats->overlimits;
+		stats->turns += queue_stats->turns;
+		stats->delay += queue_stats->delay;
+		if(queue_stats->delay_max > stats->delay_max)
+			stats->delay_max = queue_stats->delay_max;
+	}
+
+	return true;
+}
+
+bool nicdev_join_multicast(NICDevice* nicdev, VNIC* vnic, uint64_t mac) {
+	if(!(mac & ETHER_MULTICAST) || mac == ETHER_BROADCAST)
+		return false;
+
+	uint32_t index = nicdev_mac_index(mac);
+	if(nicdev_mac_find(nicdev, mac, vnic, &index))
+		return true;
+
+	for(uint16_t slot = 0; slot < nicdev->vnic_count; slot++) {
+		if(nicdev->vnics[slot] != vnic)
+			continue;
+
+		nicdev_pause(nicdev);
+		bool added = nicdev_mac_add(nicdev, mac, vnic, slot);
+		nicdev_resume(nicdev);
+
+		return added;
+	}
+
+	return false;
+}
+
+bool nicdev_leave_multicast(NICDevice* nicdev, VNIC* vnic, uint64_t mac) {
+	if(!(mac & ETHER_MULTICAST))
+		return false;
+
+	uint32_t index = nicdev_mac_index(mac);
+	NICDeviceMAC* entry = nicdev_mac_find(nicdev, mac, vnic, &index);
+	if(!entry)
+		return false;
+
+	nicdev_pause(nicdev);
+	nicdev_mac_remove(nicdev, entry);
+	nicdev_resume(nicdev);
+
+	return true;
+}
+
 
 /**
  * rx process 
  */
 
+// The consumer of vnic can dequeue packets from owner's pool
+static inline bool vnic_shares(VNIC* vnic, VNIC* owner) {
+	return vnic == owner || (vnic->domain && vnic->domain == owner->domain);
+}
+
+// Slots of the VNICs a multicast frame is queued to: the group, or everyone
+static void nicdev_get_members(NICDevice* nic_dev, uint64_t dmac, uint64_t* members) {
+	for(int i = 0; i < NICDEV_VNIC_WORDS; i++)
+		members[i] = nic_dev->mirrors[i];
+
+	bool group = false;
+	if(dmac != ETHER_BROADCAST) {
+		uint32_t index = nicdev_mac_index(dmac);
+		NICDeviceMAC* entry;
+		while((entry = nicdev_mac_find(nic_dev, dmac, NULL, &index))) {
+			members[entry->slot / 64] |= (uint64_t)1 << (entry->slot % 64);
+			group = true;
+		}
+	}
+
+	if(!group) {
+		for(int i = 0; i < nic_dev->vnic_count; i += 64)
+			members[i / 64] = nic_dev->vnic_count - i >= 64 ? (uint64_t)-1 : ((uint64_t)1 << (nic_dev->vnic_count - i)) - 1;
+	}
+}
+
+// Queue shared to the members in the domain run starting at slot first
+static void nicdev_rx_share(NICDevice* nic_dev, uint64_t* members, int first, Packet* shared) {
+	VNIC* vnic = nic_dev->vnics[first];
+	int last = first;
+	int sharers = 0;
+	for(int i = first; i < nic_dev->vnic_count && vnic_shares(nic_dev->vnics[i], vnic); i++) {
+		if(members[i / 64] & ((uint64_t)1 << (i % 64))) {
+			last = i;
+			sharers++;
+		}
+	}
+
+	// Nobody else sees the packet yet, set every owner before the first push
+	shared->refcount += sharers - 1;
+	for(int i = first; i <= last; i++) {
+		if(members[i / 64] & ((uint64_t)1 << (i % 64))) {
+			members[i / 64] &= ~((uint64_t)1 << (i % 64));
+			vnic_rx2(nic_dev->vnics[i], shared);
+		}
+	}
+}
+
+extern void* memcpy(void* dest, const void* src, size_t n);
+/*
+ * Queue one frame to the VNICs in members. The frame is copied at most once
+ * per domain; VNICs sharing the domain get a reference to the same packet.
+ * packet, if not NULL, already holds the frame in owner's pool and is consumed.
+ */
+static void nicdev_rx_fanout(NICDevice* nic_dev, uint64_t* members, VNIC* owner, Packet* packet,
+		uint8_t* data, size_t size, uint8_t* data_optional, size_t size_optional) {
+	uint64_t owned[NICDEV_VNIC_WORDS];
+	int owned_first = -1;
+
+	for(int word = 0; word < NICDEV_VNIC_WORDS; word++) {
+		while(members[word]) {
+			int first = word * 64 + __builtin_ctzll(members[word]);
+			VNIC* vnic = nic_dev->vnics[first];
+
+			if(packet && owned_first < 0 && vnic_shares(vnic, owner)) {
+				// The copies are made from packet, so it is handed off last
+				for(int i = 0; i < NICDEV_VNIC_WORDS; i++)
+					owned[i] = 0;
+
+				for(int i = first; i < nic_dev->vnic_count && vnic_shares(nic_dev->vnics[i], vnic); i++) {
+					owned[i / 64] |= members[i / 64] & ((uint64_t)1 << (i % 64));
+					members[i / 64] &= ~((uint64_t)1 << (i % 64));
+				}
+				owned_first = first;
+				continue;
+			}
+
+			Packet* shared = vnic_alloc(vnic, size + size_optional);
+			if(!shared) {
+				// vnic_rx accounts the drop
+				vnic_rx(vnic, data, size, data_optional, size_optional);
+				members[word] &= ~((uint64_t)1 << (first % 64));
+				continue;
+			}
+
+			memcpy(shared->buffer + shared->start, data, size);
+			if(size_optional)
+				memcpy(shared->buffer + shared->start + size, data_optional, size_optional);
+			shared->end = shared->start + size + size_optional;
+
+			nicdev_rx_share(nic_dev, members, first, shared);
+		}
+	}
+
+	if(owned_first >= 0)
+		nicdev_rx_share(nic_dev, owned, owned_first, packet);
+	else if(packet)
+		nic_free(packet);
+}
+
 int nicdev_rx(NICDevice* dev, void* data, size_t size) {
 	return nicdev_rx0(dev, data, size, NULL, 0);
 }
@@ -299,32 +746,146 @@ int nicdev_rx(NICDevice* dev, void* data, size_t size) {
 int nicdev_rx0(NICDevice* nic_dev, void* data, size_t size,
 		void* data_optional, size_t size_optional) {
 	Ether* eth = data;
-	int i;
-	VNIC* vnic;
 
-	if(size + size_optional < sizeof(Ether))
+	if(size + size_optional < sizeof(Ether) || unlikely(nic_dev->paused))
 		return NICDEV_PROCESS_PASS;
 	uint64_t dmac = endian48(eth->dmac);
 
 	if(unlikely(!!rx_process)) rx_process(data, size, rx_process_context);
 
+	uint64_t members[NICDEV_VNIC_WORDS];
 	if(dmac & ETHER_MULTICAST) {
-		for(i = 0; i < MAX_VNIC_COUNT; i++) {
-			if(!nic_dev->vnics[i])
-				break;
+		nicdev_get_members(nic_dev, dmac, members);
+		nicdev_rx_fanout(nic_dev, members, NULL, NULL, (uint8_t*)eth, size, data_optional, size_optional);
+		return NICDEV_PROCESS_PASS;
+	}
 
-			vnic_rx(nic_dev->vnics[i], (uint8_t*)eth, size, data_optional, size_optional);
+	uint32_t index = nicdev_mac_index(dmac);
+	NICDeviceMAC* entry = nicdev_mac_find(nic_dev, dmac, NULL, &index);
+	if(unlikely(nic_dev->mirror_count)) {
+		for(int i = 0; i < NICDEV_VNIC_WORDS; i++)
+			members[i] = nic_dev->mirrors[i];
+		if(entry)
+			members[entry->slot / 64] |= (uint64_t)1 << (entry->slot % 64);
+
+		nicdev_rx_fanout(nic_dev, members, NULL, NULL, (uint8_t*)eth, size, data_optional, size_optional);
+		return entry ? NICDEV_PROCESS_COMPLETE : NICDEV_PROCESS_PASS;
+	}
+
+	if(entry) {
+		vnic_rx(entry->vnic, (uint8_t*)eth, size, data_optional, size_optional);
+		return NICDEV_PROCESS_COMPLETE;
+	}
+
+	return NICDEV_PROCESS_PASS;
+}
+
+VNIC* nicdev_get_rx_vnic(NICDevice* nicdev) {
+	// With more VNICs a frame could land in the wrong pool and need a copy anyway
+	if(nicdev->vnic_count != 1 || unlikely(nicdev->paused))
+		return NULL;
+
+	return nicdev->vnics[0];
+}
+
+static inline bool vnic_has_packet(VNIC* vnic, Packet* packet) {
+	return (uintptr_t)packet - (uintptr_t)vnic->nic < vnic->nic_size;
+}
+
+static VNIC* nicdev_get_vnic_packet(NICDevice* nic_dev, Packet* packet) {
+	for(int i = 0; i < nic_dev->vnic_count; i++) {
+		VNIC* vnic = nic_dev->vnics[i];
+		if(vnic_has_packet(vnic, packet))
+			return vnic;
+	}
+
+	return NULL;
+}
+
+uint32_t nicdev_rx_burst(NICDevice* nic_dev, Packet** packets, uint32_t count) {
+	VNIC* owner = NULL;
+	uint32_t n = 0;
+	uint32_t queued = 0;
+
+	if(unlikely(nic_dev->paused)) {
+		for(uint32_t i = 0; i < count; i++)
+			nic_free(packets[i]);
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < count; i++) {
+		Packet* packet = packets[i];
+		Ether* eth = (Ether*)(packet->buffer + packet->start);
+		size_t size = packet->end - packet->start;
+		if(size < sizeof(Ether)) {
+			nic_free(packet);
+			continue;
 		}
-		return NICDEV_PROCESS_PASS;
-	} else {
-		vnic = nicdev_get_vnic_mac(nic_dev, dmac);
-		if(vnic) {
-			vnic_rx(vnic, (uint8_t*)eth, size, data_optional, size_optional);
-			return NICDEV_PROCESS_COMPLETE;
+		uint64_t dmac = endian48(eth->dmac);
+
+		if(unlikely(!!rx_process)) rx_process(eth, size, rx_process_context);
+
+		NICDeviceMAC* entry = NULL;
+		if(!(dmac & ETHER_MULTICAST)) {
+			uint32_t index = nicdev_mac_index(dmac);
+			entry = nicdev_mac_find(nic_dev, dmac, NULL, &index);
+		}
+
+		VNIC* vnic = entry ? entry->vnic : NULL;
+		if(!vnic || !vnic_has_packet(vnic, packet) || nic_dev->mirror_count) {
+			// Keep the order of frames already collected for the owner
+			if(n)
+				queued += vnic_rx_burst(owner, packets, n);
+			n = 0;
+
+			uint64_t members[NICDEV_VNIC_WORDS];
+			if(dmac & ETHER_MULTICAST) {
+				nicdev_get_members(nic_dev, dmac, members);
+			} else {
+				for(int j = 0; j < NICDEV_VNIC_WORDS; j++)
+					members[j] = nic_dev->mirrors[j];
+				if(entry)
+					members[entry->slot / 64] |= (uint64_t)1 << (entry->slot % 64);
+			}
+
+			VNIC* pool = vnic && vnic_has_packet(vnic, packet) ? vnic : nicdev_get_vnic_packet(nic_dev, packet);
+			if(unlikely(packet->meta.flags & PACKET_META_CSUM_PARTIAL))
+				nic_csum_complete(packet);	// Copies lose the offload state
+
+			if(unlikely(packet->next)) {
+				// Copies are made from one buffer
+				Packet* linear = pool ? vnic_linearize(pool, packet) : NULL;
+				if(!linear) {
+					nic_free(packet);
+					continue;
+				}
+
+				packet = linear;
+				eth = (Ether*)(packet->buffer + packet->start);
+				size = packet->end - packet->start;
+			}
+
+			nicdev_rx_fanout(nic_dev, members, pool, pool ? packet : NULL, (uint8_t*)eth, size, NULL, 0);
+			if(!pool)
+				nic_free(packet);
+			continue;
 		}
+
+		// Packets already handed off are never looked at again, so compact in place
+		if(vnic != owner) {
+			if(n)
+				queued += vnic_rx_burst(owner, packets, n);
+
+			owner = vnic;
+			n = 0;
+		}
+		packets[n++] = packet;
 	}
 
-	return NICDEV_PROCESS_PASS;
+	if(n)
+		queued += vnic_rx_burst(owner, packets, n);
+
+	return queued;
 }
 
 int nicdev_srx(VNIC* vnic, void* data, size_t size) {
@@ -352,21 +913,172 @@ int nicdev_srx0(VNIC* vnic, void* data, size_t size,
 typedef struct _TransmitContext{
 	bool (*process)(Packet* packet, void* context);
 	void* context;
+	NICDevice* nicdev;	///< Set to mirror transmitted frames
+	VNIC* vnic;		///< VNIC the frames are dequeued from
+	uint32_t size;		///< Size of the last frame
 } TransmitContext;
 
+/*
+ * Queue a frame the driver took to the mirror VNICs. The caller holds a
+ * reference so the packet is still valid, and sees it as the driver left it,
+ * e.g. VLAN tagged.
+ */
+static void nicdev_tx_mirror(NICDevice* nicdev, VNIC* vnic, Packet* packet) {
+	for(int word = 0; word < NICDEV_VNIC_WORDS; word++) {
+		for(uint64_t mirrors = nicdev->mirrors[word]; mirrors; mirrors &= mirrors - 1) {
+			VNIC* mirror = nicdev->vnics[word * 64 + __builtin_ctzll(mirrors)];
+			if(mirror == vnic)
+				continue;
+
+			if(vnic_shares(mirror, vnic))
+				vnic_rx2(mirror, nic_ref(packet));
+			else
+				vnic_rx(mirror, packet->buffer + packet->start, packet->end - packet->start, NULL, 0);
+		}
+	}
+}
+
+/*
+ * Frames the device cannot take as they are: chains are linearized unless the
+ * driver takes scatter-gather lists (mirrors copy contiguous frames), and
+ * partial checksums the device cannot offload are completed in software.
+ * Super-frames the device cannot segment are refused.
+ *
+ * @return frame to send, NULL if packet cannot be sent and stays with the caller
+ */
+static Packet* transmit_prepare(NICDevice* nicdev, VNIC* vnic, Packet* packet) {
+	if(likely(!packet->next && !(packet->meta.flags & PACKET_META_OFFLOAD)))
+		return packet;
+
+	uint8_t offloads = nicdev ? nicdev->offloads : 0;
+	if(packet->meta.flags & PACKET_META_GSO) {
+		PacketMeta* meta = nic_parse(packet);
+		uint8_t tso = meta->flags & PACKET_META_IPV4 ? NIC_OFFLOAD_TSO4 : NIC_OFFLOAD_TSO6;
+		if(meta->protocol != 6 || !meta->payload || !(offloads & tso))
+			return NULL;
+	}
+
+	if(packet->next && (!(offloads & NIC_OFFLOAD_SG) || nicdev->mirror_count)) {
+		Packet* linear = vnic_linearize(vnic, packet);
+		if(!linear)
+			return NULL;
+		packet = linear;
+	}
+
+	if((packet->meta.flags & PACKET_META_CSUM_PARTIAL) && !(offloads & NIC_OFFLOAD_TX_CSUM) && !nic_csum_complete(packet))
+		packet->meta.flags &= ~PACKET_META_CSUM_PARTIAL;	// Not TCP/UDP, there is nothing to complete
+
+	return packet;
+}
+
 static bool transmitter(Packet* packet, void* context) {
 	if(!packet) return false;
 
 	if(unlikely(!!tx_process)) tx_process(packet->buffer + packet->start, packet->end - packet->start, tx_process);
 
 	TransmitContext* transmitter_context = context;
+	transmitter_context->size = packet_len(packet);
+
+	NICDevice* nicdev = transmitter_context->nicdev;
+	Packet* prepared = transmit_prepare(nicdev, transmitter_context->vnic, packet);
+	if(unlikely(!prepared)) {
+		nic_free(packet);
+		return false;
+	}
+	packet = prepared;
+
+	if(unlikely(nicdev && nicdev->mirror_count)) {
+		nic_ref(packet);
+		bool sent = transmitter_context->process(packet, transmitter_context->context);
+		if(sent)
+			nicdev_tx_mirror(nicdev, transmitter_context->vnic, packet);
+		nic_free(packet);
+
+		return sent;
+	}
 
 	if(!transmitter_context->process(packet, transmitter_context->context)) return false;
 
 	return true;
 }
 
+/*
+ * Move VNICs with new frames to the ready lists. Only a window of VNICs is
+ * polled per call, so idle VNICs cost little however many there are. A
+ * waiting paced VNIC is woken early when new frames may be due sooner. The
+ * window covers about as many VNICs of the queue whatever the queue count.
+ */
+static void nicdev_tx_scan(NICDevice* nicdev, uint16_t index, uint64_t t) {
+	NICDeviceQueue* queue = &nicdev->queues[index];
+	uint16_t vnic_count = nicdev->vnic_count;
+	int count = NICDEV_TX_SCAN_COUNT * (nicdev->queue_count ? : 1);
+	if(count > vnic_count)
+		count = vnic_count;
+
+	for(int i = 0; i < count; i++) {
+		if(queue->round >= vnic_count)
+			queue->round = 0;
+
+		VNIC* vnic = nicdev->vnics[queue->round++];
+		if(!vnic || vnic->tx_dev_queue != index)
+			continue;
+
+		if(vnic->tx_waiting) {
+			uint64_t time = vnic_tx_time(vnic);
+			if(time < vnic->tx_wait_time) {
+				vnic->tx_wait_time = time;
+				nicdev_wait_up(queue, vnic->tx_wait_index);
+			}
+		} else if(!vnic->tx_ready && vnic_has_tx(vnic)) {
+			vnic->tx_deficit = 0;
+			vnic->tx_ready_time = t;
+			nicdev_tx_ready(queue, vnic);
+		}
+	}
+}
+
+/*
+ * Whether vnic may send now. The first pass only serves the guaranteed
+ * bandwidth; borrowing is bounded by the VNIC's and the class's ceilings.
+ */
+static bool nicdev_tx_conforms(NICDeviceClass* class, VNIC* vnic, bool borrow, uint64_t t) {
+	if(!borrow)
+		return vnic->tx_min_bandwidth && vnic_bucket_conforms(&vnic->tx_min_bucket, t);
+
+	return vnic_bucket_conforms(&vnic->tx_bucket, t) && vnic_bucket_conforms(&class->bucket, t);
+}
+
+/*
+ * Account a turn of vnic and put it back on a ready list while it has frames,
+ * or on the pacing timer while a paced VNIC has none due. The wait is
+ * measured from the previous turn that sent something.
+ */
+static void nicdev_tx_account(NICDeviceQueue* queue, NICDeviceClass* class, VNIC* vnic, uint32_t packets, uint64_t t) {
+	if(packets) {
+		uint64_t delay = t - vnic->tx_ready_time;
+		class->stats.turns++;
+		class->stats.delay += delay;
+		if(delay > class->stats.delay_max)
+			class->stats.delay_max = delay;
+		vnic->tx_ready_time = t;
+	}
+
+	if(!vnic_has_tx(vnic))
+		return;
+
+	uint64_t time = vnic_tx_time(vnic);
+	if(time > t)
+		nicdev_tx_wait(queue, vnic, time);
+	else
+		nicdev_tx_ready(queue, vnic);
+}
+
 /**
+ * Classes are served in priority order, lowest first. Each VNIC first gets
+ * its guaranteed bandwidth, then the remaining capacity is shared by deficit
+ * round robin in proportion to the VNIC weights. Paced VNICs join the ready
+ * lists from the pacing timer when their next frame is due.
+ *
  * @param dev NIC device
  * @param process function to process packets in NIC device
  * @param context context to be passed to process function
@@ -376,31 +1088,213 @@ static bool transmitter(Packet* packet, void* context) {
 //Task = budget
 int nicdev_tx(NICDevice* nicdev,
 		bool (*process)(Packet* packet, void* context), void* context) {
-	VNIC* vnic;
-	int budget;
+	return nicdev_tx_queue(nicdev, 0, process, context);
+}
+
+int nicdev_tx_queue(NICDevice* nicdev, uint16_t index,
+		bool (*process)(Packet* packet, void* context), void* context) {
+	NICDeviceQueue* queue = &nicdev->queues[index];
 	int count = 0;
 
+	if(unlikely(nicdev->paused))
+		return 0;
+
 	TransmitContext transmitter_context = {
 		.process = process,
-		.context = context};
+		.context = context,
+		.nicdev = nicdev};
+
+	uint64_t t = vnic_time();
+	nicdev_tx_release(queue, t);
+	nicdev_tx_scan(nicdev, index, t);
+
+	for(int borrow = 0; borrow < 2; borrow++) {
+		for(int i = 0; i < VNIC_TX_CLASS_COUNT; i++) {
+			NICDeviceClass* class = &queue->classes[i];
+
+			// Every VNIC ready now gets one turn
+			for(uint16_t ready = class->count; ready > 0; ready--) {
+				VNIC* vnic = nicdev_tx_next(class);
+				if(borrow && vnic->tx_deficit <= 0)
+					vnic->tx_deficit += vnic->tx_weight * NICDEV_TX_QUANTUM;
+
+				transmitter_context.vnic = vnic;
+				uint32_t packets = 0;
+				for(int budget = vnic->budget; budget > 0; budget--) {
+					if(borrow && vnic->tx_deficit <= 0)
+						break;
+
+					if(!nicdev_tx_conforms(class, vnic, borrow, t)) {
+						if(borrow)
+							class->stats.overlimits++;
+						break;
+					}
+
+					VNICError ret = vnic_tx(vnic, transmitter, &transmitter_context);
+					if(ret == VNIC_ERROR_RESOURCE_NOT_AVAILABLE) // There no Packet, Check next vnic
+						break;
+
+					uint16_t size = transmitter_context.size;
+					vnic_bucket_charge(&class->bucket, t, size);
+					if(borrow)
+						vnic->tx_deficit -= size;
+
+					if(ret == VNIC_ERROR_OPERATION_FAILED) { // Transmiitter Error
+						class->stats.drop_packets++;
+						class->stats.drop_bytes += size;
+						nicdev_tx_account(queue, class, vnic, packets, t);
+						return count;
+					}
+
+					class->stats.packets++;
+					class->stats.bytes += size;
+					packets++;
+					count++;
+				}
 
-	for(; nicdev->round < MAX_VNIC_COUNT; nicdev->round++) {
-		vnic = nicdev->vnics[nicdev->round];
-		if(!vnic) {
-			nicdev->round = 0;
+				nicdev_tx_account(queue, class, vnic, packets, t);
+			}
+		}
+	}
+
+	return count;
+}
+
+typedef struct _BurstTransmitContext {
+	uint32_t (*process)(Packet** packets, uint32_t count, void* context);
+	void* context;
+	bool full;
+	NICDevice* nicdev;
+	VNIC* vnic;
+	uint32_t sent;		///< Frames of the last burst the driver took
+	uint64_t bytes;		///< Bytes of the last burst the driver took
+	uint64_t drop_bytes;	///< Bytes of the last burst the driver refused
+} BurstTransmitContext;
+
+static uint32_t burst_transmitter(Packet** packets, uint32_t count, void* context) {
+	BurstTransmitContext* transmitter_context = context;
+	NICDevice* nicdev = transmitter_context->nicdev;
+
+	// The burst ends before a frame the device cannot take
+	uint32_t prepared = 0;
+	for(; prepared < count; prepared++) {
+		Packet* packet = transmit_prepare(nicdev, transmitter_context->vnic, packets[prepared]);
+		if(!packet)
 			break;
+		packets[prepared] = packet;
+	}
+	count = prepared;
+
+	if(unlikely(!!tx_process)) {
+		for(uint32_t i = 0; i < count; i++)
+			tx_process(packets[i]->buffer + packets[i]->start, packets[i]->end - packets[i]->start, tx_process_context);
+	}
+
+	bool mirror = unlikely(nicdev->mirror_count != 0);
+	if(mirror) {
+		for(uint32_t i = 0; i < count; i++)
+			nic_ref(packets[i]);
+	}
+
+	// The driver may free the frames it takes
+	uint32_t sizes[count];
+	for(uint32_t i = 0; i < count; i++)
+		sizes[i] = packet_len(packets[i]);
+
+	uint32_t sent = transmitter_context->process(packets, count, transmitter_context->context);
+	if(sent < count)
+		transmitter_context->full = true;
+
+	transmitter_context->sent = sent;
+	transmitter_context->bytes = 0;
+	transmitter_context->drop_bytes = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		if(i < sent)
+			transmitter_context->bytes += sizes[i];
+		else
+			transmitter_context->drop_bytes += sizes[i];
+	}
+
+	if(mirror) {
+		for(uint32_t i = 0; i < count; i++) {
+			if(i < sent)
+				nicdev_tx_mirror(nicdev, transmitter_context->vnic, packets[i]);
+			nic_free(packets[i]);
 		}
+	}
 
-		budget = vnic->budget;
-		while(budget--) {
-			VNICError ret = vnic_tx(vnic, transmitter, &transmitter_context);
+	return sent;
+}
 
-			if(ret == VNIC_ERROR_OPERATION_FAILED) // Transmiitter Error
-				return count;
-			else if(ret == VNIC_ERROR_RESOURCE_NOT_AVAILABLE) // There no Packet, Check next vnic
-				break;
+/**
+ * @param dev NIC device
+ * @param process function to transmit the leading packets of a burst
+ * @param context context to be passed to process function
+ *
+ * @return number of packets dequeued
+ */
+int nicdev_tx_burst(NICDevice* nicdev,
+		uint32_t (*process)(Packet** packets, uint32_t count, void* context), void* context) {
+	return nicdev_tx_burst_queue(nicdev, 0, process, context);
+}
 
-			count++;
+int nicdev_tx_burst_queue(NICDevice* nicdev, uint16_t index,
+		uint32_t (*process)(Packet** packets, uint32_t count, void* context), void* context) {
+	NICDeviceQueue* queue = &nicdev->queues[index];
+	int count = 0;
+
+	if(unlikely(nicdev->paused))
+		return 0;
+
+	BurstTransmitContext transmitter_context = {
+		.process = process,
+		.context = context,
+		.full = false,
+		.nicdev = nicdev};
+
+	uint64_t t = vnic_time();
+	nicdev_tx_release(queue, t);
+	nicdev_tx_scan(nicdev, index, t);
+
+	for(int borrow = 0; borrow < 2; borrow++) {
+		for(int i = 0; i < VNIC_TX_CLASS_COUNT; i++) {
+			NICDeviceClass* class = &queue->classes[i];
+
+			for(uint16_t ready = class->count; ready > 0; ready--) {
+				VNIC* vnic = nicdev_tx_next(class);
+				if(borrow && vnic->tx_deficit <= 0)
+					vnic->tx_deficit += vnic->tx_weight * NICDEV_TX_QUANTUM;
+
+				uint32_t sent = 0;
+				if(nicdev_tx_conforms(class, vnic, borrow, t)) {
+					transmitter_context.vnic = vnic;
+					transmitter_context.sent = 0;
+					transmitter_context.bytes = 0;
+					transmitter_context.drop_bytes = 0;
+
+					uint32_t n = vnic_tx_burst(vnic, burst_transmitter, &transmitter_context, vnic->budget);
+					count += n;
+					if(n) {
+						sent = transmitter_context.sent;
+						uint64_t bytes = transmitter_context.bytes + transmitter_context.drop_bytes;
+						vnic_bucket_charge(&class->bucket, t, bytes);
+						if(borrow)
+							vnic->tx_deficit -= bytes;
+
+						class->stats.packets += sent;
+						class->stats.bytes += transmitter_context.bytes;
+						class->stats.drop_packets += n - sent;
+						class->stats.drop_bytes += transmitter_context.drop_bytes;
+					}
+				} else if(borrow) {
+					class->stats.overlimits++;
+				}
+
+				nicdev_tx_account(queue, class, vnic, sent, t);
+
+				if(transmitter_context.full) // Transmitter queue is full
+					return count;
+			}
 		}
 	}
 
@@ -414,7 +1308,14 @@ static bool stransmitter(Packet* packet, void* context) {
 
 	TransmitContext* transmitter_context = context;
 
-	if(!transmitter_context->process(packet, transmitter_context->context)) return false;
+	// The device is not known here, so offloads are done in software
+	Packet* prepared = transmit_prepare(NULL, transmitter_context->vnic, packet);
+	if(unlikely(!prepared)) {
+		nic_free(packet);
+		return false;
+	}
+
+	if(!transmitter_context->process(prepared, transmitter_context->context)) return false;
 
 	return true;
 }
@@ -430,7 +1331,8 @@ int nicdev_stx(VNIC *vnic,
 			   bool (*process)(Packet *packet, void *context), void *context) {
 	TransmitContext transmitter_context = {
 		.process = process,
-		.context = context};
+		.context = context,
+		.vnic = vnic};
 
 	VNICError ret = vnic_stx(vnic, stransmitter, &transmitter_context);
 
@@ -444,6 +1346,4 @@ int nicdev_stx(VNIC *vnic,
 
 void nicdev_free(Packet* packet) {
 	// TODO
-	for(int i = 0; i < MAX_VNIC_COUNT; ++i) {
-	}
 }
@@ -6,22 +6,97 @@
 #define MAX_NIC_DEVICE_COUNT	128
 #define MAX_NIC_NAME_LEN	16
 
+#define NICDEV_MAC_TABLE_SIZE	(MAX_VNIC_COUNT * 2)	///< MAC table entries, kept at most 3/4 full
+#define NICDEV_VNIC_WORDS	((MAX_VNIC_COUNT + 63) / 64)	///< Words of a bitmap of VNIC slots
+#define NICDEV_TX_SCAN_COUNT	32	///< VNICs polled for new frames per nicdev_tx call
+#define NICDEV_TX_QUANTUM	1514	///< DRR quantum of a VNIC with weight 1 in bytes
+#define NICDEV_MAX_QUEUE_COUNT	8	///< Rx/tx queue pairs of a NIC device
+
+#define NICDEV_RING_SPLIT	0x01	///< Descriptor rings of the device are split virtqueues
+#define NICDEV_RING_PACKED	0x02	///< Descriptor rings of the device are packed virtqueues
+#define NICDEV_RING_IN_ORDER	0x04	///< The device uses buffers in the order they were made available
+
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 
+/**
+ * MAC address table entry. A unicast address maps to one VNIC, a multicast
+ * group has one entry per member.
+ */
+typedef struct {
+	uint64_t	mac: 48;	///< MAC address
+	uint64_t	slot: 16;	///< Index of vnic in NICDevice vnics
+	VNIC*		vnic;		///< VNIC, NULL if the entry is empty
+} NICDeviceMAC;
+
+/**
+ * Counters of a tx priority class
+ */
+typedef struct {
+	uint64_t	packets;	///< Packets transmitted
+	uint64_t	bytes;		///< Bytes transmitted
+	uint64_t	drop_packets;	///< Packets the driver did not take
+	uint64_t	drop_bytes;	///< Bytes the driver did not take
+	uint64_t	overlimits;	///< Turns cut short by a bandwidth limit
+	uint64_t	turns;		///< Turns given to VNICs
+	uint64_t	delay;		///< Total time VNICs waited for their turns (timer ticks)
+	uint64_t	delay_max;	///< Longest wait for a turn (timer ticks)
+} NICDeviceClassStats;
+
+/**
+ * Tx priority class. VNICs within their guaranteed bandwidth are served
+ * first; then the rest borrow up to their own and the class bandwidth,
+ * class by class, sharing by DRR weight within a class.
+ */
+typedef struct {
+	VNICBucket	bucket;		///< Bandwidth of the class
+	uint64_t	bandwidth;	///< Bandwidth in bps, 0 for no limit
+	VNIC*		head;		///< Ready list: VNICs with frames to transmit
+	VNIC*		tail;		///< Last VNIC on the ready list
+	uint16_t	count;		///< Number of VNICs on the ready list
+	NICDeviceClassStats stats;	///< Counters
+} NICDeviceClass;
+
+/**
+ * Tx queue of a NIC device. Every VNIC is served by one queue, and a queue is
+ * only driven by the core owning it, so queues share no tx state.
+ */
+typedef struct {
+	NICDeviceClass	classes[VNIC_TX_CLASS_COUNT]; ///< Tx scheduler
+	VNIC*		waits[MAX_VNIC_COUNT];	///< Pacing timer: paced VNICs waiting to send, min-heap by tx_wait_time
+	uint16_t	wait_count;	///< Number of VNICs in waits
+	uint16_t	round;		///< Slot in vnics the next scan starts at
+	uint16_t	vnic_count;	///< Number of VNICs the queue serves
+	uint8_t		core;		///< APIC ID of the core driving the queue
+
+	uint64_t	rx_kicks;	///< Device notifications after rx refills, each a VM exit under a hypervisor
+	uint64_t	tx_kicks;	///< Device notifications after tx bursts
+	uint64_t	kicks_saved;	///< Notifications skipped because the device did not ask for them
+} NICDeviceQueue;
+
 typedef struct _NICDevice{
 	char		name[MAX_NIC_NAME_LEN];
 	uint64_t	mac;
 	int		mtu;
 	uint16_t	vlan_proto; ///< VLAN Protocol
 	uint16_t	vlan_tci;   ///< VLAN TCI
+	uint8_t		offloads;   ///< NIC_OFFLOAD_* the driver handles, set before VNICs register
+	uint8_t		ring;	    ///< NICDEV_RING_* format of the driver's descriptor rings, 0 if not told
 
 	void*		driver;
 	void*		priv;
 
-	VNIC*		vnics[MAX_VNIC_COUNT];
+	VNIC*		vnics[MAX_VNIC_COUNT]; ///< Registered VNICs, VNICs of a domain are next to each other
+	uint16_t	vnic_count;	///< Number of VNICs in vnics
+	uint16_t	mirror_count; ///< Number of mirror VNICs in vnics
+	uint64_t	mirrors[NICDEV_VNIC_WORDS]; ///< Slots of mirror VNICs
+
+	NICDeviceMAC	macs[NICDEV_MAC_TABLE_SIZE]; ///< MAC address table, open addressing
+	uint32_t	mac_count;	///< Number of used entries in macs
 
-	uint16_t	round; //FIXME: current nicdev only support round robin schedule
+	NICDeviceQueue	queues[NICDEV_MAX_QUEUE_COUNT]; ///< Tx queues, one per rx/tx queue pair of the device
+	uint16_t	queue_count;	///< Number of queues in use, set by the driver before VNICs register; 0 counts as 1
+	volatile bool	paused;		///< VNICs are being added or removed, rx and tx keep out of the device
 
 	struct _NICDevice* next;
 	struct _NICDevice* prev;
@@ -49,6 +124,7 @@ typedef struct {
 
 	bool 		(*add_vid)(NICDevice* nicdev, uint16_t vid);
 	bool 		(*remove_vid)(NICDevice* nicdev, uint16_t vid);
+	void		(*quiesce)(NICDevice* nicdev);	///< Wait until every core polling the device finished its current poll, NULL if only the calling core polls it
 } NICDriver;
 
 typedef enum _NICDEV_PROCESS_TYPE {
@@ -98,6 +174,62 @@ VNIC* nicdev_get_vnic_mac(NICDevice* nicdev, uint64_t mac);
 VNIC* nicdev_get_vnic_name(NICDevice* nicdev, char* name);
 VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic);
 
+/**
+ * Subscribe a VNIC to a multicast group. Frames to a group with members are
+ * only queued to its members (and mirrors), other multicast frames are
+ * flooded to every VNIC.
+ *
+ * @param nicdev NIC Device
+ * @param vnic registered Virtual NIC
+ * @param mac multicast MAC address, broadcast is always flooded
+ *
+ * @return true if vnic is a member of the group
+ */
+bool nicdev_join_multicast(NICDevice* nicdev, VNIC* vnic, uint64_t mac);
+
+/**
+ * @param nicdev NIC Device
+ * @param vnic Virtual NIC
+ * @param mac multicast MAC address
+ *
+ * @return true if vnic was a member of the group
+ */
+bool nicdev_leave_multicast(NICDevice* nicdev, VNIC* vnic, uint64_t mac);
+
+/**
+ * Limit the bandwidth of a tx priority class. The limit is shared evenly by
+ * the tx queues of the device.
+ *
+ * @param nicdev NIC Device
+ * @param class priority class
+ * @param bandwidth bandwidth in bps, 0 for no limit
+ * @param burst burst size in bytes, 0 for 1ms worth
+ *
+ * @return true if the class exists
+ */
+bool nicdev_set_class(NICDevice* nicdev, uint8_t class, uint64_t bandwidth, uint32_t burst);
+
+/**
+ * @param nicdev NIC Device
+ * @param class priority class
+ * @param stats counters of the class summed over the tx queues
+ *
+ * @return true if the class exists
+ */
+bool nicdev_get_class_stats(NICDevice* nicdev, uint8_t class, NICDeviceClassStats* stats);
+
+/**
+ * Time the first paced VNIC waiting on the pacing timer of a tx queue may
+ * send. A driver that polls the queue at least that often keeps paced output
+ * on time.
+ *
+ * @param nicdev NIC Device
+ * @param queue tx queue
+ *
+ * @return timer ticks, (uint64_t)-1 if no VNIC waits
+ */
+uint64_t nicdev_tx_time(NICDevice* nicdev, uint16_t queue);
+
 enum NICDEV_PROCESS_RESULT {
 	NICDEV_PROCESS_COMPLETE,
 	NICDEV_PROCESS_PASS,
@@ -139,6 +271,29 @@ int nicdev_rx(NICDevice* dev, void* data, size_t size);
  */
 int nicdev_rx0(NICDevice* dev, void* data, size_t size, void* data_optional, size_t size_optional);
 
+/**
+ * VNIC whose pool a driver may receive into directly. Only a NIC device with
+ * a single VNIC has one, since every frame it accepts is for that VNIC.
+ *
+ * @param dev NIC device
+ *
+ * @return VNIC to allocate receive buffers from, NULL if frames must be copied
+ */
+VNIC* nicdev_get_rx_vnic(NICDevice* dev);
+
+/**
+ * Zero-copy version of nicdev_rx for packets the device wrote in place into
+ * a VNIC pool (see nicdev_get_rx_vnic). Packets addressed to the VNIC owning
+ * their buffer are queued as is, others are copied out and freed.
+ *
+ * @param dev NIC device
+ * @param packets received packets, ownership is taken for all of them
+ * @param count number of packets
+ *
+ * @return number of packets queued without copying
+ */
+uint32_t nicdev_rx_burst(NICDevice* dev, Packet** packets, uint32_t count);
+
 /**
  * @param dev NIC device
  * @param process function to process packets in NIC device
@@ -148,6 +303,45 @@ int nicdev_rx0(NICDevice* dev, void* data, size_t size, void* data_optional, siz
  */
 
 int nicdev_tx(NICDevice* dev, bool (*process)(Packet* packet, void* context), void* context);
+
+/**
+ * nicdev_tx for one tx queue of a multiqueue device. Only the core owning
+ * the queue may call it.
+ *
+ * @param dev NIC device
+ * @param queue tx queue
+ * @param process function to process packets in NIC device
+ * @param context context to be passed to process function
+ *
+ * @return number of packets proccessed
+ */
+int nicdev_tx_queue(NICDevice* dev, uint16_t queue, bool (*process)(Packet* packet, void* context), void* context);
+
+/**
+ * Burst version of nicdev_tx: dequeues up to budget packets per VNIC at once
+ *
+ * @param dev NIC device
+ * @param process function to transmit the leading packets of a burst,
+ * returns how many it took. The rest are freed by the VNIC
+ * @param context context to be passed to process function
+ *
+ * @return number of packets dequeued
+ */
+int nicdev_tx_burst(NICDevice* dev, uint32_t (*process)(Packet** packets, uint32_t count, void* context), void* context);
+
+/**
+ * nicdev_tx_burst for one tx queue of a multiqueue device. Only the core
+ * owning the queue may call it.
+ *
+ * @param dev NIC device
+ * @param queue tx queue
+ * @param process function to transmit the leading packets of a burst
+ * @param context context to be passed to process function
+ *
+ * @return number of packets dequeued
+ */
+int nicdev_tx_burst_queue(NICDevice* dev, uint16_t queue, uint32_t (*process)(Packet** packets, uint32_t count, void* context), void* context);
+
 /**
  * @param dev NIC device
  * @param data data to be sent
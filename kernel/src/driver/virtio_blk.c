@@ -297,23 +297,91 @@ int virtio_blk_write_async(DiskDriver* driver, List* blocks, int sector_count, v
 /* Add status to virtio configuration status space */
 static void add_status(VirtIODevice* vdev, uint8_t status) {
 	vdev->status |= status;
-	port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
+	if(vdev->common)
+		vdev->common->device_status = vdev->status;
+	else
+		port_out8(vdev->ioaddr + VIRTIO_PCI_STATUS, vdev->status);
+}
+
+/* Address of a memory BAR. Physical memory is mapped one to one */
+static volatile uint8_t* pci_bar(PCI_Device* dev, uint8_t bar) {
+	if(bar > 5)
+		return NULL;
+
+	uint32_t reg = PCI_BASE_ADDRESS_0 + bar * 4;
+	uint32_t low = pci_read32(dev, reg);
+	if(low & PCI_BASE_ADDRESS_SPACE_IO)
+		return NULL;
+
+	uint64_t addr = low & PCI_BASE_ADDRESS_MEM_MASK;
+	if(low & PCI_BASE_ADDRESS_MEM_TYPE_64)
+		addr |= (uint64_t)pci_read32(dev, reg + 4) << 32;
+
+	return (volatile uint8_t*)addr;
+}
+
+/* Find the structures of the modern transport in the vendor capabilities. The first usable one of a type is taken */
+static bool virtio_pci_modern(VirtIODevice* vdev) {
+	PCI_Device* dev = vdev->dev;
+	if(!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+		return false;
+
+	int reg = PCI_CAPABILITY_LIST;
+	for(int i = 0; i < 48; i++) { // TTL is 48 (from Linux)
+		reg = pci_read8(dev, reg);
+		if(reg < 0x40)
+			break;
+
+		reg &= ~3;
+		if(pci_read8(dev, reg + PCI_CAP_LIST_ID) == PCI_CAP_ID_VNDR) {
+			volatile uint8_t* base = pci_bar(dev, pci_read8(dev, reg + VIRTIO_PCI_CAP_BAR));
+			if(base) {
+				base += pci_read32(dev, reg + VIRTIO_PCI_CAP_OFFSET);
+
+				switch(pci_read8(dev, reg + VIRTIO_PCI_CAP_CFG_TYPE)) {
+					case VIRTIO_PCI_CAP_COMMON_CFG:
+						if(!vdev->common)
+							vdev->common = (volatile struct virtio_pci_common_cfg*)base;
+						break;
+
+					case VIRTIO_PCI_CAP_NOTIFY_CFG:
+						if(!vdev->notify_base) {
+							vdev->notify_base = base;
+							vdev->notify_multiplier = pci_read32(dev, reg + VIRTIO_PCI_NOTIFY_CAP_MULT);
+						}
+						break;
+				}
+			}
+		}
+
+		reg += PCI_CAP_LIST_NEXT;
+	}
+
+	if(vdev->common && vdev->notify_base)
+		return true;
+
+	vdev->common = NULL;
+	return false;
 }
 
 /* Probing function for PCI device */
 static int virtio_pci_probe(VirtIODevice* vdev) {
 
-	// Read I/O address
-	vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0) & ~3;
+	// Modern devices are set through memory, legacy ones through I/O ports
+	if(!virtio_pci_modern(vdev)) {
+		vdev->ioaddr = pci_read32(vdev->dev, PCI_BASE_ADDRESS_0) & ~3;
 
-	if(!vdev->ioaddr)
-		return -1;
+		if(!vdev->ioaddr)
+			return -1;
+	}
 
 	// Enable device
 	pci_enable(vdev->dev);
 	
-	// Reset device 
+	// Reset device. A modern device reads back 0 once the reset is done
 	add_status(vdev, 0);
+	while(vdev->common && vdev->common->device_status)
+		asm volatile("pause");
 
 	// OS notice device from now
 	add_status(vdev, VIRTIO_CONFIG_S_ACKNOWLEDGE);
@@ -333,10 +401,19 @@ static int synchronize_features(VirtIODevice* vdev) {
 		VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 		VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE,
 		VIRTIO_BLK_F_TOPOLOGY, VIRTIO_RING_F_INDIRECT_DESC,
+		VIRTIO_F_RING_PACKED, VIRTIO_F_VERSION_1,
 	};
 
-	// Figure out what features device supports
-	device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);
+	// Figure out what features device supports. The legacy registers only
+	// have bits 0 to 31, so the packed ring is only offered by modern devices
+	if(vdev->common) {
+		vdev->common->device_feature_select = 0;
+		device_features = vdev->common->device_feature;
+		vdev->common->device_feature_select = 1;
+		device_features |= (uint64_t)vdev->common->device_feature << 32;
+	} else {
+		device_features = port_in32(vdev->ioaddr + VIRTIO_PCI_HOST_FEATURES);
+	}
 
 	// Features supported by both device and driver
 	uint32_t fbit;
@@ -344,8 +421,8 @@ static int synchronize_features(VirtIODevice* vdev) {
 
 	for(size_t i = 0; i < sizeof(features)/sizeof(int); i++) {
 		fbit = features[i];
-		if(fbit > 32) {
-			printf("We only support 32 feature bits\n");
+		if(fbit >= 64) {
+			printf("We only support 64 feature bits\n");
 			return -1;
 		}
 		driver_features |= (1ULL << fbit);
@@ -353,17 +430,38 @@ static int synchronize_features(VirtIODevice* vdev) {
 	driver_features &= device_features;
 	
 	// Finally determine features that we are going to use
-	port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
+	if(vdev->common) {
+		vdev->common->guest_feature_select = 0;
+		vdev->common->guest_feature = (uint32_t)driver_features;
+		vdev->common->guest_feature_select = 1;
+		vdev->common->guest_feature = (uint32_t)(driver_features >> 32);
+	} else {
+		port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, driver_features);
+	}
 	vdev->features |= driver_features;
 
+	// A modern device checks the features before the queue is set
 	add_status(vdev, VIRTIO_CONFIG_S_FEATURES_OK);
-
-	/* Device is alive at this point */
-	add_status(vdev, VIRTIO_CONFIG_S_DRIVER_OK);
+	if(vdev->common && !(vdev->common->device_status & VIRTIO_CONFIG_S_FEATURES_OK))
+		return -2;
 
 	return 0;
 }
 
+/* Give the rings of the queue to a modern device, and find where its notifications go */
+static void enable_vq(VirtIODevice* vdev, void* desc, void* driver, void* device) {
+	volatile struct virtio_pci_common_cfg* common = vdev->common;
+	common->queue_desc_lo = (uint32_t)(uintptr_t)desc;
+	common->queue_desc_hi = (uintptr_t)desc >> 32;
+	common->queue_avail_lo = (uint32_t)(uintptr_t)driver;
+	common->queue_avail_hi = (uintptr_t)driver >> 32;
+	common->queue_used_lo = (uint32_t)(uintptr_t)device;
+	common->queue_used_hi = (uintptr_t)device >> 32;
+
+	vdev->notify = (volatile uint16_t*)(vdev->notify_base + common->queue_notify_off * vdev->notify_multiplier);
+	common->queue_enable = 1;
+}
+
 /* Initializing function for virtqueues */
 int init_vq(VirtQueue* vq) {
 
@@ -373,18 +471,28 @@ int init_vq(VirtQueue* vq) {
 	if(device_has_feature(vq->vdev, VIRTIO_RING_F_INDIRECT_DESC)) {
 		vq->indirect = true;
 	}
+	vq->packed = device_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
 	vq->vq_ops = gmalloc(sizeof(VirtQueueOps));
 	vq->vq_ops = &vops;
 
 	/* Select the queue we're interested in
 	 * Virtio block driver uses only one queue */
 	ioaddr = vq->vdev->ioaddr;
-	port_out16(ioaddr + VIRTIO_PCI_QUEUE_SEL, 0);
+	volatile struct virtio_pci_common_cfg* common = vq->vdev->common;
 
 	// Check if queue is either not available or already active
-	int num = port_in32(ioaddr + VIRTIO_PCI_QUEUE_NUM);
-	if(!num || port_in32(ioaddr + VIRTIO_PCI_QUEUE_PFN))
-		return -1;	
+	int num;
+	if(common) {
+		common->queue_select = 0;
+		num = common->queue_size;
+		if(!num || common->queue_enable)
+			return -1;
+	} else {
+		port_out16(ioaddr + VIRTIO_PCI_QUEUE_SEL, 0);
+		num = port_in32(ioaddr + VIRTIO_PCI_QUEUE_NUM);
+		if(!num || port_in32(ioaddr + VIRTIO_PCI_QUEUE_PFN))
+			return -1;	
+	}
 
 	// Memory allocation for vring area
 	void* queue = gmalloc(0x2000 + 0xfff);
@@ -397,8 +505,37 @@ int init_vq(VirtQueue* vq) {
 	queue = (void*)((uintptr_t)(queue+0xfff) & ~0xfff);
 	memset(queue, 0, 0x2000);
 
-	// Activate the queue
-	port_out32(ioaddr + VIRTIO_PCI_QUEUE_PFN, (uintptr_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+	// Activate a legacy queue. The descriptors start the area in both formats.
+	// A modern queue is enabled once its rings are set
+	if(!common)
+		port_out32(ioaddr + VIRTIO_PCI_QUEUE_PFN, (uintptr_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+	if(vq->packed) {
+		if(vring_packed_size(num) > 0x2000)
+			return -2;
+
+		vq->vring_packed = gmalloc(sizeof(VringPacked));
+		if(!vq->vring_packed)
+			return -3;
+
+		// Create the vring. The wrap counter starts at 1
+		vring_packed_init(vq->vring_packed, num, queue);
+		vq->avail_idx = 0;
+		vq->avail_wrap = 1;
+
+		// Initialize virtqueue
+		vq->num_free = num - (num % 3);
+		vq->num_added = 0;
+		vq->last_used_idx = 0;
+
+		// We don't have interrupt handler. Tell otherside not to interrupt us
+		vq->vring_packed->driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+		if(common)
+			enable_vq(vq->vdev, vq->vring_packed->desc, vq->vring_packed->driver, vq->vring_packed->device);
+
+		return 0;
+	}
 
 	// Create the vring
 	vring_init(vq->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
@@ -420,6 +557,10 @@ int init_vq(VirtQueue* vq) {
 		vq->vring->desc[i].next = i + 1;
 	}
 	vq->vring->desc[num-1].next = 0;
+
+	if(common)
+		enable_vq(vq->vdev, vq->vring->desc, vq->vring->avail, vq->vring->used);
+
 	return 0;
 }
 
@@ -439,6 +580,7 @@ Driver virtio_pci_driver = {
 
 static PCI_ID pci_ids[] = {
 	PCI_DEVICE(0x1af4, 0x1001, "virtio", NULL), 
+	PCI_DEVICE(0x1af4, 0x1042, "virtio", NULL), // Modern only
 	{ 0 }
 };
 
@@ -464,6 +606,7 @@ static int virtio_blk_init(DiskDriver* driver, const char* cmdline, DiskDriver**
 	// Memory allocations for a virtqueue & request buffers
 	priv->vq_blk = gmalloc(sizeof(VirtQueue));
 	priv->vq_blk->vdev = gmalloc(sizeof(VirtIODevice));
+	memset(priv->vq_blk->vdev, 0, sizeof(VirtIODevice));
 	priv->vq_blk->vring = gmalloc(sizeof(Vring));
 
 	count = pci_probe(virtio_device_type, virtio_device_probe, &virtio_pci_driver);
@@ -485,6 +628,12 @@ static int virtio_blk_init(DiskDriver* driver, const char* cmdline, DiskDriver**
 	if(err)
 		return -4;
 
+	/* Device is alive at this point */
+	add_status(priv->vq_blk->vdev, VIRTIO_CONFIG_S_DRIVER_OK);
+
+	printf("virtio-blk: %s ring%s\n", priv->vq_blk->packed ? "packed" : "split",
+			priv->vq_blk->indirect ? ", indirect" : "");
+
 	// Disk attachment
 	for(int i = 0; i < count; i++) {
 		disks[i] = gmalloc(sizeof(DiskDriver));
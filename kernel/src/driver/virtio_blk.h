@@ -4,6 +4,7 @@
 #include "disk.h"
 #include "virtio_config.h"
 #include "virtio_ring.h"
+#include "virtio_pci.h"
 #include "../pci.h"
 
 #define VIRTIO_BLK_F_BARRIER	0	/* Does host support barriers? */
@@ -28,14 +29,20 @@ typedef struct{
 	
         /* Virtio over PCI */
         PCI_Device* dev;
+	/* Modern transport: NULL common configuration on a legacy device */
+	volatile struct virtio_pci_common_cfg* common;
+	volatile uint8_t* notify_base;
+	uint32_t notify_multiplier;
+	/* Notification address of the queue */
+	volatile uint16_t* notify;
 
 } VirtIODevice;
 
 
 /* Check whether virtio device has specific featurs */
 static inline bool device_has_feature(const VirtIODevice* vdev, uint32_t fbit) {
-	if(fbit > 32) {
-	//	printf("Feature bit needs to be under 32\n");
+	if(fbit >= 64) {
+	//	printf("Feature bit needs to be under 64\n");
 		return false;
 	}
 
@@ -93,6 +100,13 @@ struct _VirtQueue {
 	/* Host supports indirect buffers */
 	bool indirect;
 
+	/* VIRTIO_F_RING_PACKED is negotiated: vring_packed is used instead of vring */
+	bool packed;
+	VringPacked* vring_packed;
+	/* Packed ring: slot of the next available descriptor and its wrap counter */
+	uint16_t avail_idx;
+	uint8_t avail_wrap;
+
 	/* Number of free buffers */
 	uint32_t num_free;
 };
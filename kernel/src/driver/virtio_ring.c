@@ -14,8 +14,27 @@
 
 #define PORTIO(bus, slot, function, reg)        ((1 << 31) | (bus << 16) | (slot << 11) | (function << 8) | (reg & 0xfc))
 
+/* Notify the only queue of the device */
+static inline void notify(VirtIODevice* vdev) {
+	if(vdev->notify)
+		*vdev->notify = 0;
+	else
+		port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+}
+
 /* Let other side know about buffer changed */
 void kick(VirtQueue* vq) {
+	if(vq->packed) {
+		// Descriptors were made available as they were added
+		vq->num_added = 0;
+		asm volatile("mfence" ::: "memory");
+
+		if(vq->vring_packed->device->flags != VRING_PACKED_EVENT_FLAG_DISABLE)
+			notify(vq->vdev);
+
+		return;
+	}
+
 	// Data in guest OS need to be set before we update avail ring index
 	asm volatile("sfence" ::: "memory");
 
@@ -26,7 +45,46 @@ void kick(VirtQueue* vq) {
 	asm volatile("mfence" ::: "memory");
 
 	// Notify the other side
-	port_out16(vq->vdev->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+	notify(vq->vdev);
+}
+
+/*
+ * Make a buffer of count descriptors available on a packed ring. Only WRITE
+ * and INDIRECT of the flags in sg are used. The slot of the head descriptor
+ * is the buffer ID: completions are found by the status bytes, never by ID.
+ */
+static void add_packed(VirtQueue* vq, VringDesc* sg, int count) {
+	VringPacked* vr = vq->vring_packed;
+	uint16_t head = vq->avail_idx;
+	uint16_t head_flags = 0;
+	uint16_t index = head;
+
+	for(int i = 0; i < count; i++) {
+		uint16_t flags = sg[i].flags & (VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT);
+		if(i + 1 < count)
+			flags |= VRING_DESC_F_NEXT;
+		flags |= vq->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+
+		vr->desc[index].addr = sg[i].addr;
+		vr->desc[index].len = sg[i].len;
+		vr->desc[index].id = head;
+		if(i)
+			vr->desc[index].flags = flags;
+		else
+			head_flags = flags;
+
+		if(++index == vr->num) {
+			index = 0;
+			vq->avail_wrap ^= 1;
+		}
+	}
+
+	vq->avail_idx = index;
+	vq->num_added += count;
+
+	// The device may take the request as soon as its head descriptor is available
+	asm volatile("sfence" ::: "memory");
+	vr->desc[head].flags = head_flags;
 }
 
 static uint8_t* add_indirect(VirtQueue* vq, List* req_list, List* free_list) {
@@ -76,6 +134,27 @@ static uint8_t* add_indirect(VirtQueue* vq, List* req_list, List* free_list) {
 	desc[count].len = sizeof(uint8_t);
 	desc[count].next = 0;
 
+	if(vq->packed) {
+		// Packed tables have no next field, and WRITE is their only flag
+		VringPackedDesc* packed = (VringPackedDesc*)desc;
+		for(int i = 0; i <= count; i++) {
+			uint16_t flags = desc[i].flags & VRING_DESC_F_WRITE;
+			packed[i].id = 0;
+			packed[i].flags = flags;
+		}
+
+		VringDesc head = {
+			.addr = (uintptr_t)desc,
+			.len = (count + 1) * sizeof(VringPackedDesc),
+			.flags = VRING_DESC_F_INDIRECT,
+		};
+		add_packed(vq, &head, 1);
+
+		list_add(free_list, desc);
+
+		return &(first_req->status);
+	}
+
 	// Now we put indirect descriptor chain into actual descriptor table.
 	int head = vq->free_head;
 	vq->vring->desc[head].flags = VRING_DESC_F_INDIRECT;
@@ -108,7 +187,21 @@ int add_buf(VirtQueue* vq, List* req_list, List* free_list, List* status_list) {
 	list_iterator_init(&iter, req_list);
 	while(list_iterator_has_next(&iter)) {
 		req = list_iterator_next(&iter);
-		if(req) {
+		if(req && vq->packed) {
+			// Header, data and status in consecutive descriptors
+			VringDesc sg[3] = {
+				{ .addr = (uintptr_t)req, .len = sizeof(uint64_t) * 2 },
+				{ .addr = (uintptr_t)req->data, .len = 512 * req->sector_count,
+					.flags = req->type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0 },
+				{ .addr = (uintptr_t)&(req->status), .len = sizeof(uint8_t), .flags = VRING_DESC_F_WRITE },
+			};
+			add_packed(vq, sg, 3);
+
+			list_iterator_remove(&iter);
+
+			list_add(free_list, req);
+			list_add(status_list, &(req->status));
+		} else if(req) {
 			int head = vq->free_head;
 
 			// Request header part
@@ -15,6 +15,10 @@ typedef struct {
 #define VRING_DESC_F_INDIRECT		4
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC	28
+/* We support the packed virtqueue layout */
+#define VIRTIO_F_RING_PACKED		34
+/* Buffers are used in the order they were made available */
+#define VIRTIO_F_IN_ORDER		35
 
 	/*The flags as indicated above. */
 	uint16_t flags;
@@ -53,6 +57,45 @@ typedef struct {
 	VringUsed* used;
 } Vring;
 
+/* Packed ring descriptor. Used descriptors are written back in place */
+typedef struct {
+	/* Address (guest-physical). */
+	uint64_t addr;
+	/* Length */
+	uint32_t len;
+	/* Buffer ID, the same on all descriptors of a buffer */
+	uint16_t id;
+
+/* Available when AVAIL matches the driver wrap counter and USED does not */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+/* Used when both match the device wrap counter */
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+	/* The flags as indicated above, written last on the head descriptor */
+	volatile uint16_t flags;
+} VringPackedDesc;
+
+typedef struct {
+	/* Descriptor ring offset and wrap counter in the top bit */
+	volatile uint16_t off_wrap;
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	1
+#define VRING_PACKED_EVENT_FLAG_DESC	2
+
+	volatile uint16_t flags;
+} VringPackedEvent;
+
+typedef struct {
+	uint32_t num;
+
+	VringPackedDesc* desc;
+	/* Written by the driver: when to interrupt it */
+	VringPackedEvent* driver;
+	/* Written by the device: when to notify it */
+	VringPackedEvent* device;
+} VringPacked;
+
 static inline void vring_init(Vring* vr, uint32_t num, void* p, uint64_t align){
 	vr->num = num;
 	vr->desc = p;
@@ -66,6 +109,17 @@ static inline unsigned vring_size(uint32_t num, uint64_t align){
 		+ sizeof(uint16_t)*3 + sizeof(VringUsedElem)*num;
 }
 
+static inline void vring_packed_init(VringPacked* vr, uint32_t num, void* p){
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = p + num*sizeof(VringPackedDesc);
+	vr->device = (void*)vr->driver + sizeof(VringPackedEvent);
+}
+
+static inline unsigned vring_packed_size(uint32_t num){
+	return sizeof(VringPackedDesc)*num + sizeof(VringPackedEvent)*2;
+}
+
 static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx){
 	return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
 }
@@ -48,10 +48,27 @@ static bool icc_event(void* context) {
 	}
 
 	icc_events[icc_msg->type](icc_msg); //event call
+	event_busy_progress();
 
 	return true;
 }
 
+static void icc_busy(ICC_Message* msg) {
+	uint64_t id = event_busy_add(msg->data.busy.func, msg->data.busy.context);
+	if(msg->data.busy.monitor)
+		event_busy_monitor(id, msg->data.busy.monitor);
+
+	icc_free(msg);
+}
+
+static void icc_call_event(ICC_Message* msg) {
+	msg->data.call.func(msg->data.call.context);
+	if(msg->data.call.pending)
+		__sync_fetch_and_sub(msg->data.call.pending, 1);
+
+	icc_free(msg);
+}
+
 static void icc(uint64_t vector, uint64_t err) {
 	uint8_t apic_id = mp_apic_id();
 	Shared* shared = (Shared*)SHARED_ADDR;
@@ -108,6 +125,8 @@ int icc_init() {
 	}
 
 	event_busy_add(icc_event, NULL);
+	icc_register(ICC_TYPE_BUSY, icc_busy);
+	icc_register(ICC_TYPE_CALL, icc_call_event);
 	apic_register(48, icc);
 
 	return 0;
@@ -136,9 +155,8 @@ void icc_free(ICC_Message* msg) {
 	lock_unlock(&shared->icc_lock_free);
 }
 
-uint32_t icc_send(ICC_Message* msg, uint8_t apic_id) {
+static void icc_post(ICC_Message* msg, uint8_t apic_id) {
 	Shared* shared = (Shared*)SHARED_ADDR;
-	uint32_t _icc_id = msg->id;
 
 	lock_lock(&shared->icc_queues[apic_id].icc_queue_lock);
 	fifo_push(shared->icc_queues[apic_id].icc_queue, msg);
@@ -151,6 +169,12 @@ uint32_t icc_send(ICC_Message* msg, uint8_t apic_id) {
 			APIC_DM_PHYSICAL | 
 			APIC_DMODE_FIXED |
 			(msg->type == ICC_TYPE_PAUSE ? 49 : 48));
+}
+
+uint32_t icc_send(ICC_Message* msg, uint8_t apic_id) {
+	uint32_t _icc_id = msg->id;
+
+	icc_post(msg, apic_id);
 
 	// TODO: Remove wait
 	timer_mwait(100);
@@ -161,3 +185,35 @@ uint32_t icc_send(ICC_Message* msg, uint8_t apic_id) {
 void icc_register(uint8_t type, void(*event)(ICC_Message*)) {
 	icc_events[type] = event;
 }
+
+void icc_busy_add(uint8_t apic_id, bool (*func)(void*), void* context, volatile void* monitor) {
+	if(apic_id == mp_apic_id()) {
+		uint64_t id = event_busy_add(func, context);
+		if(monitor)
+			event_busy_monitor(id, monitor);
+		return;
+	}
+
+	ICC_Message* msg = icc_alloc(ICC_TYPE_BUSY);
+	msg->data.busy.func = func;
+	msg->data.busy.context = context;
+	msg->data.busy.monitor = monitor;
+	icc_send(msg, apic_id);
+}
+
+void icc_call(uint8_t apic_id, void (*func)(void*), void* context, volatile uint32_t* pending) {
+	if(apic_id == mp_apic_id()) {
+		func(context);
+		if(pending)
+			__sync_fetch_and_sub(pending, 1);
+		return;
+	}
+
+	ICC_Message* msg = icc_alloc(ICC_TYPE_CALL);
+	msg->data.call.func = func;
+	msg->data.call.context = context;
+	msg->data.call.pending = pending;
+
+	// The caller waits for pending, so no need to sleep
+	icc_post(msg, apic_id);
+}
@@ -13,6 +13,8 @@ typedef enum {
 	ICC_TYPE_RESUMED,
 	ICC_TYPE_STOP,
 	ICC_TYPE_STOPPED,
+	ICC_TYPE_BUSY,
+	ICC_TYPE_CALL,
 } ICCType;
 
 #define ICC_STATUS_DONE		0
@@ -50,6 +52,18 @@ typedef struct _ICC_Message {
 		struct {
 			int return_code;
 		} stopped;
+
+		struct {
+			bool		(*func)(void*);
+			void*		context;
+			volatile void*	monitor;
+		} busy;
+
+		struct {
+			void		(*func)(void*);
+			void*		context;
+			volatile uint32_t*	pending;
+		} call;
 	} data;
 } ICC_Message;
 
@@ -61,4 +75,30 @@ void icc_free(ICC_Message* msg);
 uint32_t icc_send(ICC_Message* msg, uint8_t apic_id);
 void icc_register(uint8_t type, void(*event)(ICC_Message*));
 
+/**
+ * Register a busy event in the event loop of another core, e.g. to poll a
+ * device queue owned by that core
+ *
+ * @param apic_id APIC ID of the core
+ * @param func event callback
+ * @param context the callback's context
+ * @param monitor cache line the adaptive wait of the core monitors for the
+ * event, NULL for none
+ */
+void icc_busy_add(uint8_t apic_id, bool (*func)(void*), void* context, volatile void* monitor);
+
+/**
+ * Run a function in the event loop of another core. The loop runs its events
+ * one after another, so once the function returned the core has also finished
+ * every event which was running when the call was made.
+ *
+ * @param apic_id APIC ID of the core, the function runs at once on the calling
+ * core
+ * @param func function to run
+ * @param context the function's context
+ * @param pending counter which is decremented after the function returned,
+ * NULL for none
+ */
+void icc_call(uint8_t apic_id, void (*func)(void*), void* context, volatile uint32_t* pending);
+
 #endif /* __ICC_H__ */
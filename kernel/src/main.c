@@ -71,6 +71,11 @@ static void ap_timer_init() {
 	__timer_ns = *(uint64_t*)VIRTUAL_TO_PHYSICAL((uint64_t)&__timer_ns);
 }
 
+// Statistics slot of VNICs; kernel data is per core, so every core sets it
+static uint32_t vnic_core_id() {
+	return mp_processor_id();
+}
+
 static bool idle_monitor_event(void* data) {
 	static uint8_t trigger;
 
@@ -140,6 +145,7 @@ void main() {
 
 		timer_init();
 		vnic__init_timer(TIMER_FREQUENCY_PER_SEC);
+		vnic__init_core(vnic_core_id);
 
 		printf("\nInitilizing GDT...\n");
 		gdt_init();
@@ -263,6 +269,7 @@ void main() {
 	} else {
 		mp_sync();	// Barrier #2
 		ap_timer_init();
+		vnic__init_core(vnic_core_id);
 
 		gdt_load();
 		tss_load();
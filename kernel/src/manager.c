@@ -36,15 +36,19 @@ static void vm_create_handler(RPC* rpc, VMSpec* vm_spec, void* context, void(*ca
 }
 
 static void vm_get_handler(RPC* rpc, uint32_t vmid, void* context, void(*callback)(RPC* rpc, VMSpec* vm)) {
-	VMSpec spec = {};
-	vm_get_spec(&spec);
+	NICSpec nics[VM_MAX_NIC_COUNT] = {};
+	VMSpec spec = { .id = vmid, .nics = nics };
+	if(!vm_get_spec(&spec)) {
+		callback(rpc, NULL);
+		return;
+	}
 
 	callback(rpc, &spec);
 }
 
 static void vm_set_handler(RPC* rpc, VMSpec* vm, void* context, void(*callback)(RPC* rpc, bool result)) {
-	// TODO: Implement it
-	callback(rpc, false);
+	bool result = vm && vm_set_spec(vm);
+	callback(rpc, result);
 }
 
 static void vm_list_handler(RPC* rpc, int size, void* context, void(*callback)(RPC* rpc, uint32_t* ids, int size)) {
@@ -144,6 +148,20 @@ static void storage_md5_handler(RPC* rpc, uint32_t id, uint64_t size, void* cont
 	callback(rpc, ret, md5sum);
 }
 
+static void nic_stats_handler(RPC* rpc, uint32_t id, void* context, void(*callback)(RPC* rpc, VNICStats* stats, uint16_t count)) {
+	VNICStats stats[VM_MAX_NIC_COUNT];
+	int count = vm_nic_stats(id, stats, VM_MAX_NIC_COUNT);
+
+	callback(rpc, stats, count < 0 ? 0 : count);
+}
+
+static void nic_latency_handler(RPC* rpc, uint32_t id, uint16_t nic, void* context, void(*callback)(RPC* rpc, VNICLatency* latency, uint16_t count)) {
+	VNICLatency latency[NIC_LATENCY_STAGE_COUNT];
+	bool ret = vm_nic_latency(id, nic, latency);
+
+	callback(rpc, latency, ret ? NIC_LATENCY_STAGE_COUNT : 0);
+}
+
 static int assign_default_handlers(RPC* rpc) {
 	rpc_vm_create_handler(rpc, vm_create_handler, NULL);
 	rpc_vm_get_handler(rpc, vm_get_handler, NULL);
@@ -156,6 +174,8 @@ static int assign_default_handlers(RPC* rpc) {
 	rpc_storage_upload_handler(rpc, storage_upload_handler, NULL);
 	rpc_stdio_handler(rpc, stdio_handler, NULL);
 	rpc_storage_md5_handler(rpc, storage_md5_handler, NULL);
+	rpc_nic_stats_handler(rpc, nic_stats_handler, NULL);
+	rpc_nic_latency_handler(rpc, nic_latency_handler, NULL);
 
 	return 0;
 }
@@ -29,13 +29,13 @@
 
 typedef struct _Manager {
 	int	vnic_count;
-	VNIC*	vnics[MAX_VNIC_COUNT];	// gmalloc, ni_create
+	VNIC*	vnics[NIC_MAX_COUNT];	// gmalloc, ni_create
 	List* 	netifs;
 	List*	servers;
 	List* 	actives;
 } Manager;
 
-extern NIC* __nics[MAX_VNIC_COUNT];
+extern NIC* __nics[NIC_MAX_COUNT];
 extern int __nic_count;
 
 ManagerCore* manager_core;
@@ -208,7 +208,7 @@ static void rpc_free(RPC* rpc) {
 }
 
 static VNIC* manager_create_vnic(char* nicdev_name) {
-	if(manager.vnic_count > MAX_VNIC_COUNT) return NULL;
+	if(manager.vnic_count >= NIC_MAX_COUNT) return NULL;
 
 	NICDevice* nicdev = nicdev_get(nicdev_name);
 	if(!nicdev) {
@@ -230,6 +230,8 @@ static VNIC* manager_create_vnic(char* nicdev_name) {
 		VNIC_PADDING_TAIL, 32,
 		VNIC_SLOW_RX_QUEUE_SIZE, 1024,
 		VNIC_SLOW_TX_QUEUE_SIZE, 1024,
+		VNIC_TX_QUEUE_MODE, NIC_QUEUE_SP,	// Manager transmits only on BSP
+		VNIC_OFFLOADS, nicdev->offloads,
 		VNIC_NONE
 	};
 
@@ -250,7 +252,7 @@ static VNIC* manager_create_vnic(char* nicdev_name) {
 	int vnic_id = nicdev_register_vnic(nicdev, vnic);
 	if(vnic_id < 0) return NULL;
 
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
+	for(int i = 0; i < NIC_MAX_COUNT; i++) {
 		if(manager.vnics[i]) continue;
 
 		manager.vnics[i] = vnic;
@@ -270,8 +272,12 @@ fail:
 	return NULL;
 }
 
+static void manager_nic_flush(void* context) {
+	nic_cache_flush(context);
+}
+
 static bool manager_destroy_vnic(VNIC* vnic) {
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
+	for(int i = 0; i < NIC_MAX_COUNT; i++) {
 		if(manager.vnics[i] != vnic) continue;
 
 		manager.vnics[i] = NULL;
@@ -286,6 +292,10 @@ static bool manager_destroy_vnic(VNIC* vnic) {
 
 	if(!nicdev_unregister_vnic(nic_dev, vnic->id)) return false;
 
+	// Give the buffers cached by every core back before the NIC goes
+	vm_core_sync(manager_nic_flush, vnic->nic);
+
+	nic_region_remove(vnic->nic);
 	bfree(vnic->nic);
 	gfree(vnic);
 
@@ -763,7 +773,7 @@ static int cmd_arping(int argc, char** argv, void(*callback)(char* result, int e
 			uint16_t interface_index;
 			if(!parse_vnic_interface(argv[i], &vmid, &vnic_index, &interface_index)) return -i;
 
-			if(vmid) return -i;
+			if(vmid || vnic_index >= NIC_MAX_COUNT) return -i;
 
 			VNIC* vnic = manager.vnics[vnic_index];
 			if(!vnic) return -i;
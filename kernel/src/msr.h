@@ -6,6 +6,7 @@
 #define MSR_IA32_APIC_BASE	0x1B
 #define MSR_IA32_PERF_STATUS	0x198
 #define MSR_IA32_PERF_CTL	0x199
+#define MSR_IA32_TSC_DEADLINE	0x6E0
 
 /**
  * @file MSR(Model Specific Register Intrinsics)
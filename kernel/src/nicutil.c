@@ -1,9 +1,37 @@
 #include <stdio.h>
+#include <string.h>
 #include <util/cmd.h>
+#include <util/types.h>
 
 #include "driver/nicdev.h"
 
+// nic class <device> <class> <bandwidth> [burst]
+static int cmd_nic_class(int argc, char** argv) {
+	if(argc < 5)
+		return CMD_STATUS_WRONG_NUMBER;
+
+	NICDevice* nicdev = nicdev_get(argv[2]);
+	if(!nicdev) {
+		printf("Cannot Found Device!\n");
+		return -2;
+	}
+
+	if(!is_uint8(argv[3]) || !is_uint64(argv[4]) || (argc > 5 && !is_uint32(argv[5])))
+		return -3;
+
+	uint32_t burst = argc > 5 ? parse_uint32(argv[5]) : 0;
+	if(!nicdev_set_class(nicdev, parse_uint8(argv[3]), parse_uint64(argv[4]), burst)) {
+		printf("Class Wrong!\n");
+		return -3;
+	}
+
+	return 0;
+}
+
 static int cmd_nic(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc > 1 && !strcmp(argv[1], "class"))
+		return cmd_nic_class(argc, argv);
+
 	int nicdev_count = nicdev_get_count();
 	if(!nicdev_count) {
 		printf("Empty\n");
@@ -22,6 +50,38 @@ static int cmd_nic(int argc, char** argv, void(*callback)(char* result, int exit
 				(nicdev->mac >> 16) & 0xff,
 				(nicdev->mac >> 8) & 0xff,
 				(nicdev->mac >> 0) & 0xff);
+
+		if(nicdev->ring)
+			printf("    Ring: %s%s\n", nicdev->ring & NICDEV_RING_PACKED ? "packed" : "split",
+					nicdev->ring & NICDEV_RING_IN_ORDER ? ", in-order" : "");
+
+		uint16_t queue_count = nicdev->queue_count ? : 1;
+		printf("    Queues: %u\n", queue_count);
+		for(int j = 0; j < queue_count; j++) {
+			NICDeviceQueue* queue = &nicdev->queues[j];
+			printf("        Queue %d: core %u vnics %u\n", j, queue->core, queue->vnic_count);
+			printf("            kicks rx %lu tx %lu saved %lu\n", queue->rx_kicks, queue->tx_kicks, queue->kicks_saved);
+		}
+
+		for(int j = 0; j < VNIC_TX_CLASS_COUNT; j++) {
+			uint64_t bandwidth = 0;
+			uint32_t ready = 0;
+			for(int k = 0; k < queue_count; k++) {
+				bandwidth += nicdev->queues[k].classes[j].bandwidth;
+				ready += nicdev->queues[k].classes[j].count;
+			}
+
+			NICDeviceClassStats stats;
+			nicdev_get_class_stats(nicdev, j, &stats);
+			if(!bandwidth && !stats.turns)
+				continue;
+
+			printf("    Class %d: bandwidth %lu ready %u\n", j, bandwidth, ready);
+			printf("        packets %lu bytes %lu dropped %lu overlimits %lu\n",
+					stats.packets, stats.bytes, stats.drop_packets, stats.overlimits);
+			printf("        turns %lu delay avg %lu max %lu\n",
+					stats.turns, stats.turns ? stats.delay / stats.turns : 0, stats.delay_max);
+		}
 	}
 
 	return 0;
@@ -31,6 +91,7 @@ static Command commands[] = {
 	{
 		.name = "nic",
 		.desc = "Print a list of network interface",
+		.args = "[\"class\" device:str class:u8 bandwidth:u64 [burst:u32]]",
 		.func = cmd_nic
 	},
 };
@@ -24,6 +24,7 @@ NICDevice* nicdev_add_vlan(NICDevice* nicdev, uint16_t id) {
 	vlan_nicdev->mac = nicdev->mac;
 	vlan_nicdev->vlan_proto = ETHER_TYPE_8021Q;
 	vlan_nicdev->vlan_tci = endian16(id);
+	vlan_nicdev->offloads = nicdev->offloads;
 	vlan_nicdev->driver = nicdev->driver;
 	vlan_nicdev->priv = nicdev->priv;
 
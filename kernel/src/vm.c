@@ -70,12 +70,15 @@ static int cmd_status_get(int argc, char** argv, void(*callback)(char* result, i
 static int cmd_stdio(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static int cmd_vnic(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static int cmd_interface(int argc, char** argv, void(*callback)(char* result, int exit_status));
+static int cmd_latency(int argc, char** argv, void(*callback)(char* result, int exit_status));
+static int cmd_aqm(int argc, char** argv, void(*callback)(char* result, int exit_status));
+static int cmd_pacing(int argc, char** argv, void(*callback)(char* result, int exit_status));
 static Command commands[] = {
 	{
 		.name = "create",
 		.desc = "Create VM",
 		.args = "[-c core_count:u8] [-m memory_size:u32] [-s storage_size:u32] "
-			"[-n [mac:u64],[dev:str],[ibuf:u32],[obuf:u32],[iband:u64],[oband:u64],[hpad:u16],[tpad:u16],[pool:u32] ] "
+			"[-n [mac:u64],[dev:str],[ibuf:u32],[obuf:u32],[iband:u64],[oband:u64],[hpad:u16],[tpad:u16],[pool:u32],[pmode:str{bitmap|class}],[mirror],[queues:u16] ] "
 			"[-a args:str] -> vmid ",
 		.func = cmd_create
 	},
@@ -149,6 +152,24 @@ static Command commands[] = {
 		.desc = "List of virtual network interface",
 		.func = cmd_interface
 	},
+	{
+		.name = "latency",
+		.desc = "VNIC latency percentiles in ns, or turn the telemetry on or off",
+		.args = "vmid:u32 [on|off] -> bool",
+		.func = cmd_latency
+	},
+	{
+		.name = "aqm",
+		.desc = "Set the active queue management of the VM's NICs, target and interval in us",
+		.args = "vmid:u32 {off|codel|red} [target:u32] [interval:u32] -> bool",
+		.func = cmd_aqm
+	},
+	{
+		.name = "pacing",
+		.desc = "Turn tx pacing of the VM's NICs on or off",
+		.args = "vmid:u32 {on|off} -> bool",
+		.func = cmd_pacing
+	},
 };
 
 static void icc_started(ICC_Message* msg) {
@@ -346,6 +367,14 @@ static void icc_stopped(ICC_Message* msg) {
 	printf("]\n");
 }
 
+static void vm_nic_flush(void* context) {
+	VM* vm = context;
+	for(int i = 0; i < vm->nic_count; i++) {
+		if(vm->nics[i])
+			nic_cache_flush(vm->nics[i]->nic);
+	}
+}
+
 static bool vm_delete(VM* vm, int core) {
 	bool is_destroy = true;
 
@@ -395,7 +424,20 @@ static bool vm_delete(VM* vm, int core) {
 			#endif
 			for(int i = 0; i < vm->nic_count; i++) {
 				if(vm->nics[i]) {
+					NICDevice* nic_dev = nicdev_get(vm->nics[i]->parent);
+					if(nic_dev)
+						nicdev_unregister_vnic(nic_dev, vm->nics[i]->id);
+
 					dispatcher_destroy_vnic(vm->nics[i]);
+				}
+			}
+
+			// Give the buffers cached by every core back before the NICs go
+			vm_core_sync(vm_nic_flush, vm);
+
+			for(int i = 0; i < vm->nic_count; i++) {
+				if(vm->nics[i]) {
+					nic_region_remove(vm->nics[i]->nic);
 					bfree(vm->nics[i]->nic);
 					vnic_free_id(vm->nics[i]->id);
 					gfree(vm->nics[i]);
@@ -450,6 +492,7 @@ static bool vm_loop(void* context) {
 	for(int i = 1; i < MP_MAX_CORE_COUNT; i++) {
 		Core* core = &cores[i];
 		if(core->status != VM_STATUS_PAUSE && core->status != VM_STATUS_START) continue;
+		if(!core->vm) continue;	// Reserved
 		int thread_id = get_thread_id(core->vm, i);
 		if(thread_id == -1)
 			continue;
@@ -505,6 +548,40 @@ int vm_init() {
 	return 0;
 }
 
+int vm_core_reserve() {
+	uint8_t* core_map = mp_processor_map();
+	for(int i = MP_MAX_CORE_COUNT - 1; i > 0; i--) {
+		if(core_map[i] == MP_CORE_INVALID || cores[i].status != VM_STATUS_STOP)
+			continue;
+
+		// Occupied without a VM, so vm_create never picks it
+		cores[i].status = VM_STATUS_START;
+		return i;
+	}
+
+	return -1;
+}
+
+void vm_core_sync(void (*func)(void*), void* context) {
+	uint8_t* core_map = mp_processor_map();
+	volatile uint32_t pending = 0;
+
+	for(int i = 0; i < MP_MAX_CORE_COUNT; i++) {
+		if(core_map[i] == MP_CORE_INVALID || cores[i].status == VM_STATUS_INVALID)
+			continue;
+
+		// The kernel event loop does not run while a VM owns the core
+		if(cores[i].vm && cores[i].status != VM_STATUS_STOP)
+			continue;
+
+		__sync_fetch_and_add(&pending, 1);
+		icc_call(i, func, context, &pending);
+	}
+
+	while(pending)
+		asm volatile("pause");
+}
+
 static VM* vm_get(uint32_t vmid) {
 	return map_get(vms, (void*)(uint64_t)vmid);
 }
@@ -678,17 +755,29 @@ uint32_t vm_create(VMSpec* vm_spec) {
 				goto fail;
 			}
 
+			// Every queue of a multiqueue device delivers frames from its own core
+			NICDevice* root_dev = nic_dev;
+			while(root_dev->prev)
+				root_dev = root_dev->prev;
+
 			uint64_t attrs[] = {
 				VNIC_MAC, mac,
 				VNIC_DEV, (uint64_t)nic_dev->name,
 				VNIC_BUDGET, nics[i].budget,
 				VNIC_POOL_SIZE, nics[i].pool_size,
+				VNIC_POOL_MODE, nics[i].pool_mode,
 				VNIC_RX_BANDWIDTH, nics[i].rx_bandwidth,
 				VNIC_TX_BANDWIDTH, nics[i].tx_bandwidth,
 				VNIC_PADDING_HEAD, nics[i].padding_head,
 				VNIC_PADDING_TAIL, nics[i].padding_tail,
 				VNIC_RX_QUEUE_SIZE, nics[i].rx_buffer_size,
 				VNIC_TX_QUEUE_SIZE, nics[i].tx_buffer_size,
+				VNIC_RX_QUEUE_MODE, root_dev->queue_count > 1 ? NIC_QUEUE_MP : NIC_QUEUE_SP,
+				VNIC_TX_QUEUE_MODE, vm->core_size > 1 ? NIC_QUEUE_MP : NIC_QUEUE_SP,
+				VNIC_DOMAIN, vm->id,	// A VM maps all of its NICs
+				VNIC_MIRROR, nics[i].mirror,
+				VNIC_QUEUE_COUNT, nics[i].queue_count ? : 1,
+				VNIC_OFFLOADS, nic_dev->offloads,
 				VNIC_NONE
 			};
 
@@ -726,7 +815,10 @@ uint32_t vm_create(VMSpec* vm_spec) {
 
 			vm->nics[i] = vnic;
 
-			nicdev_register_vnic(nic_dev, vnic);
+			if(nicdev_register_vnic(nic_dev, vnic) < 0) {
+				errno = EVNICINIT;
+				goto fail;
+			}
 		}
 	}
 
@@ -796,19 +888,103 @@ bool vm_get_spec(VMSpec* vm_spec) {
 		nicspec->mac = vnic->mac;
 		strcpy(nicspec->parent, vnic->parent);
 		nicspec->budget = vnic->budget;
-		nicspec->rx_buffer_size = vnic->rx.size;
-		nicspec->tx_buffer_size = vnic->tx.size;
+		// A resized ring takes over once the old one drained
+		nicspec->rx_buffer_size = vnic->nic->rx.size;
+		nicspec->tx_buffer_size = vnic->nic->tx.size;
 		nicspec->padding_head = vnic->padding_head;
 		nicspec->padding_tail = vnic->padding_tail;
 		nicspec->rx_bandwidth = vnic->rx_bandwidth;
 		nicspec->tx_bandwidth = vnic->tx_bandwidth;
 		nicspec->pool_size = vnic->nic_size;
+		nicspec->mirror = vnic->mirror;
+		nicspec->queue_count = vnic->queue_count;
+		nicspec->pool_mode = vnic->pool.mode;
 	}
 
 	//TODO: Add arguments
 	return true;
 }
 
+#define NIC_SPEC_ATTR_COUNT	7
+
+// Zero fields of a NIC spec keep the current value, like mac and pool_size
+static void nic_spec_attrs(NICSpec* nicspec, uint64_t* attrs) {
+	uint64_t values[NIC_SPEC_ATTR_COUNT][2] = {
+		{ VNIC_BUDGET, nicspec->budget },
+		{ VNIC_RX_BANDWIDTH, nicspec->rx_bandwidth },
+		{ VNIC_TX_BANDWIDTH, nicspec->tx_bandwidth },
+		{ VNIC_PADDING_HEAD, nicspec->padding_head },
+		{ VNIC_PADDING_TAIL, nicspec->padding_tail },
+		{ VNIC_RX_QUEUE_SIZE, nicspec->rx_buffer_size },
+		{ VNIC_TX_QUEUE_SIZE, nicspec->tx_buffer_size },
+	};
+
+	int count = 0;
+	for(int i = 0; i < NIC_SPEC_ATTR_COUNT; i++) {
+		if(!values[i][1])
+			continue;
+
+		attrs[count++] = values[i][0];
+		attrs[count++] = values[i][1];
+	}
+	attrs[count] = VNIC_NONE;
+}
+
+bool vm_set_spec(VMSpec* vm_spec) {
+	VM* vm = vm_get(vm_spec->id);
+	if(!vm) {
+		errno = EVMID;
+		return false;
+	}
+
+	// Only the resources of the NICs can change while the VM runs
+	if((vm_spec->core_size && vm_spec->core_size != (uint32_t)vm->core_size) ||
+			(vm_spec->memory_size && vm_spec->memory_size != vm->memory.count * VM_MEMORY_SIZE_ALIGN) ||
+			(vm_spec->storage_size && vm_spec->storage_size != vm->storage.count * VM_STORAGE_SIZE_ALIGN) ||
+			vm_spec->nic_count != vm->nic_count) {
+		errno = EVMUPDATE;
+		return false;
+	}
+
+	for(int i = 0; i < vm_spec->nic_count; i++) {
+		NICSpec* nicspec = &vm_spec->nics[i];
+		VNIC* vnic = vm->nics[i];
+		if(nicspec->mac && nicspec->mac != vnic->mac) {
+			errno = EVNICMAC;
+			return false;
+		}
+
+		// The pool is the NIC memory the VM mapped when it was created
+		if(nicspec->mirror != vnic->mirror || (nicspec->queue_count ? : 1) != vnic->queue_count ||
+				nicspec->pool_mode != vnic->pool.mode ||
+				(nicspec->pool_size && ((nicspec->pool_size + VNIC_POOL_SIZE_ALIGN - 1) & ~(VNIC_POOL_SIZE_ALIGN - 1)) != vnic->nic_size)) {
+			errno = EVMUPDATE;
+			return false;
+		}
+	}
+
+	// Check every NIC first so a bad one leaves the others untouched
+	uint64_t attrs[NIC_SPEC_ATTR_COUNT * 2 + 1];
+	for(int i = 0; i < vm_spec->nic_count; i++) {
+		nic_spec_attrs(&vm_spec->nics[i], attrs);
+		if(vnic_update_check(vm->nics[i], attrs) != VNIC_ERROR_NOERROR) {
+			errno = EVNICUPDATE;
+			return false;
+		}
+	}
+
+	// Queues swap to their new rings once the packets in flight drained
+	for(int i = 0; i < vm_spec->nic_count; i++) {
+		nic_spec_attrs(&vm_spec->nics[i], attrs);
+		if(vnic_update(vm->nics[i], attrs) != VNIC_ERROR_NOERROR) {
+			errno = EVNICUPDATE;
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool vm_contains(uint32_t vmid) {
 	return map_contains(vms, (void*)(uint64_t)vmid);
 }
@@ -974,6 +1150,101 @@ VMStatus vm_status_get(uint32_t vmid) {
 	return vm->status;
 }
 
+int vm_nic_stats(uint32_t vmid, VNICStats* stats, int size) {
+	VM* vm = vm_get(vmid);
+	if(!vm) {
+		errno = EVMID;
+		return -1;
+	}
+
+	int count = vm->nic_count < size ? vm->nic_count : size;
+	for(int i = 0; i < count; i++) {
+		if(vm->nics[i])
+			vnic_stats(vm->nics[i], &stats[i]);
+		else
+			memset(&stats[i], 0, sizeof(VNICStats));
+	}
+
+	return count;
+}
+
+bool vm_nic_latency_enable(uint32_t vmid, bool enable) {
+	VM* vm = vm_get(vmid);
+	if(!vm) {
+		errno = EVMID;
+		return false;
+	}
+
+	uint64_t attrs[] = { VNIC_LATENCY, enable, VNIC_NONE };
+	for(int i = 0; i < vm->nic_count; i++) {
+		if(vnic_update(vm->nics[i], attrs) != VNIC_ERROR_NOERROR) {
+			errno = EVNICUPDATE;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool vm_nic_pacing_enable(uint32_t vmid, bool enable) {
+	VM* vm = vm_get(vmid);
+	if(!vm) {
+		errno = EVMID;
+		return false;
+	}
+
+	uint64_t attrs[] = { VNIC_TX_PACING, enable, VNIC_NONE };
+	for(int i = 0; i < vm->nic_count; i++) {
+		if(vnic_update(vm->nics[i], attrs) != VNIC_ERROR_NOERROR) {
+			errno = EVNICUPDATE;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool vm_nic_aqm(uint32_t vmid, uint8_t mode, uint32_t target, uint32_t interval) {
+	VM* vm = vm_get(vmid);
+	if(!vm) {
+		errno = EVMID;
+		return false;
+	}
+
+	uint64_t attrs[] = {
+		VNIC_RX_AQM, mode,
+		VNIC_TX_AQM, mode,
+		VNIC_AQM_TARGET, target,
+		VNIC_AQM_INTERVAL, interval,
+		VNIC_NONE
+	};
+	for(int i = 0; i < vm->nic_count; i++) {
+		if(vnic_update(vm->nics[i], attrs) != VNIC_ERROR_NOERROR) {
+			errno = EVNICUPDATE;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool vm_nic_latency(uint32_t vmid, uint16_t nic, VNICLatency* latency) {
+	VM* vm = vm_get(vmid);
+	if(!vm) {
+		errno = EVMID;
+		return false;
+	}
+
+	if(nic >= vm->nic_count) {
+		errno = EOVERMAX;
+		return false;
+	}
+
+	vnic_latency(vm->nics[nic], latency);
+
+	return true;
+}
+
 ssize_t vm_storage_read(uint32_t vmid, void** buf, size_t offset, size_t size) {
 	VM* vm = vm_get(vmid);
 	if(!vm) {
@@ -1169,6 +1440,12 @@ void print_vm_error(const char* msg) {
 		case ETHREADID:
 			printf("VM Error: Thread ID is wrong");
 			break;
+		case EVMUPDATE:
+			printf("VM Error: The attribute cannot be changed at runtime");
+			break;
+		case EVNICUPDATE:
+			printf("VM Error: VNIC update failed");
+			break;
 	}
 
 	if(msg) printf(": %s\n", msg);
@@ -1195,15 +1472,22 @@ static void print_nic_spec(NICSpec* nic_spec, char* indent) {
 	printf("%s    HeaderPadding: %ld\n", indent ? : "", nic_spec->padding_head);
 	printf("%s    TailPadding: %ld\n", indent ? : "",  nic_spec->padding_tail);
 	printf("%s    PoolSize: %ldMbs\n", indent ? : "",  nic_spec->pool_size / (1024 * 1024));
-	// 	printf("%12sRX packets:%d dropped:%d\n", "", vnic->input_packets, vnic->input_drop_packets);
-	// 	printf("%12sTX packets:%d dropped:%d\n", "", vnic->output_packets, vnic->output_drop_packets);
-	// 
-	// 	printf("%12sRX bytes:%lu ", "", vnic->input_bytes);
-	// 	print_byte_size(vnic->input_bytes);
-	// 	printf("  TX bytes:%lu ", vnic->output_bytes);
-	// 	print_byte_size(vnic->output_bytes);
-	// 	printf("\n");
-	// 	printf("%12sHead Padding:%d Tail Padding:%d\n", "",vnic->padding_head, vnic->padding_tail);
+	printf("%s    PoolMode: %s\n", indent ? : "",  nic_spec->pool_mode == NIC_POOL_CLASS ? "class" : "bitmap");
+	printf("%s    Queues: %d\n", indent ? : "",  nic_spec->queue_count);
+	if(nic_spec->mirror)
+		printf("%s    Mirror\n", indent ? : "");
+}
+
+static void print_nic_stats(VNICStats* stats, char* indent) {
+	printf("%s    RX packets:%lu dropped:%lu (bandwidth:%lu queue:%lu buffer:%lu aqm:%lu) marked:%lu\n", indent ? : "",
+		stats->input_packets, stats->input_drop_packets, stats->drops[VNIC_DROP_RX_BANDWIDTH],
+		stats->drops[VNIC_DROP_RX_QUEUE_FULL], stats->drops[VNIC_DROP_RX_NO_BUFFER],
+		stats->drops[VNIC_DROP_RX_AQM], stats->input_marked_packets);
+	printf("%s    TX packets:%lu dropped:%lu (rejected:%lu aqm:%lu horizon:%lu) marked:%lu\n", indent ? : "",
+		stats->output_packets, stats->output_drop_packets, stats->drops[VNIC_DROP_TX_REJECTED],
+		stats->drops[VNIC_DROP_TX_AQM], stats->drops[VNIC_DROP_TX_HORIZON], stats->output_marked_packets);
+	printf("%s    RX bytes:%lu dropped:%lu  TX bytes:%lu dropped:%lu\n", indent ? : "",
+		stats->input_bytes, stats->input_drop_bytes, stats->output_bytes, stats->output_drop_bytes);
 }
 
 static void print_vm_spec(VMSpec* vm_spec) {
@@ -1351,6 +1635,18 @@ static int cmd_create(int argc, char** argv, void(*callback)(char* result, int e
 				} else if(!strcmp(token, "pool")) {
 					if(!is_uint32(value)) return CMD_WRONG_TYPE_OF_ARGS;
 					nic->pool_size = parse_uint32(value);
+				} else if(!strcmp(token, "pmode")) {
+					if(!strcmp(value, "class"))
+						nic->pool_mode = NIC_POOL_CLASS;
+					else if(!strcmp(value, "bitmap"))
+						nic->pool_mode = NIC_POOL_BITMAP;
+					else
+						return CMD_WRONG_TYPE_OF_ARGS;
+				} else if(!strcmp(token, "mirror")) {
+					nic->mirror = true;
+				} else if(!strcmp(token, "queues")) {
+					if(!is_uint16(value)) return CMD_WRONG_TYPE_OF_ARGS;
+					nic->queue_count = parse_uint16(value);
 				} else {
 					i--;
 					break;
@@ -1637,10 +1933,15 @@ static int cmd_vnic(int argc, char** argv, void(*callback)(char* result, int exi
 
 		if(!vm_get_spec(&vm_spec)) continue;
 
+		VNICStats stats[VM_MAX_NIC_COUNT];
+		int stats_count = vm_nic_stats(ids[i], stats, VM_MAX_NIC_COUNT);
+
 		for(int i = 0; i < vm_spec.nic_count; i++) {
 			NICSpec* nic_spec = &nics[i];
 
 			print_nic_spec(nic_spec, NULL);
+			if(i < stats_count)
+				print_nic_stats(&stats[i], NULL);
 			is_empty = false;
 		}
 		printf("\n");
@@ -1650,6 +1951,86 @@ static int cmd_vnic(int argc, char** argv, void(*callback)(char* result, int exi
 	return CMD_SUCCESS;
 }
 
+static int cmd_latency(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc != 2 && argc != 3) return CMD_WRONG_NUMBER_OF_ARGS;
+	if(!is_uint32(argv[1])) return CMD_WRONG_TYPE_OF_ARGS;
+	uint32_t vmid = parse_uint32(argv[1]);
+
+	if(argc == 3) {
+		if(strcmp(argv[2], "on") && strcmp(argv[2], "off")) return CMD_WRONG_TYPE_OF_ARGS;
+
+		if(!vm_nic_latency_enable(vmid, !strcmp(argv[2], "on"))) {
+			print_vm_error("");
+			return CMD_ERROR;
+		}
+
+		return CMD_SUCCESS;
+	}
+
+	static const char* stages[] = { "RX driver", "RX queue", "RX", "TX queue", "TX driver", "TX" };
+	VNICLatency latency[NIC_LATENCY_STAGE_COUNT];
+	for(uint16_t i = 0; vm_nic_latency(vmid, i, latency); i++) {
+		printf("VM[%d] NIC[%d]:\n", vmid, i);
+		for(int j = 0; j < NIC_LATENCY_STAGE_COUNT; j++)
+			printf("    %-10s count:%lu p50:%lu p99:%lu p999:%lu\n", stages[j],
+				latency[j].count, latency[j].p50, latency[j].p99, latency[j].p999);
+	}
+
+	if(errno == EVMID) {
+		print_vm_error("");
+		return CMD_ERROR;
+	}
+
+	return CMD_SUCCESS;
+}
+
+static int cmd_aqm(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 3 || argc > 5) return CMD_WRONG_NUMBER_OF_ARGS;
+	if(!is_uint32(argv[1])) return CMD_WRONG_TYPE_OF_ARGS;
+	uint32_t vmid = parse_uint32(argv[1]);
+
+	uint8_t mode;
+	if(!strcmp(argv[2], "off"))
+		mode = VNIC_AQM_NONE;
+	else if(!strcmp(argv[2], "codel"))
+		mode = VNIC_AQM_CODEL;
+	else if(!strcmp(argv[2], "red"))
+		mode = VNIC_AQM_RED;
+	else
+		return CMD_WRONG_TYPE_OF_ARGS;
+
+	uint32_t target = VNIC_AQM_TARGET_DEFAULT;
+	uint32_t interval = VNIC_AQM_INTERVAL_DEFAULT;
+	if(argc > 3) {
+		if(!is_uint32(argv[3])) return CMD_WRONG_TYPE_OF_ARGS;
+		target = parse_uint32(argv[3]);
+	}
+	if(argc > 4) {
+		if(!is_uint32(argv[4])) return CMD_WRONG_TYPE_OF_ARGS;
+		interval = parse_uint32(argv[4]);
+	}
+
+	if(!vm_nic_aqm(vmid, mode, target, interval)) {
+		print_vm_error("");
+		return CMD_ERROR;
+	}
+
+	return CMD_SUCCESS;
+}
+
+static int cmd_pacing(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc != 3) return CMD_WRONG_NUMBER_OF_ARGS;
+	if(!is_uint32(argv[1])) return CMD_WRONG_TYPE_OF_ARGS;
+	if(strcmp(argv[2], "on") && strcmp(argv[2], "off")) return CMD_WRONG_TYPE_OF_ARGS;
+
+	if(!vm_nic_pacing_enable(parse_uint32(argv[1]), !strcmp(argv[2], "on"))) {
+		print_vm_error("");
+		return CMD_ERROR;
+	}
+
+	return CMD_SUCCESS;
+}
+
 static bool parse_vnic_interface(char* name, uint16_t* vmid, uint16_t* vnic_index, uint16_t* interface_index) {
 	if(strncmp(name, "v", 1)) return false;
 
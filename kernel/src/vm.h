@@ -51,6 +51,8 @@ typedef enum _VMError {
 	EVNICINIT,
 	EADDVM,
 	ETHREADID,
+	EVMUPDATE,
+	EVNICUPDATE,
 } VMError;
 
 /**
@@ -77,6 +79,26 @@ typedef struct _VM {
  */
 int vm_init();
 
+/**
+ * Take a core away from VMs, e.g. for a driver to poll a device queue on it.
+ * Cores are taken from the highest APIC ID down. May be called before
+ * vm_init.
+ *
+ * @return APIC ID of the core, -1 if no core is free
+ */
+int vm_core_reserve();
+
+/**
+ * Run a function on every core which runs the kernel event loop (the manager
+ * core, reserved cores and idle cores) and wait until all of them returned,
+ * e.g. to flush per core state or to wait until no core still uses an object
+ * which is about to be freed. Cores which run a VM are skipped.
+ *
+ * @param func function to run
+ * @param context the function's context
+ */
+void vm_core_sync(void (*func)(void*), void* context);
+
 /**
  * Create VM
  *
@@ -95,6 +117,17 @@ uint32_t vm_create(VMSpec* vm_spec);
  */
 bool vm_get_spec(VMSpec* vm_spec);
 
+/**
+ * Reconfigure the NICs of a running VM. Budget, bandwidths, padding and
+ * queue sizes can change; the pool size and the NICs themselves cannot.
+ * NICs are updated in order, the ones before a failed NIC keep their update.
+ *
+ * @param vm_spec new properties of the VM, e.g. from vm_get_spec
+ *
+ * @return true for success, false for failure
+ */
+bool vm_set_spec(VMSpec* vm_spec);
+
 /**
  * Destroy VM
  *
@@ -151,6 +184,60 @@ bool vm_status_set(uint32_t vmid, int status, VM_STATUS_CALLBACK callback, void*
  */
 VMStatus vm_status_get(uint32_t vmid);
 
+/**
+ * Get a snapshot of the statistics of the VM's NICs
+ *
+ * @param vmid id
+ * @param stats result array, one VNICStats per NIC
+ * @param size size of result array
+ *
+ * @return number of NICs, -1 if there is no such VM
+ */
+int vm_nic_stats(uint32_t vmid, VNICStats* stats, int size);
+
+/**
+ * Turn the latency telemetry of all the VM's NICs on or off
+ *
+ * @param vmid id
+ * @param enable true to stamp packets and count latencies
+ *
+ * @return true if every NIC is updated
+ */
+bool vm_nic_latency_enable(uint32_t vmid, bool enable);
+
+/**
+ * Turn tx pacing of all the VM's NICs on or off
+ *
+ * @param vmid id
+ * @param enable true to send packets at their tx_time, spaced at the output bandwidth
+ *
+ * @return true if every NIC is updated
+ */
+bool vm_nic_pacing_enable(uint32_t vmid, bool enable);
+
+/**
+ * Set the active queue management of the rx and tx queues of all the VM's NICs
+ *
+ * @param vmid id
+ * @param mode VNICAQMMode
+ * @param target queue delay target in us
+ * @param interval queue delay interval in us
+ *
+ * @return true if every NIC is updated
+ */
+bool vm_nic_aqm(uint32_t vmid, uint8_t mode, uint32_t target, uint32_t interval);
+
+/**
+ * Get the latency percentiles of a NIC of the VM
+ *
+ * @param vmid id
+ * @param nic index of the NIC
+ * @param latency result array, one VNICLatency per NICLatencyStage
+ *
+ * @return true if there is such NIC
+ */
+bool vm_nic_latency(uint32_t vmid, uint16_t nic, VNICLatency* latency);
+
 /**
  * Get VM Processors
  *
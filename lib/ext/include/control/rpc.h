@@ -3,10 +3,11 @@
 
 #include <util/list.h>
 #include <control/vmspec.h>
+#include <vnic.h>
 
 #define RPC_MAGIC		"PNRPC"
 #define RPC_MAGIC_SIZE		5
-#define RPC_VERSION		1
+#define RPC_VERSION		2
 #define RPC_BUFFER_SIZE		8192
 
 typedef enum {
@@ -34,7 +35,11 @@ typedef enum {
 	RPC_TYPE_STORAGE_MD5_RES,
 	RPC_TYPE_STDIO_REQ,
 	RPC_TYPE_STDIO_RES,
-	RPC_TYPE_END,			// 22
+	RPC_TYPE_NIC_STATS_REQ,		// 25
+	RPC_TYPE_NIC_STATS_RES,
+	RPC_TYPE_NIC_LATENCY_REQ,
+	RPC_TYPE_NIC_LATENCY_RES,
+	RPC_TYPE_END,
 } RPC_TYPE;
 
 typedef struct _RPC RPC;
@@ -107,6 +112,14 @@ struct _RPC {
 	void* stdio_context;
 	void(*stdio_handler)(RPC* rpc, uint32_t id, uint8_t thread_id, int fd, char* str, uint16_t size, void* context, void(*callback)(RPC* rpc, uint16_t size));
 	void* stdio_handler_context;
+	bool(*nic_stats_callback)(VNICStats* stats, uint16_t count, void* context);
+	void* nic_stats_context;
+	void(*nic_stats_handler)(RPC* rpc, uint32_t id, void* context, void(*callback)(RPC* rpc, VNICStats* stats, uint16_t count));
+	void* nic_stats_handler_context;
+	bool(*nic_latency_callback)(VNICLatency* latency, uint16_t count, void* context);
+	void* nic_latency_context;
+	void(*nic_latency_handler)(RPC* rpc, uint32_t id, uint16_t nic, void* context, void(*callback)(RPC* rpc, VNICLatency* latency, uint16_t count));
+	void* nic_latency_handler_context;
 	
 	// Private data
 	uint8_t		data[0];
@@ -130,6 +143,9 @@ void rpc_storage_md5(RPC* rpc, uint32_t id, uint64_t size, bool(*callback)(bool
 
 int rpc_stdio(RPC* rpc, uint32_t id, uint8_t thread_id, int fd, const char* str, uint16_t size, bool(*callback)(uint16_t written, void* context), void* context);
 
+int rpc_nic_stats(RPC* rpc, uint32_t id, bool(*callback)(VNICStats* stats, uint16_t count, void* context), void* context);
+int rpc_nic_latency(RPC* rpc, uint32_t id, uint16_t nic, bool(*callback)(VNICLatency* latency, uint16_t count, void* context), void* context);
+
 // Server side APIs
 void rpc_vm_create_handler(RPC* rpc, void(*handler)(RPC* rpc, VMSpec* vm, void* context, void(*callback)(RPC* rpc, uint32_t id)), void* context);
 void rpc_vm_get_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, void* context, void(*callback)(RPC* rpc, VMSpec* vm)), void* context);
@@ -146,6 +162,9 @@ void rpc_storage_md5_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, uin
 
 void rpc_stdio_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, uint8_t thread_id, int fd, char* str, uint16_t size, void* context, void(*callback)(RPC* rpc, uint16_t size)), void* context);
 
+void rpc_nic_stats_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, void* context, void(*callback)(RPC* rpc, VNICStats* stats, uint16_t count)), void* context);
+void rpc_nic_latency_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, uint16_t nic, void* context, void(*callback)(RPC* rpc, VNICLatency* latency, uint16_t count)), void* context);
+
 bool rpc_is_active(RPC* rpc);
 bool rpc_loop(RPC* rpc);
 
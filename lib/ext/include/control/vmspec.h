@@ -30,6 +30,9 @@ typedef struct {
 	uint64_t	rx_bandwidth;
 	uint64_t	tx_bandwidth;
 	uint32_t	pool_size;
+	bool		mirror;		///< Receive every frame of the parent device
+	uint16_t	queue_count;	///< Number of rx/tx queue pairs, 0 means 1
+	uint8_t		pool_mode;	///< Packet pool allocation mode (NICPoolMode)
 } NICSpec;
 
 typedef struct {
@@ -13,6 +13,9 @@
  * Timer event - called regularly
  * Idle event - called there is no timer or trigger event to be called
  * Event calling priority: busy > trigger > timer > idle
+ *
+ * With adaptive polling (event_wait_set()) the loop sleeps instead of spinning
+ * once busy events reported no progress for a while.
  */
 
 /**
@@ -27,6 +30,13 @@ typedef bool(*EventFunc)(void* context);
  */
 typedef bool(*TriggerEventFunc)(uint64_t event_id, void* event, void* context);
 
+/**
+ * Adaptive wait callback. Sleep until the cache line of monitor is written,
+ * an interrupt arrives or deadline (timer_us()) passed.
+ * monitor is NULL if no busy event has a monitored line.
+ */
+typedef void(*EventWaitFunc)(volatile void* monitor, uint64_t deadline, void* context);
+
 /**
  * Initialize event engine
  */
@@ -56,6 +66,38 @@ uint64_t event_busy_add(EventFunc func, void* context);
  */
 bool event_busy_remove(uint64_t id);
 
+/**
+ * Report that the running busy event processed something. Only busy events
+ * reporting their progress keep the adaptive polling from waiting.
+ */
+void event_busy_progress();
+
+/**
+ * Set the cache line the adaptive wait monitors for the busy event, e.g. the
+ * index its device or producer writes on the next enqueue. A wait monitors a
+ * single line, so while more than one busy event has a line the loop polls
+ * instead of waiting.
+ *
+ * @param id busy event ID
+ * @param monitor the cache line, NULL for none
+ * @return true if the busy event is found
+ */
+bool event_busy_monitor(uint64_t id, volatile void* monitor);
+
+/**
+ * Turn adaptive polling on or off. Once no busy event reported progress and
+ * no trigger or timer event was called for spin us, the loop calls wait
+ * instead of the idle events. A wait ends by the next timer event or after
+ * max us at the latest, so busy events without a monitored line are still
+ * polled.
+ *
+ * @param spin polling window in us
+ * @param max longest wait in us
+ * @param wait wait callback, NULL to always poll
+ * @param context the callback's context
+ */
+void event_wait_set(clock_t spin, clock_t max, EventWaitFunc wait, void* context);
+
 /**
  * Register trigger event
  *
@@ -7,6 +7,7 @@
 typedef struct {
 	EventFunc	func;
 	void*		context;
+	volatile void*	monitor;	///< Cache line the adaptive wait monitors for the busy event
 } Node;
 
 typedef struct {
@@ -35,6 +36,18 @@ static Map* trigger_events;
 static List* triggers;
 static List* idle_events;
 
+static struct {
+	EventWaitFunc	func;
+	void*		context;
+	uint64_t	spin;
+	uint64_t	max;
+	uint64_t	last;		///< Time of the last progress
+	bool		progress;	///< Progress since the last check
+	bool		busy;		///< The running busy event made progress
+	uint32_t	lines;		///< Busy events with a monitored line
+	volatile void*	monitor;	///< The monitored line when only one busy event has one
+} adaptive;
+
 bool event_init() {
 #ifndef LINUX
 	extern uint64_t __timer_ms;
@@ -97,6 +110,30 @@ static bool get_first_bigger(void* time, void* node) {
 
 static uint64_t next_timer = UINT64_MAX;
 
+/* Set the monitored line of a busy event. One wait arms one line, so the wait
+ * only monitors a line while a single busy event has one */
+static void monitor_set(Node* node, volatile void* monitor) {
+	if(node->monitor)
+		adaptive.lines--;
+	if(monitor)
+		adaptive.lines++;
+	node->monitor = monitor;
+
+	adaptive.monitor = NULL;
+	if(adaptive.lines != 1)
+		return;
+
+	ListIterator iter;
+	list_iterator_init(&iter, busy_events);
+	while(list_iterator_has_next(&iter)) {
+		Node* other = list_iterator_next(&iter);
+		if(other->monitor) {
+			adaptive.monitor = other->monitor;
+			break;
+		}
+	}
+}
+
 int event_loop() {
 	int count = 0;
 	
@@ -105,7 +142,13 @@ int event_loop() {
 	list_iterator_init(&iter, busy_events);
 	while(list_iterator_has_next(&iter)) {
 		Node* node = list_iterator_next(&iter);
-		if(!node->func(node->context)) {
+		adaptive.busy = false;
+		bool keep = node->func(node->context);
+		if(adaptive.busy)
+			adaptive.progress = true;
+
+		if(!keep) {
+			monitor_set(node, NULL);
 			list_iterator_remove(&iter);
 			free(node);
 		}
@@ -120,8 +163,10 @@ int event_loop() {
 		count++;
 	}
 	
-	if(count > 0)
+	if(count > 0) {
+		adaptive.progress = true;
 		return count;
+	}
 	
 	// Timer events
 	uint64_t time = timer_us();
@@ -157,8 +202,26 @@ int event_loop() {
 		count++;
 	}
 
-	if(count > 0)
+	if(count > 0) {
+		adaptive.progress = true;
 		return count;
+	}
+	
+	// Adaptive wait. With several monitored lines a write to any but one would
+	// only be seen after max us, so the loop keeps polling instead
+	if(adaptive.func) {
+		if(adaptive.progress) {
+			adaptive.progress = false;
+			adaptive.last = time;
+		} else if(adaptive.lines <= 1 && time - adaptive.last >= adaptive.spin) {
+			uint64_t deadline = time + adaptive.max;
+			if(next_timer < deadline)
+				deadline = next_timer;
+
+			adaptive.func(adaptive.monitor, deadline, adaptive.context);
+			return count;
+		}
+	}
 	
 	// Idle events
 	if(list_size(idle_events) > 0) {
@@ -182,6 +245,7 @@ uint64_t event_busy_add(EventFunc func, void* context) {
 		return 0;
 	node->func = func;
 	node->context = context;
+	node->monitor = NULL;
 	
 	if(!list_add(busy_events, node)) {
 		free(node);
@@ -191,8 +255,31 @@ uint64_t event_busy_add(EventFunc func, void* context) {
 	return (uintptr_t)node;
 }
 
+void event_busy_progress() {
+	adaptive.busy = true;
+}
+
+bool event_busy_monitor(uint64_t id, volatile void* monitor) {
+	if(list_index_of(busy_events, (void*)(uintptr_t)id, NULL) < 0)
+		return false;
+
+	monitor_set((Node*)(uintptr_t)id, monitor);
+
+	return true;
+}
+
+void event_wait_set(clock_t spin, clock_t max, EventWaitFunc func, void* context) {
+	adaptive.spin = spin;
+	adaptive.max = max;
+	adaptive.context = context;
+	adaptive.last = timer_us();
+	adaptive.progress = false;
+	adaptive.func = func;
+}
+
 bool event_busy_remove(uint64_t id) {
 	if(list_remove_data(busy_events, (void*)(uintptr_t)id)) {
+		monitor_set((Node*)(uintptr_t)id, NULL);
 		free((void*)(uintptr_t)id);
 		return true;
 	} else {
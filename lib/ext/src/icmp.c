@@ -7,18 +7,20 @@
 #include <util/map.h>
 
 bool icmp_process(NIC* nic, Packet* packet) {
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	if(endian16(ether->type) != ETHER_TYPE_IPv4)
+	// Received frames are parsed by the kernel already
+	PacketMeta* meta = nic_parse(packet);
+	if(!(meta->flags & PACKET_META_IPV4) || meta->l3 != packet->start + ETHER_LEN)
 		return false;
-	
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
 	IP* ip = (IP*)ether->payload;
 	uint32_t address = endian32(ip->destination);
 
 	if(!interface_get(nic, address))
 		return false;
 	
-	if(ip->protocol == IP_PROTOCOL_ICMP) {
-		ICMP* icmp = (ICMP*)((uint8_t*)ip + ip->ihl * 4);
+	if(meta->protocol == IP_PROTOCOL_ICMP && meta->l4) {
+		ICMP* icmp = (ICMP*)(packet->buffer + meta->l4);
 
 		switch(icmp->type) {
 			case ICMP_TYPE_ECHO_REQUEST:
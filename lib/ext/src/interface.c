@@ -5,20 +5,16 @@
 #define NIC_ADDR_IPv4	"net.addr.ipv4"
 
 IPv4InterfaceTable* interface_table_get(NIC* nic) {
-	int32_t interface_key = nic_config_key(nic, NIC_ADDR_IPv4);
-	IPv4InterfaceTable* table = NULL;
+	NICConfigHandle handle = nic_config_handle(nic, NIC_ADDR_IPv4);
+	if(handle)
+		return nic_config_get_h(nic, handle);
 
-	if(interface_key < 0) {
-		interface_key = nic_config_alloc(nic, NIC_ADDR_IPv4, sizeof(IPv4InterfaceTable));
-		if(interface_key < 0)
-			return NULL;
-
-		interface_key = nic_config_key(nic, NIC_ADDR_IPv4);
+	int32_t interface_key = nic_config_alloc(nic, NIC_ADDR_IPv4, sizeof(IPv4InterfaceTable));
+	if(interface_key < 0)
+		return NULL;
 
-		table = nic_config_get(nic, interface_key);
-		memset(table, 0, sizeof(IPv4InterfaceTable));
-	} else
-		table = nic_config_get(nic, interface_key);
+	IPv4InterfaceTable* table = nic_config_get(nic, interface_key);
+	memset(table, 0, sizeof(IPv4InterfaceTable));
 
 	return table;
 }
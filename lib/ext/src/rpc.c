@@ -227,6 +227,10 @@ static int write_vm(RPC* rpc, VMSpec* vm) {
 		WRITE(write_uint8(rpc, vm->nics[i].padding_head));
 		WRITE(write_uint8(rpc, vm->nics[i].padding_tail));
 		WRITE(write_uint32(rpc, vm->nics[i].pool_size));
+		WRITE(write_bool(rpc, vm->nics[i].mirror));
+		WRITE(write_uint16(rpc, vm->nics[i].queue_count));
+		WRITE(write_uint16(rpc, vm->nics[i].budget));
+		WRITE(write_uint8(rpc, vm->nics[i].pool_mode));
 	}
 
 	WRITE(write_uint16(rpc, vm->argc));
@@ -287,6 +291,10 @@ static int read_vm(RPC* rpc, VMSpec** vm2) {
 			READ2(read_uint8(rpc, &vm->nics[i].padding_head), failed);
 			READ2(read_uint8(rpc, &vm->nics[i].padding_tail), failed);
 			READ2(read_uint32(rpc, &vm->nics[i].pool_size), failed);
+			READ2(read_bool(rpc, &vm->nics[i].mirror), failed);
+			READ2(read_uint16(rpc, &vm->nics[i].queue_count), failed);
+			READ2(read_uint16(rpc, &vm->nics[i].budget), failed);
+			READ2(read_uint8(rpc, &vm->nics[i].pool_mode), failed);
 		}
 	}
 
@@ -365,6 +373,9 @@ int rpc_hello(RPC* rpc, bool(*callback)(void* context), void* context) {
 }
 
 static int hello_res_handler(RPC* rpc) {
+	// The server answers only a hello of the same version
+	rpc->ver = RPC_VERSION;
+
 	if(rpc->hello_callback && !rpc->hello_callback(rpc->hello_context)) {
 		rpc->hello_callback = NULL;
 		rpc->hello_context = NULL;
@@ -1127,6 +1138,125 @@ static int stdio_req_handler(RPC* rpc) {
 	RETURN();
 }
 
+// nic_stats client API
+int rpc_nic_stats(RPC* rpc, uint32_t id, bool(*callback)(VNICStats* stats, uint16_t count, void* context), void* context) {
+	INIT();
+
+	WRITE(write_uint16(rpc, RPC_TYPE_NIC_STATS_REQ));
+	WRITE(write_uint32(rpc, id));
+
+	rpc->nic_stats_callback = callback;
+	rpc->nic_stats_context = context;
+
+	RETURN();
+}
+
+static int nic_stats_res_handler(RPC* rpc) {
+	INIT();
+
+	int32_t size;
+	VNICStats* stats;
+	READ(read_bytes(rpc, (void**)&stats, &size));
+
+	if(rpc->nic_stats_callback && !rpc->nic_stats_callback(stats, (size < 0 ? 0 : size) / sizeof(VNICStats), rpc->nic_stats_context)) {
+		rpc->nic_stats_callback = NULL;
+		rpc->nic_stats_context = NULL;
+	}
+
+	RETURN();
+}
+
+// nic_stats server API
+void rpc_nic_stats_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, void* context, void(*callback)(RPC* rpc, VNICStats* stats, uint16_t count)), void* context) {
+	rpc->nic_stats_handler = handler;
+	rpc->nic_stats_handler_context = context;
+}
+
+static void nic_stats_handler_callback(RPC* rpc, VNICStats* stats, uint16_t count) {
+	INIT2();
+
+	WRITE2(write_uint16(rpc, RPC_TYPE_NIC_STATS_RES));
+	WRITE2(write_bytes(rpc, stats, sizeof(VNICStats) * count));
+
+	RETURN2();
+}
+
+static int nic_stats_req_handler(RPC* rpc) {
+	INIT();
+
+	uint32_t id;
+	READ(read_uint32(rpc, &id));
+
+	if(rpc->nic_stats_handler) {
+		rpc->nic_stats_handler(rpc, id, rpc->nic_stats_handler_context, nic_stats_handler_callback);
+	} else {
+		nic_stats_handler_callback(rpc, NULL, 0);
+	}
+
+	RETURN();
+}
+
+// nic_latency client API
+int rpc_nic_latency(RPC* rpc, uint32_t id, uint16_t nic, bool(*callback)(VNICLatency* latency, uint16_t count, void* context), void* context) {
+	INIT();
+
+	WRITE(write_uint16(rpc, RPC_TYPE_NIC_LATENCY_REQ));
+	WRITE(write_uint32(rpc, id));
+	WRITE(write_uint16(rpc, nic));
+
+	rpc->nic_latency_callback = callback;
+	rpc->nic_latency_context = context;
+
+	RETURN();
+}
+
+static int nic_latency_res_handler(RPC* rpc) {
+	INIT();
+
+	int32_t size;
+	VNICLatency* latency;
+	READ(read_bytes(rpc, (void**)&latency, &size));
+
+	if(rpc->nic_latency_callback && !rpc->nic_latency_callback(latency, (size < 0 ? 0 : size) / sizeof(VNICLatency), rpc->nic_latency_context)) {
+		rpc->nic_latency_callback = NULL;
+		rpc->nic_latency_context = NULL;
+	}
+
+	RETURN();
+}
+
+// nic_latency server API
+void rpc_nic_latency_handler(RPC* rpc, void(*handler)(RPC* rpc, uint32_t id, uint16_t nic, void* context, void(*callback)(RPC* rpc, VNICLatency* latency, uint16_t count)), void* context) {
+	rpc->nic_latency_handler = handler;
+	rpc->nic_latency_handler_context = context;
+}
+
+static void nic_latency_handler_callback(RPC* rpc, VNICLatency* latency, uint16_t count) {
+	INIT2();
+
+	WRITE2(write_uint16(rpc, RPC_TYPE_NIC_LATENCY_RES));
+	WRITE2(write_bytes(rpc, latency, sizeof(VNICLatency) * count));
+
+	RETURN2();
+}
+
+static int nic_latency_req_handler(RPC* rpc) {
+	INIT();
+
+	uint32_t id;
+	uint16_t nic;
+	READ(read_uint32(rpc, &id));
+	READ(read_uint16(rpc, &nic));
+
+	if(rpc->nic_latency_handler) {
+		rpc->nic_latency_handler(rpc, id, nic, rpc->nic_latency_handler_context, nic_latency_handler_callback);
+	} else {
+		nic_latency_handler_callback(rpc, NULL, 0);
+	}
+
+	RETURN();
+}
+
 // Handlers
 typedef int(*Handler)(RPC*);
 
@@ -1156,6 +1286,10 @@ static Handler handlers[] = {
 	storage_md5_res_handler,
 	stdio_req_handler,
 	stdio_res_handler,
+	nic_stats_req_handler,
+	nic_stats_res_handler,
+	nic_latency_req_handler,
+	nic_latency_res_handler,
 	download,
 	upload,
 };
@@ -1186,6 +1320,14 @@ bool rpc_loop(RPC* rpc) {
 
 				return _size > 0;
 			}
+
+			// Requests (odd types) are served only after a hello of this RPC_VERSION
+			if((type & 1) && type != RPC_TYPE_HELLO_REQ && rpc->ver != RPC_VERSION) {
+				if(rpc->close)
+					rpc->close(rpc);
+
+				return _size > 0;
+			}
 		} else if(_len < 0) {
 			if(rpc->close)
 				rpc->close(rpc);
@@ -1259,6 +1401,9 @@ void rpc_vm_dump(VMSpec* vm) {
 		printf("\tnic[%d].rx_bandwidth = %lx\n", i, vm->nics[i].rx_bandwidth);
 		printf("\tnic[%d].tx_bandwidth = %lx\n", i, vm->nics[i].tx_bandwidth);
 		printf("\tnic[%d].pool_size = %x\n", i, vm->nics[i].pool_size);
+		printf("\tnic[%d].mirror = %d\n", i, vm->nics[i].mirror);
+		printf("\tnic[%d].queue_count = %d\n", i, vm->nics[i].queue_count);
+		printf("\tnic[%d].pool_mode = %d\n", i, vm->nics[i].pool_mode);
 	}
 	printf("argv: ");
 	for(int i = 0; i < vm->argc; i++) {
@@ -258,6 +258,7 @@ static void rpc_vm_create_func() {
 	nics[0].pool_size = 0x400000;
 	nics[0].padding_head = 1;
 	nics[0].padding_tail = 1;
+	nics[0].pool_mode = NIC_POOL_CLASS;
 
 	rpc_vm_create(rpc, &vm, NULL, NULL);
 
@@ -278,9 +279,13 @@ static void rpc_vm_create_func() {
 	assert_int_equal(*(uint8_t*)(rpc->wbuf + 59), nics[0].padding_head);
 	assert_int_equal(*(uint8_t*)(rpc->wbuf + 60), nics[0].padding_tail);
 	assert_int_equal(*(uint32_t*)(rpc->wbuf + 61), nics[0].pool_size);
-	assert_int_equal(*(uint16_t*)(rpc->wbuf + 65), vm.argc);
-	assert_int_equal(*(uint16_t*)(rpc->wbuf + 67), strlen("Test"));
-	assert_memory_equal((char*)(rpc->wbuf + 69), vm.argv[0], strlen("Test"));
+	assert_int_equal(*(bool*)(rpc->wbuf + 65), nics[0].mirror);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 66), nics[0].queue_count);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 68), nics[0].budget);
+	assert_int_equal(*(uint8_t*)(rpc->wbuf + 70), nics[0].pool_mode);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 71), vm.argc);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 73), strlen("Test"));
+	assert_memory_equal((char*)(rpc->wbuf + 75), vm.argv[0], strlen("Test"));
 
 	server_open = 1;
 
@@ -354,6 +359,7 @@ static void rpc_vm_set_func() {
 	nics[0].pool_size = 0x400000;
 	nics[0].padding_head = 1;
 	nics[0].padding_tail = 1;
+	nics[0].pool_mode = NIC_POOL_CLASS;
 
 	rpc_vm_set(rpc, &vm, NULL, NULL);
 
@@ -374,9 +380,13 @@ static void rpc_vm_set_func() {
 	assert_int_equal(*(uint8_t*)(rpc->wbuf + 59), nics[0].padding_head);
 	assert_int_equal(*(uint8_t*)(rpc->wbuf + 60), nics[0].padding_tail);
 	assert_int_equal(*(uint32_t*)(rpc->wbuf + 61), nics[0].pool_size);
-	assert_int_equal(*(uint16_t*)(rpc->wbuf + 65), vm.argc);
-	assert_int_equal(*(uint16_t*)(rpc->wbuf + 67), strlen("Test"));
-	assert_memory_equal((char*)(rpc->wbuf + 69), vm.argv[0], strlen("Test"));
+	assert_int_equal(*(bool*)(rpc->wbuf + 65), nics[0].mirror);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 66), nics[0].queue_count);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 68), nics[0].budget);
+	assert_int_equal(*(uint8_t*)(rpc->wbuf + 70), nics[0].pool_mode);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 71), vm.argc);
+	assert_int_equal(*(uint16_t*)(rpc->wbuf + 73), strlen("Test"));
+	assert_memory_equal((char*)(rpc->wbuf + 75), vm.argv[0], strlen("Test"));
 
 	server_open = 1;
 
@@ -169,7 +169,18 @@ low_level_input(struct netif *netif, Packet* packet)
   struct pbuf *p, *q;
   u16_t len;
 
-  len = packet->end - packet->start;
+  /* lwIP checks checksums itself, so partial ones are completed first.
+   * Coalesced frames arrive chained. */
+  if (packet->meta.flags & PACKET_META_CSUM_PARTIAL)
+    nic_csum_complete(packet);
+
+  if (packet_len(packet) > 0xffff - ETH_PAD_SIZE) {
+    nic_free(packet);
+    LINK_STATS_INC(link.lenerr);
+    LINK_STATS_INC(link.drop);
+    return NULL;
+  }
+  len = packet_len(packet);
 
 #if ETH_PAD_SIZE
   len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
@@ -184,12 +195,20 @@ low_level_input(struct netif *netif, Packet* packet)
     pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
 
-    int idx = 0;
-    /* We iterate over the pbuf chain until we have read the entire
-     * packet into the pbuf. */
+    /* We iterate over the pbuf chain and the packet segments until we
+     * have read the entire packet into the pbuf. */
+    Packet* segment = packet;
+    int idx = segment->start;
     for(q = p; q != NULL; q = q->next) {
-      memcpy(q->payload, packet->buffer + packet->start + idx, q->len);
-      idx += q->len;
+      u16_t copied = 0;
+      while (copied < q->len && segment != NULL) {
+        u16_t size = LWIP_MIN(q->len - copied, segment->end - idx);
+        memcpy((u8_t*)q->payload + copied, segment->buffer + idx, size);
+        copied += size;
+        idx += size;
+        if (idx == segment->end && (segment = packet_next(segment)) != NULL)
+          idx = segment->start;
+      }
     }
     nic_free(packet);
 
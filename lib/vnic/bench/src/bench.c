@@ -0,0 +1,496 @@
+/**
+ * Data path benchmark of the shared memory NIC on a Linux host.
+ *
+ * A kernel side producer thread receives frames into the VNICs with vnic_rx()
+ * and drains their tx queues with vnic_tx_burst(). Every VNIC is served by one
+ * VM side consumer that echoes what it receives with nic_rx()/nic_tx(). The
+ * consumers are forked processes like the VM threads that own a data segment
+ * each, so their buffer caches are private while the NIC memory is shared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "nic.h"
+#include "vnic.h"
+
+#define BENCH_MAX_CONSUMERS	64
+#define BENCH_MAX_RUNS		16
+#define BENCH_MAX_BURST		64
+#define BENCH_TX_BURST		32
+#define BENCH_MAX_SIZE		9000		// Jumbo frames are chained
+#define BENCH_BANDWIDTH		400000000000L	// Far above what one core moves, no shaping
+
+/**
+ * State of a consumer, shared with the producer
+ */
+typedef struct {
+	volatile uint64_t	received;	///< Packets taken from the rx queue
+	volatile uint64_t	cycles;		///< TSC cycles from the first packet to the last
+	volatile bool		ready;		///< Pinned and waiting for the start
+	volatile bool		done;
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) BenchConsumer;
+
+typedef struct {
+	volatile bool	start;
+	BenchConsumer	consumers[BENCH_MAX_CONSUMERS];
+} BenchShared;
+
+typedef struct {
+	int		consumers;
+	uint64_t	count;		///< Packets per consumer
+	uint32_t	burst;		///< Packets a consumer moves at once
+	uint32_t	queue_size;
+	uint64_t	pool_size;	///< Bytes of NIC memory per VNIC
+	uint8_t		pool_mode;	///< NICPoolMode
+	bool		latency;	///< Collect latency telemetry
+	int		cpu;		///< Core of the producer, consumers take the next ones
+	uint16_t	sizes[BENCH_MAX_RUNS];
+	int		size_count;
+	uint8_t		fragments[BENCH_MAX_RUNS];	///< Percent of the pool fragmented by scattered buffers
+	int		fragment_count;
+} BenchConfig;
+
+typedef struct {
+	BenchConfig*	config;
+	BenchShared*	shared;
+	VNIC*		vnics;
+	uint16_t	size;
+	uint64_t	transmitted;
+	uint64_t	cycles;
+} BenchProducer;
+
+static uint64_t tsc_frequency;
+static bool shared_cores;	// Fewer cores than threads, waiting threads yield
+
+static void bench_idle() {
+	if(shared_cores)
+		sched_yield();
+	else
+		asm volatile("pause");
+}
+
+static uint64_t bench_tsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static uint64_t bench_calibrate() {
+	struct timespec start, end, sleep = { 0, 50000000 };
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t tsc = bench_tsc();
+	nanosleep(&sleep, NULL);
+	tsc = bench_tsc() - tsc;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+
+	return tsc * 1000000000L / ns;
+}
+
+static void bench_pin(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * Map NIC memory of every VNIC, 2MB aligned. Hugepages are used when the
+ * host has them reserved, otherwise the anonymous mapping is advised to be
+ * backed by transparent hugepages.
+ */
+static void* bench_map(size_t size, bool* huge) {
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(memory != MAP_FAILED) {
+		*huge = true;
+		return memory;
+	}
+
+	*huge = false;
+	memory = mmap(NULL, size + NIC_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(memory == MAP_FAILED)
+		return NULL;
+
+	void* aligned = (void*)(((uintptr_t)memory + NIC_REGION_SIZE - 1) & ~(uintptr_t)(NIC_REGION_SIZE - 1));
+	madvise(aligned, size, MADV_HUGEPAGE);
+
+	return aligned;
+}
+
+static bool bench_vnic_init(BenchConfig* config, VNIC* vnic, int index, void* memory) {
+	memset(memory, 0, config->pool_size);
+	memset(vnic, 0, sizeof(VNIC));
+	vnic->id = index + 1;
+	vnic->nic = memory;
+	vnic->nic_size = config->pool_size;
+
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x020000000001L + index,
+		VNIC_DEV, (uint64_t)"bench",
+		VNIC_POOL_SIZE, config->pool_size,
+		VNIC_RX_BANDWIDTH, BENCH_BANDWIDTH,
+		VNIC_TX_BANDWIDTH, BENCH_BANDWIDTH,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, config->queue_size,
+		VNIC_TX_QUEUE_SIZE, config->queue_size,
+		VNIC_SLOW_RX_QUEUE_SIZE, 64,
+		VNIC_SLOW_TX_QUEUE_SIZE, 64,
+		VNIC_POOL_MODE, config->pool_mode,
+		VNIC_LATENCY, config->latency,
+		VNIC_NONE
+	};
+
+	return vnic_init(vnic, attrs);
+}
+
+/**
+ * Fill percent of the pool with small buffers and free every other one, so
+ * later allocations search a fragmented pool. The rest of the pool stays free
+ * for frames larger than the holes.
+ *
+ * @return number of buffers held in fragments
+ */
+static uint32_t bench_fragment(NIC* nic, uint8_t percent, Packet** fragments, uint32_t max) {
+	if(!percent)
+		return 0;
+
+	size_t target = nic_pool_total(nic) * percent / 100;
+	uint32_t count = 0;
+	while(count < max && nic_pool_used(nic) < target) {
+		Packet* packet = nic_alloc(nic, 64);
+		if(!packet)
+			break;
+
+		fragments[count++] = packet;
+	}
+
+	uint32_t held = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		if(i % 2)
+			nic_free(fragments[i]);
+		else
+			fragments[held++] = fragments[i];
+	}
+
+	nic_cache_flush(nic);
+
+	return held;
+}
+
+static void bench_consumer(BenchConfig* config, BenchConsumer* consumer, NIC* nic, volatile bool* start, int cpu) {
+	bench_pin(cpu);
+	consumer->ready = true;
+	while(!*start)
+		bench_idle();
+
+	Packet* packets[BENCH_MAX_BURST];
+	uint64_t first = 0;
+	uint64_t received = 0;
+	while(received < config->count) {
+		uint32_t count;
+		if(config->burst > 1) {
+			count = nic_rx_burst(nic, packets, config->burst);
+			if(count)
+				nic_tx_burst(nic, packets, count);
+		} else {
+			packets[0] = nic_rx(nic);
+			count = packets[0] != NULL;
+			if(count && !nic_tx(nic, packets[0]))
+				nic_free(packets[0]);
+		}
+
+		if(!count) {
+			bench_idle();
+			continue;
+		}
+
+		if(!received)
+			first = bench_tsc();
+
+		received += count;
+		consumer->received = received;
+	}
+
+	nic_cache_flush(nic);
+	consumer->cycles = bench_tsc() - first;
+	consumer->done = true;
+}
+
+static uint32_t bench_transmit(Packet** packets, uint32_t count, void* context) {
+	uint64_t* transmitted = context;
+	for(uint32_t i = 0; i < count; i++)
+		nic_free(packets[i]);
+
+	*transmitted += count;
+
+	return count;
+}
+
+static void* bench_producer(void* context) {
+	BenchProducer* producer = context;
+	BenchConfig* config = producer->config;
+	bench_pin(config->cpu);
+
+	uint8_t frame[BENCH_MAX_SIZE] = { 0 };
+	uint64_t sent[BENCH_MAX_CONSUMERS] = { 0 };
+	uint64_t start = bench_tsc();
+	bool busy = true;
+	while(busy) {
+		busy = false;
+		for(int i = 0; i < config->consumers; i++) {
+			VNIC* vnic = &producer->vnics[i];
+			if(sent[i] < config->count) {
+				busy = true;
+				if(!queue_available(&vnic->nic->rx)) {
+					bench_idle();
+				} else {
+					// Destination MAC of the VNIC, experimental ethertype
+					for(int j = 0; j < 6; j++)
+						frame[j] = vnic->mac >> (40 - j * 8);
+					frame[12] = 0x88;
+					frame[13] = 0xb5;
+					if(vnic_rx(vnic, frame, producer->size, NULL, 0) == VNIC_ERROR_NOERROR)
+						sent[i]++;
+				}
+			}
+
+			if(vnic_has_tx(vnic))
+				vnic_tx_burst(vnic, bench_transmit, &producer->transmitted, BENCH_TX_BURST);
+
+			if(!producer->shared->consumers[i].done || vnic_has_tx(vnic))
+				busy = true;
+		}
+	}
+	producer->cycles = bench_tsc() - start;
+
+	return NULL;
+}
+
+static void bench_run(BenchConfig* config, BenchShared* shared, VNIC* vnics, void* memory, uint16_t size, uint8_t fragment) {
+	uint32_t max = config->pool_size / NIC_CHUNK_SIZE;
+	Packet** fragments[BENCH_MAX_CONSUMERS];
+	uint32_t held[BENCH_MAX_CONSUMERS];
+
+	memset(shared, 0, sizeof(BenchShared));
+	for(int i = 0; i < config->consumers; i++) {
+		if(!bench_vnic_init(config, &vnics[i], i, memory + config->pool_size * i)) {
+			fprintf(stderr, "Cannot initialize VNIC %d\n", i);
+			exit(1);
+		}
+
+		fragments[i] = malloc(max * sizeof(Packet*));
+		held[i] = fragments[i] ? bench_fragment(vnics[i].nic, fragment, fragments[i], max) : 0;
+	}
+
+	pid_t pids[BENCH_MAX_CONSUMERS];
+	for(int i = 0; i < config->consumers; i++) {
+		pids[i] = fork();
+		if(pids[i] == 0) {
+			bench_consumer(config, &shared->consumers[i], vnics[i].nic, &shared->start, config->cpu + 1 + i);
+			_exit(0);
+		}
+	}
+
+	for(int i = 0; i < config->consumers; i++) {
+		while(!shared->consumers[i].ready)
+			sched_yield();
+	}
+
+	BenchProducer producer = { .config = config, .shared = shared, .vnics = vnics, .size = size };
+	pthread_t thread;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	shared->start = true;
+	pthread_create(&thread, NULL, bench_producer, &producer);
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for(int i = 0; i < config->consumers; i++)
+		waitpid(pids[i], NULL, 0);
+
+	uint64_t received = 0;
+	uint64_t consumer_cycles = 0;
+	for(int i = 0; i < config->consumers; i++) {
+		received += shared->consumers[i].received;
+		consumer_cycles += shared->consumers[i].cycles;
+	}
+
+	// Percentiles of the worst VNIC
+	VNICLatency worst[NIC_LATENCY_STAGE_COUNT] = { 0 };
+	for(int i = 0; i < config->consumers; i++) {
+		if(config->latency) {
+			VNICLatency latency[NIC_LATENCY_STAGE_COUNT];
+			vnic_latency(&vnics[i], latency);
+			for(int stage = 0; stage < NIC_LATENCY_STAGE_COUNT; stage++) {
+				if(latency[stage].p50 > worst[stage].p50)
+					worst[stage].p50 = latency[stage].p50;
+				if(latency[stage].p99 > worst[stage].p99)
+					worst[stage].p99 = latency[stage].p99;
+				if(latency[stage].p999 > worst[stage].p999)
+					worst[stage].p999 = latency[stage].p999;
+			}
+		}
+
+		for(uint32_t j = 0; j < held[i]; j++)
+			nic_free(fragments[i][j]);
+		nic_cache_flush(vnics[i].nic);
+		free(fragments[i]);
+	}
+
+	char percentiles[64];
+	if(config->latency)
+		snprintf(percentiles, sizeof(percentiles), "%7lu %7lu %7lu %7lu %7lu %7lu",
+				worst[NIC_LATENCY_RX].p50, worst[NIC_LATENCY_RX].p99, worst[NIC_LATENCY_RX].p999,
+				worst[NIC_LATENCY_TX].p50, worst[NIC_LATENCY_TX].p99, worst[NIC_LATENCY_TX].p999);
+	else
+		snprintf(percentiles, sizeof(percentiles), "%7s %7s %7s %7s %7s %7s", "-", "-", "-", "-", "-", "-");
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%5d %4d%% %8.2f %8lu %8lu %s %9lu\n",
+			size, fragment, received / seconds / 1e6,
+			received ? producer.cycles / received : 0,
+			received ? consumer_cycles / received : 0,
+			percentiles, received - producer.transmitted);
+}
+
+static int bench_list(const char* arg, void* values, int width, int max, long limit) {
+	char* end;
+	int count = 0;
+	while(*arg && count < max) {
+		long value = strtol(arg, &end, 0);
+		if(end == arg || value < 0 || value > limit)
+			return -1;
+
+		if(width == 1)
+			((uint8_t*)values)[count++] = value;
+		else
+			((uint16_t*)values)[count++] = value;
+
+		arg = *end == ',' ? end + 1 : end;
+		if(*end && *end != ',')
+			return -1;
+	}
+
+	return count;
+}
+
+static void usage(const char* name) {
+	printf("Usage: %s [options]\n", name);
+	printf("  -c count    VM side consumers, one VNIC each (default 1)\n");
+	printf("  -n count    Packets per consumer per run (default 1000000)\n");
+	printf("  -s sizes    Comma separated frame sizes (default 64,512,1514)\n");
+	printf("  -f percents Comma separated shares of the pool fragmented, half of it held (default 0,50,75)\n");
+	printf("  -b burst    Packets a consumer moves at once (default 1)\n");
+	printf("  -q size     rx/tx queue size (default 512)\n");
+	printf("  -m size     NIC memory per VNIC in MB, multiple of 2 (default 8)\n");
+	printf("  -p mode     Pool mode, bitmap or class (default bitmap)\n");
+	printf("  -l          Collect latency telemetry and print percentiles in ns\n");
+	printf("  -C cpu      Core of the producer, consumers take the next ones (default 0)\n");
+}
+
+int main(int argc, char** argv) {
+	BenchConfig config = {
+		.consumers = 1,
+		.count = 1000000,
+		.burst = 1,
+		.queue_size = 512,
+		.pool_size = 8 * 1024 * 1024,
+		.pool_mode = NIC_POOL_BITMAP,
+		.latency = false,
+		.cpu = 0,
+		.sizes = { 64, 512, 1514 },
+		.size_count = 3,
+		.fragments = { 0, 50, 75 },
+		.fragment_count = 3,
+	};
+
+	int option;
+	while((option = getopt(argc, argv, "c:n:s:f:b:q:m:p:lC:h")) != -1) {
+		switch(option) {
+			case 'c':
+				config.consumers = atoi(optarg);
+				break;
+			case 'n':
+				config.count = strtoull(optarg, NULL, 0);
+				break;
+			case 's':
+				config.size_count = bench_list(optarg, config.sizes, 2, BENCH_MAX_RUNS, BENCH_MAX_SIZE);
+				break;
+			case 'f':
+				config.fragment_count = bench_list(optarg, config.fragments, 1, BENCH_MAX_RUNS, 95);
+				break;
+			case 'b':
+				config.burst = atoi(optarg);
+				break;
+			case 'q':
+				config.queue_size = atoi(optarg);
+				break;
+			case 'm':
+				config.pool_size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+				break;
+			case 'p':
+				if(strcmp(optarg, "bitmap") == 0)
+					config.pool_mode = NIC_POOL_BITMAP;
+				else if(strcmp(optarg, "class") == 0)
+					config.pool_mode = NIC_POOL_CLASS;
+				else
+					config.size_count = -1;
+				break;
+			case 'l':
+				config.latency = true;
+				break;
+			case 'C':
+				config.cpu = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+
+	if(config.consumers < 1 || config.consumers > BENCH_MAX_CONSUMERS || config.size_count <= 0 ||
+			config.fragment_count <= 0 || config.burst < 1 || config.burst > BENCH_MAX_BURST ||
+			config.queue_size == 0 || config.count == 0 ||
+			config.pool_size == 0 || config.pool_size % NIC_REGION_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	tsc_frequency = bench_calibrate();
+	vnic__init_timer(tsc_frequency);
+
+	bool huge;
+	void* memory = bench_map(config.pool_size * config.consumers, &huge);
+	BenchShared* shared = mmap(NULL, sizeof(BenchShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	VNIC* vnics = calloc(config.consumers, sizeof(VNIC));
+	if(!memory || shared == MAP_FAILED || !vnics) {
+		fprintf(stderr, "Cannot map NIC memory\n");
+		return 1;
+	}
+
+	shared_cores = sysconf(_SC_NPROCESSORS_ONLN) < config.consumers + 1;
+	printf("TSC %lu MHz, %d consumer(s), %lu packets each, burst %u, queue %u, %lu MB %s pool in %s pages%s%s\n",
+			tsc_frequency / 1000000, config.consumers, config.count, config.burst, config.queue_size,
+			config.pool_size / 1024 / 1024, config.pool_mode == NIC_POOL_CLASS ? "class" : "bitmap",
+			huge ? "huge" : "anonymous", config.latency ? ", latency telemetry" : "",
+			shared_cores ? ", cores are shared" : "");
+	printf("%5s %5s %8s %8s %8s %7s %7s %7s %7s %7s %7s %9s\n", "size", "frag", "Mpps", "cyc/pkt", "vm cyc",
+			"rx p50", "p99", "p99.9", "tx p50", "p99", "p99.9", "tx drops");
+
+	for(int i = 0; i < config.size_count; i++) {
+		for(int j = 0; j < config.fragment_count; j++)
+			bench_run(&config, shared, vnics, memory, config.sizes[i], config.fragments[j]);
+	}
+
+	return 0;
+}
@@ -20,9 +20,30 @@
 #define NIC_CHUNK_SIZE		64
 #define NIC_MAX_SIZE		(16 * 1024 * 1024)	// 16MB
 #define NIC_HEADER_SIZE		(64 * 1024)		// 64KB
+#define NIC_CACHE_LINE_SIZE	64
+#define NIC_MAX_QUEUE_COUNT	16			// rx/tx queue pairs per NIC
+#define NIC_REGION_SIZE		0x200000		// NICs are 2MB aligned and sized
+#define NIC_REGION_COUNT	2048			// 2MB regions of NIC memory resolvable per address space (power of 2)
+#define NIC_CONFIG_INDEX_SIZE	512			// Slots of the hashed config name index (power of 2)
 
 #define NIC_MAGIC_HEADER	0x0A38E56586468C01LL	// PacketNgin vNIC 01(version)
 
+#define NIC_POOL_CLASS_COUNT	3
+#define NIC_POOL_CLASS_SIZES	{ 256, 2048, 9216 }	// Buffer size including Packet header
+#define NIC_POOL_CLASS_SHARES	{ 1, 2, 1 }		// Share of pool memory per class
+#define NIC_CACHE_SIZE		64			// Buffers a thread cache keeps per size class (per run size in bitmap pools)
+#define NIC_CACHE_BULK		(NIC_CACHE_SIZE / 2)	// Buffers moved per refill or flush
+#define NIC_SEGMENT_SIZE	1536			// Data size of the segments of a chained packet
+#define NIC_LATENCY_BUCKETS	240			// 8 linear buckets per power of 2 up to 2^32 cycles
+#define NIC_WAIT_SPIN		20000			// TSC cycles nic_wait_rx polls before it sleeps
+
+#define NIC_OFFLOAD_TX_CSUM	0x01			// Device completes PACKET_META_CSUM_PARTIAL checksums
+#define NIC_OFFLOAD_TSO4	0x02			// Device segments IPv4 PACKET_META_GSO frames
+#define NIC_OFFLOAD_TSO6	0x04			// Device segments IPv6 PACKET_META_GSO frames
+#define NIC_OFFLOAD_RX_CSUM	0x08			// Received frames may carry PACKET_META_CSUM_VERIFIED or _CSUM_PARTIAL
+#define NIC_OFFLOAD_GRO		0x10			// Received frames may be coalesced PACKET_META_GSO frames
+#define NIC_OFFLOAD_SG		0x20			// Device sends chained packets without linearizing them
+
 /**
  * @file
  * Network Interface Controller (NIC) host API
@@ -30,14 +51,69 @@
 
 // Host API
 
+/**
+ * Producer model of NICQueue
+ */
+typedef enum _NICQueueMode {
+	NIC_QUEUE_SP = 0,	///< Single producer
+	NIC_QUEUE_MP,		///< Multiple producers reserve slots with compare-and-swap
+} NICQueueMode;
+
+#define NIC_QUEUE_CLOSED	((uint64_t)1 << 63)	// Producers stopped for a resize
+#define NIC_QUEUE_LAP_MASK	0x7fffffff
+
+/**
+ * Packet ring shared by a producer and a consumer. Producer and consumer
+ * indices live on separate cache lines and each side keeps a private copy of
+ * the opposite index, so the other side's line is only read when the ring
+ * looks full (or empty).
+ *
+ * A resize posts the next ring. The next push closes the queue instead of
+ * queueing, and the consumer swaps the rings once the old one drained. Pushes
+ * fail as if the queue were full in between.
+ */
 typedef struct _NICQueue {
 	uint32_t	base;			///< Base offset
-	uint32_t	head;			///< Queue head
-	uint32_t	tail;			///< Queue tail
 	uint32_t	size;			///< Maximum number of packets this queue can have
-	volatile uint8_t rlock;		///< Read lock
-	volatile uint8_t wlock;		///< Write lock
-} NICQueue;
+	uint8_t		mode;			///< NICQueueMode
+	uint32_t	capacity;		///< Number of entries the ring at base can hold
+	uint32_t	ring;			///< Offset of the pool buffer holding the ring, 0 for the ring laid out by vnic_init
+
+	// Pending resize, applied by the consumer once the producers closed and the ring drained
+	uint32_t	next_base;		///< Base offset of the next ring
+	uint32_t	next_capacity;		///< Capacity of the next ring
+	uint32_t	next_ring;		///< Pool buffer of the next ring
+	volatile uint32_t next_size;		///< Size of the next ring, 0 if no resize is pending
+
+	// Producer cache line
+	volatile uint32_t tail __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Queue tail (published to consumer)
+	volatile uint64_t reserve;		///< NIC_QUEUE_CLOSED | lap count << 32 | next slot to reserve (NIC_QUEUE_MP, or closed)
+	uint32_t	head_cache;		///< Producer's copy of head (NIC_QUEUE_SP only)
+
+	// Consumer cache line
+	volatile uint32_t head __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Queue head
+	uint32_t	tail_cache;		///< Consumer's copy of tail
+	volatile uint8_t rlock;		///< Read lock (serializes consumers)
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) NICQueue;
+
+/**
+ * Packet pool allocation mode
+ */
+typedef enum _NICPoolMode {
+	NIC_POOL_BITMAP = 0,	///< First-fit scan of 64 bytes chunk bitmap
+	NIC_POOL_CLASS,		///< Fixed size classes backed by free index stacks
+} NICPoolMode;
+
+/**
+ * Size class of packet pool
+ */
+typedef struct _NICPoolClass {
+	uint32_t	base;		///< Offset of the first buffer
+	uint32_t	size;		///< Buffer size including Packet header
+	uint32_t	count;		///< Number of buffers
+	uint32_t	stack;		///< Offset of free index stack
+	uint32_t	top;		///< Number of free indices in the stack
+} NICPoolClass;
 
 /**
  * Bitmap Pool
@@ -49,8 +125,45 @@ typedef struct _NICPool {
 	uint32_t	index;
 	uint32_t	used;		///< Number of active chunks
 	volatile uint8_t lock;	///< Write lock
+
+	uint8_t		mode;		///< NICPoolMode
+	NICPoolClass	classes[NIC_POOL_CLASS_COUNT];	///< Size classes (NIC_POOL_CLASS mode only)
 } NICPool;
 
+/**
+ * Statistics of the calling thread's packet buffer cache
+ */
+typedef struct _NICCacheStats {
+	uint64_t	allocs;		///< Allocation requests
+	uint64_t	alloc_hits;	///< Allocations served without touching the shared pool
+	uint64_t	frees;		///< Free requests
+	uint64_t	refills;	///< Bulk refills from the shared pool
+	uint64_t	flushes;	///< Bulk flushes to the shared pool
+} NICCacheStats;
+
+/**
+ * Stages of latency telemetry. Rx starts when the frame reaches the VNIC and
+ * ends when the app dequeues it; tx starts when the app queues the frame and
+ * ends when the driver took it.
+ */
+typedef enum _NICLatencyStage {
+	NIC_LATENCY_RX_DRIVER,	///< VNIC receive processing until the frame is queued
+	NIC_LATENCY_RX_QUEUE,	///< Waiting in the rx queue for the app
+	NIC_LATENCY_RX,		///< Whole rx path
+	NIC_LATENCY_TX_QUEUE,	///< Waiting in the tx queue for a turn of the NICDevice
+	NIC_LATENCY_TX_DRIVER,	///< Handing the frame to the driver
+	NIC_LATENCY_TX,		///< Whole tx path
+	NIC_LATENCY_STAGE_COUNT,
+} NICLatencyStage;
+
+/**
+ * Log-linear latency histograms in TSC cycles. Both the kernel and the VM
+ * threads count samples with atomic increments.
+ */
+typedef struct _NICLatency {
+	volatile uint64_t	buckets[NIC_LATENCY_STAGE_COUNT][NIC_LATENCY_BUCKETS];
+} NICLatency;
+
 /**
  * NIC Memory Map
  *
@@ -61,7 +174,9 @@ typedef struct _NICPool {
  * Fast path tx queue
  * Slow path rx queue
  * Slow path tx queue
- * Packet pool bitmap
+ * rx/tx queues of queue pairs 1 and above, and their rings
+ * Latency histograms
+ * Packet pool bitmap (or free index stacks of size classes)
  * Packet payload pool
  */
 typedef struct _NIC {
@@ -75,27 +190,27 @@ typedef struct _NIC {
 	uint64_t	rx_bandwidth;		///< Rx bandwith limit (bps)
 	uint64_t	tx_bandwidth;		///< Tx bandwith limit (bps)
 
-	uint64_t	input_bytes;		///< Total input bytes (read only)
-	uint64_t	input_packets;		///< Total input packets (read only)
-	uint64_t	input_drop_bytes;	///< Total dropped input bytes (read only)
-	uint64_t	input_drop_packets;	///< Total dropped input packets (read only)
-	uint64_t	output_bytes;		///< Total output bytes (read only)
-	uint64_t	output_packets;		///< Total output packets (read only)
-	uint64_t	output_drop_bytes;	///< Total dropped output bytes (read only)
-	uint64_t	output_drop_packets;	///< Total dropped output packets (read only)
-
 	uint16_t	padding_head;
 	uint16_t	padding_tail;
 
-	NICQueue	rx;
-	NICQueue	tx;
+	uint16_t	queue_count;		///< Number of rx/tx queue pairs (pair 0 is rx and tx)
+	uint32_t	queues;			///< Offset of the rx/tx NICQueues of pairs 1 and above
+	uint32_t	size;			///< Size of the NIC shared memory (NIC_REGION_SIZE aligned)
+	volatile uint8_t latency;		///< Latency telemetry is on, packets carry TSC stamps in time
+	volatile uint8_t tx_stamp;		///< The app stamps the packets it queues for tx (latency telemetry or tx AQM)
+	volatile uint8_t offloads;		///< NIC_OFFLOAD_* of the device under the VNIC (read only)
+	uint32_t	histograms;		///< Offset of the NICLatency histograms, ahead of the pool
+
+	NICQueue	rx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
+	NICQueue	tx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
 
-	NICQueue	srx;
-	NICQueue	stx;
+	NICQueue	srx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
+	NICQueue	stx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
 
 	NICPool		pool;
 
 	uint32_t	config;
+	uint16_t	config_index[NIC_CONFIG_INDEX_SIZE];	///< Config keys + 1 hashed by name, 0 if empty
 	uint8_t		config_head[0];
 	uint8_t		config_tail[0] __attribute__((__aligned__(NIC_HEADER_SIZE)));
 
@@ -107,22 +222,179 @@ typedef struct _NIC {
 	// pool (NIC_CHUNK_SIZE(64) bytges aligned)
 } __attribute__((packed)) NIC;
 
+/**
+ * Queue pair of a NIC. Pair 0 is the rx and tx queue.
+ *
+ * @return rx queue of the pair, the tx queue follows it. NULL if there is no such pair
+ */
+static inline NICQueue* nic_queue_pair(NIC* nic, uint16_t queue) {
+	if(queue == 0)
+		return &nic->rx;	// nic->tx follows
+
+	if(queue >= nic->queue_count)
+		return NULL;
+
+	return (NICQueue*)((uint8_t*)nic + nic->queues) + (queue - 1) * 2;
+}
+
+static inline uint64_t nic_time() {
+	uint64_t t;
+	uint32_t* p = (uint32_t*)&t;
+	asm volatile("rdtsc" : "=a"(p[0]), "=d"(p[1]));
+	return t;
+}
+
+/**
+ * Latency stamp of a packet: low 32 bits of the TSC at the first and the last
+ * stamp. 0 if the packet was not stamped.
+ */
+#define NIC_LATENCY_STAMP(first, last)	((uint64_t)(uint32_t)(first) << 32 | (uint32_t)(last))
+
+/**
+ * Count the cycles since the last stamp as stage, and since the first stamp
+ * as total unless it is NIC_LATENCY_STAGE_COUNT.
+ *
+ * @return stamp with the first stamp and now
+ */
+uint64_t nic_latency_lap(NIC* nic, uint64_t stamp, NICLatencyStage stage, NICLatencyStage total);
+
+/**
+ * @return histogram bucket of a latency
+ */
+static inline uint32_t nic_latency_bucket(uint32_t cycles) {
+	if(cycles < 8)
+		return cycles;
+
+	uint32_t k = 31 - __builtin_clz(cycles);
+	return (k - 2) * 8 + ((cycles >> (k - 3)) & 7);
+}
+
+/**
+ * Find the NIC a packet buffer belongs to with one lookup of the region table.
+ * NICs of this address space that are not registered yet are found by their
+ * magic header and registered. Building with NIC_REGION_DEBUG validates every
+ * lookup against the magic header.
+ */
 NIC* nic_find_by_packet(Packet* packet);
+
+/**
+ * Register or unregister the 2MB regions of a NIC in this address space's region table.
+ *
+ * @return false if the table is full; lookups of the regions not registered fall back to the magic header
+ */
+bool nic_region_add(NIC* nic);
+void nic_region_remove(NIC* nic);
+
+#ifdef NIC_REGION_DEBUG
+uint64_t nic_region_errors();	// Lookups the magic header disagreed with
+#endif
+
 int nic_count();
 NIC* nic_get(int index);
 NIC* nic_get_by_id(uint32_t id);
 
+/**
+ * First fit in a bitmap pool: the first run of req free chunks that starts
+ * in [from, to). A used chunk holds the number of chunks left in its buffer,
+ * so the scan steps over used buffers instead of stopping at them.
+ *
+ * @return index of the first chunk, (uint32_t)-1 if there is no such run
+ */
+static inline uint32_t nic_pool_bitmap_find(const uint8_t* bitmap, uint32_t count, uint32_t from, uint32_t to, uint8_t req) {
+	if(req > count)
+		return (uint32_t)-1;
+	if(to > count - req + 1)
+		to = count - req + 1;
+
+	for(uint32_t idx = from; idx < to; idx++) {
+		uint32_t j = 0;
+		uint8_t left = 0;
+		while(j < req && !(left = bitmap[idx + j]))
+			j++;
+
+		if(j == req)
+			return idx;
+
+		idx += j + left - 1;	// The loop steps to the chunk after the used buffer
+	}
+
+	return (uint32_t)-1;
+}
+
 Packet* nic_alloc(NIC* nic, uint16_t size);
-bool nic_free(Packet* packet);
+bool nic_free(Packet* packet);	// Frees every segment of a chain
+
+/**
+ * Free packets like nic_free. The owning NIC is looked up once per run of
+ * packets from the same pool.
+ *
+ * @return number of packets freed
+ */
+uint32_t nic_free_burst(Packet** packets, uint32_t count);
+
+/**
+ * Allocate a packet for size bytes of data: one buffer if the pool has one
+ * large enough, a chain of NIC_SEGMENT_SIZE segments otherwise. The end of
+ * every segment is set.
+ *
+ * @return packet, NULL if the pool is exhausted
+ */
+Packet* nic_alloc_chain(NIC* nic, uint32_t size);
+
+/**
+ * Copy data into a packet at offset from its start, across segments.
+ * Data past the end of the chain is not copied.
+ */
+void nic_write(Packet* packet, uint32_t offset, const void* data, uint32_t size);
+
+/**
+ * Add an owner to a packet, e.g. to queue it to several NICs without copying.
+ * Every owner releases it with nic_free. A packet with refcount above 1 is
+ * shared and must not be modified.
+ *
+ * @param packet packet
+ *
+ * @return packet
+ */
+Packet* nic_ref(Packet* packet);
 
 bool queue_push(NIC* nic, NICQueue* queue, Packet* packet);
 void* queue_pop(NIC* nic, NICQueue* queue);
+
+/**
+ * Oldest packet of a queue without taking it. The consumer may take and free
+ * it meanwhile, so the packet is only a hint for the producer.
+ *
+ * @return NULL if the queue is empty
+ */
+Packet* queue_peek(NIC* nic, NICQueue* queue);
 uint32_t queue_size(NICQueue* queue);
 bool queue_available(NICQueue* queue);
 bool queue_empty(NICQueue* queue);
 
+/**
+ * Consumer side of a pending resize. queue_pop does it when the queue is
+ * empty; consumers that only pop non-empty queues call it themselves.
+ */
+void queue_swap(NIC* nic, NICQueue* queue);
+
+/**
+ * Queue up to count packets, publishing the tail once
+ *
+ * @return number of leading packets queued
+ */
+uint32_t queue_push_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
+
+/**
+ * Dequeue up to count packets, releasing the head once
+ *
+ * @return number of packets stored in packets
+ */
+uint32_t queue_pop_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
+
 bool nic_has_rx(NIC* nic);
 Packet* nic_rx(NIC* nic);
+uint32_t nic_rx_burst(NIC* nic, Packet** packets, uint32_t count);
 uint32_t nic_rx_size(NIC* nic);
 
 bool nic_has_srx(NIC* nic);
@@ -130,21 +402,98 @@ Packet* nic_srx(NIC* nic);
 uint32_t nic_srx_size(NIC* nic);
 
 bool nic_tx(NIC* nic, Packet* packet);
+uint32_t nic_tx_burst(NIC* nic, Packet** packets, uint32_t count);	// Frees packets that are not queued
 bool nic_try_tx(NIC* nic, Packet* packet);
 bool nic_tx_dup(NIC* nic, Packet* packet);
 bool nic_has_tx(NIC* nic);
+bool nic_tx_available(NIC* nic);
 uint32_t nic_tx_size(NIC* nic);
 
+/**
+ * Per-thread queue pairs. The kernel spreads received flows over the pairs by
+ * a symmetric hash of the 5-tuple, so both directions of a flow land in the
+ * same pair. The functions below take no lock: each pair must be used by a
+ * single thread, and pair 0 must not be mixed with nic_rx/nic_rx_burst.
+ * Typically thread thread_id() uses pair thread_id() when there are at least
+ * thread_count() pairs.
+ *
+ * @return number of rx/tx queue pairs
+ */
+uint16_t nic_queue_count(NIC* nic);
+bool nic_has_rx_queue(NIC* nic, uint16_t queue);
+Packet* nic_rx_queue(NIC* nic, uint16_t queue);
+uint32_t nic_rx_queue_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count);
+bool nic_tx_queue(NIC* nic, uint16_t queue, Packet* packet);
+uint32_t nic_tx_queue_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count);	// Frees packets that are not queued
+
+/**
+ * Wait for a received packet instead of spinning on nic_has_rx. The thread
+ * polls for the spin window, then sleeps on the cache line of the rx queue
+ * tail with UMONITOR/UMWAIT (WAITPKG) or MONITORX/MWAITX (AMD); the next
+ * enqueue wakes it. Without either it keeps polling with pause.
+ *
+ * @param timeout TSC cycles to wait, 0 to wait until a packet arrives
+ *
+ * @return true if there is a packet to receive, false on timeout
+ */
+bool nic_wait_rx(NIC* nic, uint64_t timeout);
+bool nic_wait_rx_queue(NIC* nic, uint16_t queue, uint64_t timeout);
+
+/**
+ * Configure nic_wait_rx for all threads of the VM
+ *
+ * @param spin TSC cycles to poll before sleeping (NIC_WAIT_SPIN by default)
+ * @param deep sleep in C0.2 rather than C0.1, which saves more power but wakes slower
+ */
+void nic_wait_config(uint64_t spin, bool deep);
+
 bool nic_stx(NIC* nic, Packet* packet);
 bool nic_try_stx(NIC* nic, Packet* packet);
 bool nic_stx_dup(NIC* nic, Packet* packet);
 bool nic_has_stx(NIC* nic);
 uint32_t nic_stx_size(NIC* nic);
 
-size_t nic_pool_used(NIC* nic);
+/**
+ * Return every buffer cached by the calling thread to the shared pool.
+ */
+void nic_cache_flush(NIC* nic);
+
+/**
+ * @return false if the calling thread has no cache for the NIC
+ */
+bool nic_cache_stats(NIC* nic, NICCacheStats* stats);
+
+size_t nic_pool_used(NIC* nic);	// Includes buffers kept in thread caches
 size_t nic_pool_free(NIC* nic);
 size_t nic_pool_total(NIC* nic);
 
+/**
+ * Fill the metadata of a frame: header offsets, protocol and a flow hash which
+ * is the same for both directions. Received frames are parsed by the kernel,
+ * so for them this only tests a flag.
+ *
+ * @return packet->meta
+ */
+PacketMeta* nic_parse(Packet* packet);
+
+/**
+ * Prepare a TCP or UDP frame for checksum offload: the L4 checksum is set to
+ * the pseudo header sum and the frame is flagged PACKET_META_CSUM_PARTIAL.
+ * A TCP frame whose payload is larger than mss becomes a PACKET_META_GSO
+ * super-frame. Checksums the device cannot offload are completed at once.
+ *
+ * @param mss TCP payload size of the segments, 0 not to segment
+ * @return false if the frame is not TCP/UDP or the device cannot segment it
+ */
+bool nic_tx_offload(NIC* nic, Packet* packet, uint16_t mss);
+
+/**
+ * Complete the L4 checksum of a PACKET_META_CSUM_PARTIAL frame in software.
+ *
+ * @return false if the frame is not TCP/UDP
+ */
+bool nic_csum_complete(Packet* packet);
+
 int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size);
 void nic_config_free(NIC* nic, uint16_t key);
 int32_t nic_config_key(NIC* nic, char* name);
@@ -153,6 +502,22 @@ uint16_t nic_config_size(NIC* nic, uint16_t key);
 uint32_t nic_config_available(NIC* nic);
 uint32_t nic_config_total(NIC* nic);
 
+/**
+ * Config value resolved once by name: the offset of the value from the NIC,
+ * so it is the same in the VM and the kernel. It is valid until the entry is
+ * freed; 0 means there is no such entry.
+ */
+typedef uint32_t NICConfigHandle;
+
+NICConfigHandle nic_config_handle(NIC* nic, char* name);
+
+/**
+ * @return value of a config entry, without any lookup
+ */
+static inline void* nic_config_get_h(NIC* nic, NICConfigHandle handle) {
+	return (uint8_t*)nic + handle;
+}
+
 /**
  * Initialize NIC memory map
  *
@@ -15,11 +15,37 @@
  * Packet data structure
  */
 
+#define PACKET_META_PARSED		0x01	///< Metadata is filled
+#define PACKET_META_IPV4		0x02	///< l3 is an IPv4 header
+#define PACKET_META_IPV6		0x04	///< l3 is an IPv6 header
+#define PACKET_META_FRAGMENT		0x08	///< IP fragment, l4 is set for the first one only
+#define PACKET_META_VLAN_STRIPPED	0x10	///< VLAN tag was removed and kept in vlan_proto, vlan_tci
+#define PACKET_META_CSUM_VERIFIED	0x20	///< L4 checksum was verified by the device
+#define PACKET_META_CSUM_PARTIAL	0x40	///< L4 checksum holds only the pseudo header sum: completed by the device on tx, trusted on rx
+#define PACKET_META_GSO			0x80	///< TCP super-frame, the device cuts it into gso_size payload segments
+#define PACKET_META_OFFLOAD		(PACKET_META_CSUM_PARTIAL | PACKET_META_GSO)	///< Flags which travel with the frame
+
+/**
+ * Headers found by the rx parser. Offsets are from buffer like start and end,
+ * 0 if the frame has no such header.
+ */
+typedef struct _PacketMeta {
+	uint32_t	hash;		///< Symmetric hash of addresses, protocol and ports, 0 if not IP
+	uint16_t	ether_type;	///< Ether type after VLAN tags
+	uint16_t	l3;		///< Network header offset
+	uint16_t	l4;		///< Transport header offset
+	uint16_t	payload;	///< TCP/UDP payload offset
+	uint8_t		protocol;	///< IP protocol or IPv6 next header
+	uint8_t		flags;		///< PACKET_META_*
+	uint16_t	gso_size;	///< TCP payload size of the segments of a PACKET_META_GSO frame
+} PacketMeta;
+
 /**
  * Packet data structure
  */
 typedef struct _Packet {
-	uint64_t	time;	    ///< epoch timestamp
+	uint64_t	time;	    ///< epoch timestamp, or the latency stamp while latency telemetry is on
+	uint64_t	tx_time;    ///< Earliest departure in TSC cycles (nic_time()) on a paced VNIC, 0 to send at once
 
 	uint16_t	vlan_proto; ///< VLAN Protocol
 	uint16_t	vlan_tci;   ///< VLAN TCI
@@ -29,7 +55,67 @@ typedef struct _Packet {
 	uint16_t	end;	    ///< end offset
 
 	uint16_t	size;	    ///< size of allocated buffer
+	uint16_t	refcount;   ///< Number of owners, nic_free releases the buffer at the last one
+	PacketMeta	meta;	    ///< Parsed headers, valid if meta.flags has PACKET_META_PARSED
+
+	// Frames larger than a buffer are chained segments of the same pool
+	int32_t		next;	    ///< Offset of the next segment from this one, 0 for the last segment
+	uint32_t	total;	    ///< Data size of the whole chain, valid in the first segment of a chain
 	uint8_t		buffer[0];  ///< data buffer
 } Packet;
 
+/**
+ * A segment of packet data
+ */
+typedef struct _PacketIOVec {
+	uint8_t*	base;	///< Start of the data
+	uint32_t	len;	///< Data size
+} PacketIOVec;
+
+/**
+ * @return next segment of the chain, NULL for the last segment
+ */
+static inline Packet* packet_next(Packet* packet) {
+	return packet->next ? (Packet*)((uint8_t*)packet + packet->next) : NULL;
+}
+
+/**
+ * Link segment after last, the last segment of the chain starting at packet.
+ */
+static inline void packet_append(Packet* packet, Packet* last, Packet* segment) {
+	if(!packet->next)
+		packet->total = packet->end - packet->start;
+
+	last->next = (uint8_t*)segment - (uint8_t*)last;
+	segment->next = 0;
+	packet->total += segment->end - segment->start;
+}
+
+/**
+ * @return data size of the packet, all segments included
+ */
+static inline uint32_t packet_len(Packet* packet) {
+	return packet->next ? packet->total : (uint32_t)(packet->end - packet->start);
+}
+
+/**
+ * Describe the segments of packet without copying them.
+ *
+ * @param iov segments to fill
+ * @param count number of entries in iov
+ *
+ * @return number of segments in the chain, which is more than count if iov is too short
+ */
+static inline uint32_t packet_iov(Packet* packet, PacketIOVec* iov, uint32_t count) {
+	uint32_t i = 0;
+	for(; packet; packet = packet_next(packet), i++) {
+		if(i < count) {
+			iov[i].base = packet->buffer + packet->start;
+			iov[i].len = packet->end - packet->start;
+		}
+	}
+
+	return i;
+}
+
 #endif /*__PACKET_H__*/
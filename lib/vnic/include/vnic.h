@@ -4,7 +4,12 @@
 #include "nic.h"
 
 #define _IFNAMSIZ		16
-#define MAX_VNIC_COUNT		8
+#ifndef MAX_VNIC_COUNT
+#define MAX_VNIC_COUNT		256	///< VNICs per NICDevice, may be overridden up to 65535 at build time
+#endif
+#ifndef VNIC_STATS_SLOTS
+#define VNIC_STATS_SLOTS	16	///< Per-core statistics slots, cores beyond share a slot
+#endif
 
 /**
  * @file Virtual NIC
@@ -40,8 +45,63 @@ typedef enum {
 	VNIC_RX_ACCEPT,			///< List of accept MAC addresses to receive
 	VNIC_TX_ACCEPT_ALL,		///< To accept all packets to send
 	VNIC_TX_ACCEPT,			///< List of accept MAC addresses to send
+
+	VNIC_POOL_MODE,			///< Packet pool allocation mode (NICPoolMode)
+	VNIC_RX_QUEUE_MODE,		///< Producer model of rx and slow rx queues (NICQueueMode, default NIC_QUEUE_SP)
+	VNIC_TX_QUEUE_MODE,		///< Producer model of tx and slow tx queues (NICQueueMode, default NIC_QUEUE_MP)
+	VNIC_DOMAIN,			///< VNICs with the same nonzero domain can see each other's NIC memory
+	VNIC_MIRROR,			///< Receive every frame sent or received on the NICDevice
+	VNIC_QUEUE_COUNT,		///< Number of rx/tx queue pairs, flows are spread by RSS (default 1)
+	VNIC_RX_BURST,			///< Bytes accepted at once above the input bandwidth (default 10ms worth)
+	VNIC_TX_BURST,			///< Bytes sent at once above the output bandwidth (default 1ms worth, none when paced)
+	VNIC_TX_MIN_BANDWIDTH,		///< Output bandwidth in bps served before any VNIC borrows (default 0)
+	VNIC_TX_WEIGHT,			///< Share of borrowed output bandwidth within the tx class (default 1)
+	VNIC_TX_CLASS,			///< Output priority class below VNIC_TX_CLASS_COUNT, 0 is served first (default 0)
+	VNIC_LATENCY,			///< Latency telemetry: packets carry TSC stamps into histograms (default 0)
+	VNIC_RX_AQM,			///< Active queue management of the rx queues (VNICAQMMode, default VNIC_AQM_NONE)
+	VNIC_TX_AQM,			///< Active queue management of the tx queues (VNICAQMMode, default VNIC_AQM_NONE)
+	VNIC_AQM_TARGET,		///< Queueing delay in us AQM keeps, the RED minimum threshold (default 5000)
+	VNIC_AQM_INTERVAL,		///< CoDel interval in us, the RED maximum threshold (default 100000)
+	VNIC_AQM_ECN,			///< AQM marks ECN capable packets instead of dropping them (default 1)
+	VNIC_TX_PACING,			///< Send tx packets at their tx_time, one at a time at the output bandwidth (default 0)
+	VNIC_TX_PACING_HORIZON,		///< Latest tx_time ahead of now in us, later packets are dropped (default 1000000)
+	VNIC_OFFLOADS,			///< NIC_OFFLOAD_* of the device, shown to the app in NIC offloads (default 0)
 } VNICAttributes;
 
+#define VNIC_TX_CLASS_COUNT	8	///< Number of output priority classes
+#define VNIC_BUCKET_SHIFT	16	///< Fraction bits of VNICBucket wait
+
+/**
+ * Active queue management of VNIC queues. Packets carry their enqueue time,
+ * the rx queues are judged by the delay of their oldest packet when a packet
+ * arrives and the tx queues by the delay of the packet they send.
+ */
+typedef enum _VNICAQMMode {
+	VNIC_AQM_NONE = 0,	///< Tail drop when the queue is full
+	VNIC_AQM_CODEL,		///< Drop while the delay stays above the target for an interval, at a rate rising with sqrt of drops
+	VNIC_AQM_RED,		///< Drop with a probability rising with the average delay between the thresholds
+} VNICAQMMode;
+
+#define VNIC_AQM_TARGET_MAX	1000000	///< Longest target and interval in us, delays are 32 bits of TSC
+#define VNIC_AQM_TARGET_DEFAULT	5000	///< Default target in us
+#define VNIC_AQM_INTERVAL_DEFAULT	100000	///< Default interval in us
+#define VNIC_AQM_RED_SHIFT	9	///< RED averages delays with weight 1 / 2^shift
+#define VNIC_AQM_RED_MAX_P	6554	///< RED drop probability at the maximum threshold in 1/65536 (10%)
+
+/**
+ * AQM state of a queue
+ */
+typedef struct _VNICAQM {
+	uint64_t	first_above;		///< CoDel: time the delay will have been above the target for an interval, 0 if below
+	uint64_t	drop_next;		///< CoDel: time of the next drop while dropping
+	uint32_t	count;			///< CoDel: drops since dropping started, RED: packets since the last drop
+	uint32_t	last_count;		///< CoDel: count when dropping last started
+	bool		dropping;		///< CoDel: in the dropping state
+	uint64_t	average;		///< RED: average delay in timer ticks << VNIC_AQM_RED_SHIFT
+	uint32_t	random;			///< RED: random state, 0 until seeded from the VNIC's aqm_random
+	volatile uint8_t lock;			///< Held by the core judging a packet, rx queues are fed by every device queue
+} VNICAQM;
+
 /**
  * VNIC Error Codes
  */
@@ -59,6 +119,81 @@ typedef enum _VNICError {
 	VNIC_ERROR_UNSUPPORTED,		    ///<Unsupported operation were requested
 } VNICError;
 
+/**
+ * Token bucket kept as a virtual clock (GCRA). Sending bytes moves closed
+ * ahead by their transmission time, and the bucket conforms while closed is
+ * at most burst ahead of now.
+ */
+typedef struct _VNICBucket {
+	uint64_t	wait;			///< Timer ticks per byte << VNIC_BUCKET_SHIFT, 0 for no limit
+	uint64_t	burst;			///< Burst size in timer ticks
+	uint64_t	closed;			///< Time the bucket is drained at
+} VNICBucket;
+
+#define VNIC_TX_PACING_SIZE	256	///< Packets a paced VNIC holds until their tx_time
+#define VNIC_TX_PACING_SLACK	1514	///< Bytes a late paced VNIC may send back to back to catch up
+#define VNIC_TX_PACING_HORIZON_DEFAULT	1000000	///< Default pacing horizon in us
+
+/**
+ * Packet a paced VNIC holds until its departure time
+ */
+typedef struct _VNICPacing {
+	uint64_t	time;			///< Departure time in timer ticks
+	Packet*		packet;			///< Packet
+	uint32_t	seq;			///< Order of packets with the same departure time
+} VNICPacing;
+
+/**
+ * Reasons a VNIC drops packets
+ */
+typedef enum _VNICDropReason {
+	VNIC_DROP_RX_BANDWIDTH,		///< Input bandwidth exceeded
+	VNIC_DROP_RX_QUEUE_FULL,	///< Rx queue of the VM was full
+	VNIC_DROP_RX_NO_BUFFER,		///< No packet buffer left in the pool
+	VNIC_DROP_TX_REJECTED,		///< The driver did not take the packet
+	VNIC_DROP_RX_AQM,		///< Rx queue delay was above the AQM target
+	VNIC_DROP_TX_AQM,		///< Tx queue delay was above the AQM target
+	VNIC_DROP_TX_HORIZON,		///< Tx time was beyond the pacing horizon
+	VNIC_DROP_REASON_COUNT,
+} VNICDropReason;
+
+/**
+ * VNIC statistics
+ */
+typedef struct _VNICStats {
+	uint64_t	input_bytes;		///< Total input bytes
+	uint64_t	input_packets;		///< Total input packets
+	uint64_t	input_drop_bytes;	///< Total dropped input bytes
+	uint64_t	input_drop_packets;	///< Total dropped input packets
+	uint64_t	output_bytes;		///< Total output bytes
+	uint64_t	output_packets;		///< Total output packets
+	uint64_t	output_drop_bytes;	///< Total dropped output bytes
+	uint64_t	output_drop_packets;	///< Total dropped output packets
+	uint64_t	drops[VNIC_DROP_REASON_COUNT];	///< Dropped packets by VNICDropReason
+	uint64_t	input_marked_packets;	///< Input packets AQM marked Congestion Experienced
+	uint64_t	output_marked_packets;	///< Output packets AQM marked Congestion Experienced
+} VNICStats;
+
+/**
+ * Latency percentiles of one NICLatencyStage in ns, upper bounds of the
+ * histogram buckets
+ */
+typedef struct _VNICLatency {
+	uint64_t	count;			///< Samples counted
+	uint64_t	p50;			///< Median
+	uint64_t	p99;			///< 99th percentile
+	uint64_t	p999;			///< 99.9th percentile
+} VNICLatency;
+
+/**
+ * Statistics of one core. Only the owning core writes the slot, so updates
+ * need no atomics; the sequence is odd while an update is in progress.
+ */
+typedef struct _VNICStatsSlot {
+	volatile uint32_t	sequence;	///< Incremented before and after every update
+	VNICStats		stats;
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) VNICStatsSlot;
+
 /**
  * Virtual NIC
  */
@@ -77,22 +212,18 @@ typedef struct _VNIC {
 	uint16_t	vlan_proto; 		///< VLAN Protocol
 	uint16_t	vlan_tci;   		///< VLAN TCI
 	uint16_t	budget;			///< Polling limit
+	uint32_t	domain;			///< Memory domain, packets are shared instead of copied within a domain
+	bool		mirror;			///< Mirror (SPAN) port of the parent NICDevice
+	bool		tx_ready;		///< Queued on the tx ready list of the parent NICDevice
+	bool		latency;		///< Latency telemetry is on (VNIC_LATENCY)
 
-	// Buffers
+	// Buffers (copies of NIC queue geometry; indices are only valid in NIC)
 	NICQueue	rx;			///< Rx queue
 	NICQueue	tx;			///< Tx queue
 	NICQueue	srx;			///< Rx Queue for slowpath
 	NICQueue	stx;			///< Tx Queue for slowpath
-
-	// Statistics
-	uint64_t	input_bytes;		///< Total input bytes
-	uint64_t	input_packets;		///< Total input packets
-	uint64_t	input_drop_bytes;	///< Total dropped input bytes
-	uint64_t	input_drop_packets;	///< Total dropped input packets
-	uint64_t	output_bytes;		///< Total output bytes
-	uint64_t	output_packets;		///< Total output packets
-	uint64_t	output_drop_bytes;	///< Total dropped output bytes
-	uint64_t	output_drop_packets;	///< Total dropped output packets
+	uint16_t	queue_count;		///< Number of rx/tx queue pairs
+	uint16_t	tx_queue;		///< Queue pair to transmit from next
 
 	uint16_t	padding_head;		///< Leading padding of packet buffer
 	uint16_t	padding_tail;		///< Trailing padding of packet buffer
@@ -100,12 +231,47 @@ typedef struct _VNIC {
 	// Constraint
 	uint64_t	rx_bandwidth;		///< Rx threshold
 	uint64_t	tx_bandwidth;		///< Tx threshold
-	uint64_t	rx_wait;		///< Amount of time to wait to adjust the rx bandwidth
-	uint64_t	rx_wait_grace;		///< Amount of time to wait to adjust the rx bandwidth gracefully
-	uint64_t	tx_wait;		///< Amount of time to wait to adjust the tx bandwidth
-	uint64_t	tx_wait_grace;		///< Amount of time to wait to adjust the tx bandwidth gracefully
-	uint64_t	rx_closed;		///< The next receivable frequency
-	uint64_t	tx_closed;		///< The next transmittable frequency
+	uint64_t	tx_min_bandwidth;	///< Guaranteed tx bandwidth
+	uint32_t	rx_burst;		///< Rx burst size in bytes
+	uint32_t	tx_burst;		///< Tx burst size in bytes
+	VNICBucket	rx_bucket;		///< Rx bandwidth, charged by every core receiving for the VNIC
+	VNICBucket	tx_bucket;		///< Tx bandwidth
+	VNICBucket	tx_min_bucket;		///< Guaranteed tx bandwidth
+
+	// Tx scheduling (owned by the parent NICDevice)
+	uint8_t		tx_class;		///< Priority class
+	uint8_t		tx_ready_class;		///< Class of the ready list the VNIC is on
+	uint16_t	tx_weight;		///< DRR weight within the class
+	int32_t		tx_deficit;		///< DRR deficit in bytes
+	uint64_t	tx_ready_time;		///< Time the VNIC started waiting for a turn
+	struct _VNIC*	tx_next;		///< Next VNIC on the ready list
+	bool		tx_waiting;		///< Paced VNIC waiting for tx_wait_time instead of being on a ready list
+	uint16_t	tx_wait_index;		///< Index in the pacing timer of the parent NICDevice
+	uint64_t	tx_wait_time;		///< Time the VNIC goes back to its ready list
+	uint16_t	tx_dev_queue;		///< Tx queue of the parent NICDevice serving the VNIC
+
+	// Tx pacing
+	bool		tx_pacing;		///< Packets leave at their tx_time, spaced at the output bandwidth (VNIC_TX_PACING)
+	uint16_t	tx_pacing_count;	///< Packets in tx_pacings
+	uint32_t	tx_pacing_seq;		///< Sequence number of the next held packet
+	uint32_t	tx_pacing_horizon;	///< Latest tx_time ahead of now in us
+	uint64_t	tx_pacing_horizon_ticks;	///< Latest tx_time ahead of now in timer ticks
+	VNICPacing	tx_pacings[VNIC_TX_PACING_SIZE];	///< Packets waiting for their tx_time, min-heap by time
+
+	// Active queue management
+	uint8_t		rx_aqm;			///< VNICAQMMode of the rx queues
+	uint8_t		tx_aqm;			///< VNICAQMMode of the tx queues
+	bool		aqm_ecn;		///< Mark ECN capable packets instead of dropping them
+	uint32_t	aqm_target;		///< Target delay in us
+	uint32_t	aqm_interval;		///< Interval in us
+	uint64_t	aqm_target_ticks;	///< Target delay in timer ticks
+	uint64_t	aqm_interval_ticks;	///< Interval in timer ticks
+	uint32_t	aqm_random;		///< RED random seed
+	VNICAQM		rx_aqms[NIC_MAX_QUEUE_COUNT];	///< State of the rx queue of each queue pair
+	VNICAQM		tx_aqms[NIC_MAX_QUEUE_COUNT];	///< State of the tx queue of each queue pair
+
+	// Statistics (read with vnic_stats())
+	VNICStatsSlot	stats[VNIC_STATS_SLOTS];	///< Per-core counters
 } VNIC;
 
 /**
@@ -115,6 +281,77 @@ typedef struct _VNIC {
  */
 void vnic__init_timer(uint64_t freq_per_sec);
 
+/**
+ * Initialize the core ID source that selects the statistics slot of the caller
+ *
+ * @param core_id returns the ID of the calling core, slot 0 is used until it is set
+ */
+void vnic__init_core(uint32_t (*core_id)());
+
+/**
+ * @return current time in timer ticks, the time unit of VNICBucket
+ */
+static inline uint64_t vnic_time() {
+	uint64_t t;
+	uint32_t* p = (uint32_t*)&t;
+	asm volatile("rdtsc" : "=a"(p[0]), "=d"(p[1]));
+	return t;
+}
+
+/**
+ * Set the rate of a token bucket and fill it
+ *
+ * @param bucket token bucket
+ * @param bandwidth bandwidth in bps, 0 for no limit
+ * @param burst burst size in bytes
+ */
+void vnic_bucket_init(VNICBucket* bucket, uint64_t bandwidth, uint64_t burst);
+
+/**
+ * @param bucket token bucket
+ * @param time current time
+ *
+ * @return true if a packet may be sent now
+ */
+static inline bool vnic_bucket_conforms(VNICBucket* bucket, uint64_t time) {
+	return bucket->closed <= time + bucket->burst;
+}
+
+/**
+ * Take the transmission time of bytes from a token bucket
+ *
+ * @param bucket token bucket
+ * @param time current time
+ * @param bytes bytes sent
+ */
+static inline void vnic_bucket_charge(VNICBucket* bucket, uint64_t time, uint64_t bytes) {
+	uint64_t cost = (bucket->wait * bytes) >> VNIC_BUCKET_SHIFT;
+	bucket->closed = (bucket->closed > time ? bucket->closed : time) + cost;
+}
+
+/**
+ * Take the transmission time of bytes from a token bucket which several cores
+ * charge at once. A bucket without a limit is not written.
+ *
+ * @param bucket token bucket
+ * @param time current time
+ * @param bytes bytes sent
+ */
+static inline void vnic_bucket_charge_shared(VNICBucket* bucket, uint64_t time, uint64_t bytes) {
+	if(!bucket->wait)
+		return;
+
+	uint64_t cost = (bucket->wait * bytes) >> VNIC_BUCKET_SHIFT;
+	uint64_t closed = bucket->closed;
+	for(;;) {
+		uint64_t seen = __sync_val_compare_and_swap(&bucket->closed, closed, (closed > time ? closed : time) + cost);
+		if(seen == closed)
+			break;
+
+		closed = seen;
+	}
+}
+
 /**
  * Initialize VNIC
  *
@@ -149,6 +386,19 @@ void vnic_free_id(int id);
  */
 Packet* vnic_alloc(VNIC* vnic, size_t size);
 
+/**
+ * Allocate packet buffers in bulk. The pool lock is taken once for the whole
+ * burst, so drivers refilling receive rings should prefer this to vnic_alloc.
+ *
+ * @param vnic Virtual NIC
+ * @param size buffer size of each packet
+ * @param packets array to store the newly created packets
+ * @param count number of packets to allocate
+ *
+ * @return number of packets allocated (leading entries of packets)
+ */
+uint32_t vnic_alloc_burst(VNIC* vnic, size_t size, Packet** packets, uint32_t count);
+
 /**
  * Free packet buffer
  *
@@ -158,7 +408,26 @@ Packet* vnic_alloc(VNIC* vnic, size_t size);
 bool vnic_free(VNIC* vnic, Packet* packet);
 
 /**
- * Update the attributes of the VNIC
+ * Copy a chained packet into one buffer, for drivers which take contiguous
+ * frames only. The chain is freed once it is copied.
+ *
+ * @param vnic Virtual NIC whose pool the buffer is allocated from
+ * @param packet packet
+ *
+ * @return packet itself if it is not chained, NULL if no buffer is large enough
+ */
+Packet* vnic_linearize(VNIC* vnic, Packet* packet);
+
+/**
+ * Update the attributes of the VNIC. Bandwidths, bursts, tx scheduling,
+ * budget, padding, queue sizes, latency telemetry and AQM can be changed at runtime; nothing is
+ * changed if any attribute is invalid or unsupported. AQM of a queue starts
+ * over when its mode changes.
+ *
+ * A queue resize completes asynchronously: the rings swap once the packets
+ * in flight drained, and pushes fail until then. Rings larger than the ones
+ * laid out by vnic_init are allocated from the pool. The pool size cannot
+ * change, VNIC_POOL_SIZE is only accepted with the current size.
  *
  * @param nic Virtual NIC
  * @param attrs attributes used to update the VNIC.
@@ -167,6 +436,37 @@ bool vnic_free(VNIC* vnic, Packet* packet);
  */
 VNICError vnic_update(VNIC* nic, uint64_t* attrs);
 
+/**
+ * Check attributes the way vnic_update does without changing anything, so
+ * several VNICs can be checked before any of them is updated. Pool memory
+ * for grown rings is not reserved, vnic_update can still fail with
+ * VNIC_ERROR_NO_MEMORY.
+ *
+ * @param nic Virtual NIC
+ * @param attrs attributes to check
+ *
+ * @return VNIC_ERROR_NOERROR if vnic_update would accept the attributes, error number otherwise
+ */
+VNICError vnic_update_check(VNIC* nic, uint64_t* attrs);
+
+/**
+ * Sum the per-core statistics of the VNIC. Every slot is copied as a whole,
+ * so packets and bytes of a counter always agree.
+ *
+ * @param vnic Virtual NIC
+ * @param stats filled with the totals
+ */
+void vnic_stats(VNIC* vnic, VNICStats* stats);
+
+/**
+ * Read the latency histograms of the VNIC. Samples are counted while
+ * VNIC_LATENCY is on and start over when it is turned on again.
+ *
+ * @param vnic Virtual NIC
+ * @param latency array of NIC_LATENCY_STAGE_COUNT, filled by NICLatencyStage
+ */
+void vnic_latency(VNIC* vnic, VNICLatency* latency);
+
 // Fastpath Rx/Tx
 /**
  * Check if there is received data
@@ -202,6 +502,17 @@ VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t
  */
 VNICError vnic_rx2(VNIC* vnic, Packet* packet);
 
+/**
+ * Receive Packets with one queue release
+ *
+ * @param vnic Virtual NIC
+ * @param packets packets, owned by the VNIC afterwards
+ * @param count number of packets
+ *
+ * @return number of packets queued. The rest are freed and counted as dropped
+ */
+uint32_t vnic_rx_burst(VNIC* vnic, Packet** packets, uint32_t count);
+
 /**
  * Check if there is data available for transmission.
  *
@@ -212,7 +523,19 @@ VNICError vnic_rx2(VNIC* vnic, Packet* packet);
 bool vnic_has_tx(VNIC* vnic);
 
 /**
- * Sends queued packets
+ * Time a paced VNIC may send its next packet, that is when its output
+ * bandwidth allows and the first held packet is due, or at once while its tx
+ * queues have packets the VNIC has not looked at.
+ *
+ * @param vnic Virtual NIC with packets to send
+ *
+ * @return timer ticks, at most now if the VNIC may send now
+ */
+uint64_t vnic_tx_time(VNIC* vnic);
+
+/**
+ * Sends queued packets. A paced VNIC sends a packet only when its tx_time
+ * has come and its output bandwidth allows, packets due later are held.
  *
  * @param vnic Virtual NIC
  * @param transmitter Driver function that transmit packets
@@ -223,6 +546,19 @@ bool vnic_has_tx(VNIC* vnic);
  */
 VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context);
 
+/**
+ * Sends up to count queued packets with one queue release and one transmitter call
+ *
+ * @param vnic Virtual NIC
+ * @param transmitter Driver function that transmits the leading packets of a burst
+ * and returns how many it took. The remaining packets are freed and counted as dropped
+ * @param transmitter_context Driver function context
+ * @param count maximum number of packets
+ *
+ * @return number of packets dequeued
+ */
+uint32_t vnic_tx_burst(VNIC* vnic, uint32_t (*transmitter)(Packet**, uint32_t, void*), void* transmitter_context, uint32_t count);
+
 // Slowpath Rx/Tx
 /**
  * Check if there is received slowpath data
@@ -6,18 +6,153 @@
 NIC* __nics[NIC_MAX_COUNT];
 int __nic_count;
 
-NIC* nic_find_by_packet(Packet* packet) {
-	NIC* nic = (void*)((uintptr_t)packet & ~(uintptr_t)(0x200000 - 1)); // 2MB alignment
-	for(int i = 0; i < NIC_MAX_SIZE / 0x200000  - 1 && (uintptr_t)nic > 0; i++) {
+/**
+ * Region table of the NICs in this address space, hashed by (address >> 21).
+ * Writers serialize on the lock; readers only follow probe chains, which
+ * removal keeps intact by leaving a tombstone.
+ */
+#define NIC_REGION_EMPTY	0		// Region 0 never holds a NIC (nic_init rejects base 0)
+#define NIC_REGION_REMOVED	UINTPTR_MAX
+
+typedef struct _NICRegion {
+	volatile uintptr_t	region;	///< address >> 21, NIC_REGION_EMPTY or NIC_REGION_REMOVED
+	NIC* volatile		nic;
+} NICRegion;
+
+static NICRegion __nic_regions[NIC_REGION_COUNT];
+static volatile uint8_t __nic_regions_lock;
+#ifdef NIC_REGION_DEBUG
+static uint64_t __nic_region_errors;
+#endif
+
+static inline uint32_t nic_region_hash(uintptr_t region) {
+	return (uint32_t)(((uint64_t)region * 0x9e3779b97f4a7c15ULL) >> 32) & (NIC_REGION_COUNT - 1);
+}
+
+static inline NIC* nic_region_find(const void* addr) {
+	uintptr_t region = (uintptr_t)addr >> 21;
+	uint32_t index = nic_region_hash(region);
+	for(uint32_t i = 0; i < NIC_REGION_COUNT; i++) {
+		NICRegion* entry = &__nic_regions[index];
+		if(entry->region == region)
+			return entry->nic;
+		if(entry->region == NIC_REGION_EMPTY)
+			return NULL;
+
+		index = (index + 1) & (NIC_REGION_COUNT - 1);
+	}
+
+	return NULL;
+}
+
+static inline uintptr_t nic_region_count(NIC* nic) {
+	return nic->size > NIC_REGION_SIZE ? nic->size / NIC_REGION_SIZE : 1;
+}
+
+bool nic_region_add(NIC* nic) {
+	uintptr_t first = (uintptr_t)nic >> 21;
+	uintptr_t count = nic_region_count(nic);
+	bool result = true;
+
+	lock_lock(&__nic_regions_lock);
+	for(uintptr_t region = first; region < first + count; region++) {
+		NICRegion* slot = NULL;
+		uint32_t index = nic_region_hash(region);
+		for(uint32_t i = 0; i < NIC_REGION_COUNT; i++) {
+			NICRegion* entry = &__nic_regions[index];
+			if(entry->region == region) {
+				slot = entry;	// Memory of a freed NIC reused
+				break;
+			}
+			if(entry->region == NIC_REGION_REMOVED && !slot)
+				slot = entry;
+			if(entry->region == NIC_REGION_EMPTY) {
+				if(!slot)
+					slot = entry;
+				break;
+			}
+
+			index = (index + 1) & (NIC_REGION_COUNT - 1);
+		}
+
+		if(!slot) {
+			result = false;
+			break;
+		}
+
+		// Readers match the region first, so the NIC must be visible before it
+		slot->nic = nic;
+		__sync_synchronize();
+		slot->region = region;
+	}
+	lock_unlock(&__nic_regions_lock);
+
+	return result;
+}
+
+void nic_region_remove(NIC* nic) {
+	uintptr_t first = (uintptr_t)nic >> 21;
+	uintptr_t count = nic_region_count(nic);
+
+	lock_lock(&__nic_regions_lock);
+	for(uintptr_t region = first; region < first + count; region++) {
+		uint32_t index = nic_region_hash(region);
+		for(uint32_t i = 0; i < NIC_REGION_COUNT; i++) {
+			NICRegion* entry = &__nic_regions[index];
+			if(entry->region == region) {
+				if(entry->nic == nic) {
+					entry->region = NIC_REGION_REMOVED;
+					entry->nic = NULL;
+				}
+				break;
+			}
+			if(entry->region == NIC_REGION_EMPTY)
+				break;
+
+			index = (index + 1) & (NIC_REGION_COUNT - 1);
+		}
+	}
+	lock_unlock(&__nic_regions_lock);
+}
+
+// Step back 2MB at a time until the NIC magic header shows up
+static NIC* nic_find_by_magic(Packet* packet) {
+	NIC* nic = (void*)((uintptr_t)packet & ~(uintptr_t)(NIC_REGION_SIZE - 1)); // 2MB alignment
+	for(int i = 0; i < NIC_MAX_SIZE / NIC_REGION_SIZE  - 1 && (uintptr_t)nic > 0; i++) {
 		if(nic->magic == NIC_MAGIC_HEADER)
 			return nic;
 
-		nic = (void*)nic - 0x200000;
+		nic = (void*)nic - NIC_REGION_SIZE;
 	}
 
 	return NULL;
 }
 
+NIC* nic_find_by_packet(Packet* packet) {
+	NIC* nic = nic_region_find(packet);
+#ifdef NIC_REGION_DEBUG
+	if(nic && (nic->magic != NIC_MAGIC_HEADER || nic != nic_find_by_magic(packet))) {
+		__sync_fetch_and_add(&__nic_region_errors, 1);
+		nic = NULL;	// Re-register from the magic header below
+	}
+#endif
+	if(nic)
+		return nic;
+
+	// Not registered in this address space yet, e.g. a NIC the kernel mapped into the VM
+	nic = nic_find_by_magic(packet);
+	if(nic)
+		nic_region_add(nic);
+
+	return nic;
+}
+
+#ifdef NIC_REGION_DEBUG
+uint64_t nic_region_errors() {
+	return __nic_region_errors;
+}
+#endif
+
 int nic_count() {
 	return __nic_count;
 }
@@ -37,1641 +172,4216 @@ NIC* nic_get_by_id(uint32_t id) {
 	return nic;
 }
 
-Packet* nic_alloc(NIC* nic, uint16_t size) {
-	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
-	uint32_t count = nic->pool.count;
-	void* pool = (void*)nic + nic->pool.pool;
+/**
+ * Thread cache (magazine) of free buffers per size class. Bitmap pools have
+ * no classes: each slot keeps runs of one chunk count instead, and buffers
+ * parked in it stay marked in the bitmap.
+ * The loader gives every VM thread its own data segment, and the kernel data
+ * is per core, so each VM thread and each kernel core owns its caches and the
+ * alloc/free fast path never touches a shared line. A slot is keyed by the
+ * NIC's address and owned by one NIC at a time; the kernel must flush every
+ * core's cache of a NIC (nic_cache_flush) before it frees the NIC.
+ */
+typedef struct _NICCache {
+	NIC*		nic;
+	uint32_t	count[NIC_POOL_CLASS_COUNT];
+	uint32_t	indices[NIC_POOL_CLASS_COUNT][NIC_CACHE_SIZE];	// Buffer indices, first chunks of runs in bitmap pools
+	uint8_t		chunks[NIC_POOL_CLASS_COUNT];	// Chunks per run of a slot (bitmap pools)
+	NICCacheStats	stats;
+} NICCache;
+
+static NICCache __nic_caches[NIC_MAX_COUNT];
+
+static inline NICCache* cache_slot(NIC* nic) {
+	// NICs are 2MB blocks
+	return &__nic_caches[((uintptr_t)nic >> 21) % NIC_MAX_COUNT];
+}
 
-	uint32_t size2 = sizeof(Packet) + nic->padding_head + size + nic->padding_tail;
-	uint8_t req = (ROUNDUP(size2, NIC_CHUNK_SIZE)) / NIC_CHUNK_SIZE;
-	uint32_t index = nic->pool.index;
+static int pool_class_find(NIC* nic, uint32_t offset) {
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++) {
+		NICPoolClass* class = &nic->pool.classes[i];
+		if(offset >= class->base && offset < class->base + class->count * class->size)
+			return i;
+	}
 
-	lock_lock(&nic->pool.lock);
+	return -1;
+}
 
-	// Find tail
-	uint32_t idx = 0;
-	for(idx = index; idx <= count - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			if(bitmap[idx + j] == 0) {
-				continue;
-			} else {
-				idx += j + bitmap[idx + j];
-				goto next;
-			}
-		}
+static uint32_t pool_class_pop(NIC* nic, int index, uint32_t* indices, uint32_t count) {
+	NICPool* pool = &nic->pool;
+	NICPoolClass* class = &pool->classes[index];
+	uint32_t* stack = (void*)nic + class->stack;
+
+	lock_lock(&pool->lock);
+	if(count > class->top)
+		count = class->top;
+
+	for(uint32_t i = 0; i < count; i++)
+		indices[i] = stack[--class->top];
+
+	pool->used += count * (class->size / NIC_CHUNK_SIZE);
+	lock_unlock(&pool->lock);
+
+	return count;
+}
+
+static void pool_class_push(NIC* nic, int index, uint32_t* indices, uint32_t count) {
+	NICPool* pool = &nic->pool;
+	NICPoolClass* class = &pool->classes[index];
+	uint32_t* stack = (void*)nic + class->stack;
+
+	lock_lock(&pool->lock);
+	for(uint32_t i = 0; i < count; i++)
+		stack[class->top++] = indices[i];
+
+	pool->used -= count * (class->size / NIC_CHUNK_SIZE);
+	lock_unlock(&pool->lock);
+}
+
+// Take runs of req chunks from a bitmap pool, first fit after the last allocation
+static uint32_t pool_bitmap_pop(NIC* nic, uint8_t req, uint32_t* indices, uint32_t count) {
+	NICPool* pool = &nic->pool;
+	uint8_t* bitmap = (void*)nic + pool->bitmap;
+
+	lock_lock(&pool->lock);
+	uint32_t i;
+	for(i = 0; i < count; i++) {
+		uint32_t idx = nic_pool_bitmap_find(bitmap, pool->count, pool->index, pool->count, req);
+		if(idx == (uint32_t)-1)
+			idx = nic_pool_bitmap_find(bitmap, pool->count, 0, pool->index, req);
+		if(idx == (uint32_t)-1)
+			break;
 
-		goto found;
-next:
-		;
+		for(uint32_t k = 0; k < req; k++)
+			bitmap[idx + k] = req - k;
+
+		pool->index = idx + req;
+		indices[i] = idx;
 	}
 
-	// Find head
-	for(idx = 0; idx < index - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			if(bitmap[idx + j] == 0) {
-				continue;
-			} else {
-				idx += j + bitmap[idx + j];
-				goto notfound;
-			}
-		}
+	pool->used += i * req;
+	lock_unlock(&pool->lock);
+
+	return i;
+}
+
+// Give runs of req chunks back to a bitmap pool
+static void pool_bitmap_push(NIC* nic, uint8_t req, uint32_t* indices, uint32_t count) {
+	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
 
-		goto found;
+	for(uint32_t i = 0; i < count; i++) {
+		for(uint32_t k = req - 1; k > 0; k--)
+			bitmap[indices[i] + k] = 0;
+		bitmap[indices[i]] = 0;
 	}
 
-notfound:
-	// Not found
-	lock_unlock(&nic->pool.lock);
-	return NULL;
+	__sync_fetch_and_sub(&nic->pool.used, count * req);
+}
+
+static void cache_push(NICCache* cache, int index, uint32_t* indices, uint32_t count) {
+	if(cache->nic->pool.mode == NIC_POOL_CLASS)
+		pool_class_push(cache->nic, index, indices, count);
+	else
+		pool_bitmap_push(cache->nic, cache->chunks[index], indices, count);
+}
+
+static void cache_flush(NICCache* cache) {
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++) {
+		if(!cache->count[i])
+			continue;
 
-found:
-	nic->pool.index = idx + req;
-	for(uint32_t k = 0; k < req; k++) {
-		bitmap[idx + k] = req - k;
+		cache_push(cache, i, cache->indices[i], cache->count[i]);
+		cache->count[i] = 0;
+		cache->stats.flushes++;
 	}
+}
+
+static NICCache* cache_get(NIC* nic) {
+	NICCache* cache = cache_slot(nic);
+	if(cache->nic != nic) {
+		// Slot collision with another NIC: give its buffers back
+		if(cache->nic)
+			cache_flush(cache);
 
-	nic->pool.used += req;
+		memset(cache, 0, sizeof(NICCache));
+		cache->nic = nic;
+	}
 
-	lock_unlock(&nic->pool.lock);
+	return cache;
+}
 
-	Packet* packet = pool + (idx * NIC_CHUNK_SIZE);
+static Packet* buffer_init(Packet* packet, uint32_t size) {
 	packet->time = 0;
+	packet->tx_time = 0;
 	packet->start = 0;
 	packet->end = 0;
-	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+	packet->size = size - sizeof(Packet);
+	packet->refcount = 1;
+	packet->meta.flags = 0;
+	packet->next = 0;
 
 	return packet;
 }
 
-bool nic_free(Packet* packet) {
-	NIC* nic = nic_find_by_packet(packet);
-	if(nic == NULL)
-		return false;
+// Park a freed buffer in slot index of the cache, the oldest half goes back to the pool when it is full
+static void cache_free(NICCache* cache, int index, uint32_t idx) {
+	if(cache->count[index] == NIC_CACHE_SIZE) {
+		cache_push(cache, index, cache->indices[index], NIC_CACHE_BULK);
+		memmove(cache->indices[index], cache->indices[index] + NIC_CACHE_BULK, (NIC_CACHE_SIZE - NIC_CACHE_BULK) * sizeof(uint32_t));
+		cache->count[index] -= NIC_CACHE_BULK;
+		cache->stats.flushes++;
+	}
 
-	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
-	uint32_t count = nic->pool.count;
-	void* pool = (void*)nic + nic->pool.pool;
+	cache->indices[index][cache->count[index]++] = idx;
+}
 
-	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool) / NIC_CHUNK_SIZE;
-	if(idx >= count)
-		return false;
+static Packet* pool_class_alloc(NIC* nic, uint32_t packet_size) {
+	NICCache* cache = cache_get(nic);
+	cache->stats.allocs++;
 
-	uint8_t req = bitmap[idx];
-	if(idx + req > count)
-		return false;
+	// Smallest class which fits the packet, larger classes when it is exhausted
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++) {
+		NICPoolClass* class = &nic->pool.classes[i];
+		if(class->size < packet_size)
+			continue;
 
-	for(uint32_t i = idx + req - 1; i > idx; i--) {
-		bitmap[i] = 0;
-	}
-	bitmap[idx] = 0;	// if idx is zero, it for loop will never end
+		if(cache->count[i]) {
+			cache->stats.alloc_hits++;
+		} else {
+			cache->count[i] = pool_class_pop(nic, i, cache->indices[i], NIC_CACHE_BULK);
+			if(!cache->count[i])
+				continue;
+
+			cache->stats.refills++;
+		}
 
-	lock_lock(&nic->pool.lock);
-	nic->pool.used -= req;
-	lock_unlock(&nic->pool.lock);
+		uint32_t idx = cache->indices[i][--cache->count[i]];
 
-	return true;
+		return buffer_init((void*)nic + class->base + idx * class->size, class->size);
+	}
+
+	return NULL;
 }
 
-bool queue_push(NIC* nic, NICQueue* queue, Packet* packet) {
-	NIC* nic2 = nic_find_by_packet(packet);
-	if(nic2 == NULL)
+static bool pool_class_free(NIC* nic, Packet* packet) {
+	uint32_t offset = (uintptr_t)packet - (uintptr_t)nic;
+	int i = pool_class_find(nic, offset);
+	if(i < 0)
 		return false;
 
-	uint64_t* array = (void*)nic + queue->base;
-	uint32_t next = (queue->tail + 1) % queue->size;
-	if(queue->head != next) {
-		array[queue->tail] = ((uint64_t)nic2->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic2);
-		queue->tail = next;
+	NICPoolClass* class = &nic->pool.classes[i];
+	if((offset - class->base) % class->size)
+		return false;
 
-		return true;
-	} else {
+	// A free buffer has no owner: a second free would put its index in the stacks twice
+	if(!packet->refcount)
 		return false;
-	}
+	packet->refcount = 0;
+
+	NICCache* cache = cache_get(nic);
+	cache->stats.frees++;
+	cache_free(cache, i, (offset - class->base) / class->size);
+
+	return true;
 }
 
-void* queue_pop(NIC* nic, NICQueue* queue) {
-	uint64_t* array = (void*)nic + queue->base;
+// Slot of the cache keeping runs of req chunks. An empty slot is taken over; -1 if every slot keeps runs of other sizes
+static int cache_run_slot(NICCache* cache, uint8_t req) {
+	int empty = -1;
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++) {
+		if(cache->chunks[i] == req)
+			return i;
 
-	if(queue->head != queue->tail) {
-		uint64_t tmp = array[queue->head];
-		uint32_t id = (uint32_t)(tmp >> 32);
-		uint32_t data = (uint32_t)tmp;
+		if(empty < 0 && !cache->count[i])
+			empty = i;
+	}
 
-		array[queue->head] = 0;
+	if(empty >= 0)
+		cache->chunks[empty] = req;
 
-		queue->head = (queue->head + 1) % queue->size;
+	return empty;
+}
 
+static Packet* pool_bitmap_alloc(NIC* nic, uint32_t packet_size) {
+	if(packet_size > UINT8_MAX * NIC_CHUNK_SIZE)
+		return NULL;	// Longer than the bitmap can record, use a chain
 
-		if(nic->id == id) {
-			return (void*)nic + data;
+	uint8_t req = ROUNDUP(packet_size, NIC_CHUNK_SIZE) / NIC_CHUNK_SIZE;
+	NICCache* cache = cache_get(nic);
+	cache->stats.allocs++;
+
+	uint32_t idx;
+	int i = cache_run_slot(cache, req);
+	if(i < 0) {
+		if(!pool_bitmap_pop(nic, req, &idx, 1))
+			return NULL;
+	} else {
+		if(cache->count[i]) {
+			cache->stats.alloc_hits++;
 		} else {
-			nic = nic_get_by_id(id);
-			if(nic != NULL)
-				return (void*)nic + data;
-			else
-				return NULL;
+			cache->count[i] = pool_bitmap_pop(nic, req, cache->indices[i], NIC_CACHE_BULK);
+			if(!cache->count[i]) {
+				// The other slots may keep the chunks this run needs
+				cache_flush(cache);
+				cache->count[i] = pool_bitmap_pop(nic, req, cache->indices[i], NIC_CACHE_BULK);
+				if(!cache->count[i])
+					return NULL;
+			}
+
+			cache->stats.refills++;
 		}
-	} else {
-		return NULL;
+
+		idx = cache->indices[i][--cache->count[i]];
 	}
+
+	return buffer_init((void*)nic + nic->pool.pool + idx * NIC_CHUNK_SIZE, req * NIC_CHUNK_SIZE);
 }
 
-uint32_t queue_size(NICQueue* queue) {
-	if(queue->tail >= queue->head)
-		return queue->tail - queue->head;
+static bool pool_bitmap_free(NIC* nic, Packet* packet) {
+	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
+	uint32_t count = nic->pool.count;
+	void* pool = (void*)nic + nic->pool.pool;
+
+	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool) / NIC_CHUNK_SIZE;
+	if(idx >= count)
+		return false;
+
+	uint8_t req = bitmap[idx];
+	if(!req || idx + req > count)
+		return false;
+
+	// A free buffer has no owner: a cached one is still marked in the bitmap
+	if(!packet->refcount)
+		return false;
+	packet->refcount = 0;
+
+	NICCache* cache = cache_get(nic);
+	cache->stats.frees++;
+
+	int i = cache_run_slot(cache, req);
+	if(i < 0)
+		pool_bitmap_push(nic, req, &idx, 1);
 	else
-		return queue->size + queue->tail - queue->head;
+		cache_free(cache, i, idx);
+
+	return true;
 }
 
-bool queue_available(NICQueue* queue) {
-	return queue->head != (queue->tail + 1) % queue->size;
+void nic_cache_flush(NIC* nic) {
+	NICCache* cache = cache_slot(nic);
+	if(cache->nic == nic)
+		cache_flush(cache);
 }
 
-bool queue_empty(NICQueue* queue) {
-	return queue->head == queue->tail;
+bool nic_cache_stats(NIC* nic, NICCacheStats* stats) {
+	NICCache* cache = cache_slot(nic);
+	if(cache->nic != nic)
+		return false;
+
+	*stats = cache->stats;
+	return true;
 }
 
-bool nic_has_rx(NIC* nic) {
-	return !queue_empty(&nic->rx);
+Packet* nic_alloc(NIC* nic, uint16_t size) {
+	uint32_t packet_size = sizeof(Packet) + nic->padding_head + size + nic->padding_tail;
+	if(nic->pool.mode == NIC_POOL_CLASS)
+		return pool_class_alloc(nic, packet_size);
+
+	return pool_bitmap_alloc(nic, packet_size);
 }
 
-Packet* nic_rx(NIC* nic) {
-	lock_lock(&nic->rx.rlock);
-	Packet* packet = queue_pop(nic, &nic->rx);
-	lock_unlock(&nic->rx.rlock);
+Packet* nic_ref(Packet* packet) {
+	__sync_fetch_and_add(&packet->refcount, 1);
 
 	return packet;
 }
 
-uint32_t nic_rx_size(NIC* nic) {
-	return queue_size(&nic->rx);
-}
+Packet* nic_alloc_chain(NIC* nic, uint32_t size) {
+	// One buffer if the pool has one that large
+	Packet* packet = NULL;
+	if(size <= UINT16_MAX)
+		packet = nic_alloc(nic, size);
 
-bool nic_has_srx(NIC* nic) {
-	return !queue_empty(&nic->srx);
-}
+	if(packet) {
+		packet->end = packet->start + size;
+		return packet;
+	}
 
-Packet* nic_srx(NIC* nic) {
-	lock_lock(&nic->srx.rlock);
-	Packet* packet = queue_pop(nic, &nic->srx);
-	lock_unlock(&nic->srx.rlock);
+	Packet* last = NULL;
+	while(size) {
+		uint16_t len = size < NIC_SEGMENT_SIZE ? size : NIC_SEGMENT_SIZE;
+		Packet* segment = nic_alloc(nic, len);
+		if(!segment) {
+			if(packet)
+				nic_free(packet);
+			return NULL;
+		}
+
+		segment->end = segment->start + len;
+		if(packet)
+			packet_append(packet, last, segment);
+		else
+			packet = segment;
+
+		last = segment;
+		size -= len;
+	}
 
 	return packet;
 }
 
-uint32_t nic_srx_size(NIC* nic) {
-	return queue_size(&nic->srx);
-}
+void nic_write(Packet* packet, uint32_t offset, const void* data, uint32_t size) {
+	for(; packet && size; packet = packet_next(packet)) {
+		uint32_t len = packet->end - packet->start;
+		if(offset >= len) {
+			offset -= len;
+			continue;
+		}
 
-bool nic_has_tx(NIC* nic) {
-	return !queue_empty(&nic->tx);
+		uint32_t n = len - offset < size ? len - offset : size;
+		memcpy(packet->buffer + packet->start + offset, data, n);
+		data = (const uint8_t*)data + n;
+		size -= n;
+		offset = 0;
+	}
 }
 
-bool nic_tx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
-	if(!queue_push(nic, &nic->tx, packet)) {
-		lock_unlock(&nic->tx.wlock);
+// Whether packet lies in the buffers of the pool of nic
+static inline bool pool_owns(NIC* nic, Packet* packet) {
+	uintptr_t offset = (uintptr_t)packet - (uintptr_t)nic;
 
-		nic_free(packet);
+	return offset >= nic->pool.pool && offset < nic->pool.pool + (uintptr_t)nic->pool.count * NIC_CHUNK_SIZE;
+}
+
+// Return a buffer to the pool, segments of a chain one by one
+static bool nic_free_segment(Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(nic == NULL)
 		return false;
-	} else {
-		lock_unlock(&nic->tx.wlock);
+
+	if(nic->pool.mode == NIC_POOL_CLASS)
+		return pool_class_free(nic, packet);
+
+	return pool_bitmap_free(nic, packet);
+}
+
+bool nic_free(Packet* packet) {
+	// Exclusive packets skip the atomic; of two racing owners exactly one reaches zero
+	if(packet->refcount > 1 && __sync_sub_and_fetch(&packet->refcount, 1) != 0)
 		return true;
+
+	// The segments of a chain belong to its first one
+	bool freed = true;
+	while(packet) {
+		Packet* next = packet_next(packet);
+		freed &= nic_free_segment(packet);
+		packet = next;
 	}
+
+	return freed;
 }
 
-bool nic_try_tx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
-	bool result = queue_push(nic, &nic->tx, packet);
-	lock_unlock(&nic->tx.wlock);
+uint32_t nic_free_burst(Packet** packets, uint32_t count) {
+	NIC* nic = NULL;
+	uint32_t freed = 0;
 
-	return result;
-}
+	for(uint32_t i = 0; i < count; i++) {
+		Packet* packet = packets[i];
+		if(packet->refcount > 1 && __sync_sub_and_fetch(&packet->refcount, 1) != 0) {
+			freed++;
+			continue;
+		}
 
-bool nic_tx_dup(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
-	if(!queue_available(&nic->tx)) {
-		lock_unlock(&nic->tx.wlock);
-		return false;
-	}
+		// The segments of a chain may come from other pools
+		if(packet->next) {
+			bool chain = true;
+			while(packet) {
+				Packet* next = packet_next(packet);
+				chain &= nic_free_segment(packet);
+				packet = next;
+			}
+			freed += chain;
+			continue;
+		}
 
-	int len = packet->end - packet->start;
+		// A burst mostly comes from one pool: the NIC is looked up once per run
+		if(!nic || !pool_owns(nic, packet)) {
+			nic = nic_find_by_packet(packet);
+			if(!nic)
+				continue;
+		}
 
-	Packet* packet2 = nic_alloc(nic, len);
-	if(!packet2) {
-		lock_unlock(&nic->tx.wlock);
-		return false;
+		if(nic->pool.mode == NIC_POOL_CLASS)
+			freed += pool_class_free(nic, packet);
+		else
+			freed += pool_bitmap_free(nic, packet);
 	}
 
-	packet2->time = packet->time;
-	packet2->end = packet2->start + len;
-	memcpy(packet2->buffer + packet2->start, packet->buffer + packet->start, len);
+	return freed;
+}
 
-	if(!queue_push(nic, &nic->tx, packet)) {
-		lock_unlock(&nic->tx.wlock);
+// The producer publishes a slot with a release store of tail after writing
+// it; the consumer frees a slot with a release store of head after reading it.
+#define load_acquire(ptr)		__atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define store_release(ptr, value)	__atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
 
-		nic_free(packet);
-		return false;
-	} else {
-		lock_unlock(&nic->tx.wlock);
-		return true;
-	}
+static inline uint32_t queue_next(NICQueue* queue, uint32_t index) {
+	return index + 1 == queue->size ? 0 : index + 1;
 }
 
-bool nic_tx_available(NIC* nic) {
-	return queue_available(&nic->tx);
+static inline uint32_t queue_free(NICQueue* queue, uint32_t head, uint32_t tail) {
+	return head > tail ? head - tail - 1 : queue->size + head - tail - 1;
 }
 
-uint32_t nic_tx_size(NIC* nic) {
-	return queue_size(&nic->tx);
+static inline uint32_t queue_used(NICQueue* queue, uint32_t head, uint32_t tail) {
+	return tail >= head ? tail - head : queue->size + tail - head;
 }
 
-bool nic_stx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
-	if(!queue_push(nic, &nic->stx, packet)) {
-		lock_unlock(&nic->stx.wlock);
-		nic_free(packet);
+// Most packets are queued to the NIC whose pool they came from; skip the region lookup for those
+static inline NIC* queue_find_nic(NIC* nic, Packet* packet) {
+	if(pool_owns(nic, packet))
+		return nic;
 
-		return false;
+	return nic_find_by_packet(packet);
+}
+
+// Producer side of a resize: stop reserving slots and record where the tail stopped
+static bool queue_close(NICQueue* queue) {
+	if(queue->mode == NIC_QUEUE_MP) {
+		uint64_t reserve;
+		do {
+			reserve = queue->reserve;
+			if(reserve & NIC_QUEUE_CLOSED)
+				return false;
+		} while(!__sync_bool_compare_and_swap(&queue->reserve, reserve, reserve | NIC_QUEUE_CLOSED));
 	} else {
-		lock_unlock(&nic->stx.wlock);
-		return true;
+		store_release(&queue->reserve, NIC_QUEUE_CLOSED | queue->tail);
 	}
-}
 
-bool nic_try_stx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
-	bool result = queue_push(nic, &nic->stx, packet);
-	lock_unlock(&nic->stx.wlock);
+	return false;
+}
 
-	return result;
+// Swap in the next ring once every reserved slot was published and popped
+void queue_swap(NIC* nic, NICQueue* queue) {
+	uint64_t reserve = load_acquire(&queue->reserve);
+	uint32_t head = queue->head;
+	if(!(reserve & NIC_QUEUE_CLOSED) || (uint32_t)reserve != head || load_acquire(&queue->tail) != head)
+		return;
+
+	uint32_t ring = queue->ring;
+	queue->base = queue->next_base;
+	queue->size = queue->next_size;
+	queue->capacity = queue->next_capacity;
+	queue->ring = queue->next_ring;
+	queue->tail = 0;
+	queue->head_cache = 0;
+	queue->head = 0;
+	queue->tail_cache = 0;
+
+	// A new lap count keeps MP producers that read reserve before the swap from reserving
+	store_release(&queue->next_size, 0);
+	store_release(&queue->reserve, (((reserve >> 32) + 1) & NIC_QUEUE_LAP_MASK) << 32);
+
+	if(ring && ring != queue->ring)
+		nic_free((void*)nic + ring);
 }
 
-bool nic_stx_dup(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
-	if(!queue_available(&nic->stx)) {
-		lock_unlock(&nic->stx.wlock);
+bool queue_push(NIC* nic, NICQueue* queue, Packet* packet) {
+	NIC* nic2 = queue_find_nic(nic, packet);
+	if(nic2 == NULL)
 		return false;
+
+	uint64_t value = ((uint64_t)nic2->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic2);
+	uint64_t* array;
+	uint32_t tail, next;
+
+	if(queue->mode == NIC_QUEUE_MP) {
+		// Reserve a slot, fill it, then publish in reservation order.
+		// head is read after reserve; the lap count in the upper half of
+		// reserve makes the CAS fail if the ring wrapped in between.
+		// head_cache is not used: producers would overwrite each other's copy.
+		uint64_t reserve;
+		do {
+			reserve = load_acquire(&queue->reserve);
+			if(reserve & NIC_QUEUE_CLOSED)
+				return false;
+			if(queue->next_size)
+				return queue_close(queue);
+
+			tail = (uint32_t)reserve;
+			next = queue_next(queue, tail);
+			if(next == load_acquire(&queue->head))
+				return false;
+		} while(!__sync_bool_compare_and_swap(&queue->reserve, reserve,
+					(((reserve >> 32) + (next == 0)) & NIC_QUEUE_LAP_MASK) << 32 | next));
+
+		array = (void*)nic + queue->base;
+		array[tail] = value;
+
+		while(queue->tail != tail)
+			__builtin_ia32_pause();
+
+		store_release(&queue->tail, next);
+	} else {
+		if(load_acquire(&queue->next_size))
+			return queue_close(queue);
+
+		tail = queue->tail;
+		next = queue_next(queue, tail);
+		if(next == queue->head_cache) {
+			queue->head_cache = load_acquire(&queue->head);
+			if(next == queue->head_cache)
+				return false;
+		}
+
+		array = (void*)nic + queue->base;
+		array[tail] = value;
+		store_release(&queue->tail, next);
 	}
 
-	int len = packet->end - packet->start;
+	return true;
+}
 
-	Packet* packet2 = nic_alloc(nic, len);
-	if(!packet2) {
-		lock_unlock(&nic->stx.wlock);
-		return false;
+void* queue_pop(NIC* nic, NICQueue* queue) {
+	uint32_t head = queue->head;
+	if(head == queue->tail_cache) {
+		queue->tail_cache = load_acquire(&queue->tail);
+		if(head == queue->tail_cache) {
+			if(load_acquire(&queue->next_size))
+				queue_swap(nic, queue);
+
+			return NULL;
+		}
 	}
 
-	packet2->time = packet->time;
-	packet2->end = packet2->start + len;
-	memcpy(packet2->buffer + packet2->start, packet->buffer + packet->start, len);
+	uint64_t* array = (void*)nic + queue->base;
 
-	if(!queue_push(nic, &nic->stx, packet)) {
-		lock_unlock(&nic->stx.wlock);
-		nic_free(packet);
+	uint64_t tmp = array[head];
+	uint32_t id = (uint32_t)(tmp >> 32);
+	uint32_t data = (uint32_t)tmp;
 
-		return false;
+	array[head] = 0;
+	store_release(&queue->head, queue_next(queue, head));
+
+	if(nic->id == id) {
+		return (void*)nic + data;
 	} else {
-		lock_unlock(&nic->stx.wlock);
-		return true;
+		nic = nic_get_by_id(id);
+		if(nic != NULL)
+			return (void*)nic + data;
+		else
+			return NULL;
 	}
 }
 
-bool nic_has_stx(NIC* nic) {
-	return queue_available(&nic->stx);
-}
+Packet* queue_peek(NIC* nic, NICQueue* queue) {
+	uint32_t head = load_acquire(&queue->head);
+	if(head == load_acquire(&queue->tail) || head >= queue->size)
+		return NULL;
 
-uint32_t nic_stx_size(NIC* nic) {
-	return queue_size(&nic->stx);
-}
+	uint64_t* array = (void*)nic + queue->base;
+	uint64_t tmp = array[head];
+	uint32_t id = (uint32_t)(tmp >> 32);
+	uint32_t data = (uint32_t)tmp;
+	if(!tmp)
+		return NULL;	// Just taken
 
-size_t nic_pool_used(NIC* nic) {
-	return nic->pool.used * NIC_CHUNK_SIZE;
-}
+	if(nic->id != id)
+		nic = nic_get_by_id(id);
 
-size_t nic_pool_free(NIC* nic) {
-	return (nic->pool.count - nic->pool.used) * NIC_CHUNK_SIZE;
-}
+	// The slot may have been reused already, stay inside the NIC
+	if(!nic || data + sizeof(Packet) > nic->size)
+		return NULL;
 
-size_t nic_pool_total(NIC* nic) {
-	return nic->pool.count * NIC_CHUNK_SIZE;
+	return (void*)nic + data;
 }
 
-/**
- * Payload
- * name_length: uint16_t
- * block_count: uint16_t
- * name: 4 bytes rounded string length
- * blocks
- * @return -1 key length is too long
- * @return -2 already allocated
- * @return -3 no space to allocate
- * @return 0 ~ 2^16 - 1 key
- */
-int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size) {
-	int len = strlen(name) + 1;
-	if(len > 255)
-		return -1;
-	
-	uint32_t req = 1 + ((len + sizeof(uint32_t) - 1) / sizeof(uint32_t)) + (((uint32_t)size + sizeof(uint32_t) - 1) / sizeof(uint32_t)); // heder + round(name) + round(blocks)
-	
-	// Check name is already allocated
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		uint16_t len2 = *p >> 16;
-		uint16_t count2 = *p & 0xffff;
-		
-		if(*p == 0) {
-			p++;
-		} else {
-			if(len2 == len && strncmp(name, (const char*)(p + 1), len - 1) == 0) {
-				return -1;
-			}
-			
-			p += count2;
+uint32_t queue_push_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	// Only the leading packets whose NIC can be resolved are queued
+	NIC* nic2 = nic;
+	for(uint32_t i = 0; i < count; i++) {
+		nic2 = queue_find_nic(nic2, packets[i]);
+		if(nic2 == NULL) {
+			count = i;
+			break;
 		}
 	}
-	
-	// Check available space
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		if(*p == 0) {
-			bool found = true;
-			for(int i = 0; i < req; i++) {
-				if(p >= (uint32_t*)nic->config_tail) {
-					return -2;
-				}
-				
-				if(p[i] != 0) {
-					p += i - 1;
-					found = false;
-					break;
-				}
-			}
-			
-			if(found) {
-				*p = (uint32_t)len << 16 | req;
-				memcpy(p + 1, name, len);
-				return ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
-			}
-			
-			p++;
-		} else {
-			p += *p & 0xffff;
+
+	uint32_t tail, next, n;
+
+	if(queue->mode == NIC_QUEUE_MP) {
+		uint64_t reserve;
+		do {
+			reserve = load_acquire(&queue->reserve);
+			if(reserve & NIC_QUEUE_CLOSED)
+				return 0;
+			if(queue->next_size)
+				return queue_close(queue);
+
+			tail = (uint32_t)reserve;
+			n = queue_free(queue, load_acquire(&queue->head), tail);
+			if(n > count)
+				n = count;
+			if(n == 0)
+				return 0;
+
+			next = tail + n;
+			if(next >= queue->size)
+				next -= queue->size;
+		} while(!__sync_bool_compare_and_swap(&queue->reserve, reserve,
+					(((reserve >> 32) + (next < tail)) & NIC_QUEUE_LAP_MASK) << 32 | next));
+	} else {
+		if(load_acquire(&queue->next_size))
+			return queue_close(queue);
+
+		tail = queue->tail;
+		n = queue_free(queue, queue->head_cache, tail);
+		if(n < count) {
+			queue->head_cache = load_acquire(&queue->head);
+			n = queue_free(queue, queue->head_cache, tail);
 		}
+		if(n > count)
+			n = count;
+		if(n == 0)
+			return 0;
+
+		next = tail + n;
+		if(next >= queue->size)
+			next -= queue->size;
 	}
-	
-	return -2;
-}
 
-void nic_config_free(NIC* nic, uint16_t key) {
-	uint16_t count = (uint16_t)nic->config_head[key] & 0xffff;
-	
-	for(int i = count - 1; i >= 0; i--) {
-		nic->config_head[key + i] = 0;
+	uint64_t* array = (void*)nic + queue->base;
+	nic2 = nic;
+	for(uint32_t i = 0, index = tail; i < n; i++) {
+		Packet* packet = packets[i];
+		nic2 = queue_find_nic(nic2, packet);
+		array[index] = ((uint64_t)nic2->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic2);
+
+		if(++index == queue->size)
+			index = 0;
 	}
-}
 
-/**
- *
- * @return -1 key length is too long
- * @return -2 key of the name not found
- * @return otherwise key of the name
- */
-int32_t nic_config_key(NIC* nic, char* name) {
-	int len = strlen(name) + 1;
-	if(len > 255)
-		return -1;
-	
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		if(*p == 0) {
-			p++;
-		} else {
-			uint16_t len2 = *p >> 16;
-			uint16_t count2 = *p & 0xffff;
-			
-			if(len2 == len && strncmp(name, (const char*)(p + 1), len - 1) == 0) {
-				return ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
-			}
-			
-			p += count2;
-		}
+	if(queue->mode == NIC_QUEUE_MP) {
+		while(queue->tail != tail)
+			__builtin_ia32_pause();
 	}
 
-	return -2;
+	store_release(&queue->tail, next);
+
+	return n;
 }
 
-void* nic_config_get(NIC* nic, uint16_t key) {
-	uint32_t* header = (uint32_t*)&nic->config_head[key];
-	uint16_t len = *header >> 16;
-	
-	return header + 1 + (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+uint32_t queue_pop_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	uint32_t head = queue->head;
+	uint32_t n = queue_used(queue, head, queue->tail_cache);
+	if(n < count) {
+		queue->tail_cache = load_acquire(&queue->tail);
+		n = queue_used(queue, head, queue->tail_cache);
+		if(n == 0 && load_acquire(&queue->next_size))
+			queue_swap(nic, queue);
+	}
+	if(n > count)
+		n = count;
+
+	uint64_t* array = (void*)nic + queue->base;
+
+	NIC* nic2 = nic;
+	uint32_t popped = 0;
+	for(uint32_t i = 0; i < n; i++) {
+		uint64_t tmp = array[head];
+		uint32_t id = (uint32_t)(tmp >> 32);
+		uint32_t data = (uint32_t)tmp;
+
+		array[head] = 0;
+		if(++head == queue->size)
+			head = 0;
+
+		if(nic2 == NULL || nic2->id != id)
+			nic2 = nic_get_by_id(id);
+		if(nic2 == NULL)
+			continue;
+
+		// Warm up the header and the first payload line while the rest of the burst is dequeued
+		Packet* packet = (void*)nic2 + data;
+		__builtin_prefetch(packet);
+		__builtin_prefetch((void*)packet + NIC_CACHE_LINE_SIZE);
+		packets[popped++] = packet;
+	}
+
+	if(n)
+		store_release(&queue->head, head);
+
+	return popped;
 }
 
-uint16_t nic_config_size(NIC* nic, uint16_t key) {
-	uint32_t* header = (uint32_t*)&nic->config_head[key];
-	uint16_t len = *header >> 16;
-	uint16_t count = *header & 0xffff;
-	
-	return (count - (len + sizeof(uint32_t) - 1) / sizeof(uint32_t) - 1) * sizeof(uint32_t);
+uint32_t queue_size(NICQueue* queue) {
+	uint32_t head = queue->head;
+	uint32_t tail = queue->tail;
+
+	if(tail >= head)
+		return tail - head;
+	else
+		return queue->size + tail - head;
 }
 
-uint32_t nic_config_available(NIC* nic) {
-	uint32_t count = 0;
-	
-	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
-		if(*p == 0) {
-			p++;
-			count++;
-		} else {
-			p += *p & 0xffff;
-		}
-	}
+bool queue_available(NICQueue* queue) {
+	uint64_t reserve = queue->reserve;
+	if(reserve & NIC_QUEUE_CLOSED)
+		return false;
 
-	return count * sizeof(uint32_t);
+	uint32_t tail = queue->mode == NIC_QUEUE_MP ? (uint32_t)reserve : queue->tail;
+	return queue->head != queue_next(queue, tail);
 }
 
-uint32_t nic_config_total(NIC* nic) {
-	return (uint32_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head);
+bool queue_empty(NICQueue* queue) {
+	return queue->head == queue->tail;
 }
 
-#if TEST
+uint64_t nic_latency_lap(NIC* nic, uint64_t stamp, NICLatencyStage stage, NICLatencyStage total) {
+	NICLatency* latency = (void*)nic + nic->histograms;
+	uint32_t now = nic_time();
 
-#include <stdio.h>
-#include <stdarg.h>
-#include <stdlib.h>
+	__sync_fetch_and_add(&latency->buckets[stage][nic_latency_bucket(now - (uint32_t)stamp)], 1);
+	if(total < NIC_LATENCY_STAGE_COUNT)
+		__sync_fetch_and_add(&latency->buckets[total][nic_latency_bucket(now - (uint32_t)(stamp >> 32))], 1);
 
-static void print_queue(NICQueue* queue) {
-	printf("\tbase: %d\n", queue->base);
-	printf("\thead: %d\n", queue->head);
-	printf("\ttail: %d\n", queue->tail);
-	printf("\tsize: %d\n", queue->size);
+	return NIC_LATENCY_STAMP(stamp >> 32, now);
 }
 
-static void print_config(VNIC* vnic) {	
-	for(uint32_t* p = vnic->config_head; p < vnic->config_tail; ) {
-		if(*p == 0) {
-			p++;
-		} else {
-			uint16_t len2 = *p >> 16;
-			uint16_t count2 = *p & 0xffff;
-			
-			printf("[%3d] %3d %3d \"%s\" ", (int)(((uintptr_t)p - (uintptr_t)vnic->config_head) / sizeof(uint32_t)), len2, count2, (char*)(p + 1));
-			uint32_t* base = p + 1 + (len2 + 3) / 4;
-			uint16_t count3 = count2 - 1 - (len2 + 3) / 4;
-			for(int i = 0; i < count3 && i < 12; i++) {
-				printf("%08x ", base[i]);
-			}
-			if(count3 >= 12)
-				printf("...\n");
-			else
-				printf("\n");
-			
-			p += count2;
+// The app ends the rx stamps of the packets it dequeues
+static void latency_rx(NIC* nic, Packet** packets, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++) {
+		if(packets[i] && packets[i]->time) {
+			nic_latency_lap(nic, packets[i]->time, NIC_LATENCY_RX_QUEUE, NIC_LATENCY_RX);
+			packets[i]->time = 0;
 		}
 	}
 }
 
-static void dump_config(NIC* nic) {
-	uint8_t* p = (void*)nic->config_head;
-	int i = 0;
-	while(p < nic->config_tail) {
-		printf("%02x", *p);
-		if((i + 1) % 8 == 0)
-			printf(" ");
-		if((i + 1) % 40 == 0)
-			printf("\n");
-		p++;
-		i++;
-	}
-	printf("\nconfig=%d\n", nic->config);
+// and starts the tx stamps of the packets it queues, which the tx AQM reads too
+static void latency_tx(Packet** packets, uint32_t count) {
+	uint32_t now = nic_time();
+	for(uint32_t i = 0; i < count; i++)
+		packets[i]->time = NIC_LATENCY_STAMP(now, now);
 }
 
-static void dump(NIC* nic) {
-	printf("nic: %p\n", nic);
-	printf("magic: %lx\n", nic->magic);
-	printf("MAC: %lx\n", nic->mac);
-	printf("rx_bandwidth: %ld\n", nic->rx_bandwidth);
-	printf("tx_bandwidth: %ld\n", nic->tx_bandwidth);
-	printf("padding_head: %d\n", nic->padding_head);
-	printf("padding_tail: %d\n", nic->padding_tail);
-	printf("rx queue\n");
-	print_queue(&nic->rx);
-	printf("tx queue\n");
-	print_queue(&nic->tx);
-	printf("srx queue\n");
-	print_queue(&nic->srx);
-	printf("tx slow_queue\n");
-	print_queue(&nic->stx);
-	printf("pool\n");
-	printf("\tbitmap: %d\n", nic->pool.bitmap);
-	printf("\tcount: %d\n", nic->pool.count);
-	printf("\tpool: %d\n", nic->pool.pool);
-	printf("\tindex: %d\n", nic->pool.index);
-	print_config(nic);
+bool nic_has_rx(NIC* nic) {
+	return !queue_empty(&nic->rx);
 }
 
-static void dump_queue(NIC* nic, NICQueue* queue) {
-	print_queue(queue);
-	uint64_t* array = (void*)nic + queue->base;
-	for(int i = 0; i < queue->size; i++) {
-		printf("%016lx ", array[i]);
-		if((i + 1) % 6 == 0)
-			printf("\n");
-	}
-	printf("\n");
-}
+Packet* nic_rx(NIC* nic) {
+	lock_lock(&nic->rx.rlock);
+	Packet* packet = queue_pop(nic, &nic->rx);
+	lock_unlock(&nic->rx.rlock);
 
-static void dump_bitmap(NIC* nic) {
-	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
-	uint32_t count = nic->pool.count;
-	uint32_t index = nic->pool.index;
-	for(int i = 0; i < count; i++) {
-		printf("%02x", bitmap[i]);
-		if((i + 1) % 8 == 0)
-			printf(" ");
+	if(nic->latency)
+		latency_rx(nic, &packet, 1);
 
-		if((i + 1) % 48 == 0)
-			printf("\n");
-	}
-	printf("\n");
+	return packet;
 }
 
-static int bitmap_used(NIC* nic) {
-	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
-	uint32_t count = nic->pool.count;
-	int used = 0;
-	for(int i = 0; i < count; i++) {
-		if(bitmap[i] != 0)
-			used++;
-	}
+uint32_t nic_rx_burst(NIC* nic, Packet** packets, uint32_t count) {
+	lock_lock(&nic->rx.rlock);
+	uint32_t n = queue_pop_burst(nic, &nic->rx, packets, count);
+	lock_unlock(&nic->rx.rlock);
 
-	return used;
+	if(nic->latency)
+		latency_rx(nic, packets, n);
+
+	return n;
 }
 
-uint8_t buffer[2 * 1024 * 1024] __attribute__((__aligned__(2 * 1024 * 1024)));
+uint32_t nic_rx_size(NIC* nic) {
+	return queue_size(&nic->rx);
+}
 
-void pass() {
-	printf("\tPASSED\n");
+uint16_t nic_queue_count(NIC* nic) {
+	return nic->queue_count;
 }
 
-void fail(const char* format, ...) {
-	fflush(stdout);
-	fprintf(stderr, "\tFAILED\n"
-	
-	va_list argptr;
-	va_start(argptr, format);
-	vfprintf(stderr, format, arg
-	va_end(argptr);
+bool nic_has_rx_queue(NIC* nic, uint16_t queue) {
+	NICQueue* rx = nic_queue_pair(nic, queue);
+
+	return rx && !queue_empty(rx);
+}
+
+Packet* nic_rx_queue(NIC* nic, uint16_t queue) {
+	NICQueue* rx = nic_queue_pair(nic, queue);
+	if(!rx)
+		return NULL;
+
+	Packet* packet = queue_pop(nic, rx);
+	if(nic->latency)
+		latency_rx(nic, &packet, 1);
+
+	return packet;
+}
+
+uint32_t nic_rx_queue_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count) {
+	NICQueue* rx = nic_queue_pair(nic, queue);
+	if(!rx)
+		return 0;
+
+	uint32_t n = queue_pop_burst(nic, rx, packets, count);
+	if(nic->latency)
+		latency_rx(nic, packets, n);
+
+	return n;
+}
+
+typedef enum {
+	WAIT_UNKNOWN,
+	WAIT_PAUSE,
+	WAIT_UMWAIT,	// Intel WAITPKG
+	WAIT_MWAITX,	// AMD
+} WaitMode;
+
+static struct {
+	volatile uint8_t	mode;	///< WaitMode
+	uint64_t		spin;
+	bool			deep;
+} rx_wait = { WAIT_UNKNOWN, NIC_WAIT_SPIN, false };
+
+void nic_wait_config(uint64_t spin, bool deep) {
+	rx_wait.spin = spin;
+	rx_wait.deep = deep;
+}
+
+// MONITOR/MWAIT fault outside ring 0, VM threads need their user mode variants
+static uint8_t wait_mode() {
+	uint32_t a, b, c, d;
+	asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0), "c"(0));
+	if(a >= 7) {
+		asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(7), "c"(0));
+		if(c & (1 << 5))
+			return WAIT_UMWAIT;
+	}
+
+	asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x80000000), "c"(0));
+	if(a >= 0x80000001) {
+		asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x80000001), "c"(0));
+		if(c & (1 << 29))
+			return WAIT_MWAITX;
+	}
+
+	return WAIT_PAUSE;
+}
+
+static bool queue_wait(NIC* nic, NICQueue* queue, volatile uint8_t* lock, uint64_t timeout) {
+	if(rx_wait.mode == WAIT_UNKNOWN)
+		rx_wait.mode = wait_mode();
+
+	uint64_t now = nic_time();
+	uint64_t deadline = timeout ? now + timeout : UINT64_MAX;
+	uint64_t spin = now + rx_wait.spin;
+	while(queue_empty(queue)) {
+		// Producers stay closed until the consumer swaps in the resized ring
+		if(queue->next_size) {
+			if(lock)
+				lock_lock(lock);
+			queue_swap(nic, queue);
+			if(lock)
+				lock_unlock(lock);
+		}
+
+		now = nic_time();
+		if(now >= deadline)
+			return false;
+
+		if(now < spin || rx_wait.mode == WAIT_PAUSE) {
+			asm volatile("pause");
+			continue;
+		}
+
+		// Armed before the last check, so an enqueue in between still wakes
+		if(rx_wait.mode == WAIT_UMWAIT) {
+			asm volatile(".byte 0xf3, 0x0f, 0xae, 0xf0" : : "a"(&queue->tail));	// umonitor rax
+			if(!queue_empty(queue))
+				break;
+
+			// Bit 0 of ecx selects C0.1; the OS caps the deadline
+			asm volatile(".byte 0xf2, 0x0f, 0xae, 0xf1"	// umwait ecx
+				: : "c"(rx_wait.deep ? 0 : 1), "a"((uint32_t)deadline), "d"((uint32_t)(deadline >> 32))
+				: "cc", "memory");
+		} else {
+			asm volatile(".byte 0x0f, 0x01, 0xfa" : : "a"(&queue->tail), "c"(0), "d"(0));	// monitorx
+			if(!queue_empty(queue))
+				break;
+
+			// Bit 1 of ecx enables the timeout in ebx
+			uint64_t left = deadline - now;
+			asm volatile(".byte 0x0f, 0x01, 0xfb"	// mwaitx
+				: : "a"(0), "b"(left > UINT32_MAX ? UINT32_MAX : (uint32_t)left), "c"(2)
+				: "memory");
+		}
+	}
+
+	return true;
+}
+
+bool nic_wait_rx(NIC* nic, uint64_t timeout) {
+	return queue_wait(nic, &nic->rx, &nic->rx.rlock, timeout);
+}
+
+bool nic_wait_rx_queue(NIC* nic, uint16_t queue, uint64_t timeout) {
+	NICQueue* rx = nic_queue_pair(nic, queue);
+	if(!rx)
+		return false;
+
+	return queue_wait(nic, rx, NULL, timeout);
+}
+
+bool nic_has_srx(NIC* nic) {
+	return !queue_empty(&nic->srx);
+}
+
+Packet* nic_srx(NIC* nic) {
+	lock_lock(&nic->srx.rlock);
+	Packet* packet = queue_pop(nic, &nic->srx);
+	lock_unlock(&nic->srx.rlock);
+
+	return packet;
+}
+
+uint32_t nic_srx_size(NIC* nic) {
+	return queue_size(&nic->srx);
+}
+
+bool nic_has_tx(NIC* nic) {
+	return !queue_empty(&nic->tx);
+}
+
+bool nic_tx(NIC* nic, Packet* packet) {
+	if(nic->tx_stamp)
+		latency_tx(&packet, 1);
+
+	if(!queue_push(nic, &nic->tx, packet)) {
+		nic_free(packet);
+		return false;
+	} else {
+		return true;
+	}
+}
+
+uint32_t nic_tx_burst(NIC* nic, Packet** packets, uint32_t count) {
+	if(nic->tx_stamp)
+		latency_tx(packets, count);
+
+	uint32_t n = queue_push_burst(nic, &nic->tx, packets, count);
+	for(uint32_t i = n; i < count; i++)
+		nic_free(packets[i]);
+
+	return n;
+}
+
+bool nic_tx_queue(NIC* nic, uint16_t queue, Packet* packet) {
+	if(nic->tx_stamp)
+		latency_tx(&packet, 1);
+
+	NICQueue* rx = nic_queue_pair(nic, queue);
+	if(!rx || !queue_push(nic, rx + 1, packet)) {
+		nic_free(packet);
+		return false;
+	} else {
+		return true;
+	}
+}
+
+uint32_t nic_tx_queue_burst(NIC* nic, uint16_t queue, Packet** packets, uint32_t count) {
+	if(nic->tx_stamp)
+		latency_tx(packets, count);
+
+	NICQueue* rx = nic_queue_pair(nic, queue);
+	uint32_t n = rx ? queue_push_burst(nic, rx + 1, packets, count) : 0;
+	for(uint32_t i = n; i < count; i++)
+		nic_free(packets[i]);
+
+	return n;
+}
+
+bool nic_try_tx(NIC* nic, Packet* packet) {
+	if(nic->tx_stamp)
+		latency_tx(&packet, 1);
+
+	return queue_push(nic, &nic->tx, packet);
+}
+
+// Copy of packet in the pool of nic, chained if packet is
+static Packet* nic_dup(NIC* nic, Packet* packet) {
+	Packet* packet2 = nic_alloc_chain(nic, packet_len(packet));
+	if(!packet2)
+		return NULL;
+
+	packet2->time = packet->time;
+	packet2->tx_time = packet->tx_time;
+	uint32_t offset = 0;
+	for(; packet; packet = packet_next(packet)) {
+		nic_write(packet2, offset, packet->buffer + packet->start, packet->end - packet->start);
+		offset += packet->end - packet->start;
+	}
+
+	return packet2;
+}
+
+bool nic_tx_dup(NIC* nic, Packet* packet) {
+	if(!queue_available(&nic->tx))
+		return false;
+
+	Packet* packet2 = nic_dup(nic, packet);
+	if(!packet2)
+		return false;
+
+	if(nic->tx_stamp)
+		latency_tx(&packet2, 1);
+
+	if(!queue_push(nic, &nic->tx, packet2)) {
+		nic_free(packet2);
+		return false;
+	} else {
+		return true;
+	}
+}
+
+bool nic_tx_available(NIC* nic) {
+	return queue_available(&nic->tx);
+}
+
+uint32_t nic_tx_size(NIC* nic) {
+	return queue_size(&nic->tx);
+}
+
+bool nic_stx(NIC* nic, Packet* packet) {
+	if(!queue_push(nic, &nic->stx, packet)) {
+		nic_free(packet);
+		return false;
+	} else {
+		return true;
+	}
+}
+
+bool nic_try_stx(NIC* nic, Packet* packet) {
+	return queue_push(nic, &nic->stx, packet);
+}
+
+bool nic_stx_dup(NIC* nic, Packet* packet) {
+	if(!queue_available(&nic->stx))
+		return false;
+
+	Packet* packet2 = nic_dup(nic, packet);
+	if(!packet2)
+		return false;
+
+	if(!queue_push(nic, &nic->stx, packet2)) {
+		nic_free(packet2);
+		return false;
+	} else {
+		return true;
+	}
+}
+
+bool nic_has_stx(NIC* nic) {
+	return queue_available(&nic->stx);
+}
+
+uint32_t nic_stx_size(NIC* nic) {
+	return queue_size(&nic->stx);
+}
+
+size_t nic_pool_used(NIC* nic) {
+	return nic->pool.used * NIC_CHUNK_SIZE;
+}
+
+size_t nic_pool_free(NIC* nic) {
+	return (nic->pool.count - nic->pool.used) * NIC_CHUNK_SIZE;
+}
+
+size_t nic_pool_total(NIC* nic) {
+	return nic->pool.count * NIC_CHUNK_SIZE;
+}
+
+/*
+ * Toeplitz hash. The key repeats 0x6d5a every 16 bits, so sliding the 32 bits
+ * key window by a bit is a rotation, and swapping source and destination
+ * addresses or ports gives the same hash.
+ */
+static uint32_t toeplitz(const uint8_t* data, uint32_t size) {
+	uint32_t key = 0x6d5a6d5a;
+	uint32_t hash = 0;
+
+	for(uint32_t i = 0; i < size; i++) {
+		for(int bit = 7; bit >= 0; bit--) {
+			if(data[i] & (1 << bit))
+				hash ^= key;
+			key = (key << 1) | (key >> 31);
+		}
+	}
+
+	return hash;
+}
+
+PacketMeta* nic_parse(Packet* packet) {
+	PacketMeta* meta = &packet->meta;
+	if(meta->flags & PACKET_META_PARSED)
+		return meta;
+
+	// Flags set by the device and offload requests are kept
+	uint8_t flags = (meta->flags & (PACKET_META_VLAN_STRIPPED | PACKET_META_CSUM_VERIFIED | PACKET_META_OFFLOAD)) | PACKET_META_PARSED;
+	uint8_t* data = packet->buffer;
+	uint32_t end = packet->end;
+	uint32_t offset = packet->start + 12;		// Ether type
+
+	meta->hash = 0;
+	meta->ether_type = 0;
+	meta->l3 = 0;
+	meta->l4 = 0;
+	meta->payload = 0;
+	meta->protocol = 0;
+
+	if(offset + 2 > end)
+		goto done;
+
+	uint16_t type = data[offset] << 8 | data[offset + 1];
+	while((type == 0x8100 || type == 0x88a8) && offset + 6 <= end) {	// 802.1Q, 802.1ad
+		offset += 4;
+		type = data[offset] << 8 | data[offset + 1];
+	}
+	meta->ether_type = type;
+	meta->l3 = offset += 2;
+
+	uint8_t tuple[37];
+	uint32_t len = 0;
+	uint32_t l4 = 0;
+	if(type == 0x0800 && offset + 20 <= end) {
+		uint8_t* ip = data + offset;
+		uint32_t ihl = (ip[0] & 0xf) * 4;
+		if(ihl < 20 || offset + ihl > end)
+			goto done;
+
+		flags |= PACKET_META_IPV4;
+		meta->protocol = ip[9];
+		memcpy(tuple, ip + 12, 8);	// Source, destination
+		len = 8;
+
+		// Only the first fragment has ports, and no fragment is hashed with them
+		if((ip[6] & 0x3f) | ip[7])
+			flags |= PACKET_META_FRAGMENT;
+		if(!((ip[6] & 0x1f) | ip[7]))
+			l4 = offset + ihl;
+	} else if(type == 0x86dd && offset + 40 <= end) {
+		uint8_t* ip = data + offset;
+		flags |= PACKET_META_IPV6;
+		meta->protocol = ip[6];
+		memcpy(tuple, ip + 8, 32);	// Source, destination
+		len = 32;
+
+		// Extension headers are not followed
+		if(meta->protocol == 44)
+			flags |= PACKET_META_FRAGMENT;
+		else
+			l4 = offset + 40;
+	} else {
+		goto done;	// Not IP, e.g. ARP
+	}
+
+	uint8_t protocol = meta->protocol;
+	if(l4 && l4 + 4 <= end && (protocol == 6 || protocol == 17 || protocol == 132)) {
+		meta->l4 = l4;
+		if(protocol == 6 && l4 + 20 <= end) {
+			uint32_t header = (data[l4 + 12] >> 4) * 4;
+			if(header >= 20 && l4 + header <= end)
+				meta->payload = l4 + header;
+		} else if(protocol == 17 && l4 + 8 <= end) {
+			meta->payload = l4 + 8;
+		}
+
+		if(!(flags & PACKET_META_FRAGMENT)) {
+			memcpy(tuple + len, data + l4, 4);	// Source, destination port
+			len += 4;
+		}
+	} else if(l4 && l4 < end) {
+		meta->l4 = l4;
+	}
+	tuple[len++] = protocol;
+
+	meta->hash = toeplitz(tuple, len);
+
+done:
+	meta->flags = flags;
+	return meta;
+}
+
+/**
+ * Internet checksum arithmetic. Sums are kept in 64 bits and folded when the
+ * checksum is written; odd carries a segment which ended on an odd byte over
+ * to the next one.
+ */
+static uint64_t csum_add(uint64_t sum, const uint8_t* data, uint32_t len, bool* odd) {
+	if(*odd && len) {
+		sum += *data++;
+		len--;
+		*odd = false;
+	}
+
+	for(; len >= 2; data += 2, len -= 2)
+		sum += data[0] << 8 | data[1];
+
+	if(len) {
+		sum += data[0] << 8;
+		*odd = true;
+	}
+
+	return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum) {
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+// L4 size from the IP header, so Ethernet padding is not summed
+static uint32_t csum_l4_len(PacketMeta* meta, uint8_t* data) {
+	uint8_t* ip = data + meta->l3;
+	if(meta->flags & PACKET_META_IPV4)
+		return (ip[2] << 8 | ip[3]) - (meta->l4 - meta->l3);
+	else
+		return ip[4] << 8 | ip[5];
+}
+
+static uint64_t csum_pseudo(PacketMeta* meta, uint8_t* data) {
+	uint8_t* ip = data + meta->l3;
+	bool odd = false;
+	uint64_t sum;
+	if(meta->flags & PACKET_META_IPV4)
+		sum = csum_add(0, ip + 12, 8, &odd);	// Source, destination
+	else
+		sum = csum_add(0, ip + 8, 32, &odd);
+
+	return sum + meta->protocol + csum_l4_len(meta, data);
+}
+
+// Offset of the checksum field, 0 if the frame is not TCP/UDP
+static uint32_t csum_offset(PacketMeta* meta) {
+	if(!meta->payload || (meta->flags & PACKET_META_FRAGMENT))
+		return 0;
+
+	if(meta->protocol == 6)
+		return meta->l4 + 16;
+	else if(meta->protocol == 17)
+		return meta->l4 + 6;
+	else
+		return 0;
+}
+
+bool nic_tx_offload(NIC* nic, Packet* packet, uint16_t mss) {
+	PacketMeta* meta = nic_parse(packet);
+	uint32_t offset = csum_offset(meta);
+	if(!offset)
+		return false;
+
+	uint32_t payload = packet_len(packet) - (meta->payload - packet->start);
+	bool gso = meta->protocol == 6 && mss && payload > mss;
+	uint8_t tso = meta->flags & PACKET_META_IPV4 ? NIC_OFFLOAD_TSO4 : NIC_OFFLOAD_TSO6;
+	if(gso && (nic->offloads & (NIC_OFFLOAD_TX_CSUM | tso)) != (NIC_OFFLOAD_TX_CSUM | tso))
+		return false;
+
+	uint16_t sum = csum_fold(csum_pseudo(meta, packet->buffer));
+	packet->buffer[offset] = sum >> 8;
+	packet->buffer[offset + 1] = sum;
+
+	meta->flags = (meta->flags & ~PACKET_META_GSO) | PACKET_META_CSUM_PARTIAL;
+	if(gso) {
+		meta->flags |= PACKET_META_GSO;
+		meta->gso_size = mss;
+	}
+
+	if(!(nic->offloads & NIC_OFFLOAD_TX_CSUM))
+		return nic_csum_complete(packet);
+
+	return true;
+}
+
+bool nic_csum_complete(Packet* packet) {
+	PacketMeta* meta = nic_parse(packet);
+	uint32_t offset = csum_offset(meta);
+	if(!offset)
+		return false;
+
+	// The checksum field holds the pseudo header sum
+	uint32_t len = csum_l4_len(meta, packet->buffer);
+	uint32_t start = meta->l4;
+	bool odd = false;
+	uint64_t sum = 0;
+	for(Packet* segment = packet; segment && len; segment = packet_next(segment)) {
+		uint32_t size = segment->end - start;
+		if(size > len)
+			size = len;
+
+		sum = csum_add(sum, segment->buffer + start, size, &odd);
+		len -= size;
+
+		Packet* next = packet_next(segment);
+		if(next)
+			start = next->start;
+	}
+
+	uint16_t check = ~csum_fold(sum);
+	if(!check && meta->protocol == 17)
+		check = 0xffff;		// 0 means no checksum in UDP
+
+	packet->buffer[offset] = check >> 8;
+	packet->buffer[offset + 1] = check;
+	meta->flags &= ~PACKET_META_CSUM_PARTIAL;
+
+	return true;
+}
+
+/**
+ * Config names are found through a hashed index of their keys. A slot is
+ * published with one atomic store after the entry is written, so the other
+ * side of the NIC sees complete entries without locks.
+ */
+#define CONFIG_INDEX_EMPTY	0
+#define CONFIG_INDEX_REMOVED	0xffff
+
+static uint32_t config_hash(const char* name) {
+	uint32_t hash = 2166136261U;	// FNV-1a
+	for(; *name; name++) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static int32_t config_lookup(NIC* nic, const char* name, int len) {
+	volatile uint16_t* index = nic->config_index;
+	uint32_t slot = config_hash(name) & (NIC_CONFIG_INDEX_SIZE - 1);
+	for(int i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		uint16_t entry = index[slot];
+		if(entry == CONFIG_INDEX_EMPTY)
+			break;
+
+		if(entry != CONFIG_INDEX_REMOVED) {
+			uint32_t* p = (uint32_t*)nic->config_head + entry - 1;
+			if((*p >> 16) == len && memcmp(name, p + 1, len) == 0)
+				return entry - 1;
+		}
+
+		slot = (slot + 1) & (NIC_CONFIG_INDEX_SIZE - 1);
+	}
+
+	return -2;
+}
+
+static bool config_index_add(NIC* nic, const char* name, uint16_t key) {
+	uint16_t* index = nic->config_index;
+	uint32_t slot = config_hash(name) & (NIC_CONFIG_INDEX_SIZE - 1);
+	for(int i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		uint16_t entry = index[slot];
+		if((entry == CONFIG_INDEX_EMPTY || entry == CONFIG_INDEX_REMOVED) &&
+				__sync_bool_compare_and_swap(&index[slot], entry, key + 1))
+			return true;
+
+		slot = (slot + 1) & (NIC_CONFIG_INDEX_SIZE - 1);
+	}
+
+	return false;
+}
+
+static void config_index_remove(NIC* nic, uint16_t key) {
+	volatile uint16_t* index = nic->config_index;
+	uint32_t slot = config_hash((const char*)((uint32_t*)nic->config_head + key + 1)) & (NIC_CONFIG_INDEX_SIZE - 1);
+	for(int i = 0; i < NIC_CONFIG_INDEX_SIZE && index[slot] != CONFIG_INDEX_EMPTY; i++) {
+		if(index[slot] == key + 1) {
+			index[slot] = CONFIG_INDEX_REMOVED;	// Keeps the probe chain of the others
+			return;
+		}
+
+		slot = (slot + 1) & (NIC_CONFIG_INDEX_SIZE - 1);
+	}
+}
+
+/**
+ * Payload
+ * name_length: uint16_t
+ * block_count: uint16_t
+ * name: 4 bytes rounded string length
+ * blocks
+ * @return -1 key length is too long or already allocated
+ * @return -2 no space to allocate
+ * @return 0 ~ 2^16 - 1 key
+ */
+int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size) {
+	int len = strlen(name) + 1;
+	if(len > 255)
+		return -1;
+	
+	uint32_t req = 1 + ((len + sizeof(uint32_t) - 1) / sizeof(uint32_t)) + (((uint32_t)size + sizeof(uint32_t) - 1) / sizeof(uint32_t)); // heder + round(name) + round(blocks)
+	
+	// Check name is already allocated
+	if(config_lookup(nic, name, len) >= 0)
+		return -1;
+	
+	// Check available space
+	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
+		if(*p == 0) {
+			bool found = true;
+			for(int i = 0; i < req; i++) {
+				if(p >= (uint32_t*)nic->config_tail) {
+					return -2;
+				}
+				
+				if(p[i] != 0) {
+					p += i - 1;
+					found = false;
+					break;
+				}
+			}
+			
+			if(found) {
+				memcpy(p + 1, name, len);
+				*p = (uint32_t)len << 16 | req;
+
+				uint16_t key = ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
+				if(!config_index_add(nic, name, key)) {
+					memset(p, 0, req * sizeof(uint32_t));
+					return -2;
+				}
+
+				return key;
+			}
+			
+			p++;
+		} else {
+			p += *p & 0xffff;
+		}
+	}
+	
+	return -2;
+}
+
+void nic_config_free(NIC* nic, uint16_t key) {
+	uint32_t* header = (uint32_t*)nic->config_head + key;
+	uint16_t count = *header & 0xffff;
+
+	config_index_remove(nic, key);
+	
+	for(int i = count - 1; i >= 0; i--) {
+		header[i] = 0;
+	}
+}
+
+/**
+ *
+ * @return -1 key length is too long
+ * @return -2 key of the name not found
+ * @return otherwise key of the name
+ */
+int32_t nic_config_key(NIC* nic, char* name) {
+	int len = strlen(name) + 1;
+	if(len > 255)
+		return -1;
+	
+	return config_lookup(nic, name, len);
+}
+
+void* nic_config_get(NIC* nic, uint16_t key) {
+	uint32_t* header = (uint32_t*)nic->config_head + key;
+	uint16_t len = *header >> 16;
+	
+	return header + 1 + (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+}
+
+NICConfigHandle nic_config_handle(NIC* nic, char* name) {
+	int32_t key = nic_config_key(nic, name);
+	if(key < 0)
+		return 0;
+
+	return (uintptr_t)nic_config_get(nic, key) - (uintptr_t)nic;
+}
+
+uint16_t nic_config_size(NIC* nic, uint16_t key) {
+	uint32_t* header = (uint32_t*)nic->config_head + key;
+	uint16_t len = *header >> 16;
+	uint16_t count = *header & 0xffff;
+	
+	return (count - (len + sizeof(uint32_t) - 1) / sizeof(uint32_t) - 1) * sizeof(uint32_t);
+}
+
+uint32_t nic_config_available(NIC* nic) {
+	uint32_t count = 0;
+	
+	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
+		if(*p == 0) {
+			p++;
+			count++;
+		} else {
+			p += *p & 0xffff;
+		}
+	}
+
+	return count * sizeof(uint32_t);
+}
+
+uint32_t nic_config_total(NIC* nic) {
+	return (uint32_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head);
+}
+
+#if TEST
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "vnic.h"
+
+static void print_queue(NICQueue* queue) {
+	printf("\tbase: %d\n", queue->base);
+	printf("\thead: %d\n", queue->head);
+	printf("\ttail: %d\n", queue->tail);
+	printf("\tsize: %d\n", queue->size);
+}
+
+static void print_config(NIC* nic) {
+	for(uint32_t* p = (uint32_t*)nic->config_head; p < (uint32_t*)nic->config_tail; ) {
+		if(*p == 0) {
+			p++;
+		} else {
+			uint16_t len2 = *p >> 16;
+			uint16_t count2 = *p & 0xffff;
+			
+			printf("[%3d] %3d %3d \"%s\" ", (int)(((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t)), len2, count2, (char*)(p + 1));
+			uint32_t* base = p + 1 + (len2 + 3) / 4;
+			uint16_t count3 = count2 - 1 - (len2 + 3) / 4;
+			for(int i = 0; i < count3 && i < 12; i++) {
+				printf("%08x ", base[i]);
+			}
+			if(count3 >= 12)
+				printf("...\n");
+			else
+				printf("\n");
+			
+			p += count2;
+		}
+	}
+}
+
+static void dump_config(NIC* nic) {
+	uint8_t* p = (void*)nic->config_head;
+	int i = 0;
+	while(p < nic->config_tail) {
+		printf("%02x", *p);
+		if((i + 1) % 8 == 0)
+			printf(" ");
+		if((i + 1) % 40 == 0)
+			printf("\n");
+		p++;
+		i++;
+	}
+	printf("\nconfig=%d\n", nic->config);
+}
+
+static void dump(NIC* nic) {
+	printf("nic: %p\n", nic);
+	printf("magic: %lx\n", nic->magic);
+	printf("MAC: %lx\n", nic->mac);
+	printf("rx_bandwidth: %ld\n", nic->rx_bandwidth);
+	printf("tx_bandwidth: %ld\n", nic->tx_bandwidth);
+	printf("padding_head: %d\n", nic->padding_head);
+	printf("padding_tail: %d\n", nic->padding_tail);
+	printf("rx queue\n");
+	print_queue(&nic->rx);
+	printf("tx queue\n");
+	print_queue(&nic->tx);
+	printf("srx queue\n");
+	print_queue(&nic->srx);
+	printf("tx slow_queue\n");
+	print_queue(&nic->stx);
+	printf("pool\n");
+	printf("\tbitmap: %d\n", nic->pool.bitmap);
+	printf("\tcount: %d\n", nic->pool.count);
+	printf("\tpool: %d\n", nic->pool.pool);
+	printf("\tindex: %d\n", nic->pool.index);
+	print_config(nic);
+}
+
+static void dump_queue(NIC* nic, NICQueue* queue) {
+	print_queue(queue);
+	uint64_t* array = (void*)nic + queue->base;
+	for(int i = 0; i < queue->size; i++) {
+		printf("%016lx ", array[i]);
+		if((i + 1) % 6 == 0)
+			printf("\n");
+	}
+	printf("\n");
+}
+
+static void dump_bitmap(NIC* nic) {
+	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
+	uint32_t count = nic->pool.count;
+	for(int i = 0; i < count; i++) {
+		printf("%02x", bitmap[i]);
+		if((i + 1) % 8 == 0)
+			printf(" ");
+
+		if((i + 1) % 48 == 0)
+			printf("\n");
+	}
+	printf("\n");
+}
+
+// Chunks of the buffers in use: the buffers parked in this thread's cache go back first
+static int bitmap_used(NIC* nic) {
+	nic_cache_flush(nic);
+
+	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
+	uint32_t count = nic->pool.count;
+	int used = 0;
+	for(int i = 0; i < count; i++) {
+		if(bitmap[i] != 0)
+			used++;
+	}
+
+	return used;
+}
+
+static bool free_transmitter(Packet* packet, void* context) {
+	return nic_free(packet);
+}
+
+static bool reject_transmitter(Packet* packet, void* context) {
+	nic_free(packet);
+	return false;
+}
+
+static uint32_t test_core;
+
+static uint32_t test_core_id() {
+	return test_core;
+}
+
+static int chunks(NIC* nic, uint16_t size) {
+	return ROUNDUP(sizeof(Packet) + nic->padding_head + size + nic->padding_tail, NIC_CHUNK_SIZE) / NIC_CHUNK_SIZE;
+}
+
+uint8_t buffer[2 * 1024 * 1024] __attribute__((__aligned__(2 * 1024 * 1024)));
+
+void pass() {
+	printf("\tPASSED\n");
+}
+
+void fail(const char* format, ...) {
+	fflush(stdout);
+	fprintf(stderr, "\tFAILED\n");
+
+	va_list argptr;
+	va_start(argptr, format);
+	vfprintf(stderr, format, argptr);
+	va_end(argptr);
 
 	printf("\n");
+
+	NIC* nic = (NIC*)buffer;
+
+	/*
+	printf("* rx\n");
+	dump_queue(nic, &nic->rx);
+
+	printf("* tx\n");
+	dump_queue(nic, &nic->tx);
+
+	printf("* srx\n");
+	dump_queue(nic, &nic->srx);
+
+	printf("* stx\n");
+	dump_queue(nic, &nic->stx);
+
+	printf("* Bitmap\n");
+	dump_bitmap(nic);
+	*/
+	printf("* Config\n");
+	print_config(nic);
+
+	exit(1);
+}
+
+typedef struct {
+	NIC*		nic;
+	Packet*		packet;
+	uint64_t	count;
+	uint32_t	burst;
+	int		cpu;
+} QueueBench;
+
+#define BENCH_MAX_BURST	64
+
+static void bench_pin(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void* bench_producer(void* context) {
+	QueueBench* bench = context;
+	bench_pin(bench->cpu);
+
+	if(bench->burst > 1) {
+		Packet* packets[BENCH_MAX_BURST];
+		for(uint32_t i = 0; i < bench->burst; i++)
+			packets[i] = bench->packet;
+
+		for(uint64_t i = 0; i < bench->count; ) {
+			uint32_t n = bench->count - i < bench->burst ? bench->count - i : bench->burst;
+			n = queue_push_burst(bench->nic, &bench->nic->rx, packets, n);
+			if(n)
+				i += n;
+			else
+				sched_yield();
+		}
+
+		return NULL;
+	}
+
+	for(uint64_t i = 0; i < bench->count; i++) {
+		while(!queue_push(bench->nic, &bench->nic->rx, bench->packet))
+			sched_yield();	// Cores may be shared
+	}
+
+	return NULL;
+}
+
+static void* bench_consumer(void* context) {
+	QueueBench* bench = context;
+	bench_pin(bench->cpu);
+
+	Packet* packets[BENCH_MAX_BURST];
+	for(uint64_t i = 0; i < bench->count; ) {
+		uint32_t n = bench->burst > 1 ? queue_pop_burst(bench->nic, &bench->nic->rx, packets, bench->burst) :
+				queue_pop(bench->nic, &bench->nic->rx) != NULL;
+		if(n)
+			i += n;
+		else
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static uint16_t aqm_checksum(uint8_t* ip) {
+	uint32_t sum = 0;
+	for(int i = 0; i < 20; i += 2)
+		sum += ip[i] << 8 | ip[i + 1];
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+// Ethernet, IPv4 and UDP headers with tos
+static void aqm_frame(uint8_t* frame, uint8_t tos) {
+	memset(frame, 0, 64);
+	frame[12] = 0x08;
+	uint8_t* ip = frame + 14;
+	ip[0] = 0x45;
+	ip[1] = tos;
+	ip[3] = 50;
+	ip[8] = 64;
+	ip[9] = 17;
+	ip[12] = 10;
+	ip[15] = 1;
+	ip[16] = 10;
+	ip[19] = 2;
+	uint16_t checksum = aqm_checksum(ip);
+	ip[10] = checksum >> 8;
+	ip[11] = checksum;
+}
+
+static int aqm_drain(NIC* nic, Packet** packets, int size) {
+	int count = 0;
+	for(uint16_t queue = 0; queue < nic_queue_count(nic); queue++) {
+		while(count < size && (packets[count] = nic_rx_queue(nic, queue)))
+			count++;
+	}
+
+	return count;
+}
+
+// Records the first payload byte of the packets it sends
+static bool pacing_transmitter(Packet* packet, void* context) {
+	uint8_t** order = context;
+	*(*order)++ = packet->buffer[packet->start];
+
+	return nic_free(packet);
+}
+
+// Keeps the packet it sends for the caller to look at
+static bool keep_transmitter(Packet* packet, void* context) {
+	*(Packet**)context = packet;
+
+	return true;
+}
+
+// L4 checksum of an IPv4 frame summed from scratch, 0 if the frame carries the right one
+static uint16_t l4_check(uint8_t* frame) {
+	uint8_t* ip = frame + 14;
+	uint32_t ihl = (ip[0] & 0xf) * 4;
+	uint32_t len = (ip[2] << 8 | ip[3]) - ihl;
+	uint32_t sum = ip[9] + len;
+	for(int i = 12; i < 20; i += 2)
+		sum += ip[i] << 8 | ip[i + 1];
+
+	uint8_t* l4 = ip + ihl;
+	for(uint32_t i = 0; i < len; i += 2)
+		sum += l4[i] << 8 | (i + 1 < len ? l4[i + 1] : 0);
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum & 0xffff;
+}
+
+static uint32_t free_burst_transmitter(Packet** packets, uint32_t count, void* context) {
+	for(uint32_t i = 0; i < count; i++)
+		nic_free(packets[i]);
+
+	return count;
+}
+
+static void pacing_packet(NIC* nic, uint8_t mark, uint16_t size, uint64_t tx_time) {
+	Packet* packet = nic_alloc(nic, size);
+	packet->end = packet->start + size;
+	packet->buffer[packet->start] = mark;
+	packet->tx_time = tx_time;
+	nic_tx(nic, packet);
+}
+
+static void* wait_producer(void* context) {
+	VNIC* vnic = context;
+	uint8_t frame[64] = { 0 };
+
+	usleep(2000);
+	vnic_rx(vnic, frame, sizeof(frame), NULL, 0);
+
+	return NULL;
+}
+
+#define SHARED_CHARGES	100000
+
+static void* shared_charger(void* context) {
+	VNICBucket* bucket = context;
+	for(int i = 0; i < SHARED_CHARGES; i++)
+		vnic_bucket_charge_shared(bucket, 0, 1000);
+
+	return NULL;
+}
+
+/**
+ * Moves packet references through the rx queue between producer threads and
+ * one consumer thread, each pinned to its own core, and prints Mpps.
+ */
+static void bench_queue(VNIC* vnic, uint8_t mode, int producers, uint32_t burst, uint64_t count) {
+	// A producer spins while a preempted producer holds an unpublished slot
+	if(producers > 1 && sysconf(_SC_NPROCESSORS_ONLN) < producers + 1) {
+		printf("Bench: %s queue, burst %d, %d producer(s) -> 1 consumer: skipped (needs %d cores)\n",
+				mode == NIC_QUEUE_MP ? "MP" : "SP", burst, producers, producers + 1);
+		return;
+	}
+
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"test",
+		VNIC_POOL_SIZE, 2 * 1024 * 1024,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 16,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 1024,
+		VNIC_TX_QUEUE_SIZE, 1024,
+		VNIC_SLOW_RX_QUEUE_SIZE, 64,
+		VNIC_SLOW_TX_QUEUE_SIZE, 64,
+		VNIC_RX_QUEUE_MODE, mode,
+		VNIC_NONE
+	};
+
+	nic_cache_flush(vnic->nic);	// The NIC memory is reused
+	if(!vnic_init(vnic, attrs)) {
+		fail("cannot initialize benchmark NIC");
+		return;
+	}
+
+	NIC* nic = vnic->nic;
+	QueueBench benches[producers + 1];
+	pthread_t threads[producers + 1];
+	Packet* packet = nic_alloc(nic, 64);
+
+	for(int i = 0; i <= producers; i++) {
+		benches[i].nic = nic;
+		benches[i].packet = packet;
+		benches[i].count = i < producers ? count : count * producers;
+		benches[i].burst = burst;
+		benches[i].cpu = i;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i <= producers; i++)
+		pthread_create(&threads[i], NULL, i < producers ? bench_producer : bench_consumer, &benches[i]);
+	for(int i = 0; i <= producers; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Bench: %s queue, burst %d, %d producer(s) -> 1 consumer: %.2f Mpps\n",
+			mode == NIC_QUEUE_MP ? "MP" : "SP", burst, producers, count * producers / seconds / 1e6);
+
+	nic_free(packet);
+}
+
+int main(int argc, char** argv) {
+	NIC* nic = (NIC*)buffer;
+	VNIC* vnic = &(VNIC){ .id = 1, .nic = nic };
+
+	vnic__init_timer(1000000000L);
+
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"test",
+		VNIC_POOL_SIZE, 2 * 1024 * 1024,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 16,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 128,
+		VNIC_TX_QUEUE_SIZE, 128,
+		VNIC_SLOW_RX_QUEUE_SIZE, 64,
+		VNIC_SLOW_TX_QUEUE_SIZE, 64,
+		VNIC_NONE
+	};
+
+	if(!vnic_init(vnic, attrs))
+		fail("cannot initialize NIC");
+
+	dump(nic);
+
+
+	int used = bitmap_used(nic);
+	printf("Pool: Check initial used: %d", used);
+	if(used == 0)
+		pass();
+	else
+		fail("initial used must be 0");
+	
+	
+	Packet* p1 = nic_alloc(nic, 64);
+	used = bitmap_used(nic);
+	printf("Pool: Check 64 bytes packet allocation: packet: %p, used: %d", p1, used);
+	if(used == chunks(nic, 64) && p1 != NULL)
+		pass();
+	else
+		fail("packet must not be NULL and %d chunks must be used", chunks(nic, 64));
+	
+	
+	nic_free(p1);
+	used = bitmap_used(nic);
+	printf("Pool: Check 64 bytes packet deallocation: used: %d", used);
+	if(used == 0)
+		pass();
+	else
+		fail("0 chunks must be used");
+	
+	
+	p1 = nic_alloc(nic, 512);
+	used = bitmap_used(nic);
+	printf("Pool: Check 512 bytes packet allocation: packet: %p, used: %d", p1, used);
+	if(used == chunks(nic, 512) && p1 != NULL)
+		pass();
+	else
+		fail("packet must not be NULL and %d chunks must be used", chunks(nic, 512));
+	
+	
+	nic_free(p1);
+	used = bitmap_used(nic);
+	printf("Pool: Check 512cbytes packet deallocation: used: %d", used);
+	if(used == 0)
+		pass();
+	else
+		fail("0 chunks must be used");
+	
+	
+	p1 = nic_alloc(nic, 1500);
+	used = bitmap_used(nic);
+	printf("Pool: Check 1500 bytes packet allocation: packet: %p, used: %d", p1, used);
+	if(used == chunks(nic, 1500) && p1 != NULL)
+		pass();
+	else
+		fail("packet must not be NULL and %d chunks must be used", chunks(nic, 1500));
+	
+	
+	nic_free(p1);
+	used = bitmap_used(nic);
+	printf("Pool: Check 1500 bytes packet deallocation: used: %d", used);
+	if(used == 0)
+		pass();
+	else
+		fail("0 chunks must be used");
+	
+	
+	p1 = nic_alloc(nic, 0);
+	used = bitmap_used(nic);
+	printf("Pool: Check 0 bytes packet allocation: packet: %p, used: %d", p1, used);
+	if(used == chunks(nic, 0) && p1 != NULL)
+		pass();
+	else
+		fail("packet must not be NULL and %d chunks must be used", chunks(nic, 0));
+	
+	
+	nic_free(p1);
+	used = bitmap_used(nic);
+	printf("Pool: Check 0 bytes packet deallocation: used: %d", used);
+	if(used == 0)
+		pass();
+	else
+		fail("0 chunks must be used");
+	
+	
+	printf("Pool: Check full allocation: ");
+	nic->pool.index = 0;
+	
+	int max = nic->pool.count / chunks(nic, 1500);
+	Packet* ps[2048] = { NULL, };
+	int i;
+	for(i = 0; i < max; i++) {
+		ps[i] = nic_alloc(nic, 1500);
+		if(ps[i] == NULL)
+			fail("allocation failed: index: %d", i);
+	}
+
+	used = bitmap_used(nic);
+	if(used != max * chunks(nic, 1500))
+		fail("%d * %d chunks must be used: %d", max, chunks(nic, 1500), used);
+	else
+		pass();
+	
+
+	printf("Pool: Check overflow(big packet): ");
+	p1 = nic_alloc(nic, 1500);
+	if(p1 != NULL)
+		fail("packet must not be allocated: %p", p1);
+	else
+		pass();
+	
+	printf("Pool: Small packets allocation from rest of small chunks: ");
+	used = bitmap_used(nic);
+	while(nic->pool.count - used >= chunks(nic, 0)) {
+		ps[i] = nic_alloc(nic, 0);
+		if(ps[i] == NULL) {
+			fail("Small packet must be allocated: index: %d, packet: %p", i, ps[i]);
+		}
+		i++;
+		used = bitmap_used(nic);
+	}
+	pass();
+	
+	printf("Pool: Check overflow(small packet): ");
+	p1 = nic_alloc(nic, 0);
+	if(p1 != NULL)
+		fail("packet must not be allocated: %p", p1);
+	else
+		pass();
+	
+	printf("Pool: Clear all: ");
+	for(int j = 0; j < i; j++) {
+		if(!nic_free(ps[j]))
+			fail("packet can not be freed: index: %d, packet: %p\n", j, ps[j]);
+	}
+
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("0 chunk must be used: %d", used);
+	else
+		pass();
+	
+
+	p1 = nic_alloc(nic, 64);
+	used = bitmap_used(nic);
+	printf("Pool: Check 64 bytes packet allocation after full allocation: packet: %p, used: %d", p1, used);
+	if(used == chunks(nic, 64) && p1 != NULL)
+		pass();
+	else
+		fail("packet must not be NULL and %d chunks must be used", chunks(nic, 64));
+	
+	
+	nic_free(p1);
+	used = bitmap_used(nic);
+	printf("Pool: Check 64 bytes packet deallocation after full allocation: used: %d", used);
+	if(used == 0)
+		pass();
+	else
+		fail("0 chunks must be used");
+	
+	
+	printf("rx queue: Check initial status: ");
+	if(nic_has_rx(nic))
+		fail("nic_has_rx must be false");
+	
+	p1 = nic_rx(nic);
+	if(p1 != NULL)
+		fail("nic_rx must be NULL: %p", p1);
+
+	uint32_t size = nic_rx_size(nic);
+	if(size != 0)
+		fail("nic_rx_size must be 0: %d", size);
+	
+	if(!queue_available(&nic->rx))
+		fail("rx queue must be available");
+	
+	pass();
+
+
+	printf("rx queue: push one: ");
+	p1 = nic_alloc(nic, 64);
+	if(vnic_rx2(vnic, p1) != VNIC_ERROR_NOERROR)
+		fail("vnic_rx2 must succeed");
+	
+	if(!nic_has_rx(nic))
+		fail("nic_has_rx must be true");
+	
+	size = nic_rx_size(nic);
+	if(size != 1)
+		fail("nic_rx_size must be 1: %d", size);
+	
+	pass();
+	
+
+	printf("rx queue: pop one: ");
+	
+	Packet* p2 = nic_rx(nic);
+	if(p2 != p1)
+		fail("nic_rx returned wrong pointer: %p != %p", p1, p2);
+	
+	size = nic_rx_size(nic);
+	if(size != 0)
+		fail("nic_rx_size must be 0: %d", size);
+	
+	nic_free(p2);
+	
+	pass();
+	
+
+	printf("rx queue: push full: ");
+	for(i = 0; i < nic->rx.size - 1; i++) {
+		ps[i] = nic_alloc(nic, 0);
+		if(ps[i] == NULL)
+			fail("cannot alloc packet: count: %d", i);
+		
+		if(vnic_rx2(vnic, ps[i]) != VNIC_ERROR_NOERROR)
+			fail("cannot push rx: count: %d, queue size: %d", i, nic->rx.size);
+	}
+	
+	if(queue_available(&nic->rx))
+		fail("rx queue must be full");
+	
+	size = nic_rx_size(nic);
+	if(size != nic->rx.size - 1)
+		fail("nic_rx_size must return %d but %d", nic->rx.size - 1, size);
+	
+	if(!nic_has_rx(nic))
+		fail("nic_has_rx must return true");
+	
+	pass();
+	
+
+	printf("rx queue: overflow: ");
+
+	used = bitmap_used(nic);
+	
+	p1 = nic_alloc(nic, 0);
+	if(p1 == NULL)
+		fail("packet allocation failed");
+	
+	if(vnic_rx2(vnic, p1) == VNIC_ERROR_NOERROR)
+		fail("push overflow: count: %d, queue size: %d", i, nic->rx.size);
+	
+	int used2 = bitmap_used(nic);
+	if(used != used2)
+		fail("packet pool usage is changed: used: %d != %d", used, used2);
+	
+	if(queue_available(&nic->rx))
+		fail("rx queue must be full");
+	
+	size = nic_rx_size(nic);
+	if(size != nic->rx.size - 1)
+		fail("nic_rx_size must return %d but %d", nic->rx.size - 1, size);
+	
+	if(!nic_has_rx(nic))
+		fail("nic_has_rx must return true");
+	
+	pass();
+	
+
+	printf("rx queue: pop: ");
+	for(i = 0; i < nic->rx.size - 1; i++) {
+		Packet* p1 = nic_rx(nic);
+		if(p1 != ps[i])
+			fail("worong pointer returned: %p, expected: %p", p1, (void*)(uintptr_t)i);
+
+		nic_free(p1);
+	}
+	
+	if(!queue_available(&nic->rx))
+		fail("rx queue must be available");
+	
+	size = nic_rx_size(nic);
+	if(size != 0)
+		fail("nic_rx_size must return 0 but %d", size);
+	
+	if(nic_has_rx(nic))
+		fail("nic_has_rx must return false");
+	
+	pass();
+
+
+	printf("rx queue: push one after overflow: ");
+	p1 = nic_alloc(nic, 0);
+	if(p1 == NULL)
+		fail("cannot alloc packet: %p\n", p1);
+	
+	if(vnic_rx2(vnic, p1) != VNIC_ERROR_NOERROR)
+		fail("vnic_rx2 must succeed");
+	
+	if(!nic_has_rx(nic))
+		fail("nic_has_rx must be true");
+	
+	size = nic_rx_size(nic);
+	if(size != 1)
+		fail("nic_rx_size must be 1: %d", size);
+	
+	pass();
+	
+
+	printf("rx queue: pop one after overflow: ");
+	
+	p2 = nic_rx(nic);
+	if(p1 != p2)
+		fail("nic_rx returned wrong pointer: %p != %p", p1, p2);
+	
+	size = nic_rx_size(nic);
+	if(size != 0)
+		fail("nic_rx_size must be 0: %d", size);
+	
+	nic_free(p2);
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("packet is not freed: used: %d", used);
+	
+	pass();
+
+
+	printf("srx queue: Check initial status: ");
+	if(nic_has_srx(nic))
+		fail("nic_has_srx must be false");
+	
+	p1 = nic_srx(nic);
+	if(p1 != NULL)
+		fail("nic_srx must be NULL: %p", p1);
+
+	size = nic_srx_size(nic);
+	if(size != 0)
+		fail("nic_srx_size must be 0: %d", size);
+	
+	if(!queue_available(&nic->srx))
+		fail("srx queue must be available");
+	
+	pass();
+
+
+	printf("srx queue: push one: ");
+	p1 = nic_alloc(nic, 64);
+	if(!vnic_srx2(vnic, p1))
+		fail("vnic_srx2 must return true");
+	
+	if(!nic_has_srx(nic))
+		fail("nic_has_srx must be true");
+	
+	size = nic_srx_size(nic);
+	if(size != 1)
+		fail("nic_srx_size must be 1: %d", size);
+	
+	pass();
+	
+
+	printf("srx queue: pop one: ");
+	
+	p2 = nic_srx(nic);
+	if(p2 != p1)
+		fail("nic_srx returned wrong pointer: %p != %p", p1, p2);
+	
+	size = nic_srx_size(nic);
+	if(size != 0)
+		fail("nic_srx_size must be 0: %d", size);
+	
+	nic_free(p2);
+	
+	pass();
+	
+
+	printf("srx queue: push full: ");
+	for(i = 0; i < nic->srx.size - 1; i++) {
+		ps[i] = nic_alloc(nic, 0);
+		if(ps[i] == NULL)
+			fail("cannot alloc packet: count: %d", i);
+		
+		if(!vnic_srx2(vnic, ps[i]))
+			fail("cannot push srx: count: %d, queue size: %d", i, nic->srx.size);
+	}
+	
+	if(queue_available(&nic->srx))
+		fail("srx queue must be full");
+	
+	size = nic_srx_size(nic);
+	if(size != nic->srx.size - 1)
+		fail("nic_srx_size must return %d but %d", nic->srx.size - 1, size);
+	
+	if(!nic_has_srx(nic))
+		fail("nic_has_srx must return true");
+	
+	pass();
+	
+
+	printf("srx queue: overflow: ");
+
+	used = bitmap_used(nic);
+	
+	p1 = nic_alloc(nic, 0);
+	if(p1 == NULL)
+		fail("packet allocation failed");
+	
+	if(vnic_srx2(vnic, p1))
+		fail("push overflow: count: %d, queue size: %d", i, nic->srx.size);
+	
+	used2 = bitmap_used(nic);
+	if(used != used2)
+		fail("packet pool usage is changed: used: %d != %d", used, used2);
+	
+	if(queue_available(&nic->srx))
+		fail("srx queue must be full");
+	
+	size = nic_srx_size(nic);
+	if(size != nic->srx.size - 1)
+		fail("nic_srx_size must return %d but %d", nic->srx.size - 1, size);
+	
+	if(!nic_has_srx(nic))
+		fail("nic_has_srx must return true");
+	
+	pass();
+	
+
+	printf("srx queue: pop: ");
+	for(i = 0; i < nic->srx.size - 1; i++) {
+		Packet* p1 = nic_srx(nic);
+		if(p1 != ps[i])
+			fail("worong pointer returned: %p, expected: %p", p1, (void*)(uintptr_t)i);
+
+		nic_free(p1);
+	}
+	
+	if(!queue_available(&nic->srx))
+		fail("srx queue must be available");
+	
+	size = nic_srx_size(nic);
+	if(size != 0)
+		fail("nic_srx_size must return 0 but %d", size);
+	
+	if(nic_has_srx(nic))
+		fail("nic_has_srx must return false");
+	
+	pass();
+
+
+	printf("srx queue: push one after overflow: ");
+	p1 = nic_alloc(nic, 0);
+	if(p1 == NULL)
+		fail("cannot alloc packet: %p\n", p1);
+	
+	if(!vnic_srx2(vnic, p1))
+		fail("vnic_srx2 must return true");
+	
+	if(!nic_has_srx(nic))
+		fail("nic_has_srx must be true");
+	
+	size = nic_srx_size(nic);
+	if(size != 1)
+		fail("nic_srx_size must be 1: %d", size);
+	
+	pass();
+	
+
+	printf("srx queue: pop one after overflow: ");
+	
+	p2 = nic_srx(nic);
+	if(p1 != p2)
+		fail("nic_srx returned wrong pointer: %p != %p", p1, p2);
+	
+	size = nic_srx_size(nic);
+	if(size != 0)
+		fail("nic_srx_size must be 0: %d", size);
+	
+	nic_free(p2);
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("packet is not freed: used: %d", used);
+	
+	pass();
+
+
+
+	printf("tx queue: Check initial state: ");
+
+	size = nic_tx_size(nic);
+	if(size != 0)
+		fail("nic_tx_size must be 0: %d", size);
+	
+	if(!nic_tx_available(nic))
+		fail("nic_tx_available must be true");
+	
+	if(!queue_empty(&nic->tx))
+		fail("tx queue must be empty");
+
+	pass();
+	
+
+	printf("tx queue: tx one: ");
+	p1 = nic_alloc(nic, 0);
+	
+	if(!nic_tx(nic, p1))
+		fail("nic_tx must be true");
+	
+	size = nic_tx_size(nic);
+	if(size != 1)
+		fail("nic_tx_size must be 1: %d", size);
+	
+	if(!nic_tx_available(nic))
+		fail("nic_tx_available must be true");
+	
+	if(!!queue_empty(&nic->tx))
+		fail("tx queue must not be empty");
+
+	pass();
+	
+
+	printf("tx queue: send one: ");
+	p1 = queue_pop(nic, &nic->tx);
+	nic_free(p1);
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("cannot free packet: %d", used);
+	
+	size = nic_tx_size(nic);
+	if(size != 0)
+		fail("nic_tx_size must be 0: %d", size);
+	
+	if(!nic_tx_available(nic))
+		fail("nic_tx_available must be true");
+	
+	if(!queue_empty(&nic->tx))
+		fail("tx queue must be empty");
+	
+	pass();
+
+
+	printf("tx queue: tx full: ");
+	for(i = 0; i < nic->tx.size - 1; i++) {
+		ps[i] = nic_alloc(nic, 0);
+		if(ps[i] == NULL)
+			fail("cannot alloc packet: count: %d", i + 1);
+		
+		if(!nic_tx(nic, ps[i]))
+			fail("cannot tx packet: index: %d", i);
+	}
+
+	size = nic_tx_size(nic);
+	if(size != nic->tx.size - 1)
+		fail("nic_tx_size must be %d: %d", nic->tx.size - 1, size);
+	
+	if(nic_tx_available(nic))
+		fail("nic_tx_available must be false");
+	
+	if(!!queue_empty(&nic->tx))
+		fail("tx queue must not be empty");
+	
+	pass();
+
+
+	printf("tx queue: overflow: ");
+	
+	used = bitmap_used(nic);
+	
+	p1 = nic_alloc(nic, 0);
+	
+	if(nic_tx(nic, p1))
+		fail("nic_tx overflow");
+	
+	used2 = bitmap_used(nic);
+	
+	if(used != used2)
+		fail("packet not freed on overflow %d != %d", used, used2);
+		
+	if(nic_try_tx(nic, p1))
+		fail("nic_try_tx overflow");
+	
+	used2 = bitmap_used(nic);
+	
+	if(used != used2)
+		fail("packet freed on try_tx %d != %d", used, used2);
+	
+	if(nic_tx_dup(nic, p1))
+		fail("nic_tx_dup overflow");
+	
+	used2 = bitmap_used(nic);
+	
+	if(used != used2)
+		fail("packet allocated on overflow %d != %d", used, used2);
+
+	size = nic_tx_size(nic);
+	if(size != nic->tx.size - 1)
+		fail("nic_tx_size must be %d: %d", nic->tx.size - 1, size);
+	
+	if(nic_tx_available(nic))
+		fail("nic_tx_available must be false");
+	
+	if(!!queue_empty(&nic->tx))
+		fail("tx queue must not be empty");
+	
+	pass();
+	
+	
+	printf("tx queue: send all: ");
+	for(i = 0; i < nic->tx.size - 1; i++) {
+		p1 = queue_pop(nic, &nic->tx);
+		if(p1 != ps[i])
+			fail("wrong pointer returned: %p != %p", ps[i], p1);
+		
+		if(!nic_free(p1))
+			fail("cannot free packet: %p", p1);
+	}
+
+	size = nic_tx_size(nic);
+	if(size != 0)
+		fail("nic_tx_size must be 0: %d", 0, size);
+	
+	if(!nic_tx_available(nic))
+		fail("nic_tx_available must be true");
+	
+	if(!queue_empty(&nic->tx))
+		fail("tx queue must be empty");
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("packet is not freed: used: %d", used);
+		
+	pass();
+
+
+	printf("tx queue: tx one after overflow: ");
+	p1 = nic_alloc(nic, 0);
+	
+	if(!nic_tx(nic, p1))
+		fail("nic_tx must be true");
+	
+	size = nic_tx_size(nic);
+	if(size != 1)
+		fail("nic_tx_size must be 1: %d", size);
+	
+	if(!nic_tx_available(nic))
+		fail("nic_tx_available must be true");
+	
+	if(!!queue_empty(&nic->tx))
+		fail("tx queue must not be empty");
+
+	pass();
 	
-	VNIC* vnic = (VNIC*)buffer;
+
+	printf("tx queue: send one after overflow: ");
+	p1 = queue_pop(nic, &nic->tx);
+	nic_free(p1);
 	
-	/*
-	printf("* rx\n");
-	dump_queue(vnic, &vnic->rx);
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("cannot free packet: %d", used);
 	
-	printf("* tx\n");
-	dump_queue(vnic, &vnic->tx);
+	size = nic_tx_size(nic);
+	if(size != 0)
+		fail("nic_tx_size must be 0: %d", size);
 	
-	printf("* srx\n");
-	dump_queue(vnic, &vnic->srx)
+	if(!nic_tx_available(nic))
+		fail("nic_tx_available must be true");
 	
-	printf("* stx\n");
-	dump_queue(vnic, &vnic->stx)
+	if(!queue_empty(&nic->tx))
+		fail("tx queue must be empty");
 	
-	printf("* Bitmap\n");
-	dump_bitmap(vnic);
-	*/
-	printf("* Config\n");
-	print_config(vnic);
+	pass();
+
+
+	printf("Stx queue: Check initial state: ");
+
+	size = nic_stx_size(nic);
+	if(size != 0)
+		fail("nic_stx_size must be 0: %d", size);
 	
-	exit(1);
-}
+	if(!nic_has_stx(nic))
+		fail("nic_has_stx must be true");
+	
+	if(!queue_empty(&nic->stx))
+		fail("stx queue must be empty");
 
-int main(int argc, char** argv) {
-	VNIC* vnic = (VNIC*)buffer;
+	pass();
+	
+
+	printf("Stx queue: stx one: ");
+	p1 = nic_alloc(nic, 0);
+	
+	if(!nic_stx(nic, p1))
+		fail("nic_stx must be true");
+	
+	size = nic_stx_size(nic);
+	if(size != 1)
+		fail("nic_stx_size must be 1: %d", size);
+	
+	if(!nic_has_stx(nic))
+		fail("nic_has_stx must be true");
+	
+	if(!!queue_empty(&nic->stx))
+		fail("stx queue must not be empty");
+
+	pass();
+	
+
+	printf("Stx queue: send one: ");
+	p1 = queue_pop(nic, &nic->stx);
+	nic_free(p1);
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("cannot free packet: %d", used);
+	
+	size = nic_stx_size(nic);
+	if(size != 0)
+		fail("nic_stx_size must be 0: %d", size);
+	
+	if(!nic_has_stx(nic))
+		fail("nic_has_stx must be true");
+	
+	if(!queue_empty(&nic->stx))
+		fail("stx queue must be empty");
+	
+	pass();
+
+
+	printf("Stx queue: stx full: ");
+	for(i = 0; i < nic->stx.size - 1; i++) {
+		ps[i] = nic_alloc(nic, 0);
+		if(ps[i] == NULL)
+			fail("cannot alloc packet: count: %d", i + 1);
+		
+		if(!nic_stx(nic, ps[i]))
+			fail("cannot stx packet: index: %d", i);
+	}
+
+	size = nic_stx_size(nic);
+	if(size != nic->stx.size - 1)
+		fail("nic_stx_size must be %d: %d", nic->stx.size - 1, size);
+	
+	if(nic_has_stx(nic))
+		fail("nic_has_stx must be false");
+	
+	if(!!queue_empty(&nic->stx))
+		fail("stx queue must not be empty");
+	
+	pass();
+
+
+	printf("Stx queue: overflow: ");
+	
+	used = bitmap_used(nic);
+	
+	p1 = nic_alloc(nic, 0);
+	
+	if(nic_stx(nic, p1))
+		fail("nic_stx overflow");
+	
+	used2 = bitmap_used(nic);
+	
+	if(used != used2)
+		fail("packet not freed on overflow %d != %d", used, used2);
+		
+	if(nic_try_stx(nic, p1))
+		fail("nic_try_stx overflow");
+	
+	used2 = bitmap_used(nic);
+	
+	if(used != used2)
+		fail("packet freed on try_stx %d != %d", used, used2);
+	
+	if(nic_stx_dup(nic, p1))
+		fail("nic_stx_dup overflow");
+	
+	used2 = bitmap_used(nic);
+	
+	if(used != used2)
+		fail("packet allocated on overflow %d != %d", used, used2);
+
+	size = nic_stx_size(nic);
+	if(size != nic->stx.size - 1)
+		fail("nic_stx_size must be %d: %d", nic->stx.size - 1, size);
+	
+	if(nic_has_stx(nic))
+		fail("nic_has_stx must be false");
+	
+	if(!!queue_empty(&nic->stx))
+		fail("stx queue must not be empty");
+	
+	pass();
+	
+	
+	printf("Stx queue: send all: ");
+	for(i = 0; i < nic->stx.size - 1; i++) {
+		p1 = queue_pop(nic, &nic->stx);
+		if(p1 != ps[i])
+			fail("wrong pointer returned: %p != %p", ps[i], p1);
+		
+		if(!nic_free(p1))
+			fail("cannot free packet: %p", p1);
+	}
+
+	size = nic_stx_size(nic);
+	if(size != 0)
+		fail("nic_stx_size must be 0: %d", 0, size);
+	
+	if(!nic_has_stx(nic))
+		fail("nic_has_stx must be true");
+	
+	if(!queue_empty(&nic->stx))
+		fail("stx queue must be empty");
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("packet is not freed: used: %d", used);
+		
+	pass();
+
+
+	printf("Stx queue: stx one after overflow: ");
+	p1 = nic_alloc(nic, 0);
+	
+	if(!nic_stx(nic, p1))
+		fail("nic_stx must be true");
+	
+	size = nic_stx_size(nic);
+	if(size != 1)
+		fail("nic_stx_size must be 1: %d", size);
+	
+	if(!nic_has_stx(nic))
+		fail("nic_has_stx must be true");
+	
+	if(!!queue_empty(&nic->stx))
+		fail("stx queue must not be empty");
+
+	pass();
+	
+
+	printf("Stx queue: send one after overflow: ");
+	p1 = queue_pop(nic, &nic->stx);
+	nic_free(p1);
+	
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("cannot free packet: %d", used);
+	
+	size = nic_stx_size(nic);
+	if(size != 0)
+		fail("nic_stx_size must be 0: %d", size);
+	
+	if(!nic_has_stx(nic))
+		fail("nic_has_stx must be true");
+	
+	if(!queue_empty(&nic->stx))
+		fail("stx queue must be empty");
+	
+	pass();
+	
+
+	printf("Burst: rx push and pop across the ring end: ");
+	Packet* bursts[32];
+	for(i = 0; i < 20; i++) {
+		bursts[i] = nic_alloc(nic, 0);
+		if(bursts[i] == NULL)
+			fail("cannot alloc packet: count: %d", i + 1);
+	}
+
+	for(int round = 0; round < 16; round++) {
+		uint32_t n = vnic_rx_burst(vnic, bursts, 20);
+		if(n != 20)
+			fail("vnic_rx_burst must queue 20 packets: %d", n);
+
+		size = nic_rx_size(nic);
+		if(size != 20)
+			fail("nic_rx_size must be 20: %d", size);
+
+		Packet* bursts2[32];
+		n = nic_rx_burst(nic, bursts2, 32);
+		if(n != 20)
+			fail("nic_rx_burst must return 20 packets: %d", n);
+
+		for(int j = 0; j < 20; j++) {
+			if(bursts2[j] != bursts[j])
+				fail("wrong pointer returned: %p != %p", bursts[j], bursts2[j]);
+		}
+	}
+
+	if(nic_has_rx(nic))
+		fail("nic_has_rx must be false");
+
+	pass();
+
+
+	printf("Burst: rx overflow frees the rest: ");
+	used = bitmap_used(nic);
+	ps[0] = nic_alloc(nic, 0);
+	for(i = 0; i < nic->rx.size - 2; i++) {
+		if(vnic_rx2(vnic, ps[0]) != VNIC_ERROR_NOERROR)	// Same packet queued many times
+			fail("cannot fill rx queue: %d", i);
+	}
+
+	uint32_t n = vnic_rx_burst(vnic, bursts, 20);
+	if(n != 1)
+		fail("vnic_rx_burst must queue only 1 packet: %d", n);
+
+	used2 = bitmap_used(nic);
+	if(used2 != used - chunks(nic, 0) * 18)
+		fail("19 packets must be freed: used: %d -> %d", used, used2);
+
+	Packet* bursts2[32];
+	for(i = 0; i < nic->rx.size - 1; ) {
+		n = nic_rx_burst(nic, bursts2, 32);
+		if(n == 0)
+			fail("nic_rx_burst must not be empty: %d", i);
+		i += n;
+	}
+
+	nic_free(ps[0]);
+	nic_free(bursts[0]);
+	used = bitmap_used(nic);
+	if(used != 0)
+		fail("packet is not freed: used: %d", used);
+
+	pass();
+
+
+	printf("Burst: tx: ");
+	for(i = 0; i < 8; i++)
+		bursts[i] = nic_alloc(nic, 0);
+
+	n = nic_tx_burst(nic, bursts, 8);
+	if(n != 8)
+		fail("nic_tx_burst must queue 8 packets: %d", n);
+
+	n = queue_pop_burst(nic, &nic->tx, bursts2, 32);
+	if(n != 8 || bursts2[7] != bursts[7])
+		fail("queue_pop_burst must return 8 packets: %d", n);
+
+	for(i = 0; i < 8; i++)
+		nic_free(bursts2[i]);
+
+	if(bitmap_used(nic) != used)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Burst: vnic_alloc_burst: ");
+	n = vnic_alloc_burst(vnic, 1526, bursts, 32);
+	if(n != 32)
+		fail("vnic_alloc_burst must allocate 32 packets: %d", n);
+
+	used2 = bitmap_used(nic);
+	if(used2 != used + chunks(nic, 1526) * 32)
+		fail("wrong chunks used: %d -> %d", used, used2);
+
+	for(i = 0; i < 32; i++) {
+		if(bursts[i]->size < 1526 || bursts[i]->start != 0 || bursts[i]->end != 0)
+			fail("wrong packet: size: %d start: %d end: %d", bursts[i]->size, bursts[i]->start, bursts[i]->end);
+
+		nic_free(bursts[i]);
+	}
+
+	if(bitmap_used(nic) != used)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Burst: nic_free_burst frees singles, chains and shared packets: ");
+	for(i = 0; i < 16; i++)
+		bursts[i] = i == 8 ? nic_alloc(nic, 1000) : nic_alloc(nic, 64);
+
+	// A chain in the middle of the run, and a packet with a second owner
+	bursts[8]->end = bursts[8]->start + 1000;
+	Packet* tail = nic_alloc(nic, 1000);
+	tail->end = tail->start + 1000;
+	packet_append(bursts[8], bursts[8], tail);
+	nic_ref(bursts[3]);
+
+	n = nic_free_burst(bursts, 16);
+	if(n != 16)
+		fail("16 packets must be freed: %d", n);
+
+	if(bitmap_used(nic) != used + chunks(nic, 64))
+		fail("only the shared packet must stay: used: %d", bitmap_used(nic));
+
+	if(nic_free_burst(&bursts[3], 1) != 1 || bitmap_used(nic) != used)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Shared: last nic_free releases the packet: ");
+	ps[0] = nic_alloc(nic, 0);
+	if(ps[0]->refcount != 1)
+		fail("new packet must have one owner: %d", ps[0]->refcount);
+
+	nic_ref(nic_ref(ps[0]));
+	for(i = 0; i < 2; i++) {
+		if(vnic_rx2(vnic, ps[0]) != VNIC_ERROR_NOERROR)	// Shared by two queue entries
+			fail("cannot queue shared packet: %d", i);
+	}
+
+	nic_free(ps[0]);
+	if(bitmap_used(nic) != used + chunks(nic, 0))
+		fail("shared packet must not be freed: used: %d", bitmap_used(nic));
+
+	for(i = 0; i < 2; i++) {
+		Packet* packet = nic_rx(nic);
+		if(packet != ps[0])
+			fail("wrong pointer returned: %p != %p", ps[0], packet);
+
+		nic_free(packet);
+	}
+
+	if(bitmap_used(nic) != used)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	uint16_t total = nic_config_total(nic);
+	uint16_t available = nic_config_available(nic);
+
+	printf("Config: Check total and available size equals: ");
+	if(total != available)
+		fail("available: %d != total: %d\n", available, total);
+	
+	pass();
+	
+	printf("Config: alloc one: ");
+	int32_t key = nic_config_alloc(nic, "net.ipv4", 12);
+	if(key < 0)
+		fail("cannot alloc config: %d", key);
+	else
+		printf("%d", key);
+	
+	pass();
+	
+	printf("Config: available consumption check 1: ");
+	uint32_t available2 = nic_config_available(nic);
+	if(available2 != available - 4 - 12 - 12)
+		fail("available memory is differ: %d expected: %d\n", available2, available - 4 - 12 - 12);
+	
+	available += - 4 - 12 - 12;
+	
+	pass();
+	
+	printf("Config: find key: ");
+	int32_t key2 = nic_config_key(nic, "net.ipv4");
+	if(key2 != key)
+		fail("cannot find key for net.ipv4: %d", key2);
+	
+	pass();
+	
+	printf("Config: get size: ");
+	size = nic_config_size(nic, key);
+	if(size != 12)
+		fail("config size is wrong: %d\n", size);
+	else
+		printf("%d", size);
+	
+	pass();
+	
+	
+	printf("Config: alloc next: ");
+	key2 = nic_config_alloc(nic, "net.ipv6", 48);
+	if(key2 < 0)
+		fail("cannot alloc config: %d", key2);
+	
+	if(key + 1 + (strlen("net.ipv4") + 1 + 3) / 4 + 12 / 4 != key2)
+		fail("wrong second key allocated: %d", key2);
+	
+	pass();
+	
+	printf("Config: available consumption check 2: ");
+	available2 = nic_config_available(nic);
+	if(available2 != available - 4 - 12 - 48)
+		fail("available memory is differ: %d expected: %d\n", available2, available - 4 - 12 - 48);
+	
+	available += - 4 - 12 - 48;
+	
+	pass();
+	
+	printf("Config: find second key: ");
+	int32_t key3 = nic_config_key(nic, "net.ipv6");
+	if(key3 != key2)
+		fail("cannot find key for net.ipv6: %d", key3);
+	
+	pass();
+	
+	printf("Config: get size: ");
+	size = nic_config_size(nic, key2);
+	if(size != 48)
+		fail("config size is wrong: %d\n", size);
+	else
+		printf("%d", size);
+	
+	pass();
 	
-	vnic_driver_init(1, 0x001122334455, vnic, 2 * 1024 * 1024,
-		1000000000L, 1000000000L,
-		16, 32, 128, 128, 64, 64);
+	printf("Config: check overwriting: ");
 	
-	dump(vnic);
-
-
-	int used = bitmap_used(vnic);
-	printf("Pool: Check initial used: %d", used);
-	if(used == 0)
-		pass();
-	else
-		fail("initial used must be 0");
+	uint32_t* ipv4 = nic_config_get(nic, key);
+	ipv4[0] = 0x11223344;
+	ipv4[1] = 0x55667788;
+	ipv4[2] = 0x99001122;
 	
+	uint64_t* ipv6 = nic_config_get(nic, key2);
+	ipv6[0] = 0x0102030405060708;
+	ipv6[1] = 0x0900010203040506;
+	ipv6[2] = 0x0708091011121314;
+	ipv6[3] = 0x1516171819202122;
+	ipv6[4] = 0x2324252627282930;
+	ipv6[5] = 0x3132333435363738;
 	
-	Packet* p1 = vnic_alloc(vnic, 64);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 64 bytes packet allocation: packet: %p, used: %d", p1, used);
-	if(used == 2 && p1 != NULL)
-		pass();
-	else
-		fail("packet must not be NULL and 2 chunks must be used");
+	printf("Config: find key(2): ");
+	key3 = nic_config_key(nic, "net.ipv4");
+	if(key3 != key)
+		fail("cannot find key for net.ipv4: %d", key3);
 	
+	pass();
 	
-	vnic_free(p1);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 64 bytes packet deallocation: used: %d", used);
-	if(used == 0)
-		pass();
+	printf("Config: get size(2): ");
+	size = nic_config_size(nic, key);
+	if(size != 12)
+		fail("config size is wrong: %d\n", size);
 	else
-		fail("0 chunks must be used");
+		printf("%d", size);
 	
+	pass();
 	
-	p1 = vnic_alloc(vnic, 512);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 512 bytes packet allocation: packet: %p, used: %d", p1, used);
-	if(used == 9 && p1 != NULL)
-		pass();
-	else
-		fail("packet must not be NULL and 9 chunks must be used");
 	
+	printf("Config: find second key(2): ");
+	key3 = nic_config_key(nic, "net.ipv6");
+	if(key3 != key2)
+		fail("cannot find key for net.ipv6: %d", key3);
+	
+	pass();
 	
-	vnic_free(p1);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 512cbytes packet deallocation: used: %d", used);
-	if(used == 0)
-		pass();
+	printf("Config: get size(2): ");
+	size = nic_config_size(nic, key2);
+	if(size != 48)
+		fail("config size is wrong: %d\n", size);
 	else
-		fail("0 chunks must be used");
+		printf("%d", size);
 	
+	pass();
 	
-	p1 = vnic_alloc(vnic, 1500);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 1500 bytes packet allocation: packet: %p, used: %d", p1, used);
-	if(used == 25 && p1 != NULL)
-		pass();
-	else
-		fail("packet must not be NULL and 25 chunks must be used");
+
+	printf("Config: free first alloc: ");
+	nic_config_free(nic, key);
 	
+	key = nic_config_key(nic, "net.ipvs");
+	if(key >= 0)
+		fail("freed key exists: %d", key);
 	
-	vnic_free(p1);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 1500 bytes packet deallocation: used: %d", used);
-	if(used == 0)
-		pass();
-	else
-		fail("0 chunks must be used");
+	pass();
 	
+	printf("Config: available consumption check 3: ");
+	available2 = nic_config_available(nic);
+	if(available2 != available + 4 + 12 + 12)
+		fail("available memory is differ: %d expected: %d\n", available2, available + 4 + 12 + 12);
 	
-	p1 = vnic_alloc(vnic, 0);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 0 bytes packet allocation: packet: %p, used: %d", p1, used);
-	if(used == 1 && p1 != NULL)
-		pass();
-	else
-		fail("packet must not be NULL and 1 chunk must be used");
+	available += 4 + 12 + 12;
 	
+	printf("Config: overflow: ");
+	uint32_t chunk = available - 4 - 12 - 12 - 4 - 8;
+	key3 = nic_config_alloc(nic, "chunk", chunk);
+	if(key3 < 0)
+		fail("cannot allocate big chunk: %d", key3);
 	
-	vnic_free(p1);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 0 bytes packet deallocation: used: %d", used);
-	if(used == 0)
-		pass();
-	else
-		fail("0 chunks must be used");
+	key = nic_config_alloc(nic, "net.ipv4", 12);
+	if(key < 0)
+		fail("cannot allocate first chunk: %d", key);
 	
+	pass();
 	
-	printf("Pool: Check full allocation: ");
-	vnic->pool.index = 0;
+	printf("Config: available consumption check 4: ");
+	available = nic_config_available(nic);
+	if(available != 0)
+		fail("available memory is differ: %d expected: %d\n", available, 0);
 	
-	int max = vnic->pool.count / 25;
-	Packet* ps[2048] = { NULL, };
-	int i;
-	for(i = 0; i < max; i++) {
-		ps[i] = vnic_alloc(vnic, 1500);
-		if(ps[i] == NULL)
-			fail("allocation failed: index: %d", i);
+	pass();
+	
+	print_config(nic);
+
+
+	printf("Config: handles resolve once and see updates: ");
+	nic_config_free(nic, key3);
+	NICConfigHandle handle = nic_config_handle(nic, "net.ipv4");
+	if(!handle || nic_config_get_h(nic, handle) != nic_config_get(nic, key))
+		fail("handle of net.ipv4 must point to its value");
+
+	if(nic_config_handle(nic, "chunk") != 0)
+		fail("freed entry must have no handle");
+
+	*(uint32_t*)nic_config_get(nic, key) = 0xc0a8640a;
+	if(*(uint32_t*)nic_config_get_h(nic, handle) != 0xc0a8640a)
+		fail("update must be visible through the handle");
+
+	pass();
+
+	printf("Config: names collide in the index: ");
+	char name[16];
+	int32_t names = 0;
+	for(i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		sprintf(name, "n%d", i);
+		if(nic_config_alloc(nic, name, 4) < 0)
+			break;
+		names++;
 	}
 
-	used = bitmap_used(vnic);
-	if(used != max * 25)
-		fail("%d * 25 chunks must be used: %d", max, used);
-	else
-		pass();
-	
+	printf("%d names ", names);
+	if(names != NIC_CONFIG_INDEX_SIZE - 2)	// net.ipv4 and net.ipv6 hold two slots
+		fail("index must be filled");
 
-	printf("Pool: Check overflow(big packet): ");
-	p1 = vnic_alloc(vnic, 1500);
-	if(p1 != NULL)
-		fail("packet must not be allocated: %p", p1);
-	else
-		pass();
-	
-	printf("Pool: Small packets allocation from rest of small chunks: ");
-	used = bitmap_used(vnic);
-	while(vnic->pool.count - used > 0) {
-		ps[i] = vnic_alloc(vnic, 0);
-		if(ps[i] == NULL) {
-			fail("Small packet must be allocated: index: %d, packet: %p", i, ps[i]);
+	for(i = 0; i < names; i += 7) {
+		sprintf(name, "n%d", i);
+		int32_t found = nic_config_key(nic, name);
+		if(found < 0 || strcmp((char*)((uint32_t*)nic->config_head + found + 1), name))
+			fail("cannot find %s", name);
+	}
+
+	for(i = 0; i < names; i++) {
+		sprintf(name, "n%d", i);
+		nic_config_free(nic, nic_config_key(nic, name));
+	}
+
+	if(nic_config_key(nic, "net.ipv4") != key || nic_config_key(nic, "n3") >= 0)
+		fail("removed names must not hide the others");
+
+	pass();
+
+
+	printf("MultiQueue: init 4 queue pairs: ");
+	uint64_t attrs2[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"test",
+		VNIC_POOL_SIZE, 2 * 1024 * 1024,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 16,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 128,
+		VNIC_TX_QUEUE_SIZE, 128,
+		VNIC_SLOW_RX_QUEUE_SIZE, 64,
+		VNIC_SLOW_TX_QUEUE_SIZE, 64,
+		VNIC_QUEUE_COUNT, 4,
+		VNIC_NONE
+	};
+
+	nic_cache_flush(nic);	// The NIC memory is reused
+	if(!vnic_init(vnic, attrs2))
+		fail("cannot initialize NIC");
+
+	if(nic_queue_count(nic) != 4 || nic_queue_pair(nic, 4) != NULL)
+		fail("must have 4 queue pairs: %d", nic_queue_count(nic));
+
+	for(i = 1; i < 4; i++) {
+		NICQueue* pair = nic_queue_pair(nic, i);
+		if((uintptr_t)pair % NIC_CACHE_LINE_SIZE || pair->size != 128 || pair[1].size != 128)
+			fail("wrong queue pair %d: %p", i, pair);
+	}
+
+	pass();
+
+
+	printf("MultiQueue: both directions of a flow share a queue: ");
+	// UDP over IPv4: 10.0.0.1 -> 10.0.0.2
+	uint8_t frame[64] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x00, 0x11, 0x22, 0x33, 0x44, 0x66, 0x08, 0x00,
+		0x45, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00,
+		10, 0, 0, 1, 10, 0, 0, 2,
+		0x03, 0xe8, 0x07, 0xd0, 0x00, 0x0c, 0x00, 0x00,
+	};
+	uint8_t reverse[64];
+	memcpy(reverse, frame, sizeof(frame));
+	memcpy(reverse + 26, frame + 30, 4);
+	memcpy(reverse + 30, frame + 26, 4);
+	memcpy(reverse + 34, frame + 36, 2);
+	memcpy(reverse + 36, frame + 34, 2);
+
+	vnic_rx(vnic, frame, sizeof(frame), NULL, 0);
+	vnic_rx(vnic, reverse, sizeof(reverse), NULL, 0);
+
+	int queues = 0;
+	for(i = 0; i < 4; i++) {
+		uint32_t n = nic_rx_queue_burst(nic, i, bursts, 32);
+		if(n == 0)
+			continue;
+
+		if(n != 2)
+			fail("flow is split: queue %d has %d packets", i, n);
+
+		nic_free(bursts[0]);
+		nic_free(bursts[1]);
+		queues++;
+	}
+
+	if(queues != 1)
+		fail("flow must be in one queue: %d", queues);
+
+	pass();
+
+
+	printf("MultiQueue: flows are spread: ");
+	int hits[4] = { 0, };
+	for(int port = 0; port < 64; port++) {
+		frame[34] = port;
+		vnic_rx(vnic, frame, sizeof(frame), NULL, 0);
+	}
+
+	for(i = 0; i < 4; i++) {
+		Packet* packet;
+		while((packet = nic_rx_queue(nic, i))) {
+			hits[i]++;
+			nic_free(packet);
 		}
-		i++;
-		used = bitmap_used(vnic);
 	}
+
+	printf("%d %d %d %d", hits[0], hits[1], hits[2], hits[3]);
+	if(hits[0] + hits[1] + hits[2] + hits[3] != 64)
+		fail("64 packets must be received");
+
+	for(i = 0; i < 4; i++) {
+		if(hits[i] == 0)
+			fail("queue %d has no flow", i);
+	}
+
 	pass();
-	
-	printf("Pool: Check overflow(small packet): ");
-	p1 = vnic_alloc(vnic, 0);
-	if(p1 != NULL)
-		fail("packet must not be allocated: %p", p1);
-	else
-		pass();
-	
-	printf("Pool: Clear all: ");
-	for(int j = 0; j < i; j++) {
-		if(!vnic_free(ps[j]))
-			fail("packet can not be freed: index: %d, packet: %p\n", j, ps[j]);
+
+
+	printf("MultiQueue: tx from every queue: ");
+	for(i = 0; i < 4; i++) {
+		if(!nic_tx_queue(nic, i, nic_alloc(nic, 0)))
+			fail("cannot queue tx: %d", i);
 	}
 
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("0 chunk must be used: %d", used);
-	else
-		pass();
-	
+	for(i = 0; i < 4; i++) {
+		if(!vnic_has_tx(vnic))
+			fail("vnic_has_tx must be true: %d", i);
 
-	p1 = vnic_alloc(vnic, 64);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 64 bytes packet allocation after full allocation: packet: %p, used: %d", p1, used);
-	if(used == 2 && p1 != NULL)
-		pass();
-	else
-		fail("packet must not be NULL and 2 chunks must be used");
-	
-	
-	vnic_free(p1);
-	used = bitmap_used(vnic);
-	printf("Pool: Check 64 bytes packet deallocation after full allocation: used: %d", used);
-	if(used == 0)
-		pass();
-	else
-		fail("0 chunks must be used");
-	
-	
-	printf("rx queue: Check initial status: ");
-	if(vnic_has_rx(vnic))
-		fail("vnic_has_rxmust be false");
-	
-	p1 = vnic_rx(vnic);
-	if(p1 != NULL)
-		fail("vnic_rx must be NULL: %p", p1);
+		if(vnic_tx(vnic, free_transmitter, NULL) != VNIC_ERROR_NOERROR)
+			fail("cannot transmit: %d", i);
+	}
+
+	if(vnic_has_tx(vnic))
+		fail("vnic_has_tx must be false");
+
+	if(bitmap_used(nic) != 0)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Meta: received frames are parsed: ");
+	frame[34] = 0x03;
+	vnic_rx(vnic, frame, sizeof(frame), NULL, 0);
+	vnic_rx(vnic, reverse, sizeof(reverse), NULL, 0);
+
+	Packet* parsed[2];
+	int parsed_count = 0;
+	for(i = 0; i < 4 && parsed_count < 2; i++)
+		parsed_count += nic_rx_queue_burst(nic, i, parsed + parsed_count, 2 - parsed_count);
+
+	if(parsed_count != 2)
+		fail("2 packets must be received: %d", parsed_count);
+
+	PacketMeta* meta = &parsed[0]->meta;
+	uint16_t start = parsed[0]->start;
+	printf("hash %08x ", meta->hash);
+	if(meta->flags != (PACKET_META_PARSED | PACKET_META_IPV4) || meta->ether_type != 0x0800 || meta->protocol != 17)
+		fail("wrong flags %x, type %x, protocol %d", meta->flags, meta->ether_type, meta->protocol);
+
+	if(meta->l3 != start + 14 || meta->l4 != start + 34 || meta->payload != start + 42)
+		fail("wrong offsets %d %d %d", meta->l3 - start, meta->l4 - start, meta->payload - start);
+
+	if(meta->hash == 0 || meta->hash != parsed[1]->meta.hash)
+		fail("hash must be symmetric: %08x %08x", meta->hash, parsed[1]->meta.hash);
+
+	if(nic_parse(parsed[0]) != meta)
+		fail("nic_parse must return the metadata");
+
+	nic_free(parsed[0]);
+	nic_free(parsed[1]);
+
+	pass();
+
+
+	printf("Meta: VLAN tags and non-IP frames: ");
+	Packet* tagged = nic_alloc(nic, 68);
+	uint8_t* data = tagged->buffer + tagged->start;
+	memcpy(data, frame, 12);
+	data[12] = 0x81;
+	data[13] = 0x00;
+	data[14] = 0x00;
+	data[15] = 0x05;
+	memcpy(data + 16, frame + 12, sizeof(frame) - 12);
+	tagged->end = tagged->start + 68;
+
+	meta = nic_parse(tagged);
+	if(!(meta->flags & PACKET_META_IPV4) || meta->l3 != tagged->start + 18 || meta->l4 != tagged->start + 38)
+		fail("wrong tagged frame: flags %x, l3 %d", meta->flags, meta->l3 - tagged->start);
+
+	// Parsed once, so a rewritten frame keeps its metadata until it is reset
+	data[16] = 0x08;
+	data[17] = 0x06;
+	if(nic_parse(tagged)->ether_type != 0x0800)
+		fail("frame must not be parsed twice");
+
+	tagged->meta.flags = 0;
+	meta = nic_parse(tagged);
+	if(meta->ether_type != 0x0806 || meta->flags != PACKET_META_PARSED || meta->hash != 0 || meta->l4 != 0)
+		fail("wrong ARP frame: type %x, flags %x", meta->ether_type, meta->flags);
+
+	nic_free(tagged);
+
+	pass();
+
+
+	printf("Chain: large packets are chained: ");
+	int chain_used = bitmap_used(nic);
+	uint8_t* large = malloc(20000);
+	for(i = 0; i < 20000; i++)
+		large[i] = i * 7;
+
+	Packet* chain = nic_alloc_chain(nic, 20000);
+	if(!chain || packet_len(chain) != 20000)
+		fail("cannot allocate a chain of 20000 bytes");
+
+	PacketIOVec iov[16];
+	uint32_t segments = packet_iov(chain, iov, 16);
+	printf("%d segments ", segments);
+	if(segments != (20000 + NIC_SEGMENT_SIZE - 1) / NIC_SEGMENT_SIZE || packet_iov(chain, iov, 2) != segments)
+		fail("wrong number of segments: %d", segments);
+
+	nic_write(chain, 0, large, 20000);
+	uint32_t offset = 0;
+	for(i = 0; i < segments; i++) {
+		if(memcmp(iov[i].base, large + offset, iov[i].len))
+			fail("wrong data in segment %d", i);
+		offset += iov[i].len;
+	}
+
+	if(offset != 20000)
+		fail("segments hold %d bytes", offset);
+
+	nic_free(chain);
+	if(bitmap_used(nic) != chain_used)
+		fail("chain is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Chain: jumbo frames are received and linearized: ");
+	if(vnic_rx(vnic, large, 9000, NULL, 0) != VNIC_ERROR_NOERROR || vnic_rx(vnic, large, 12000, large + 12000, 8000) != VNIC_ERROR_NOERROR)
+		fail("cannot receive");
+
+	Packet* jumbo = nic_rx(nic);
+	if(!jumbo || jumbo->next || packet_len(jumbo) != 9000 || memcmp(jumbo->buffer + jumbo->start, large, 9000))
+		fail("9000 bytes must be in one buffer");
+	nic_free(jumbo);
+
+	chain = nic_rx(nic);
+	if(!chain || !chain->next || packet_len(chain) != 20000)
+		fail("20000 bytes must be chained");
+
+	if(!(chain->meta.flags & PACKET_META_PARSED) || vnic_linearize(vnic, chain) != NULL)
+		fail("chain must be parsed and too large to linearize");
+	nic_free(chain);
+
+	chain = nic_alloc(nic, 1000);
+	chain->end = chain->start + 1000;
+	Packet* segment = nic_alloc(nic, 3000);
+	segment->end = segment->start + 3000;
+	packet_append(chain, chain, segment);
+	nic_write(chain, 0, large, 4000);
+
+	Packet* linear = vnic_linearize(vnic, chain);
+	if(!linear || linear->next || packet_len(linear) != 4000 || memcmp(linear->buffer + linear->start, large, 4000))
+		fail("chain must be copied to one buffer");
+	nic_free(linear);
+	free(large);
+
+	if(bitmap_used(nic) != chain_used)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Offload: checksums are completed in software or left to the device: ");
+	uint8_t udp[64];
+	memcpy(udp, frame, sizeof(udp));
+	for(i = 42; i < 46; i++)
+		udp[i] = i * 3;
+
+	Packet* offload = nic_alloc(nic, sizeof(udp));
+	memcpy(offload->buffer + offload->start, udp, sizeof(udp));
+	offload->end = offload->start + sizeof(udp);
+
+	nic->offloads = 0;
+	if(!nic_tx_offload(nic, offload, 0) || (offload->meta.flags & PACKET_META_OFFLOAD) || l4_check(offload->buffer + offload->start))
+		fail("checksum must be completed without the device: flags %x", offload->meta.flags);
+
+	nic->offloads = NIC_OFFLOAD_TX_CSUM;
+	offload->meta.flags = 0;
+	if(!nic_tx_offload(nic, offload, 16) || (offload->meta.flags & PACKET_META_OFFLOAD) != PACKET_META_CSUM_PARTIAL)
+		fail("UDP frame must be partial and never segmented: flags %x", offload->meta.flags);
+
+	if(!l4_check(offload->buffer + offload->start))
+		fail("partial checksum must be left to the device");
+
+	if(!nic_csum_complete(offload) || (offload->meta.flags & PACKET_META_CSUM_PARTIAL) || l4_check(offload->buffer + offload->start))
+		fail("partial checksum must be completed");
+
+	// ARP has no L4 checksum
+	offload->buffer[offload->start + 12] = 0x08;
+	offload->buffer[offload->start + 13] = 0x06;
+	offload->meta.flags = 0;
+	if(nic_tx_offload(nic, offload, 0) || nic_csum_complete(offload))
+		fail("non-IP frame must not be offloaded");
+
+	nic_free(offload);
+
+	pass();
+
+
+	printf("Offload: TCP super-frames are segmented by the device and keep their flags: ");
+	uint32_t super_size = 4000;
+	uint8_t* tcp = malloc(super_size);
+	memcpy(tcp, frame, 34);
+	tcp[16] = (super_size - 14) >> 8;
+	tcp[17] = super_size - 14;
+	tcp[23] = 6;
+	memset(tcp + 34, 0, 20);
+	tcp[46] = 0x50;		// Data offset
+	for(i = 54; i < super_size; i++)
+		tcp[i] = i * 13;
+
+	// Headers and an odd part of the payload in the first segment
+	Packet* super = nic_alloc(nic, 1001);
+	super->end = super->start + 1001;
+	segment = nic_alloc(nic, super_size - 1001);
+	segment->end = segment->start + super_size - 1001;
+	packet_append(super, super, segment);
+	nic_write(super, 0, tcp, super_size);
+
+	nic->offloads = NIC_OFFLOAD_TX_CSUM;
+	if(nic_tx_offload(nic, super, 1460))
+		fail("super-frame needs TSO");
+
+	// The checksum of a chain is completed over every segment
+	nic->offloads = 0;
+	if(!nic_tx_offload(nic, super, 0) || (super->meta.flags & PACKET_META_OFFLOAD))
+		fail("checksum must be completed without the device: flags %x", super->meta.flags);
+
+	PacketIOVec super_iov[2];
+	uint32_t super_segments = packet_iov(super, super_iov, 2);
+	offset = 0;
+	for(i = 0; i < super_segments; i++) {
+		memcpy(tcp + offset, super_iov[i].base, super_iov[i].len);
+		offset += super_iov[i].len;
+	}
+
+	if(l4_check(tcp))
+		fail("wrong checksum over %d segments", super_segments);
+
+	nic->offloads = NIC_OFFLOAD_TX_CSUM | NIC_OFFLOAD_TSO4;
+	if(!nic_tx_offload(nic, super, 1460) || (super->meta.flags & PACKET_META_OFFLOAD) != PACKET_META_OFFLOAD || super->meta.gso_size != 1460)
+		fail("super-frame must be partial and segmented: flags %x", super->meta.flags);
+
+	// The kernel parses tx frames again, the offload request stays
+	nic_tx(nic, super);
+	Packet* kept = NULL;
+	if(vnic_tx(vnic, keep_transmitter, &kept) != VNIC_ERROR_NOERROR || kept != super)
+		fail("cannot transmit");
+
+	if((kept->meta.flags & (PACKET_META_PARSED | PACKET_META_OFFLOAD)) != PACKET_META_OFFLOAD)
+		fail("offload flags must stay: flags %x", kept->meta.flags);
+
+	linear = vnic_linearize(vnic, kept);
+	if(!linear || (linear->meta.flags & PACKET_META_OFFLOAD) != PACKET_META_OFFLOAD || linear->meta.gso_size != 1460)
+		fail("linearized super-frame must keep its offloads");
+
+	if(!nic_csum_complete(linear) || l4_check(linear->buffer + linear->start))
+		fail("checksum must be completed after linearizing");
+
+	nic_free(linear);
+	free(tcp);
+	nic->offloads = 0;
+
+	if(bitmap_used(nic) != chain_used)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
+
+	pass();
+
+
+	printf("Region: packets resolve to their NIC with one lookup: ");
+	Packet* owned = nic_alloc(nic, 64);
+	if(nic_region_find(owned) != nic || nic_find_by_packet(owned) != nic)
+		fail("NIC must be registered by vnic_init");
+
+	nic_region_remove(nic);
+	if(nic_region_find(owned) != NULL)
+		fail("NIC must be unregistered");
+
+	if(nic_find_by_packet(owned) != nic || nic_region_find(owned) != nic)
+		fail("NIC must be found by its magic header and registered again");
+
+	nic_free(owned);
+
+	pass();
+
+
+	printf("Stats: per-core counters add up with drop reasons: ");
+	VNICStats before, after;
+	vnic_stats(vnic, &before);
+	vnic__init_core(test_core_id);
+
+	uint8_t counted[64] = { 0 };
+	test_core = 3;
+	if(vnic_rx(vnic, counted, sizeof(counted), NULL, 0) != VNIC_ERROR_NOERROR)
+		fail("cannot receive");
+	nic_free(nic_rx(nic));
+
+	test_core = VNIC_STATS_SLOTS + 5;	// Shares slot 5
+	if(vnic_rx(vnic, counted, 4 * 1024 * 1024, NULL, 0) == VNIC_ERROR_NOERROR)
+		fail("4MB must not fit in the pool");
+
+	Packet* rejected = nic_alloc(nic, 100);
+	rejected->end = rejected->start + 100;
+	nic_tx(nic, rejected);
+	if(vnic_tx(vnic, reject_transmitter, NULL) != VNIC_ERROR_OPERATION_FAILED)
+		fail("transmitter must reject");
+
+	vnic__init_core(NULL);
+	vnic_stats(vnic, &after);
+	if(after.input_packets - before.input_packets != 1 || after.input_bytes - before.input_bytes != sizeof(counted))
+		fail("1 packet must be received");
+
+	if(after.input_drop_packets - before.input_drop_packets != 1 || after.drops[VNIC_DROP_RX_NO_BUFFER] - before.drops[VNIC_DROP_RX_NO_BUFFER] != 1)
+		fail("1 packet must be dropped for lack of buffer");
+
+	if(after.output_drop_bytes - before.output_drop_bytes != 100 || after.drops[VNIC_DROP_TX_REJECTED] - before.drops[VNIC_DROP_TX_REJECTED] != 1)
+		fail("1 packet must be rejected");
+
+	if(vnic->stats[3].stats.input_packets == 0 || vnic->stats[5].stats.output_drop_packets == 0 || (vnic->stats[5].sequence & 1))
+		fail("counters must be in the slots of their cores");
+
+	if((uintptr_t)&vnic->stats[1] - (uintptr_t)&vnic->stats[0] < NIC_CACHE_LINE_SIZE || (uintptr_t)vnic->stats % NIC_CACHE_LINE_SIZE)
+		fail("slots must be on their own cache lines");
 
-	uint32_t size = vnic_rx_size(vnic);
-	if(size != 0)
-		fail("vnic_rx_size must be 0: %d", size);
-	
-	if(!vnic_driver_has_rx(vnic))
-		fail("vnic_driver_has_rx must be true");
-	
 	pass();
 
 
-	printf("rx queue: push one: ");
-	p1 = vnic_alloc(vnic, 64);
-	if(!vnic_driver_rx2(vnic, p1))
-		fail("vnic_driver_rx must be return true");
-	
-	if(!vnic_has_rx(vnic))
-		fail("vnic_has_rx must be true");
-	
-	size = vnic_rx_size(vnic);
-	if(size != 1)
-		fail("vnic_rx_size must be 1: %d", size);
-	
-	pass();
-	
+	printf("Shaping: invalid update changes nothing: ");
+	uint64_t invalid[] = { VNIC_TX_WEIGHT, 2, VNIC_TX_CLASS, VNIC_TX_CLASS_COUNT, VNIC_NONE };
+	if(vnic_update(vnic, invalid) != VNIC_ERROR_ATTRIBUTE_INVALID)
+		fail("class %d must be invalid", VNIC_TX_CLASS_COUNT);
+
+	if(vnic->tx_weight != 1 || vnic->tx_class != 0)
+		fail("weight %d class %d must not be changed", vnic->tx_weight, vnic->tx_class);
 
-	printf("rx queue: pop one: ");
-	
-	Packet* p2 = vnic_rx(vnic);
-	if(p2 != p1)
-		fail("vnic_rx returned wrong pointer: %p != %p", p1, p2);
-	
-	size = vnic_rx_size(vnic);
-	if(size != 0)
-		fail("vnic_rx_size must be 0: %d", size);
-	
-	vnic_free(p2);
-	
 	pass();
-	
 
-	printf("rx queue: push full: ");
-	for(i = 0; i < vnic->rx.size - 1; i++) {
-		ps[i] = vnic_alloc(vnic, 0);
-		if(ps[i] == NULL)
-			fail("cannot alloc packet: count: %d", i);
-		
-		if(!vnic_driver_rx2(vnic, ps[i]))
-			fail("cannot push rx: count: %d, queue size: %d", i, vnic->rx.size);
+
+	printf("Shaping: tx burst is bounded: ");
+	uint64_t shaping[] = { VNIC_TX_BANDWIDTH, 8000, VNIC_TX_BURST, 1000, VNIC_NONE };
+	if(vnic_update(vnic, shaping) != VNIC_ERROR_NOERROR)
+		fail("cannot update");
+
+	for(i = 0; i < 4; i++) {
+		Packet* packet = nic_alloc(nic, 600);
+		packet->end = packet->start + 600;
+		nic_tx(nic, packet);
 	}
-	
-	if(vnic_driver_has_rx(vnic))
-		fail("vnic_driver_has_rx must return false");
-	
-	size = vnic_rx_size(vnic);
-	if(size != vnic->rx.size - 1)
-		fail("vnic_rx_size must return %d but %d", vnic->rx.size - 1, size);
-	
-	if(!vnic_has_rx(vnic))
-		fail("vnic_has_rx must return true");
-	
-	pass();
-	
 
-	printf("rx queue: overflow: ");
+	int sent = 0;
+	while(vnic_tx(vnic, free_transmitter, NULL) == VNIC_ERROR_NOERROR)
+		sent++;
 
-	used = bitmap_used(vnic);
-	
-	p1 = vnic_alloc(vnic, 0);
-	if(p1 == NULL)
-		fail("packet allocation failed");
-	
-	if(vnic_driver_rx2(vnic, p1))
-		fail("push overflow: count: %d, queue size: %d", i, vnic->rx.size);
-	
-	int used2 = bitmap_used(vnic);
-	if(used != used2)
-		fail("packet pool usage is changed: used: %d != %d", used, used2);
-	
-	if(vnic_driver_has_rx(vnic))
-		fail("vnic_driver_has_rx must return false");
-	
-	size = vnic_rx_size(vnic);
-	if(size != vnic->rx.size - 1)
-		fail("vnic_rx_size must return %d but %d", vnic->rx.size - 1, size);
-	
-	if(!vnic_has_rx(vnic))
-		fail("vnic_has_rx must return true");
-	
-	pass();
-	
+	printf("%d", sent);
+	if(sent != 2)
+		fail("2 packets must fit in the burst");
 
-	printf("rx queue: pop: ");
-	for(i = 0; i < vnic->rx.size - 1; i++) {
-		Packet* p1 = vnic_rx(vnic);
-		if(p1 != ps[i])
-			fail("worong pointer returned: %p, expected: %p", p1, (void*)(uintptr_t)i);
+	uint64_t unshaped[] = { VNIC_TX_BANDWIDTH, 1000000000L, VNIC_TX_BURST, 0, VNIC_NONE };
+	vnic_update(vnic, unshaped);
+	while(vnic_tx(vnic, free_transmitter, NULL) == VNIC_ERROR_NOERROR);
+
+	if(bitmap_used(nic) != 0)
+		fail("packet is not freed: used: %d", bitmap_used(nic));
 
-		vnic_free(p1);
-	}
-	
-	if(!vnic_driver_has_rx(vnic))
-		fail("vnic_driver_has_rx must return true");
-	
-	size = vnic_rx_size(vnic);
-	if(size != 0)
-		fail("vnic_rx_size must return 0 but %d", size);
-	
-	if(vnic_has_rx(vnic))
-		fail("vnic_has_rx must return false");
-	
 	pass();
 
 
-	printf("rx queue: push one after overflow: ");
-	p1 = vnic_alloc(vnic, 0);
-	if(p1 == NULL)
-		fail("cannot alloc packet: %p\n", p1);
-	
-	if(!vnic_driver_rx2(vnic, p1))
-		fail("vnic_driver_rx must be return true");
-	
-	if(!vnic_has_rx(vnic))
-		fail("vnic_has_rx must be true");
-	
-	size = vnic_rx_size(vnic);
-	if(size != 1)
-		fail("vnic_rx_size must be 1: %d", size);
-	
-	pass();
-	
+	printf("Shaping: rx bucket charges from several cores add up: ");
+	VNICBucket shared_bucket;
+	vnic_bucket_init(&shared_bucket, 8000000, 0);
+	uint64_t closed = shared_bucket.closed;
+	pthread_t chargers[4];
+	for(i = 0; i < 4; i++)
+		pthread_create(&chargers[i], NULL, shared_charger, &shared_bucket);
+	for(i = 0; i < 4; i++)
+		pthread_join(chargers[i], NULL);
+
+	if(shared_bucket.closed - closed != 4 * SHARED_CHARGES * ((shared_bucket.wait * 1000) >> VNIC_BUCKET_SHIFT))
+		fail("charges are lost: %lu", shared_bucket.closed - closed);
+
+	vnic_bucket_init(&shared_bucket, 0, 0);
+	closed = shared_bucket.closed;
+	vnic_bucket_charge_shared(&shared_bucket, closed + 1000, 1000);
+	if(shared_bucket.closed != closed)
+		fail("a bucket without a limit must not be written");
 
-	printf("rx queue: pop one after overflow: ");
-	
-	p2 = vnic_rx(vnic);
-	if(p1 != p2)
-		fail("vnic_rx returned wrong pointer: %p != %p", p1, p2);
-	
-	size = vnic_rx_size(vnic);
-	if(size != 0)
-		fail("vnic_rx_size must be 0: %d", size);
-	
-	vnic_free(p2);
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("packet is not freed: used: %d", used);
-	
 	pass();
 
 
-	printf("srx queue: Check initial status: ");
-	if(vnic_has_srx(vnic))
-		fail("vnic_has_srx must be false");
-	
-	p1 = vnic_srx(vnic);
-	if(p1 != NULL)
-		fail("vnic_srx must be NULL: %p", p1);
+	printf("Reconfig: rx rings grow after in-flight packets drain: ");
+	for(i = 0; i < 3; i++)
+		vnic_rx(vnic, counted, sizeof(counted), NULL, 0);
 
-	size = vnic_srx_size(vnic);
-	if(size != 0)
-		fail("vnic_srx_size must be 0: %d", size);
-	
-	if(!vnic_driver_has_srx(vnic))
-		fail("vnic_driver_has_srx must be true");
-	
-	pass();
+	// New rings at the start of the pool, as right after the NIC was created
+	nic->pool.index = 0;
+	uint64_t grow[] = { VNIC_RX_QUEUE_SIZE, 1024, VNIC_RX_BANDWIDTH, 2000000000L, VNIC_BUDGET, 64, VNIC_NONE };
+	if(vnic_update(vnic, grow) != VNIC_ERROR_NOERROR)
+		fail("cannot update");
 
+	if(vnic->rx_bandwidth != 2000000000L || vnic->budget != 64 || nic->rx.next_size != 1024)
+		fail("bandwidth, budget and size must be updated");
 
-	printf("srx queue: push one: ");
-	p1 = vnic_alloc(vnic, 64);
-	if(!vnic_driver_srx2(vnic, p1))
-		fail("vnic_driver_srx must be return true");
-	
-	if(!vnic_has_srx(vnic))
-		fail("vnic_has_srx must be true");
-	
-	size = vnic_srx_size(vnic);
-	if(size != 1)
-		fail("vnic_srx_size must be 1: %d", size);
-	
-	pass();
-	
+	if(vnic_rx(vnic, counted, sizeof(counted), NULL, 0) == VNIC_ERROR_NOERROR || nic->rx.size != 128)
+		fail("rx must be closed until the ring drained");
 
-	printf("srx queue: pop one: ");
-	
-	p2 = vnic_srx(vnic);
-	if(p2 != p1)
-		fail("vnic_srx returned wrong pointer: %p != %p", p1, p2);
-	
-	size = vnic_srx_size(vnic);
-	if(size != 0)
-		fail("vnic_srx_size must be 0: %d", size);
-	
-	vnic_free(p2);
-	
-	pass();
-	
+	for(i = 0; i < 3; i++) {
+		Packet* packet = nic_rx(nic);
+		if(!packet)
+			fail("in-flight packet %d is lost", i);
+		nic_free(packet);
+	}
 
-	printf("srx queue: push full: ");
-	for(i = 0; i < vnic->srx.size - 1; i++) {
-		ps[i] = vnic_alloc(vnic, 0);
-		if(ps[i] == NULL)
-			fail("cannot alloc packet: count: %d", i);
-		
-		if(!vnic_driver_srx2(vnic, ps[i]))
-			fail("cannot push srx: count: %d, queue size: %d", i, vnic->srx.size);
+	if(nic_rx(nic) != NULL || nic->rx.size != 1024 || !nic->rx.ring || nic->rx.capacity < 1024)
+		fail("new ring must be swapped in: size %d", nic->rx.size);
+
+	for(i = 0; i < 1000; i++) {
+		if(vnic_rx(vnic, counted, sizeof(counted), NULL, 0) != VNIC_ERROR_NOERROR)
+			fail("%dth packet must fit in the new ring", i);
 	}
-	
-	if(vnic_driver_has_srx(vnic))
-		fail("vnic_driver_has_srx must return false");
-	
-	size = vnic_srx_size(vnic);
-	if(size != vnic->srx.size - 1)
-		fail("vnic_srx_size must return %d but %d", vnic->srx.size - 1, size);
-	
-	if(!vnic_has_srx(vnic))
-		fail("vnic_has_srx must return true");
-	
-	pass();
-	
 
-	printf("srx queue: overflow: ");
+	for(i = 0; i < 1000; i++)
+		nic_free(nic_rx(nic));
 
-	used = bitmap_used(vnic);
-	
-	p1 = vnic_alloc(vnic, 0);
-	if(p1 == NULL)
-		fail("packet allocation failed");
-	
-	if(vnic_driver_srx2(vnic, p1))
-		fail("push overflow: count: %d, queue size: %d", i, vnic->srx.size);
-	
-	used2 = bitmap_used(vnic);
-	if(used != used2)
-		fail("packet pool usage is changed: used: %d != %d", used, used2);
-	
-	if(vnic_driver_has_srx(vnic))
-		fail("vnic_driver_has_srx must return false");
-	
-	size = vnic_srx_size(vnic);
-	if(size != vnic->srx.size - 1)
-		fail("vnic_srx_size must return %d but %d", vnic->srx.size - 1, size);
-	
-	if(!vnic_has_srx(vnic))
-		fail("vnic_has_srx must return true");
-	
-	pass();
-	
+	// Queue pairs swap on their own traffic
+	for(i = 1; i < 4; i++) {
+		NICQueue* rx = nic_queue_pair(nic, i);
+		Packet* packet = nic_alloc(nic, 64);
+		if(queue_push(nic, rx, packet) || queue_pop(nic, rx) != NULL || rx->size != 1024 || queue_push(nic, rx, packet) != true)
+			fail("queue pair %d must be resized", i);
+		nic_free(queue_pop(nic, rx));
+	}
 
-	printf("srx queue: pop: ");
-	for(i = 0; i < vnic->srx.size - 1; i++) {
-		Packet* p1 = vnic_srx(vnic);
-		if(p1 != ps[i])
-			fail("worong pointer returned: %p, expected: %p", p1, (void*)(uintptr_t)i);
+	// The grown rings are pool buffers: allocation goes on past them once the pool index wraps
+	int laps = 2 * nic->pool.count / chunks(nic, sizeof(counted));
+	for(i = 0; i < laps; i++) {
+		if(vnic_rx(vnic, counted, sizeof(counted), NULL, 0) != VNIC_ERROR_NOERROR)
+			fail("rx stopped after %d of %d packets", i, laps);
 
-		vnic_free(p1);
+		nic_free(nic_rx(nic));
 	}
-	
-	if(!vnic_driver_has_srx(vnic))
-		fail("vnic_driver_has_srx must return true");
-	
-	size = vnic_srx_size(vnic);
-	if(size != 0)
-		fail("vnic_srx_size must return 0 but %d", size);
-	
-	if(vnic_has_srx(vnic))
-		fail("vnic_has_srx must return false");
-	
+
 	pass();
 
 
-	printf("srx queue: push one after overflow: ");
-	p1 = vnic_alloc(vnic, 0);
-	if(p1 == NULL)
-		fail("cannot alloc packet: %p\n", p1);
-	
-	if(!vnic_driver_srx2(vnic, p1))
-		fail("vnic_driver_srx must be return true");
-	
-	if(!vnic_has_srx(vnic))
-		fail("vnic_has_srx must be true");
-	
-	size = vnic_srx_size(vnic);
-	if(size != 1)
-		fail("vnic_srx_size must be 1: %d", size);
-	
-	pass();
-	
+	printf("Reconfig: tx rings shrink in place: ");
+	uint32_t tx_base = nic->tx.base;
+	Packet* inflight = nic_alloc(nic, 100);
+	inflight->end = inflight->start + 100;
+	nic_tx(nic, inflight);
 
-	printf("srx queue: pop one after overflow: ");
-	
-	p2 = vnic_srx(vnic);
-	if(p1 != p2)
-		fail("vnic_srx returned wrong pointer: %p != %p", p1, p2);
-	
-	size = vnic_srx_size(vnic);
-	if(size != 0)
-		fail("vnic_srx_size must be 0: %d", size);
-	
-	vnic_free(p2);
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("packet is not freed: used: %d", used);
-	
-	pass();
+	uint64_t shrink[] = { VNIC_TX_QUEUE_SIZE, 16, VNIC_NONE };
+	uint64_t again[] = { VNIC_TX_QUEUE_SIZE, 32, VNIC_NONE };
+	uint64_t pool[] = { VNIC_POOL_SIZE, 4 * 1024 * 1024, VNIC_NONE };
+	if(vnic_update(vnic, shrink) != VNIC_ERROR_NOERROR)
+		fail("cannot update");
 
+	if(vnic_update(vnic, again) != VNIC_ERROR_RESOURCE_NOT_AVAILABLE || vnic_update(vnic, pool) != VNIC_ERROR_INVALID_POOLSIZE)
+		fail("resize must be pending and the pool fixed");
 
+	if(vnic_update_check(vnic, again) != VNIC_ERROR_RESOURCE_NOT_AVAILABLE || vnic_update_check(vnic, shrink) != VNIC_ERROR_NOERROR ||
+			nic->tx.next_size != 16)
+		fail("check must see the pending resize and change nothing");
 
-	printf("tx queue: Check initial state: ");
+	if(nic_tx(nic, nic_alloc(nic, 100)) || nic_tx_available(nic))
+		fail("tx must be closed until the ring drained");
 
-	size = vnic_tx_size(vnic);
-	if(size != 0)
-		fail("vnic_tx_size must be 0: %d", size);
-	
-	if(!vnic_has_tx(vnic))
-		fail("vnic_has_tx must be true");
-	
-	if(vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must false");
+	if(vnic_tx(vnic, free_transmitter, NULL) != VNIC_ERROR_NOERROR)
+		fail("in-flight packet is lost");
+
+	if(vnic_has_tx(vnic) || nic->tx.size != 16 || nic->tx.base != tx_base || nic->tx.ring)
+		fail("ring must shrink in place: size %d", nic->tx.size);
+
+	for(i = 0; i < 16; i++) {
+		if(nic_tx(nic, nic_alloc(nic, 100)) != (i < 15))
+			fail("15 packets must fit: %d", i);
+	}
+
+	while(vnic_tx(vnic, free_transmitter, NULL) == VNIC_ERROR_NOERROR);
+
+	if(bitmap_used(nic) == 0 || bitmap_used(nic) != nic->pool.used)
+		fail("only the new rx rings must be left: used: %d", bitmap_used(nic));
 
 	pass();
-	
 
-	printf("tx queue: tx one: ");
-	p1 = vnic_alloc(vnic, 0);
-	
-	if(!vnic_tx(vnic, p1))
-		fail("vnic_tx must be true");
-	
-	size = vnic_tx_size(vnic);
-	if(size != 1)
-		fail("vnic_tx_size must be 1: %d", size);
-	
-	if(!vnic_has_tx(vnic))
-		fail("vnic_has_tx must be true");
-	
-	if(!vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must true");
+
+	printf("Latency: stages are counted while telemetry is on: ");
+	uint64_t latency_on[] = { VNIC_LATENCY, 1, VNIC_NONE };
+	uint64_t latency_off[] = { VNIC_LATENCY, 0, VNIC_NONE };
+	uint64_t latency_bad[] = { VNIC_LATENCY, 2, VNIC_NONE };
+	if(vnic_update(vnic, latency_bad) != VNIC_ERROR_ATTRIBUTE_INVALID || nic->latency)
+		fail("invalid value must change nothing");
+
+	if(vnic_update(vnic, latency_on) != VNIC_ERROR_NOERROR || !nic->latency || !nic->histograms)
+		fail("cannot turn on");
+
+	for(i = 0; i < 10; i++)
+		vnic_rx(vnic, counted, sizeof(counted), NULL, 0);
+
+	for(i = 0; i < 10; i++) {
+		Packet* packet = nic_rx(nic);
+		if(!packet || packet->time)
+			fail("stamp must be cleared when the app dequeues");
+		nic_free(packet);
+	}
+
+	for(i = 0; i < 4; i++) {
+		Packet* packet = nic_alloc(nic, 100);
+		packet->end = packet->start + 100;
+		nic_tx(nic, packet);
+	}
+	while(vnic_tx(vnic, free_transmitter, NULL) == VNIC_ERROR_NOERROR);
+
+	VNICLatency latency[NIC_LATENCY_STAGE_COUNT];
+	vnic_latency(vnic, latency);
+	for(i = 0; i < NIC_LATENCY_STAGE_COUNT; i++) {
+		if(latency[i].count != (i < NIC_LATENCY_TX_QUEUE ? 10 : 4))
+			fail("stage %d counted %lu samples", i, latency[i].count);
+		if(latency[i].p50 > latency[i].p99 || latency[i].p99 > latency[i].p999)
+			fail("stage %d percentiles out of order", i);
+	}
+
+	if(vnic_update(vnic, latency_off) != VNIC_ERROR_NOERROR || nic->latency)
+		fail("cannot turn off");
+
+	vnic_rx(vnic, counted, sizeof(counted), NULL, 0);
+	nic_free(nic_rx(nic));
+	vnic_latency(vnic, latency);
+	if(latency[NIC_LATENCY_RX].count != 10)
+		fail("samples must not be counted while off");
+
+	for(uint32_t cycles = 1, last = 0; cycles < UINT32_MAX / 2; cycles += cycles / 16 + 1) {
+		uint32_t bucket = nic_latency_bucket(cycles);
+		if(bucket < last || bucket >= NIC_LATENCY_BUCKETS)
+			fail("bucket of %u cycles is %u", cycles, bucket);
+		last = bucket;
+	}
+
+	if(nic_latency_bucket(UINT32_MAX) != NIC_LATENCY_BUCKETS - 1)
+		fail("last bucket must hold the largest latency");
 
 	pass();
-	
 
-	printf("tx queue: send one: ");
-	p1 = vnic_driver_tx(vnic);
-	vnic_free(p1);
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("cannot free packet: %d", used);
-	
-	size = vnic_tx_size(vnic);
-	if(size != 0)
-		fail("vnic_tx_size must be 0: %d", size);
-	
-	if(!vnic_has_tx(vnic))
-		fail("vnic_has_tx must be true");
-	
-	if(vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must false");
-	
+
+	printf("Wait: sleeping consumer wakes on the next enqueue: ");
+	uint64_t waited = nic_time();
+	if(nic_wait_rx(nic, 1000000) || nic_time() - waited < 1000000)
+		fail("empty queue must time out");
+
+	nic_wait_config(0, false);
+	pthread_t producer;
+	pthread_create(&producer, NULL, wait_producer, vnic);
+	if(!nic_wait_rx(nic, 0) || !nic_has_rx(nic))
+		fail("packet must wake the consumer");
+
+	pthread_join(producer, NULL);
+	nic_free(nic_rx(nic));
+	nic_wait_config(NIC_WAIT_SPIN, false);
+
+	if(nic_wait_rx_queue(nic, nic->queue_count, 0))
+		fail("there is no such queue pair");
+
 	pass();
 
 
-	printf("tx queue: tx full: ");
-	for(i = 0; i < vnic->tx.size - 1; i++) {
-		ps[i] = vnic_alloc(vnic, 0);
-		if(ps[i] == NULL)
-			fail("cannot alloc packet: count: %d", i + 1);
-		
-		if(!vnic_tx(vnic, ps[i]))
-			fail("cannot tx packet: index: %d", i);
+	printf("AQM: CoDel drops or marks once the rx delay stayed above the target: ");
+	uint64_t aqm_bad[] = { VNIC_AQM_TARGET, 2000, VNIC_AQM_INTERVAL, 1000, VNIC_NONE };
+	uint64_t aqm_bad2[] = { VNIC_RX_AQM, VNIC_AQM_RED + 1, VNIC_NONE };
+	uint64_t aqm_codel[] = { VNIC_RX_AQM, VNIC_AQM_CODEL, VNIC_AQM_TARGET, 100, VNIC_AQM_INTERVAL, 1000, VNIC_NONE };
+	if(vnic_update(vnic, aqm_bad) != VNIC_ERROR_ATTRIBUTE_INVALID || vnic_update(vnic, aqm_bad2) != VNIC_ERROR_ATTRIBUTE_INVALID ||
+			vnic->rx_aqm || vnic->aqm_target != 5000)
+		fail("invalid thresholds or modes must change nothing");
+
+	if(vnic_update(vnic, aqm_codel) != VNIC_ERROR_NOERROR)
+		fail("cannot turn on");
+
+	uint8_t ect[64], not_ect[64];
+	aqm_frame(ect, 0x02);
+	aqm_frame(not_ect, 0x00);
+
+	VNICStats aqm_before, aqm_after;
+	vnic_stats(vnic, &aqm_before);
+	vnic_rx(vnic, not_ect, sizeof(not_ect), NULL, 0);
+	usleep(2000);
+	if(vnic_rx(vnic, not_ect, sizeof(not_ect), NULL, 0) != VNIC_ERROR_NOERROR)
+		fail("delay must stay above the target for an interval first");
+
+	usleep(2000);
+	if(vnic_rx(vnic, not_ect, sizeof(not_ect), NULL, 0) == VNIC_ERROR_NOERROR)
+		fail("must drop after an interval above the target");
+	if(vnic_rx(vnic, ect, sizeof(ect), NULL, 0) != VNIC_ERROR_NOERROR)
+		fail("next drop must wait for the control law");
+
+	usleep(2000);
+	if(vnic_rx(vnic, ect, sizeof(ect), NULL, 0) != VNIC_ERROR_NOERROR)
+		fail("ECN capable packet must be marked instead");
+
+	vnic_stats(vnic, &aqm_after);
+	if(aqm_after.drops[VNIC_DROP_RX_AQM] - aqm_before.drops[VNIC_DROP_RX_AQM] != 1 ||
+			aqm_after.input_marked_packets - aqm_before.input_marked_packets != 1)
+		fail("one drop and one mark must be counted");
+
+	// The flow may be spread to any queue pair
+	Packet* aqm_packets[8];
+	int marked = 0;
+	int count = aqm_drain(nic, aqm_packets, 8);
+	for(i = 0; i < count; i++) {
+		uint8_t* ip = aqm_packets[i]->buffer + aqm_packets[i]->start + 14;
+		if((ip[1] & 0x03) == 0x03) {
+			marked++;
+			if(aqm_checksum(ip) != 0)
+				fail("IPv4 checksum must be updated");
+		}
+		nic_free(aqm_packets[i]);
 	}
+	if(count != 4 || marked != 1)
+		fail("%d of %d packets marked Congestion Experienced", marked, count);
+
+	if(vnic_rx(vnic, not_ect, sizeof(not_ect), NULL, 0) != VNIC_ERROR_NOERROR)
+		fail("empty queue must leave the dropping state");
+	count = aqm_drain(nic, aqm_packets, 8);
+	while(count--)
+		nic_free(aqm_packets[count]);
 
-	size = vnic_tx_size(vnic);
-	if(size != vnic->tx.size - 1)
-		fail("vnic_tx_size must be %d: %d", vnic->tx.size - 1, size);
-	
-	if(vnic_has_tx(vnic))
-		fail("vnic_has_tx must be false");
-	
-	if(!vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must true");
-	
 	pass();
 
 
-	printf("tx queue: overflow: ");
-	
-	used = bitmap_used(vnic);
-	
-	p1 = vnic_alloc(vnic, 0);
-	
-	if(vnic_tx(vnic, p1))
-		fail("vnic_tx overflow");
-	
-	used2 = bitmap_used(vnic);
-	
-	if(used != used2)
-		fail("packet not freed on overflow %d != %d", used, used2);
-		
-	if(vnic_try_tx(vnic, p1))
-		fail("vnic_try_tx overflow");
-	
-	used2 = bitmap_used(vnic);
-	
-	if(used != used2)
-		fail("packet freed on try_tx %d != %d", used, used2);
-	
-	if(vnic_tx_dup(vnic, p1))
-		fail("vnic_tx_dup overflow");
-	
-	used2 = bitmap_used(vnic);
-	
-	if(used != used2)
-		fail("packet allocated on overflow %d != %d", used, used2);
+	printf("AQM: RED drops everything above the maximum average delay: ");
+	uint64_t aqm_red[] = { VNIC_RX_AQM, VNIC_AQM_RED, VNIC_AQM_TARGET, 10, VNIC_AQM_INTERVAL, 20, VNIC_NONE };
+	if(vnic_update(vnic, aqm_red) != VNIC_ERROR_NOERROR)
+		fail("cannot switch to RED");
 
-	size = vnic_tx_size(vnic);
-	if(size != vnic->tx.size - 1)
-		fail("vnic_tx_size must be %d: %d", vnic->tx.size - 1, size);
-	
-	if(vnic_has_tx(vnic))
-		fail("vnic_has_tx must be false");
-	
-	if(!vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must true");
-	
-	pass();
-	
-	
-	printf("tx queue: send all: ");
-	for(i = 0; i < vnic->tx.size - 1; i++) {
-		p1 = vnic_driver_tx(vnic);
-		if(p1 != ps[i])
-			fail("wrong pointer returned: %p != %p", ps[i], p1);
-		
-		if(!vnic_free(p1))
-			fail("cannot free packet: %p", p1);
+	vnic_stats(vnic, &aqm_before);
+	vnic_rx(vnic, not_ect, sizeof(not_ect), NULL, 0);
+	usleep(20000);
+	for(i = 0; i < 10; i++) {
+		if(vnic_rx(vnic, not_ect, sizeof(not_ect), NULL, 0) == VNIC_ERROR_NOERROR)
+			fail("packet %d must be dropped", i);
 	}
 
-	size = vnic_tx_size(vnic);
-	if(size != 0)
-		fail("vnic_tx_size must be 0: %d", 0, size);
-	
-	if(!vnic_has_tx(vnic))
-		fail("vnic_has_tx must be true");
-	
-	if(vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must false");
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("packet is not freed: used: %d", used);
-		
+	vnic_stats(vnic, &aqm_after);
+	count = aqm_drain(nic, aqm_packets, 8);
+	if(aqm_after.drops[VNIC_DROP_RX_AQM] - aqm_before.drops[VNIC_DROP_RX_AQM] != 10 || count != 1)
+		fail("drops must be counted");
+	while(count--)
+		nic_free(aqm_packets[count]);
+
 	pass();
 
 
-	printf("tx queue: tx one after overflow: ");
-	p1 = vnic_alloc(vnic, 0);
-	
-	if(!vnic_tx(vnic, p1))
-		fail("vnic_tx must be true");
-	
-	size = vnic_tx_size(vnic);
-	if(size != 1)
-		fail("vnic_tx_size must be 1: %d", size);
-	
-	if(!vnic_has_tx(vnic))
-		fail("vnic_has_tx must be true");
-	
-	if(!vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must true");
+	printf("AQM: tx queue delay drops the packets the app queued long ago: ");
+	uint64_t aqm_tx_on[] = { VNIC_RX_AQM, VNIC_AQM_NONE, VNIC_TX_AQM, VNIC_AQM_CODEL,
+		VNIC_AQM_TARGET, 100, VNIC_AQM_INTERVAL, 1000, VNIC_NONE };
+	uint64_t aqm_tx_off[] = { VNIC_TX_AQM, VNIC_AQM_NONE, VNIC_NONE };
+	if(vnic_update(vnic, aqm_tx_on) != VNIC_ERROR_NOERROR || !nic->tx_stamp)
+		fail("app must stamp tx packets");
+
+	vnic_stats(vnic, &aqm_before);
+	for(i = 0; i < 3; i++) {
+		Packet* packet = nic_alloc(nic, 100);
+		packet->end = packet->start + 100;
+		nic_tx(nic, packet);
+	}
 
-	pass();
-	
+	usleep(2000);
+	if(vnic_tx(vnic, free_transmitter, NULL) != VNIC_ERROR_NOERROR || vnic_tx(vnic, free_transmitter, NULL) != VNIC_ERROR_NOERROR)
+		fail("delay must stay above the target for an interval first");
+
+	usleep(2000);
+	if(vnic_tx(vnic, free_transmitter, NULL) == VNIC_ERROR_NOERROR || nic_tx_size(nic))
+		fail("must drop after an interval above the target");
+
+	vnic_stats(vnic, &aqm_after);
+	if(aqm_after.drops[VNIC_DROP_TX_AQM] - aqm_before.drops[VNIC_DROP_TX_AQM] != 1 ||
+			aqm_after.output_packets - aqm_before.output_packets != 2)
+		fail("one drop must be counted");
+
+	if(vnic_update(vnic, aqm_tx_off) != VNIC_ERROR_NOERROR || nic->tx_stamp)
+		fail("app must stop stamping");
 
-	printf("tx queue: send one after overflow: ");
-	p1 = vnic_driver_tx(vnic);
-	vnic_free(p1);
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("cannot free packet: %d", used);
-	
-	size = vnic_tx_size(vnic);
-	if(size != 0)
-		fail("vnic_tx_size must be 0: %d", size);
-	
-	if(!vnic_has_tx(vnic))
-		fail("vnic_has_tx must be true");
-	
-	if(vnic_driver_has_tx(vnic))
-		fail("vnic_driver_has_tx must false");
-	
 	pass();
 
 
-	printf("Stx queue: Check initial state: ");
+	printf("Pacing: packets leave at their tx_time in time order: ");
+	uint64_t pacing_on[] = { VNIC_TX_PACING, 1, VNIC_NONE };
+	uint64_t pacing_off[] = { VNIC_TX_PACING, 0, VNIC_NONE };
+	if(vnic_update(vnic, pacing_on) != VNIC_ERROR_NOERROR || vnic->tx_bucket.burst != 0)
+		fail("paced output must have no burst");
+
+	uint8_t pacing_order[8];
+	uint8_t* pacing_last = pacing_order;
+	uint64_t pacing_now = nic_time();
+	pacing_packet(nic, 1, 100, pacing_now + 4000000);
+	pacing_packet(nic, 2, 100, pacing_now + 2000000);
+	pacing_packet(nic, 3, 100, 0);
+
+	if(vnic_tx(vnic, pacing_transmitter, &pacing_last) != VNIC_ERROR_NOERROR)
+		fail("a packet without tx_time must leave at once");
+	if(vnic_tx(vnic, pacing_transmitter, &pacing_last) != VNIC_ERROR_RESOURCE_NOT_AVAILABLE ||
+			vnic->tx_pacing_count != 2 || !vnic_has_tx(vnic))
+		fail("packets due later must be held");
+
+	uint64_t pacing_time = vnic_tx_time(vnic);
+	if(pacing_time < pacing_now + 2000000)
+		fail("the VNIC must wait for the first held packet");
+
+	while(pacing_last < pacing_order + 3) {
+		while(nic_time() < pacing_time);
+		if(vnic_tx(vnic, pacing_transmitter, &pacing_last) != VNIC_ERROR_NOERROR)
+			fail("a due packet must leave");
+		if(pacing_last < pacing_order + 3)
+			pacing_time = vnic_tx_time(vnic);
+	}
 
-	size = vnic_stx_size(vnic);
-	if(size != 0)
-		fail("vnic_stx_size must be 0: %d", size);
-	
-	if(!vnic_has_stx(vnic))
-		fail("vnic_has_stx must be true");
-	
-	if(vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must false");
+	if(pacing_order[0] != 3 || pacing_order[1] != 2 || pacing_order[2] != 1 || vnic_has_tx(vnic))
+		fail("order %d %d %d", pacing_order[0], pacing_order[1], pacing_order[2]);
 
 	pass();
-	
 
-	printf("Stx queue: stx one: ");
-	p1 = vnic_alloc(vnic, 0);
-	
-	if(!vnic_stx(vnic, p1))
-		fail("vnic_stx must be true");
-	
-	size = vnic_stx_size(vnic);
-	if(size != 1)
-		fail("vnic_stx_size must be 1: %d", size);
-	
-	if(!vnic_has_stx(vnic))
-		fail("vnic_has_stx must be true");
-	
-	if(!vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must true");
 
-	pass();
-	
+	printf("Pacing: the output bandwidth spaces packets one by one: ");
+	uint64_t pacing_rate[] = { VNIC_TX_BANDWIDTH, 100000000, VNIC_NONE };
+	uint64_t pacing_unrated[] = { VNIC_TX_BANDWIDTH, 1000000000L, VNIC_NONE };
+	if(vnic_update(vnic, pacing_rate) != VNIC_ERROR_NOERROR)
+		fail("cannot update");
 
-	printf("Stx queue: send one: ");
-	p1 = vnic_driver_stx(vnic);
-	vnic_free(p1);
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("cannot free packet: %d", used);
-	
-	size = vnic_stx_size(vnic);
-	if(size != 0)
-		fail("vnic_stx_size must be 0: %d", size);
-	
-	if(!vnic_has_stx(vnic))
-		fail("vnic_has_stx must be true");
-	
-	if(vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must false");
-	
-	pass();
+	for(i = 0; i < 4; i++)
+		pacing_packet(nic, i, 1000, 0);
 
+	for(i = 0; i < 4; i++) {
+		if(vnic_tx_burst(vnic, free_burst_transmitter, NULL, 32) != 1)
+			fail("one packet must leave per slot");
 
-	printf("Stx queue: stx full: ");
-	for(i = 0; i < vnic->stx.size - 1; i++) {
-		ps[i] = vnic_alloc(vnic, 0);
-		if(ps[i] == NULL)
-			fail("cannot alloc packet: count: %d", i + 1);
-		
-		if(!vnic_stx(vnic, ps[i]))
-			fail("cannot stx packet: index: %d", i);
+		pacing_time = vnic_tx_time(vnic);
+		if(i < 3 && pacing_time <= nic_time())
+			fail("the next slot must be ahead");
+		while(nic_time() < pacing_time);
 	}
 
-	size = vnic_stx_size(vnic);
-	if(size != vnic->stx.size - 1)
-		fail("vnic_stx_size must be %d: %d", vnic->stx.size - 1, size);
-	
-	if(vnic_has_stx(vnic))
-		fail("vnic_has_stx must be false");
-	
-	if(!vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must true");
-	
+	if(nic_tx_size(nic) || vnic_has_tx(vnic))
+		fail("every packet must be sent");
+
 	pass();
 
 
-	printf("Stx queue: overflow: ");
-	
-	used = bitmap_used(vnic);
-	
-	p1 = vnic_alloc(vnic, 0);
-	
-	if(vnic_stx(vnic, p1))
-		fail("vnic_stx overflow");
-	
-	used2 = bitmap_used(vnic);
-	
-	if(used != used2)
-		fail("packet not freed on overflow %d != %d", used, used2);
-		
-	if(vnic_try_stx(vnic, p1))
-		fail("vnic_try_stx overflow");
-	
-	used2 = bitmap_used(vnic);
-	
-	if(used != used2)
-		fail("packet freed on try_stx %d != %d", used, used2);
-	
-	if(vnic_stx_dup(vnic, p1))
-		fail("vnic_stx_dup overflow");
-	
-	used2 = bitmap_used(vnic);
-	
-	if(used != used2)
-		fail("packet allocated on overflow %d != %d", used, used2);
+	printf("Pacing: packets beyond the horizon are dropped, held packets leave when pacing is off: ");
+	VNICStats pacing_before;
+	VNICStats pacing_after;
+	vnic_update(vnic, pacing_unrated);
+	vnic_stats(vnic, &pacing_before);
+	size_t pacing_used = nic_pool_used(nic);
+	pacing_packet(nic, 1, 100, nic_time() + 100000000000UL);
+	pacing_packet(nic, 2, 100, nic_time() + 100000000);
+	if(vnic_tx(vnic, free_transmitter, NULL) != VNIC_ERROR_RESOURCE_NOT_AVAILABLE || vnic->tx_pacing_count != 1)
+		fail("one packet must be held");
+
+	vnic_stats(vnic, &pacing_after);
+	if(pacing_after.drops[VNIC_DROP_TX_HORIZON] - pacing_before.drops[VNIC_DROP_TX_HORIZON] != 1)
+		fail("drop must be counted");
+
+	if(vnic_update(vnic, pacing_off) != VNIC_ERROR_NOERROR || vnic_tx_time(vnic) != 0 ||
+			vnic_tx(vnic, free_transmitter, NULL) != VNIC_ERROR_NOERROR || vnic_has_tx(vnic))
+		fail("held packet must leave at once");
+
+	if(nic_pool_used(nic) != pacing_used)
+		fail("packet is not freed: used: %zu", nic_pool_used(nic) - pacing_used);
 
-	size = vnic_stx_size(vnic);
-	if(size != vnic->stx.size - 1)
-		fail("vnic_stx_size must be %d: %d", vnic->stx.size - 1, size);
-	
-	if(vnic_has_stx(vnic))
-		fail("vnic_has_stx must be false");
-	
-	if(!vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must true");
-	
 	pass();
-	
-	
-	printf("Stx queue: send all: ");
-	for(i = 0; i < vnic->stx.size - 1; i++) {
-		p1 = vnic_driver_stx(vnic);
-		if(p1 != ps[i])
-			fail("wrong pointer returned: %p != %p", ps[i], p1);
-		
-		if(!vnic_free(p1))
-			fail("cannot free packet: %p", p1);
+
+
+	printf("Pool: thread cache serves bitmap pool allocations: ");
+	NICCacheStats cache_before;
+	NICCacheStats cache_after;
+	uint8_t* cache_bitmap = (void*)nic + nic->pool.bitmap;
+	int cache_used = bitmap_used(nic);
+	Packet* cached = nic_alloc(nic, 64);
+	nic_free(cached);
+	nic_cache_stats(nic, &cache_before);
+	uint32_t cached_idx = ((uintptr_t)cached - (uintptr_t)nic - nic->pool.pool) / NIC_CHUNK_SIZE;
+	if(cache_bitmap[cached_idx] != chunks(nic, 64))
+		fail("a cached buffer must stay marked in the bitmap");
+
+	if(nic_free(cached))
+		fail("second free must fail");
+
+	Packet* cache_again = nic_alloc(nic, 64);
+	nic_cache_stats(nic, &cache_after);
+	if(cache_again != cached || cache_after.alloc_hits - cache_before.alloc_hits != 1 || cache_after.refills != cache_before.refills)
+		fail("the buffer freed last must come from the cache: %p", cache_again);
+
+	// Runs of a fourth size bypass the three slots
+	Packet* sizes[4] = { cache_again, nic_alloc(nic, 512), nic_alloc(nic, 1500), nic_alloc(nic, 4000) };
+	for(i = 0; i < 4; i++) {
+		if(!sizes[i] || !nic_free(sizes[i]))
+			fail("cannot allocate and free size %d", i);
 	}
 
-	size = vnic_stx_size(vnic);
-	if(size != 0)
-		fail("vnic_stx_size must be 0: %d", 0, size);
-	
-	if(!vnic_has_stx(vnic))
-		fail("vnic_has_stx must be true");
-	
-	if(vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must false");
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("packet is not freed: used: %d", used);
-		
+	if(bitmap_used(nic) != cache_used || nic->pool.used != cache_used)
+		fail("flushed cache must leave the pool as it was: used: %d", bitmap_used(nic) - cache_used);
+
 	pass();
 
 
-	printf("Stx queue: stx one after overflow: ");
-	p1 = vnic_alloc(vnic, 0);
-	
-	if(!vnic_stx(vnic, p1))
-		fail("vnic_stx must be true");
-	
-	size = vnic_stx_size(vnic);
-	if(size != 1)
-		fail("vnic_stx_size must be 1: %d", size);
-	
-	if(!vnic_has_stx(vnic))
-		fail("vnic_has_stx must be true");
-	
-	if(!vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must true");
+	printf("Pool: bitmap pool keeps allocating across wraps with telemetry on: ");
+	uint64_t wrap_attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"test",
+		VNIC_POOL_SIZE, 2 * 1024 * 1024,
+		VNIC_RX_BANDWIDTH, 100000000000L,
+		VNIC_TX_BANDWIDTH, 100000000000L,
+		VNIC_PADDING_HEAD, 16,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 128,
+		VNIC_TX_QUEUE_SIZE, 128,
+		VNIC_SLOW_RX_QUEUE_SIZE, 64,
+		VNIC_SLOW_TX_QUEUE_SIZE, 64,
+		VNIC_LATENCY, true,
+		VNIC_NONE
+	};
+
+	nic_cache_flush(nic);
+	if(!vnic_init(vnic, wrap_attrs) || nic->pool.mode != NIC_POOL_BITMAP)
+		fail("cannot initialize NIC");
+
+	if(!nic->histograms || nic->histograms + sizeof(NICLatency) > nic->pool.pool || nic_pool_used(nic) != 0)
+		fail("histograms must be ahead of the pool");
+
+	// A buffer that stays near the start of the pool, e.g. a grown ring
+	Packet* held = nic_alloc(nic, 1000);
+	uint8_t wrap_frame[1514] = { 0 };
+	int wraps = 4 * nic->pool.count / chunks(nic, sizeof(wrap_frame));
+	for(i = 0; i < wraps; i++) {
+		if(vnic_rx(vnic, wrap_frame, sizeof(wrap_frame), NULL, 0) != VNIC_ERROR_NOERROR)
+			fail("rx stopped after %d of %d packets", i, wraps);
+
+		nic_free(nic_rx(nic));
+	}
 
-	pass();
-	
+	if(!held || bitmap_used(nic) != chunks(nic, 1000))
+		fail("only the held buffer must be used: used: %d", bitmap_used(nic));
+
+	nic_free(held);
 
-	printf("Stx queue: send one after overflow: ");
-	p1 = vnic_driver_stx(vnic);
-	vnic_free(p1);
-	
-	used = bitmap_used(vnic);
-	if(used != 0)
-		fail("cannot free packet: %d", used);
-	
-	size = vnic_stx_size(vnic);
-	if(size != 0)
-		fail("vnic_stx_size must be 0: %d", size);
-	
-	if(!vnic_has_stx(vnic))
-		fail("vnic_has_stx must be true");
-	
-	if(vnic_driver_has_stx(vnic))
-		fail("vnic_driver_has_stx must false");
-	
 	pass();
-	
 
-	uint16_t total = vnic_config_total(vnic);
-	uint16_t available = vnic_config_available(vnic);
 
-	printf("Config: Check total and available size equals: ");
-	if(total != available)
-		fail("available: %d != total: %d\n", available, total);
-	
-	pass();
-	
-	printf("Config: alloc one: ");
-	int32_t key = vnic_config_alloc(vnic, "net.ipv4", 12);
-	if(key < 0)
-		fail("cannot alloc config: %d", key);
-	else
-		printf("%d", key);
-	
-	pass();
-	
-	printf("Config: available consumption check 1: ");
-	uint32_t available2 = vnic_config_available(vnic);
-	if(available2 != available - 4 - 12 - 12)
-		fail("available memory is differ: %d expected: %d\n", available2, available - 4 - 12 - 12);
-	
-	available += - 4 - 12 - 12;
-	
-	pass();
-	
-	printf("Config: find key: ");
-	int32_t key2 = vnic_config_key(vnic, "net.ipv4");
-	if(key2 != key)
-		fail("cannot find key for net.ipv4: %d", key2);
-	
-	pass();
-	
-	printf("Config: get size: ");
-	size = vnic_config_size(vnic, key);
-	if(size != 12)
-		fail("config size is wrong: %d\n", size);
-	else
-		printf("%d", size);
-	
-	pass();
-	
-	
-	printf("Config: alloc next: ");
-	key2 = vnic_config_alloc(vnic, "net.ipv6", 48);
-	if(key2 < 0)
-		fail("cannot alloc config: %d", key2);
-	
-	if(key + 1 + (strlen("net.ipv4") + 1 + 3) / 4 + 12 / 4 != key2)
-		fail("wrong second key allocated: %d", key2);
-	
-	pass();
-	
-	printf("Config: available consumption check 2: ");
-	available2 = vnic_config_available(vnic);
-	if(available2 != available - 4 - 12 - 48)
-		fail("available memory is differ: %d expected: %d\n", available2, available - 4 - 12 - 48);
-	
-	available += - 4 - 12 - 48;
-	
-	pass();
-	
-	printf("Config: find second key: ");
-	int32_t key3 = vnic_config_key(vnic, "net.ipv6");
-	if(key3 != key2)
-		fail("cannot find key for net.ipv6: %d", key3);
-	
-	pass();
-	
-	printf("Config: get size: ");
-	size = vnic_config_size(vnic, key2);
-	if(size != 48)
-		fail("config size is wrong: %d\n", size);
-	else
-		printf("%d", size);
-	
-	pass();
-	
-	printf("Config: check overwriting: ");
-	
-	uint32_t* ipv4 = vnic_config_get(vnic, key);
-	ipv4[0] = 0x11223344;
-	ipv4[1] = 0x55667788;
-	ipv4[2] = 0x99001122;
-	
-	uint64_t* ipv6 = vnic_config_get(vnic, key2);
-	ipv6[0] = 0x0102030405060708;
-	ipv6[1] = 0x0900010203040506;
-	ipv6[2] = 0x0708091011121314;
-	ipv6[3] = 0x1516171819202122;
-	ipv6[4] = 0x2324252627282930;
-	ipv6[5] = 0x3132333435363738;
-	
-	printf("Config: find key(2): ");
-	key3 = vnic_config_key(vnic, "net.ipv4");
-	if(key3 != key)
-		fail("cannot find key for net.ipv4: %d", key3);
-	
-	pass();
-	
-	printf("Config: get size(2): ");
-	size = vnic_config_size(vnic, key);
-	if(size != 12)
-		fail("config size is wrong: %d\n", size);
-	else
-		printf("%d", size);
-	
-	pass();
-	
-	
-	printf("Config: find second key(2): ");
-	key3 = vnic_config_key(vnic, "net.ipv6");
-	if(key3 != key2)
-		fail("cannot find key for net.ipv6: %d", key3);
-	
-	pass();
-	
-	printf("Config: get size(2): ");
-	size = vnic_config_size(vnic, key2);
-	if(size != 48)
-		fail("config size is wrong: %d\n", size);
-	else
-		printf("%d", size);
-	
-	pass();
-	
+	printf("Pool: class pool rejects a double free: ");
+	uint64_t class_attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"test",
+		VNIC_POOL_SIZE, 2 * 1024 * 1024,
+		VNIC_POOL_MODE, NIC_POOL_CLASS,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 16,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 128,
+		VNIC_TX_QUEUE_SIZE, 128,
+		VNIC_SLOW_RX_QUEUE_SIZE, 64,
+		VNIC_SLOW_TX_QUEUE_SIZE, 64,
+		VNIC_NONE
+	};
+
+	nic_cache_flush(nic);
+	if(!vnic_init(vnic, class_attrs) || nic->pool.mode != NIC_POOL_CLASS)
+		fail("cannot initialize NIC");
+
+	Packet* freed = nic_alloc(nic, 64);
+	if(!freed || !nic_free(freed))
+		fail("cannot allocate and free");
+
+	if(nic_free(freed))
+		fail("second free must fail");
+
+	Packet* first = nic_alloc(nic, 64);
+	Packet* second = nic_alloc(nic, 64);
+	if(!first || first == second)
+		fail("buffer is handed out twice: %p", first);
+
+	nic_free(first);
+	nic_free(second);
+	nic_cache_flush(nic);
+	if(nic_pool_used(nic) != 0)
+		fail("pool must be empty: used: %zu", nic_pool_used(nic));
 
-	printf("Config: free first alloc: ");
-	vnic_config_free(vnic, key);
-	
-	key = vnic_config_key(vnic, "net.ipvs");
-	if(key >= 0)
-		fail("freed key exists: %d", key);
-	
-	pass();
-	
-	printf("Config: available consumption check 3: ");
-	available2 = vnic_config_available(vnic);
-	if(available2 != available + 4 + 12 + 12)
-		fail("available memory is differ: %d expected: %d\n", available2, available + 4 + 12 + 12);
-	
-	available += 4 + 12 + 12;
-	
-	printf("Config: overflow: ");
-	uint32_t chunk = available - 4 - 12 - 12 - 4 - 8;
-	key3 = vnic_config_alloc(vnic, "chunk", chunk);
-	if(key3 < 0)
-		fail("cannot allocate big chunk: %d", key3);
-	
-	key = vnic_config_alloc(vnic, "net.ipv4", 12);
-	if(key < 0)
-		fail("cannot allocate first chunk: %d", key);
-	
-	pass();
-	
-	printf("Config: available consumption check 4: ");
-	available = vnic_config_available(vnic);
-	if(available != 0)
-		fail("available memory is differ: %d expected: %d\n", available, 0);
-	
 	pass();
-	
-	print_config(vnic);
-	
+
+	bench_queue(vnic, NIC_QUEUE_SP, 1, 1, 10000000);
+	bench_queue(vnic, NIC_QUEUE_MP, 1, 1, 10000000);
+	bench_queue(vnic, NIC_QUEUE_MP, 2, 1, 5000000);
+	bench_queue(vnic, NIC_QUEUE_SP, 1, 32, 10000000);
+	bench_queue(vnic, NIC_QUEUE_MP, 1, 32, 10000000);
+	bench_queue(vnic, NIC_QUEUE_MP, 2, 32, 5000000);
+
 	return 0;
 }
 
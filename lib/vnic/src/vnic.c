@@ -12,6 +12,16 @@ void vnic__init_timer(uint64_t freq_per_sec) {
 	TIMER_FREQUENCY_PER_SEC = freq_per_sec;
 }
 
+static uint32_t core_id_default() {
+	return 0;
+}
+
+static uint32_t (*core_id)() = core_id_default;
+
+void vnic__init_core(uint32_t (*_core_id)()) {
+	core_id = _core_id ? : core_id_default;
+}
+
 inline uint64_t timer_frequency() {
 	uint64_t t;
 	uint32_t* p = (uint32_t*)&t;
@@ -56,6 +66,11 @@ static uint64_t get_value(uint64_t* attrs, uint64_t key) {
 	return (uint64_t)-1;
 }
 
+static uint64_t get_value_or(uint64_t* attrs, uint64_t key, uint64_t value) {
+	uint64_t v = get_value(attrs, key);
+	return v == (uint64_t)-1 ? value : v;
+}
+
 static VNICError has_mandatory(uint64_t* attrs) {
 	uint8_t used[VNIC__MAND_END] = {0,};
 
@@ -77,6 +92,79 @@ static VNICError has_mandatory(uint64_t* attrs) {
 		VNIC_ERROR_NOERROR : VNIC_ERROR_ATTRIBUTE_MISSING;
 }
 
+/**
+ * Carve the pool into fixed size classes. Every class has a free index stack
+ * followed by its buffers, and all of them stay inside the NIC memory map.
+ */
+static VNICError pool_class_init(NIC* nic, uint32_t index, uint64_t poolsize) {
+	const uint32_t sizes[NIC_POOL_CLASS_COUNT] = NIC_POOL_CLASS_SIZES;
+	const uint32_t shares[NIC_POOL_CLASS_COUNT] = NIC_POOL_CLASS_SHARES;
+
+	uint32_t total_shares = 0;
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++)
+		total_shares += shares[i];
+
+	// Reserve slack for the alignment of stacks and buffers
+	uint64_t slack = (NIC_POOL_CLASS_COUNT + 1) * NIC_CHUNK_SIZE;
+	if(index + slack >= poolsize)
+		return VNIC_ERROR_NO_MEMORY;
+	uint64_t available = poolsize - index - slack;
+
+	// Free index stacks
+	nic->pool.bitmap = index;
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++) {
+		NICPoolClass* class = &nic->pool.classes[i];
+		class->size = sizes[i];
+		class->count = available * shares[i] / total_shares / (sizes[i] + sizeof(uint32_t));
+		class->stack = index;
+		index += class->count * sizeof(uint32_t);
+		index = ROUNDUP(index, 8);
+	}
+
+	// Buffers
+	index = ROUNDUP(index, NIC_CHUNK_SIZE);
+	nic->pool.pool = index;
+	for(int i = 0; i < NIC_POOL_CLASS_COUNT; i++) {
+		NICPoolClass* class = &nic->pool.classes[i];
+		class->base = index;
+		index += class->count * class->size;
+
+		// Pop order starts from the lowest address
+		uint32_t* stack = (void*)nic + class->stack;
+		for(uint32_t j = 0; j < class->count; j++)
+			stack[j] = class->count - 1 - j;
+		class->top = class->count;
+	}
+
+	if(index > poolsize)
+		return VNIC_ERROR_NO_MEMORY;
+
+	nic->pool.count = (index - nic->pool.pool) / NIC_CHUNK_SIZE;
+
+	return VNIC_ERROR_NOERROR;
+}
+
+static uint32_t queue_init(NICQueue* queue, uint32_t index, uint32_t size, uint8_t mode) {
+	queue->base = index;
+	queue->size = size;
+	queue->mode = mode;
+	queue->capacity = size;
+	queue->ring = 0;
+	queue->next_base = 0;
+	queue->next_capacity = 0;
+	queue->next_ring = 0;
+	queue->next_size = 0;
+	queue->tail = 0;
+	queue->reserve = 0;
+	queue->head_cache = 0;
+	queue->head = 0;
+	queue->tail_cache = 0;
+	queue->rlock = 0;
+
+	index += size * sizeof(uint64_t);
+	return ROUNDUP(index, 8);
+}
+
 static VNICError nic_init(void* base, uint64_t* attrs) {
 	if(has_mandatory(attrs) != VNIC_ERROR_NOERROR)
 		return has_mandatory(attrs);
@@ -90,70 +178,105 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	NIC* nic = base;
 	nic->magic = NIC_MAGIC_HEADER;
 	nic->id = 0;
+	nic->size = get_value(attrs, VNIC_POOL_SIZE);
 	nic->mac = get_value(attrs, VNIC_MAC);
 	nic->rx_bandwidth = get_value(attrs, VNIC_RX_BANDWIDTH);
 	nic->tx_bandwidth = get_value(attrs, VNIC_TX_BANDWIDTH);
 	nic->padding_head = get_value(attrs, VNIC_PADDING_HEAD);
 	nic->padding_tail = get_value(attrs, VNIC_PADDING_TAIL);
 
-	nic->rx.base = index;
-	nic->rx.head = 0;
-	nic->rx.tail = 0;
-	nic->rx.size = get_value(attrs, VNIC_RX_QUEUE_SIZE);
-	nic->rx.rlock = 0;
-	nic->rx.wlock = 0;
-
-	index += nic->rx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
-	nic->tx.base = index;
-	nic->tx.head = 0;
-	nic->tx.tail = 0;
-	nic->tx.size = get_value(attrs, VNIC_TX_QUEUE_SIZE);
-	nic->tx.rlock = 0;
-	nic->tx.wlock = 0;
-
-	index += nic->tx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
-	nic->srx.base = index;
-	nic->srx.head = 0;
-	nic->srx.tail = 0;
-	nic->srx.size = get_value(attrs, VNIC_SLOW_RX_QUEUE_SIZE);
-	nic->srx.rlock = 0;
-	nic->srx.wlock = 0;
-
-	index += nic->srx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
-	nic->stx.base = index;
-	nic->stx.head = 0;
-	nic->stx.tail = 0;
-	nic->stx.size = get_value(attrs, VNIC_SLOW_TX_QUEUE_SIZE);
-	nic->stx.rlock = 0;
-	nic->stx.wlock = 0;
-	index += nic->stx.size * sizeof(uint64_t);
-	index = ROUNDUP(index, 8);
+	// Kernel produces rx queues, VM threads produce tx queues
+	uint8_t rx_mode = get_value(attrs, VNIC_RX_QUEUE_MODE) == NIC_QUEUE_MP ? NIC_QUEUE_MP : NIC_QUEUE_SP;
+	uint8_t tx_mode = get_value(attrs, VNIC_TX_QUEUE_MODE) == NIC_QUEUE_SP ? NIC_QUEUE_SP : NIC_QUEUE_MP;
+
+	index = queue_init(&nic->rx, index, get_value(attrs, VNIC_RX_QUEUE_SIZE), rx_mode);
+	index = queue_init(&nic->tx, index, get_value(attrs, VNIC_TX_QUEUE_SIZE), tx_mode);
+	index = queue_init(&nic->srx, index, get_value(attrs, VNIC_SLOW_RX_QUEUE_SIZE), rx_mode);
+	index = queue_init(&nic->stx, index, get_value(attrs, VNIC_SLOW_TX_QUEUE_SIZE), tx_mode);
+
+	uint64_t queue_count = get_value(attrs, VNIC_QUEUE_COUNT);
+	if(queue_count == (uint64_t)-1 || queue_count == 0)
+		queue_count = 1;
+	if(queue_count > NIC_MAX_QUEUE_COUNT)
+		return VNIC_ERROR_ATTRIBUTE_INVALID;
+
+	// Queue pair 0 is rx and tx, the rest follow the slow path queues
+	index = ROUNDUP(index, NIC_CACHE_LINE_SIZE);
+	nic->queue_count = queue_count;
+	nic->queues = index;
+	NICQueue* queues = base + index;
+	index += sizeof(NICQueue) * 2 * (queue_count - 1);
+	for(uint32_t i = 0; i < queue_count - 1; i++) {
+		index = queue_init(&queues[i * 2], index, get_value(attrs, VNIC_RX_QUEUE_SIZE), rx_mode);
+		index = queue_init(&queues[i * 2 + 1], index, get_value(attrs, VNIC_TX_QUEUE_SIZE), tx_mode);
+	}
+
+	// Histograms go ahead of the pool: they live as long as the NIC, the VM may be counting
+	nic->latency = 0;
+	nic->tx_stamp = 0;
+	nic->histograms = index;
+	memset(base + index, 0, sizeof(NICLatency));
+	index = ROUNDUP(index + sizeof(NICLatency), NIC_CHUNK_SIZE);
 
 	uint64_t poolsize = get_value(attrs, VNIC_POOL_SIZE);
 	#define BITMAP_SIZE (poolsize - index) / NIC_CHUNK_SIZE;
 
-	nic->pool.bitmap = index;
-	index += BITMAP_SIZE;
-	index = ROUNDUP(index, NIC_CHUNK_SIZE);
-	if(index + NIC_CHUNK_SIZE > poolsize) return VNIC_ERROR_NO_MEMORY;
-
-	nic->pool.pool = index;
-	nic->pool.count = BITMAP_SIZE;
+	nic->pool.mode = get_value(attrs, VNIC_POOL_MODE) == NIC_POOL_CLASS ? NIC_POOL_CLASS : NIC_POOL_BITMAP;
 	nic->pool.index = 0;
 	nic->pool.used = 0;
 	nic->pool.lock = 0;
 
+	if(nic->pool.mode == NIC_POOL_CLASS) {
+		if(pool_class_init(nic, index, poolsize) != VNIC_ERROR_NOERROR)
+			return VNIC_ERROR_NO_MEMORY;
+	} else {
+		nic->pool.bitmap = index;
+		index += BITMAP_SIZE;
+		index = ROUNDUP(index, NIC_CHUNK_SIZE);
+		if(index + NIC_CHUNK_SIZE > poolsize) return VNIC_ERROR_NO_MEMORY;
+
+		nic->pool.pool = index;
+		nic->pool.count = BITMAP_SIZE;
+
+		memset(base + nic->pool.bitmap, 0, nic->pool.count);
+	}
+
 	nic->config = 0;
+	memset(nic->config_index, 0, sizeof(nic->config_index));
 
 	memset(nic->config_head, 0, (size_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head));
-	memset(base + nic->pool.bitmap, 0, nic->pool.count);
 
 	return VNIC_ERROR_NOERROR;
 }
 
+void vnic_bucket_init(VNICBucket* bucket, uint64_t bandwidth, uint64_t burst) {
+	bucket->wait = bandwidth ? (TIMER_FREQUENCY_PER_SEC * 8 << VNIC_BUCKET_SHIFT) / bandwidth : 0;
+	bucket->burst = (bucket->wait * burst) >> VNIC_BUCKET_SHIFT;
+	bucket->closed = timer_frequency();
+}
+
+// Bursts default to 10ms of input and 1ms of output, paced output has none
+static void vnic_buckets_init(VNIC* vnic) {
+	vnic_bucket_init(&vnic->rx_bucket, vnic->rx_bandwidth, vnic->rx_burst ? : vnic->rx_bandwidth / 8 / 100);
+	vnic_bucket_init(&vnic->tx_bucket, vnic->tx_bandwidth, vnic->tx_pacing ? 0 : vnic->tx_burst ? : vnic->tx_bandwidth / 8 / 1000);
+	vnic_bucket_init(&vnic->tx_min_bucket, vnic->tx_min_bandwidth, vnic->tx_burst ? : vnic->tx_min_bandwidth / 8 / 1000);
+}
+
+static bool aqm_valid(uint64_t target, uint64_t interval) {
+	return target > 0 && target < interval && interval <= VNIC_AQM_TARGET_MAX;
+}
+
+// Thresholds in timer ticks, and the app stamps tx packets while anything reads the stamps
+static void aqm_init(VNIC* vnic) {
+	vnic->aqm_target_ticks = TIMER_FREQUENCY_PER_SEC * vnic->aqm_target / 1000000;
+	vnic->aqm_interval_ticks = TIMER_FREQUENCY_PER_SEC * vnic->aqm_interval / 1000000;
+	vnic->nic->tx_stamp = vnic->latency || vnic->tx_aqm;
+}
+
+static void pacing_init(VNIC* vnic) {
+	vnic->tx_pacing_horizon_ticks = TIMER_FREQUENCY_PER_SEC * vnic->tx_pacing_horizon / 1000000;
+}
+
 bool vnic_init(VNIC* vnic, uint64_t* attrs) {
 	if(nic_init(vnic->nic, attrs) != VNIC_ERROR_NOERROR)
 		return false;
@@ -161,11 +284,15 @@ bool vnic_init(VNIC* vnic, uint64_t* attrs) {
 	strncpy(vnic->parent, (char*)get_value(attrs, VNIC_DEV), MAX_NIC_NAME_LEN);
 	vnic->nic->id = vnic->id;
 	vnic->budget = get_value(attrs, VNIC_BUDGET) ? : 32;
+	vnic->domain = get_value(attrs, VNIC_DOMAIN) == (uint64_t)-1 ? 0 : get_value(attrs, VNIC_DOMAIN);
+	vnic->mirror = get_value(attrs, VNIC_MIRROR) == true;
+	vnic->tx_ready = false;
 	vnic->magic = vnic->nic->magic;
 	vnic->mac = vnic->nic->mac;
 	vnic->pool.bitmap = vnic->nic->pool.bitmap;
 	vnic->pool.count = vnic->nic->pool.count;
 	vnic->pool.pool = vnic->nic->pool.pool;
+	vnic->pool.mode = vnic->nic->pool.mode;
 
 	vnic->rx_bandwidth = vnic->nic->rx_bandwidth;
 	vnic->tx_bandwidth = vnic->nic->tx_bandwidth;
@@ -176,72 +303,335 @@ bool vnic_init(VNIC* vnic, uint64_t* attrs) {
 	vnic->tx = vnic->nic->tx;
 	vnic->srx = vnic->nic->srx;
 	vnic->stx = vnic->nic->stx;
+	vnic->queue_count = vnic->nic->queue_count;
+	vnic->tx_queue = 0;
+
+	vnic->tx_min_bandwidth = get_value_or(attrs, VNIC_TX_MIN_BANDWIDTH, 0);
+	vnic->rx_burst = get_value_or(attrs, VNIC_RX_BURST, 0);
+	vnic->tx_burst = get_value_or(attrs, VNIC_TX_BURST, 0);
+	vnic->tx_class = get_value_or(attrs, VNIC_TX_CLASS, 0);
+	vnic->tx_weight = get_value_or(attrs, VNIC_TX_WEIGHT, 1);
+	if(vnic->tx_class >= VNIC_TX_CLASS_COUNT || vnic->tx_weight == 0)
+		return false;
+
+	vnic->tx_ready_class = 0;
+	vnic->tx_deficit = 0;
+	vnic->tx_ready_time = 0;
+	vnic->tx_next = NULL;
+	vnic->tx_waiting = false;
+	vnic->tx_wait_index = 0;
+	vnic->tx_wait_time = 0;
+
+	uint64_t horizon = get_value_or(attrs, VNIC_TX_PACING_HORIZON, VNIC_TX_PACING_HORIZON_DEFAULT);
+	if(horizon == 0 || horizon > UINT32_MAX)
+		return false;
+
+	vnic->tx_pacing = get_value(attrs, VNIC_TX_PACING) == true;
+	vnic->tx_pacing_count = 0;
+	vnic->tx_pacing_seq = 0;
+	vnic->tx_pacing_horizon = horizon;
+	pacing_init(vnic);
+
+	uint64_t offloads = get_value_or(attrs, VNIC_OFFLOADS, 0);
+	if(offloads > UINT8_MAX)
+		return false;
 
-	vnic->rx_closed = vnic->tx_closed = timer_frequency();
-	vnic->rx_wait = TIMER_FREQUENCY_PER_SEC * 8 / vnic->rx_bandwidth;
-	vnic->rx_wait_grace = TIMER_FREQUENCY_PER_SEC / 100;
-	vnic->tx_wait = TIMER_FREQUENCY_PER_SEC * 8 / vnic->tx_bandwidth;
-	vnic->tx_wait_grace = TIMER_FREQUENCY_PER_SEC / 1000;
+	vnic->nic->offloads = offloads;
+	vnic_buckets_init(vnic);
+	memset(vnic->stats, 0, sizeof(vnic->stats));
+
+	vnic->latency = get_value(attrs, VNIC_LATENCY) == true;
+	vnic->nic->latency = vnic->latency;
+
+	uint64_t rx_aqm = get_value_or(attrs, VNIC_RX_AQM, VNIC_AQM_NONE);
+	uint64_t tx_aqm = get_value_or(attrs, VNIC_TX_AQM, VNIC_AQM_NONE);
+	uint64_t target = get_value_or(attrs, VNIC_AQM_TARGET, VNIC_AQM_TARGET_DEFAULT);
+	uint64_t interval = get_value_or(attrs, VNIC_AQM_INTERVAL, VNIC_AQM_INTERVAL_DEFAULT);
+	if(rx_aqm > VNIC_AQM_RED || tx_aqm > VNIC_AQM_RED || !aqm_valid(target, interval))
+		return false;
+
+	vnic->rx_aqm = rx_aqm;
+	vnic->tx_aqm = tx_aqm;
+	vnic->aqm_target = target;
+	vnic->aqm_interval = interval;
+	vnic->aqm_ecn = get_value_or(attrs, VNIC_AQM_ECN, true) != 0;
+	vnic->aqm_random = vnic->id * 2654435761U | 1;
+	memset(vnic->rx_aqms, 0, sizeof(vnic->rx_aqms));
+	memset(vnic->tx_aqms, 0, sizeof(vnic->tx_aqms));
+	aqm_init(vnic);
+
+	nic_region_add(vnic->nic);
 
 	return true;
 }
 
-VNICError vnic_update(VNIC* vnic, uint64_t* attrs) {
-	// TODO impl
-	return VNIC_ERROR_UNSUPPORTED;
+typedef struct {
+	NICQueue*	queue;
+	uint32_t	size;
+	Packet*		ring;		///< New pool buffer, NULL if the current ring is large enough
+} QueueResize;
+
+// Rings that outgrow their memory move to a pool buffer
+static VNICError queue_resize_prepare(VNIC* vnic, QueueResize* resize, NICQueue* queue, uint32_t size) {
+	resize->queue = queue;
+	resize->size = size;
+	resize->ring = NULL;
+
+	if(queue->next_size)
+		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+
+	if(size > queue->capacity && vnic_alloc_burst(vnic, size * sizeof(uint64_t), &resize->ring, 1) == 0)
+		return VNIC_ERROR_NO_MEMORY;
+
+	return VNIC_ERROR_NOERROR;
 }
 
-Packet* vnic_alloc(VNIC* vnic, size_t size) {
-	if(!lock_trylock(&vnic->nic->pool.lock))
-		return NULL;
+static void queue_resize_commit(VNIC* vnic, QueueResize* resize) {
+	NICQueue* queue = resize->queue;
+	if(resize->ring) {
+		queue->next_ring = (uintptr_t)resize->ring - (uintptr_t)vnic->nic;
+		queue->next_base = queue->next_ring + sizeof(Packet);
+		queue->next_capacity = resize->ring->size / sizeof(uint64_t);
+	} else {
+		queue->next_ring = queue->ring;
+		queue->next_base = queue->base;
+		queue->next_capacity = queue->capacity;
+	}
 
-	uint8_t* bitmap = (void*)vnic->nic + vnic->pool.bitmap;
-	uint32_t count = vnic->pool.count;
-	void* pool = (void*)vnic->nic + vnic->pool.pool;
+	__atomic_store_n(&queue->next_size, resize->size, __ATOMIC_RELEASE);
+}
 
-	uint32_t packet_size = sizeof(Packet) + vnic->padding_head + size + vnic->padding_tail;
-	uint8_t req = (ROUNDUP(packet_size, NIC_CHUNK_SIZE)) / NIC_CHUNK_SIZE;
-	uint32_t index = vnic->nic->pool.index;
+// Resize the rx (or tx) queue of every queue pair
+static VNICError queue_resize(VNIC* vnic, uint64_t* attrs, uint64_t key, QueueResize* resizes, int* count) {
+	uint64_t size = get_value(attrs, key);
+	if(size == (uint64_t)-1)
+		return VNIC_ERROR_NOERROR;
 
-	// Find tail
-	uint32_t idx = 0;
-	for(idx = index; idx <= count - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			uint32_t pos = idx + j; // base + i
-			if(bitmap[pos] == 0) {
-				continue;
-			} else {
-				// another packet uses it. jump to the end of packet chunk
-				idx += j + bitmap[pos];
-				goto next;
-			}
+	for(uint16_t i = 0; i < vnic->queue_count; i++) {
+		NICQueue* queue = nic_queue_pair(vnic->nic, i) + (key == VNIC_TX_QUEUE_SIZE);
+		if((queue->next_size ? : queue->size) == size)
+			continue;
+
+		VNICError error = queue_resize_prepare(vnic, &resizes[(*count)++], queue, size);
+		if(error != VNIC_ERROR_NOERROR)
+			return error;
+	}
+
+	return VNIC_ERROR_NOERROR;
+}
+
+VNICError vnic_update_check(VNIC* vnic, uint64_t* attrs) {
+	for(int i = 0; attrs[i] != VNIC_NONE; i += 2) {
+		uint64_t value = attrs[i + 1];
+		switch(attrs[i]) {
+			case VNIC_POOL_SIZE:
+				// The pool is the NIC memory the VM mapped when it was created
+				if(value != vnic->nic->size)
+					return VNIC_ERROR_INVALID_POOLSIZE;
+				break;
+			case VNIC_RX_QUEUE_SIZE:
+			case VNIC_TX_QUEUE_SIZE:
+				if(value < 2 || value > UINT16_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_BUDGET:
+			case VNIC_RX_BANDWIDTH:
+			case VNIC_TX_BANDWIDTH:
+			case VNIC_TX_MIN_BANDWIDTH:
+				break;
+			case VNIC_PADDING_HEAD:
+			case VNIC_PADDING_TAIL:
+				if(value > UINT16_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_RX_BURST:
+			case VNIC_TX_BURST:
+				if(value > UINT32_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_TX_WEIGHT:
+				if(value == 0 || value > UINT16_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_TX_CLASS:
+				if(value >= VNIC_TX_CLASS_COUNT)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_LATENCY:
+			case VNIC_AQM_ECN:
+			case VNIC_TX_PACING:
+				if(value > 1)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_TX_PACING_HORIZON:
+				if(value == 0 || value > UINT32_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_OFFLOADS:
+				if(value > UINT8_MAX)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_RX_AQM:
+			case VNIC_TX_AQM:
+				if(value > VNIC_AQM_RED)
+					return VNIC_ERROR_ATTRIBUTE_INVALID;
+				break;
+			case VNIC_AQM_TARGET:
+			case VNIC_AQM_INTERVAL:
+				break;
+			default:
+				return VNIC_ERROR_UNSUPPORTED;
 		}
+	}
 
-		goto found;
-next:
-		idx -= 1; // for loop increases idx for next loop
+	// Thresholds are checked together, either may change
+	uint64_t target = get_value_or(attrs, VNIC_AQM_TARGET, vnic->aqm_target);
+	uint64_t interval = get_value_or(attrs, VNIC_AQM_INTERVAL, vnic->aqm_interval);
+	if(!aqm_valid(target, interval))
+		return VNIC_ERROR_ATTRIBUTE_INVALID;
+
+	// A queue takes one resize at a time
+	for(int key = VNIC_RX_QUEUE_SIZE; key <= VNIC_TX_QUEUE_SIZE; key++) {
+		uint64_t size = get_value(attrs, key);
+		if(size == (uint64_t)-1)
+			continue;
+
+		for(uint16_t i = 0; i < vnic->queue_count; i++) {
+			NICQueue* queue = nic_queue_pair(vnic->nic, i) + (key == VNIC_TX_QUEUE_SIZE);
+			if(queue->next_size && queue->next_size != size)
+				return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+		}
 	}
 
-	// Find head
-	for(idx = 0; idx < index - req; idx++) {
-		for(uint32_t j = 0; j < req; j++) {
-			if(bitmap[idx + j] == 0) {
-				continue;
-			} else {
-				idx += j + bitmap[idx + j];
-				goto notfound;
-			}
+	return VNIC_ERROR_NOERROR;
+}
+
+VNICError vnic_update(VNIC* vnic, uint64_t* attrs) {
+	// Check everything first, a failed update changes nothing
+	VNICError error = vnic_update_check(vnic, attrs);
+	if(error != VNIC_ERROR_NOERROR)
+		return error;
+
+	// Allocate the new rings before anything changes
+	QueueResize resizes[NIC_MAX_QUEUE_COUNT * 2];
+	int resize_count = 0;
+	error = queue_resize(vnic, attrs, VNIC_RX_QUEUE_SIZE, resizes, &resize_count);
+	if(error == VNIC_ERROR_NOERROR)
+		error = queue_resize(vnic, attrs, VNIC_TX_QUEUE_SIZE, resizes, &resize_count);
+
+	if(error != VNIC_ERROR_NOERROR) {
+		for(int i = 0; i < resize_count; i++) {
+			if(resizes[i].ring)
+				vnic_free(vnic, resizes[i].ring);
 		}
 
-		goto found;
+		return error;
 	}
 
-notfound:
-	// Not found
-	lock_unlock(&vnic->nic->pool.lock);
-	return NULL;
+	for(int i = 0; i < resize_count; i++)
+		queue_resize_commit(vnic, &resizes[i]);
+
+	for(int i = 0; attrs[i] != VNIC_NONE; i += 2) {
+		uint64_t value = attrs[i + 1];
+		switch(attrs[i]) {
+			case VNIC_BUDGET:
+				vnic->budget = value ? : 32;
+				break;
+			case VNIC_RX_BANDWIDTH:
+				vnic->rx_bandwidth = vnic->nic->rx_bandwidth = value;
+				break;
+			case VNIC_TX_BANDWIDTH:
+				vnic->tx_bandwidth = vnic->nic->tx_bandwidth = value;
+				break;
+			case VNIC_TX_MIN_BANDWIDTH:
+				vnic->tx_min_bandwidth = value;
+				break;
+			case VNIC_PADDING_HEAD:
+				vnic->padding_head = vnic->nic->padding_head = value;
+				break;
+			case VNIC_PADDING_TAIL:
+				vnic->padding_tail = vnic->nic->padding_tail = value;
+				break;
+			case VNIC_RX_BURST:
+				vnic->rx_burst = value;
+				break;
+			case VNIC_TX_BURST:
+				vnic->tx_burst = value;
+				break;
+			case VNIC_TX_WEIGHT:
+				vnic->tx_weight = value;
+				break;
+			case VNIC_TX_CLASS:
+				// The NICDevice moves the VNIC on its next turn
+				vnic->tx_class = value;
+				break;
+			case VNIC_LATENCY:
+				// Histograms start over when telemetry is turned on
+				if(value && !vnic->latency)
+					memset((void*)vnic->nic + vnic->nic->histograms, 0, sizeof(NICLatency));
+				asm volatile("" ::: "memory");
+				vnic->nic->latency = value;
+				vnic->latency = value;
+				break;
+			case VNIC_RX_AQM:
+				if(value != vnic->rx_aqm)
+					memset(vnic->rx_aqms, 0, sizeof(vnic->rx_aqms));
+				vnic->rx_aqm = value;
+				break;
+			case VNIC_TX_AQM:
+				if(value != vnic->tx_aqm)
+					memset(vnic->tx_aqms, 0, sizeof(vnic->tx_aqms));
+				vnic->tx_aqm = value;
+				break;
+			case VNIC_AQM_TARGET:
+				vnic->aqm_target = value;
+				break;
+			case VNIC_AQM_INTERVAL:
+				vnic->aqm_interval = value;
+				break;
+			case VNIC_AQM_ECN:
+				vnic->aqm_ecn = value;
+				break;
+			case VNIC_TX_PACING:
+				// Held packets leave at once when pacing is turned off
+				vnic->tx_pacing = value;
+				break;
+			case VNIC_TX_PACING_HORIZON:
+				vnic->tx_pacing_horizon = value;
+				break;
+			case VNIC_OFFLOADS:
+				vnic->nic->offloads = value;
+				break;
+		}
+	}
+
+	vnic_buckets_init(vnic);
+	aqm_init(vnic);
+	pacing_init(vnic);
+
+	return VNIC_ERROR_NOERROR;
+}
+
+// Caller must hold the pool lock
+static Packet* pool_alloc(VNIC* vnic, size_t size) {
+	uint8_t* bitmap = (void*)vnic->nic + vnic->pool.bitmap;
+	uint32_t count = vnic->pool.count;
+	void* pool = (void*)vnic->nic + vnic->pool.pool;
+
+	uint32_t packet_size = sizeof(Packet) + vnic->padding_head + size + vnic->padding_tail;
+	if(packet_size > UINT8_MAX * NIC_CHUNK_SIZE)
+		return NULL;	// Longer than the bitmap can record, use a chain
+
+	uint8_t req = (ROUNDUP(packet_size, NIC_CHUNK_SIZE)) / NIC_CHUNK_SIZE;
+	uint32_t index = vnic->nic->pool.index;
+
+	// First fit after the last allocation, then from the start of the pool
+	uint32_t idx = nic_pool_bitmap_find(bitmap, count, index, count, req);
+	if(idx == (uint32_t)-1)
+		idx = nic_pool_bitmap_find(bitmap, count, 0, index, req);
+	if(idx == (uint32_t)-1)
+		return NULL;
 
-found:
 	vnic->nic->pool.index = idx + req;
 	for(uint32_t k = 0; k < req; k++) {
 		bitmap[idx + k] = req - k;
@@ -249,25 +639,65 @@ found:
 
 	vnic->nic->pool.used += req;
 
-	lock_unlock(&vnic->nic->pool.lock);
-
 	Packet* packet = pool + (idx * NIC_CHUNK_SIZE);
 	packet->time = 0;
+	packet->tx_time = 0;
 	packet->start = 0;
 	packet->end = 0;
 	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+	packet->refcount = 1;
+	packet->meta.flags = 0;
+	packet->next = 0;
 
 	return packet;
 }
 
-bool vnic_free(VNIC* vnic, Packet* packet) {
-	NIC* nic = nic_find_by_packet(packet);
-	if(!nic || vnic->nic->id != nic->id)
-		return false;
+Packet* vnic_alloc(VNIC* vnic, size_t size) {
+	if(size > UINT16_MAX)
+		return NULL;
+
+	if(vnic->pool.mode == NIC_POOL_CLASS)
+		return nic_alloc(vnic->nic, size);
+
+	if(!lock_trylock(&vnic->nic->pool.lock))
+		return NULL;
+
+	Packet* packet = pool_alloc(vnic, size);
+
+	lock_unlock(&vnic->nic->pool.lock);
+
+	return packet;
+}
+
+uint32_t vnic_alloc_burst(VNIC* vnic, size_t size, Packet** packets, uint32_t count) {
+	uint32_t i = 0;
+	if(vnic->pool.mode == NIC_POOL_CLASS) {
+		for(; i < count; i++) {
+			packets[i] = nic_alloc(vnic->nic, size);
+			if(!packets[i])
+				break;
+		}
+
+		return i;
+	}
 
+	// One lock round trip for the whole burst
+	lock_lock(&vnic->nic->pool.lock);
+	for(; i < count; i++) {
+		packets[i] = pool_alloc(vnic, size);
+		if(!packets[i])
+			break;
+	}
+	lock_unlock(&vnic->nic->pool.lock);
+
+	return i;
+}
+
+// Caller holds the last reference
+static bool vnic_free_segment(VNIC* vnic, Packet* packet) {
 	uint8_t* bitmap = (void*)vnic->nic + vnic->pool.bitmap;
 	uint32_t count = vnic->pool.count;
-	void* pool = (void*)vnic + vnic->pool.pool;
+	void* pool = (void*)vnic->nic + vnic->pool.pool;
 
 	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool) / NIC_CHUNK_SIZE;
 	if(idx >= count)
@@ -277,8 +707,9 @@ bool vnic_free(VNIC* vnic, Packet* packet) {
 	if(idx + req > count)
 		return false;
 
-	for(uint32_t i = idx + req - 1; i >= idx; i--)
+	for(uint32_t i = idx + req - 1; i > idx; i--)
 		bitmap[i] = 0;
+	bitmap[idx] = 0;
 
 	lock_lock(&vnic->nic->pool.lock);
 	vnic->nic->pool.used -= req;
@@ -287,53 +718,443 @@ bool vnic_free(VNIC* vnic, Packet* packet) {
 	return true;
 }
 
+bool vnic_free(VNIC* vnic, Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(!nic || vnic->nic->id != nic->id)
+		return false;
+
+	if(vnic->pool.mode == NIC_POOL_CLASS)
+		return nic_free(packet);
+
+	if(packet->refcount > 1 && __sync_sub_and_fetch(&packet->refcount, 1) != 0)
+		return true;
+
+	bool freed = true;
+	while(packet) {
+		Packet* next = packet_next(packet);
+		freed &= vnic_free_segment(vnic, packet);
+		packet = next;
+	}
+
+	return freed;
+}
+
+// A packet holding size bytes, chained if no buffer is large enough. The end of every segment is set.
+static Packet* vnic_alloc_chain(VNIC* vnic, size_t size) {
+	Packet* packet = vnic_alloc(vnic, size);
+	if(packet) {
+		packet->end = packet->start + size;
+		return packet;
+	}
+
+	Packet* last = NULL;
+	while(size) {
+		uint16_t len = size < NIC_SEGMENT_SIZE ? size : NIC_SEGMENT_SIZE;
+		Packet* segment = vnic_alloc(vnic, len);
+		if(!segment) {
+			if(packet)
+				nic_free(packet);
+			return NULL;
+		}
+
+		segment->end = segment->start + len;
+		if(packet)
+			packet_append(packet, last, segment);
+		else
+			packet = segment;
+
+		last = segment;
+		size -= len;
+	}
+
+	return packet;
+}
+
+Packet* vnic_linearize(VNIC* vnic, Packet* packet) {
+	if(!packet->next)
+		return packet;
+
+	uint32_t len = packet->total;
+	Packet* packet2 = vnic_alloc(vnic, len);
+	if(!packet2)
+		return NULL;
+
+	packet2->time = packet->time;
+	packet2->tx_time = packet->tx_time;
+	packet2->vlan_proto = packet->vlan_proto;
+	packet2->vlan_tci = packet->vlan_tci;
+	packet2->meta.flags = packet->meta.flags & PACKET_META_OFFLOAD;	// Offsets change, the copy is parsed again
+	packet2->meta.gso_size = packet->meta.gso_size;
+	packet2->end = packet2->start + len;
+
+	uint8_t* data = packet2->buffer + packet2->start;
+	for(Packet* segment = packet; segment; segment = packet_next(segment)) {
+		memcpy(data, segment->buffer + segment->start, segment->end - segment->start);
+		data += segment->end - segment->start;
+	}
+
+	nic_free(packet);
+
+	return packet2;
+}
+
+// Counters of the calling core; the caller is the only writer of the slot
+static inline VNICStatsSlot* stats_begin(VNIC* vnic) {
+	VNICStatsSlot* slot = &vnic->stats[core_id() % VNIC_STATS_SLOTS];
+	slot->sequence++;
+	asm volatile("" ::: "memory");	// x86 keeps stores in order, the compiler must too
+
+	return slot;
+}
+
+static inline void stats_end(VNICStatsSlot* slot) {
+	asm volatile("" ::: "memory");
+	slot->sequence++;
+}
+
+static void stats_input(VNIC* vnic, uint32_t packets, uint64_t bytes) {
+	VNICStatsSlot* slot = stats_begin(vnic);
+	slot->stats.input_packets += packets;
+	slot->stats.input_bytes += bytes;
+	stats_end(slot);
+}
+
+static void stats_input_drop(VNIC* vnic, VNICDropReason reason, uint64_t bytes) {
+	VNICStatsSlot* slot = stats_begin(vnic);
+	slot->stats.input_drop_packets += 1;
+	slot->stats.input_drop_bytes += bytes;
+	slot->stats.drops[reason] += 1;
+	stats_end(slot);
+}
+
+static void stats_output(VNIC* vnic, uint32_t packets, uint64_t bytes) {
+	VNICStatsSlot* slot = stats_begin(vnic);
+	slot->stats.output_packets += packets;
+	slot->stats.output_bytes += bytes;
+	stats_end(slot);
+}
+
+static void stats_output_drop(VNIC* vnic, VNICDropReason reason, uint64_t bytes) {
+	VNICStatsSlot* slot = stats_begin(vnic);
+	slot->stats.output_drop_packets += 1;
+	slot->stats.output_drop_bytes += bytes;
+	slot->stats.drops[reason] += 1;
+	stats_end(slot);
+}
+
+static void stats_mark(VNIC* vnic, bool input) {
+	VNICStatsSlot* slot = stats_begin(vnic);
+	if(input)
+		slot->stats.input_marked_packets += 1;
+	else
+		slot->stats.output_marked_packets += 1;
+	stats_end(slot);
+}
+
+void vnic_stats(VNIC* vnic, VNICStats* stats) {
+	memset(stats, 0, sizeof(VNICStats));
+	for(int i = 0; i < VNIC_STATS_SLOTS; i++) {
+		VNICStatsSlot* slot = &vnic->stats[i];
+		VNICStats copy;
+		uint32_t sequence;
+		do {
+			while((sequence = slot->sequence) & 1)
+				asm volatile("pause");
+
+			asm volatile("" ::: "memory");
+			memcpy(&copy, &slot->stats, sizeof(VNICStats));
+			asm volatile("" ::: "memory");
+		} while(slot->sequence != sequence);
+
+		uint64_t* sum = (uint64_t*)stats;
+		uint64_t* value = (uint64_t*)&copy;
+		for(size_t j = 0; j < sizeof(VNICStats) / sizeof(uint64_t); j++)
+			sum[j] += value[j];
+	}
+}
+
+// Upper bound of a histogram bucket in ns
+static uint64_t latency_ns(uint32_t bucket) {
+	uint64_t cycles = bucket < 8 ? bucket : ((uint64_t)(8 + bucket % 8 + 1) << (bucket / 8 - 1)) - 1;
+
+	return TIMER_FREQUENCY_PER_SEC ? cycles * 1000000000 / TIMER_FREQUENCY_PER_SEC : cycles;
+}
+
+void vnic_latency(VNIC* vnic, VNICLatency* latency) {
+	NICLatency* histograms = (void*)vnic->nic + vnic->nic->histograms;
+	for(int stage = 0; stage < NIC_LATENCY_STAGE_COUNT; stage++) {
+		// Samples keep coming in, rank over one copy
+		uint64_t buckets[NIC_LATENCY_BUCKETS];
+		uint64_t count = 0;
+		for(uint32_t i = 0; i < NIC_LATENCY_BUCKETS; i++) {
+			buckets[i] = histograms->buckets[stage][i];
+			count += buckets[i];
+		}
+
+		VNICLatency* l = &latency[stage];
+		l->count = count;
+		l->p50 = l->p99 = l->p999 = 0;
+		if(!count)
+			continue;
+
+		const uint64_t ranks[] = { (count * 500 + 999) / 1000, (count * 990 + 999) / 1000, (count * 999 + 999) / 1000 };
+		uint64_t* values[] = { &l->p50, &l->p99, &l->p999 };
+		uint64_t seen = 0;
+		int p = 0;
+		for(uint32_t i = 0; i < NIC_LATENCY_BUCKETS && p < 3; i++) {
+			seen += buckets[i];
+			while(p < 3 && seen >= ranks[p])
+				*values[p++] = latency_ns(i);
+		}
+	}
+}
+
+// Parse a received frame once; frames of VLAN devices arrive untagged
+static void vnic_parse(VNIC* vnic, Packet* packet) {
+	if(packet->meta.flags & PACKET_META_PARSED)
+		return;
+
+	packet->vlan_proto = vnic->vlan_proto;
+	packet->vlan_tci = vnic->vlan_tci;
+	if(vnic->vlan_tci)
+		packet->meta.flags |= PACKET_META_VLAN_STRIPPED;
+
+	nic_parse(packet);
+}
+
+// rx queue of a parsed frame: flows of IPv4/IPv6 are spread by their hash
+static NICQueue* vnic_rss(VNIC* vnic, Packet* packet) {
+	if(vnic->queue_count <= 1)
+		return &vnic->nic->rx;
+
+	if(!(packet->meta.flags & (PACKET_META_IPV4 | PACKET_META_IPV6)))
+		return &vnic->nic->rx;	// Not IP, e.g. ARP
+
+	uint32_t queue = ((uint64_t)packet->meta.hash * vnic->queue_count) >> 32;
+
+	return nic_queue_pair(vnic->nic, queue);
+}
+
+// Queue pair of a rx or tx queue
+static uint16_t vnic_queue_index(VNIC* vnic, NICQueue* queue) {
+	if(queue == &vnic->nic->rx || queue == &vnic->nic->tx)
+		return 0;
+
+	return (queue - nic_queue_pair(vnic->nic, 1)) / 2 + 1;
+}
+
+static uint32_t aqm_sqrt(uint32_t value) {
+	uint32_t root = 0;
+	for(uint32_t bit = 1 << 30; bit; bit >>= 2) {
+		if(value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+
+	return root;
+}
+
+// RFC 8289, judged per packet: the queue is congested once the delay stayed
+// above the target for an interval, and drops then come closer as
+// interval / sqrt(count) until the delay falls below the target
+static bool aqm_codel(VNIC* vnic, VNICAQM* aqm, uint32_t delay, uint64_t time) {
+	bool above = false;
+	if(delay < vnic->aqm_target_ticks) {
+		aqm->first_above = 0;
+	} else if(!aqm->first_above) {
+		aqm->first_above = time + vnic->aqm_interval_ticks;
+	} else {
+		above = time >= aqm->first_above;
+	}
+
+	if(aqm->dropping) {
+		if(!above) {
+			aqm->dropping = false;
+			return false;
+		}
+
+		if(time < aqm->drop_next)
+			return false;
+
+		aqm->count++;
+		aqm->drop_next += vnic->aqm_interval_ticks / aqm_sqrt(aqm->count);
+		return true;
+	}
+
+	if(!above)
+		return false;
+
+	// Resume near the drop rate that controlled the queue if that was recent
+	uint32_t delta = aqm->count - aqm->last_count;
+	aqm->count = delta > 1 && time - aqm->drop_next < 16 * vnic->aqm_interval_ticks ? delta : 1;
+	aqm->last_count = aqm->count;
+	aqm->drop_next = time + vnic->aqm_interval_ticks / aqm_sqrt(aqm->count);
+	aqm->dropping = true;
+
+	return true;
+}
+
+// RED on the average delay: the probability rises linearly to
+// VNIC_AQM_RED_MAX_P between the thresholds and is spread by the count of
+// packets since the last drop, every packet is dropped above the maximum
+static bool aqm_red(VNIC* vnic, VNICAQM* aqm, uint32_t delay) {
+	aqm->average += delay - (aqm->average >> VNIC_AQM_RED_SHIFT);
+	uint64_t average = aqm->average >> VNIC_AQM_RED_SHIFT;
+	if(average < vnic->aqm_target_ticks) {
+		aqm->count = 0;
+		return false;
+	}
+
+	if(average >= vnic->aqm_interval_ticks) {
+		aqm->count = 0;
+		return true;
+	}
+
+	uint64_t pb = VNIC_AQM_RED_MAX_P * (average - vnic->aqm_target_ticks) /
+			(vnic->aqm_interval_ticks - vnic->aqm_target_ticks);
+	uint64_t spread = ++aqm->count * pb;
+	uint64_t pa = spread < 65536 ? (pb << 16) / (65536 - spread) : 65536;
+
+	uint32_t random = aqm->random ? : vnic->aqm_random;
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
+	aqm->random = random;
+	if((random & 0xffff) >= pa)
+		return false;
+
+	aqm->count = 0;
+	return true;
+}
+
+// Set Congestion Experienced in the IP header of an ECN capable packet
+static bool aqm_mark(Packet* packet) {
+	if(packet->refcount > 1)
+		return false;	// Other owners read the same header
+
+	PacketMeta* meta = nic_parse(packet);
+	uint8_t* ip = packet->buffer + meta->l3;
+	if(meta->flags & PACKET_META_IPV4) {
+		if(!(ip[1] & 0x03))
+			return false;
+
+		// RFC 1624 update of the header checksum
+		uint16_t old = ip[0] << 8 | ip[1];
+		ip[1] |= 0x03;
+		uint32_t sum = (uint16_t)~(ip[10] << 8 | ip[11]) + (uint16_t)~old + (ip[0] << 8 | ip[1]);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		ip[10] = ~sum >> 8;
+		ip[11] = ~sum;
+		return true;
+	} else if(meta->flags & PACKET_META_IPV6) {
+		if(!(ip[1] & 0x30))
+			return false;
+
+		ip[1] |= 0x30;
+		return true;
+	}
+
+	return false;
+}
+
+// false if AQM drops the packet. Packets carry their enqueue time in the low
+// 32 bits of time, 0 if they were not stamped
+static bool aqm_pass(VNIC* vnic, uint8_t mode, VNICAQM* aqm, Packet* packet, uint32_t delay, uint64_t time, bool input) {
+	if(!(mode == VNIC_AQM_CODEL ? aqm_codel(vnic, aqm, delay, time) : aqm_red(vnic, aqm, delay)))
+		return true;
+
+	if(!vnic->aqm_ecn || !aqm_mark(packet))
+		return false;
+
+	stats_mark(vnic, input);
+
+	return true;
+}
+
+// Arriving packets are judged by the delay of the oldest packet in their queue.
+// Every device queue feeds the queue, and a packet arriving while another core
+// judges one passes unjudged
+static bool aqm_rx(VNIC* vnic, NICQueue* queue, Packet* packet, uint64_t time) {
+	VNICAQM* aqm = &vnic->rx_aqms[vnic_queue_index(vnic, queue)];
+	if(aqm->lock || __sync_lock_test_and_set(&aqm->lock, 1))
+		return true;
+
+	Packet* head = queue_peek(vnic->nic, queue);
+	uint32_t delay = head && head->time ? (uint32_t)time - (uint32_t)head->time : 0;
+
+	bool pass = aqm_pass(vnic, vnic->rx_aqm, aqm, packet, delay, time, true);
+	__sync_lock_release(&aqm->lock);
+
+	return pass;
+}
+
+// and leaving ones by their own
+static bool aqm_tx(VNIC* vnic, NICQueue* queue, Packet* packet, uint64_t time) {
+	uint32_t delay = packet->time ? (uint32_t)time - (uint32_t)packet->time : 0;
+
+	return aqm_pass(vnic, vnic->tx_aqm, &vnic->tx_aqms[vnic_queue_index(vnic, queue)], packet, delay, time, false);
+}
+
+// Received packets carry the latency stamp, or the enqueue time for the rx AQM
+static void rx_stamp(VNIC* vnic, Packet* packet, uint64_t time) {
+	if(vnic->latency)
+		packet->time = nic_latency_lap(vnic->nic, NIC_LATENCY_STAMP(time, time), NIC_LATENCY_RX_DRIVER, NIC_LATENCY_STAGE_COUNT);
+	else if(vnic->rx_aqm)
+		packet->time = NIC_LATENCY_STAMP(time, time);
+}
+
 VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
 	const uint64_t t = timer_frequency();
 	const size_t size = size1 + size2;
-	if(vnic->rx_closed - vnic->rx_wait_grace > t) // TODO
-		return -1;
+	VNICDropReason reason = VNIC_DROP_RX_BANDWIDTH;
+	if(!vnic_bucket_conforms(&vnic->rx_bucket, t))
+		goto drop;
 
-	if(!lock_trylock(&vnic->nic->rx.wlock))
-		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+	// Other queues are known once the frame is parsed
+	reason = VNIC_DROP_RX_QUEUE_FULL;
+	if(vnic->queue_count <= 1 && !queue_available(&vnic->nic->rx))
+		goto drop;
 
-	vnic->rx.head = vnic->nic->rx.head;
-	if(queue_available(&vnic->rx)) {
-		Packet* packet = vnic_alloc(vnic, size);
-		if(!packet) {
-			lock_unlock(&vnic->nic->rx.wlock);
-			goto drop;
-		}
+	reason = VNIC_DROP_RX_NO_BUFFER;
+	Packet* packet = vnic_alloc_chain(vnic, size);
+	if(!packet)
+		goto drop;
 
+	if(!packet->next) {
 		memcpy(packet->buffer + packet->start, buf1, size1);
 		if(size2)
 			memcpy(packet->buffer + packet->start + size1, buf2, size2);
-		packet->end = packet->start + size;
-
-		if(queue_push(vnic->nic, &vnic->rx, packet)) {
-			vnic->nic->rx.tail = vnic->rx.tail;
-			lock_unlock(&vnic->nic->rx.wlock);
+	} else {
+		nic_write(packet, 0, buf1, size1);
+		nic_write(packet, size1, buf2, size2);
+	}
+	vnic_parse(vnic, packet);
+	rx_stamp(vnic, packet, t);
 
-			if(vnic->rx_closed > t)
-				vnic->rx_closed += vnic->rx_wait * size;
-			else
-				vnic->rx_closed = t + vnic->rx_wait * size;
+	NICQueue* queue = vnic_rss(vnic, packet);
+	if(vnic->rx_aqm && !aqm_rx(vnic, queue, packet, t)) {
+		nic_free(packet);
+		reason = VNIC_DROP_RX_AQM;
+		goto drop;
+	}
 
-			vnic->input_packets += 1;
-			vnic->input_bytes += size;
-			return VNIC_ERROR_NOERROR;
-		} else {
-			lock_unlock(&vnic->nic->rx.wlock);
-			nic_free(packet);
-			goto drop;
-		}
-	} else {
-		lock_unlock(&vnic->nic->rx.wlock);
+	if(!queue_push(vnic->nic, queue, packet)) {
+		nic_free(packet);
+		reason = VNIC_DROP_RX_QUEUE_FULL;
 		goto drop;
 	}
 
+	vnic_bucket_charge_shared(&vnic->rx_bucket, t, size);
+
+	stats_input(vnic, 1, size);
+	return VNIC_ERROR_NOERROR;
+
 drop:
-	vnic->input_drop_packets += 1;
-	vnic->input_drop_bytes += size;
+	stats_input_drop(vnic, reason, size);
 	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 }
 
@@ -341,163 +1162,423 @@ VNICError vnic_rx2(VNIC* vnic, Packet* packet) {
 	// For VNICs belonging to the same VM: exchanging is done by putting packets in the queue
 	// For VNICs not in the same VM: packets are replicated for exchange
 	uint64_t t = timer_frequency();
-	if(vnic->rx_closed - vnic->rx_wait_grace > t)
-		goto drop;
-	if(!lock_trylock(&vnic->nic->rx.wlock))
+	uint32_t size = packet_len(packet);	// Queued packets belong to the consumer
+	VNICDropReason reason = VNIC_DROP_RX_BANDWIDTH;
+	if(!vnic_bucket_conforms(&vnic->rx_bucket, t))
 		goto drop;
 
-	vnic->rx.head = vnic->nic->rx.head;
-	if(queue_push(vnic->nic, &vnic->rx, packet)) {
-		vnic->nic->rx.tail = vnic->rx.tail;
-		lock_unlock(&vnic->nic->rx.wlock);
+	vnic_parse(vnic, packet);
+	rx_stamp(vnic, packet, t);
 
-		if(vnic->rx_closed > t)
-			vnic->rx_closed += vnic->rx_wait * (packet->end - packet->start);
-		else
-			vnic->rx_closed = t + vnic->rx_wait * (packet->end - packet->start);
+	NICQueue* queue = vnic_rss(vnic, packet);
+	reason = VNIC_DROP_RX_AQM;
+	if(vnic->rx_aqm && !aqm_rx(vnic, queue, packet, t))
+		goto drop;
+
+	reason = VNIC_DROP_RX_QUEUE_FULL;
+	if(queue_push(vnic->nic, queue, packet)) {
+		vnic_bucket_charge_shared(&vnic->rx_bucket, t, size);
 
-		vnic->input_packets += 1;
-		vnic->input_bytes += packet->end - packet->start;
+		stats_input(vnic, 1, size);
 		return VNIC_ERROR_NOERROR;
-	} else {
-		lock_unlock(&vnic->nic->rx.wlock);
-		nic_free(packet);
-		goto drop;
 	}
 
 drop:
-	vnic->input_drop_packets += 1;
-	vnic->input_drop_bytes += packet->end - packet->start;
+	nic_free(packet);
+	stats_input_drop(vnic, reason, size);
 	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 }
 
+uint32_t vnic_rx_burst(VNIC* vnic, Packet** packets, uint32_t count) {
+	uint64_t t = timer_frequency();
+	uint32_t n = 0;
+	uint64_t bytes = 0;
+
+	// Sizes are read before pushing, queued packets belong to the consumer
+	uint32_t sizes[count];
+	for(uint32_t i = 0; i < count; i++) {
+		sizes[i] = packet_len(packets[i]);
+		vnic_parse(vnic, packets[i]);
+		rx_stamp(vnic, packets[i], t);
+	}
+
+	bool conforms = vnic_bucket_conforms(&vnic->rx_bucket, t);
+	if(conforms && vnic->rx_aqm) {
+		uint32_t kept = 0;
+		for(uint32_t i = 0; i < count; i++) {
+			if(!aqm_rx(vnic, vnic_rss(vnic, packets[i]), packets[i], t)) {
+				stats_input_drop(vnic, VNIC_DROP_RX_AQM, sizes[i]);
+				nic_free(packets[i]);
+				continue;
+			}
+
+			packets[kept] = packets[i];
+			sizes[kept++] = sizes[i];
+		}
+		count = kept;
+	}
+
+	if(conforms) {
+		if(vnic->queue_count <= 1) {
+			n = queue_push_burst(vnic->nic, &vnic->nic->rx, packets, count);
+			for(uint32_t i = 0; i < n; i++)
+				bytes += sizes[i];
+		} else {
+			// Flows go to different queues; keep the packets not queued at the end
+			for(uint32_t i = 0; i < count; i++) {
+				Packet* packet = packets[i];
+				uint32_t size = sizes[i];
+				if(queue_push(vnic->nic, vnic_rss(vnic, packet), packet)) {
+					packets[i] = packets[n];
+					sizes[i] = sizes[n];
+					packets[n] = packet;
+					n++;
+					bytes += size;
+				}
+			}
+		}
+	}
+
+	if(n) {
+		vnic_bucket_charge_shared(&vnic->rx_bucket, t, bytes);
+
+		stats_input(vnic, n, bytes);
+	}
+
+	for(uint32_t i = n; i < count; i++) {
+		stats_input_drop(vnic, conforms ? VNIC_DROP_RX_QUEUE_FULL : VNIC_DROP_RX_BANDWIDTH, sizes[i]);
+		nic_free(packets[i]);
+	}
+
+	return n;
+}
+
 bool vnic_has_srx(VNIC* vnic) {
-	vnic->srx.head = vnic->nic->srx.head;
-	return queue_available(&vnic->srx);
+	return queue_available(&vnic->nic->srx);
 }
 
 bool vnic_srx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
-	if(!lock_trylock(&vnic->nic->srx.wlock))
+	if(!queue_available(&vnic->nic->srx))
 		return false;
 
 	size_t size = size1 + size2;
-	vnic->srx.head = vnic->nic->srx.head;
-	if(queue_available(&vnic->srx)) {
-		Packet* packet = vnic_alloc(vnic, size);
-		if(packet == NULL) {
-			lock_unlock(&vnic->nic->srx.wlock);
-			return false;
-		}
+	Packet* packet = vnic_alloc(vnic, size);
+	if(packet == NULL)
+		return false;
 
-		memcpy(packet->buffer + packet->start, buf1, size1);
-		memcpy(packet->buffer + packet->start + size1, buf2, size2);
+	memcpy(packet->buffer + packet->start, buf1, size1);
+	memcpy(packet->buffer + packet->start + size1, buf2, size2);
 
-		packet->end = packet->start + size;
+	packet->end = packet->start + size;
 
-		if(queue_push(vnic->nic, &vnic->srx, packet)) {
-			vnic->nic->srx.tail = vnic->srx.tail;
-			lock_unlock(&vnic->nic->srx.wlock);
-			return true;
-		} else {
-			lock_unlock(&vnic->nic->srx.wlock);
-			nic_free(packet);
-			return false;
-		}
+	if(queue_push(vnic->nic, &vnic->nic->srx, packet)) {
+		return true;
 	} else {
-		lock_unlock(&vnic->nic->srx.wlock);
+		nic_free(packet);
 		return false;
 	}
 }
 
 bool vnic_srx2(VNIC* vnic, Packet* packet) {
-	if(!lock_trylock(&vnic->nic->srx.wlock))
-		return false;
-	vnic->srx.head = vnic->nic->srx.head;
-	if(queue_push(vnic->nic, &vnic->srx, packet)) {
-		vnic->nic->srx.tail = vnic->srx.tail;
-		lock_unlock(&vnic->nic->srx.wlock);
+	if(queue_push(vnic->nic, &vnic->nic->srx, packet)) {
 		return true;
 	} else {
-		lock_unlock(&vnic->nic->srx.wlock);
 		nic_free(packet);
 		return false;
 	}
 }
 
 bool vnic_has_tx(VNIC* vnic) {
-	vnic->tx.tail = vnic->nic->tx.tail;
-	return !queue_empty(&vnic->tx);
+	for(uint16_t i = 0; i < vnic->queue_count; i++) {
+		NICQueue* tx = nic_queue_pair(vnic->nic, i) + 1;
+		if(!queue_empty(tx))
+			return true;
+
+		// Empty queues are not popped, finish their resize here
+		if(tx->next_size)
+			queue_swap(vnic->nic, tx);
+	}
+
+	return vnic->tx_pacing_count != 0;
 }
 
-VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
-	if(!vnic_has_tx(vnic))
-		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+// Next non-empty tx queue, round robin over the queue pairs
+static NICQueue* vnic_tx_queue(VNIC* vnic) {
+	if(vnic->queue_count <= 1)
+		return queue_empty(&vnic->nic->tx) ? NULL : &vnic->nic->tx;
 
-	uint64_t t = timer_frequency();
-	if(vnic->tx_closed - vnic->tx_wait_grace > t)
-		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+	for(uint16_t i = 0; i < vnic->queue_count; i++) {
+		uint16_t queue = vnic->tx_queue;
+		vnic->tx_queue = queue + 1 == vnic->queue_count ? 0 : queue + 1;
 
-	if(!lock_trylock(&vnic->nic->tx.rlock))
-		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+		NICQueue* tx = nic_queue_pair(vnic->nic, queue) + 1;
+		if(!queue_empty(tx))
+			return tx;
+	}
+
+	return NULL;
+}
+
+static inline bool pacing_before(VNICPacing* a, VNICPacing* b) {
+	return a->time < b->time || (a->time == b->time && (int32_t)(a->seq - b->seq) < 0);
+}
+
+static void pacing_push(VNIC* vnic, Packet* packet) {
+	VNICPacing* heap = vnic->tx_pacings;
+	VNICPacing pacing = { .time = packet->tx_time, .packet = packet, .seq = vnic->tx_pacing_seq++ };
+
+	uint16_t index = vnic->tx_pacing_count++;
+	while(index > 0) {
+		uint16_t parent = (index - 1) / 2;
+		if(!pacing_before(&pacing, &heap[parent]))
+			break;
+
+		heap[index] = heap[parent];
+		index = parent;
+	}
+	heap[index] = pacing;
+}
+
+static Packet* pacing_pop(VNIC* vnic) {
+	VNICPacing* heap = vnic->tx_pacings;
+	Packet* packet = heap[0].packet;
+	VNICPacing last = heap[--vnic->tx_pacing_count];
+
+	uint16_t index = 0;
+	for(;;) {
+		uint16_t child = index * 2 + 1;
+		if(child >= vnic->tx_pacing_count)
+			break;
+		if(child + 1 < vnic->tx_pacing_count && pacing_before(&heap[child + 1], &heap[child]))
+			child++;
+		if(!pacing_before(&heap[child], &last))
+			break;
+
+		heap[index] = heap[child];
+		index = child;
+	}
+	heap[index] = last;
+
+	return packet;
+}
+
+/*
+ * Next packet of a paced VNIC that may leave at t. Packets from the tx queues
+ * that are due later are held in time order; once pacing is off the held
+ * packets are due at once.
+ */
+static Packet* pacing_next(VNIC* vnic, uint64_t t) {
+	if(!vnic_bucket_conforms(&vnic->tx_bucket, t))
+		return NULL;
+
+	uint64_t due = vnic->tx_pacing ? t : (uint64_t)-1;
+	for(;;) {
+		if(vnic->tx_pacing_count && vnic->tx_pacings[0].time <= due)
+			return pacing_pop(vnic);
+
+		if(vnic->tx_pacing_count == VNIC_TX_PACING_SIZE)
+			return NULL;
+
+		NICQueue* tx = vnic_tx_queue(vnic);
+		Packet* packet = tx ? queue_pop(vnic->nic, tx) : NULL;
+		if(!packet)
+			return NULL;
+
+		packet->meta.flags &= PACKET_META_OFFLOAD;
+		if(vnic->tx_aqm && !aqm_tx(vnic, tx, packet, t)) {
+			stats_output_drop(vnic, VNIC_DROP_TX_AQM, packet_len(packet));
+			nic_free(packet);
+			continue;
+		}
+
+		if(packet->tx_time <= due)
+			return packet;
+
+		if(packet->tx_time - t > vnic->tx_pacing_horizon_ticks) {
+			stats_output_drop(vnic, VNIC_DROP_TX_HORIZON, packet_len(packet));
+			nic_free(packet);
+			continue;
+		}
 
+		pacing_push(vnic, packet);
+	}
+}
+
+// A paced VNIC that got its turn late catches up by at most VNIC_TX_PACING_SLACK bytes
+static void tx_charge(VNIC* vnic, uint64_t t, uint64_t bytes) {
+	if(vnic->tx_pacing) {
+		VNICBucket* bucket = &vnic->tx_bucket;
+		uint64_t slack = (bucket->wait * VNIC_TX_PACING_SLACK) >> VNIC_BUCKET_SHIFT;
+		if(bucket->closed + slack < t)
+			bucket->closed = t - slack;
+		bucket->closed += (bucket->wait * bytes) >> VNIC_BUCKET_SHIFT;
+	} else {
+		vnic_bucket_charge(&vnic->tx_bucket, t, bytes);
+	}
+
+	vnic_bucket_charge(&vnic->tx_min_bucket, t, bytes);
+}
+
+uint64_t vnic_tx_time(VNIC* vnic) {
+	if(!vnic->tx_pacing)
+		return 0;
+
+	uint64_t time = vnic->tx_bucket.closed;
+	if(!vnic->tx_pacing_count)
+		return time;
+
+	// Queued packets may be due now, unless there is no room to hold them
+	if(vnic->tx_pacing_count < VNIC_TX_PACING_SIZE) {
+		for(uint16_t i = 0; i < vnic->queue_count; i++) {
+			if(!queue_empty(nic_queue_pair(vnic->nic, i) + 1))
+				return time;
+		}
+	}
+
+	return vnic->tx_pacings[0].time > time ? vnic->tx_pacings[0].time : time;
+}
+
+VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
+	uint64_t t = timer_frequency();
 	bool transmitted	= false;
+	Packet* packet;
+
+	if(vnic->tx_pacing || vnic->tx_pacing_count) {
+		packet = pacing_next(vnic, t);
+		if(!packet)
+			return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+	} else {
+		NICQueue* tx = vnic_tx_queue(vnic);
+		if(!tx)
+			return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+
+		if(!vnic_bucket_conforms(&vnic->tx_bucket, t))
+			return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+
+		packet = queue_pop(vnic->nic, tx);
 
-	vnic->tx.tail		= vnic->nic->tx.tail;
-	Packet* packet		= queue_pop(vnic->nic, &vnic->tx);
-	vnic->nic->tx.head	= vnic->tx.head;
+		// AQM drops from the head until a packet passes
+		while(packet && vnic->tx_aqm) {
+			packet->meta.flags &= PACKET_META_OFFLOAD;
+			if(aqm_tx(vnic, tx, packet, t))
+				break;
+
+			stats_output_drop(vnic, VNIC_DROP_TX_AQM, packet_len(packet));
+			nic_free(packet);
+			packet = queue_pop(vnic->nic, tx);
+		}
+	}
 
 	if(packet) {
-		uint64_t packet_size = packet->end - packet->start;
-		if(vnic->tx_closed > t)
-			vnic->tx_closed += vnic->tx_wait * packet_size;
-		else
-			vnic->tx_closed = t + vnic->tx_wait * packet_size;
+		uint64_t packet_size = packet_len(packet);
+		packet->meta.flags &= PACKET_META_OFFLOAD;		// Headers may have been rewritten since rx, offload requests stay
+		tx_charge(vnic, t, packet_size);
+
+		// The transmitter may free the packet
+		uint64_t stamp = 0;
+		if(vnic->latency && packet->time)
+			stamp = nic_latency_lap(vnic->nic, packet->time, NIC_LATENCY_TX_QUEUE, NIC_LATENCY_STAGE_COUNT);
 
 		transmitted = transmitter(packet, transmitter_context);
-		if(transmitted) {
-			vnic->output_packets += 1;
-			vnic->output_bytes += packet_size;
+		if(transmitted)
+			stats_output(vnic, 1, packet_size);
+		else
+			stats_output_drop(vnic, VNIC_DROP_TX_REJECTED, packet_size);
+
+		if(stamp && transmitted)
+			nic_latency_lap(vnic->nic, stamp, NIC_LATENCY_TX_DRIVER, NIC_LATENCY_TX);
+	}
+
+	return transmitted ? VNIC_ERROR_NOERROR : VNIC_ERROR_OPERATION_FAILED;
+}
+
+uint32_t vnic_tx_burst(VNIC* vnic, uint32_t (*transmitter)(Packet**, uint32_t, void*), void* transmitter_context, uint32_t count) {
+	uint64_t t = timer_frequency();
+	Packet* packets[count];
+	uint32_t n = 0;
+
+	if(vnic->tx_pacing || vnic->tx_pacing_count) {
+		// Each paced packet waits for the bandwidth the previous ones took
+		for(; n < count && (packets[n] = pacing_next(vnic, t)); n++)
+			tx_charge(vnic, t, packet_len(packets[n]));
+	} else {
+		if(!vnic_bucket_conforms(&vnic->tx_bucket, t))
+			return 0;
+
+		NICQueue* tx = vnic_tx_queue(vnic);
+		if(!tx)
+			return 0;
+
+		uint32_t popped = queue_pop_burst(vnic->nic, tx, packets, count);
+		for(uint32_t i = 0; i < popped; i++) {
+			packets[i]->meta.flags &= PACKET_META_OFFLOAD;
+			if(!vnic->tx_aqm || aqm_tx(vnic, tx, packets[i], t)) {
+				packets[n++] = packets[i];
+			} else {
+				stats_output_drop(vnic, VNIC_DROP_TX_AQM, packet_len(packets[i]));
+				nic_free(packets[i]);
+			}
+		}
+
+		uint64_t bytes = 0;
+		for(uint32_t i = 0; i < n; i++)
+			bytes += packet_len(packets[i]);
+		tx_charge(vnic, t, bytes);
+	}
+
+	if(n == 0)
+		return 0;
+
+	uint32_t sizes[n];
+	uint64_t stamps[n];
+	for(uint32_t i = 0; i < n; i++) {
+		sizes[i] = packet_len(packets[i]);
+		packets[i]->meta.flags &= PACKET_META_OFFLOAD;
+		stamps[i] = vnic->latency && packets[i]->time ?
+			nic_latency_lap(vnic->nic, packets[i]->time, NIC_LATENCY_TX_QUEUE, NIC_LATENCY_STAGE_COUNT) : 0;
+	}
+
+	// The transmitter sends the leading packets; the rest come back to the pool
+	uint32_t sent = transmitter(packets, n, transmitter_context);
+	uint64_t sent_bytes = 0;
+	for(uint32_t i = 0; i < n; i++) {
+		if(i < sent) {
+			sent_bytes += sizes[i];
+			if(stamps[i])
+				nic_latency_lap(vnic->nic, stamps[i], NIC_LATENCY_TX_DRIVER, NIC_LATENCY_TX);
 		} else {
-			vnic->output_drop_packets += 1;
-			vnic->output_drop_bytes += packet_size;
+			stats_output_drop(vnic, VNIC_DROP_TX_REJECTED, sizes[i]);
+			nic_free(packets[i]);
 		}
 	}
 
-	lock_unlock(&vnic->nic->tx.rlock);
-	return transmitted ? VNIC_ERROR_NOERROR : VNIC_ERROR_OPERATION_FAILED;
+	if(sent)
+		stats_output(vnic, sent, sent_bytes);
+
+	return n;
 }
 
 bool vnic_has_stx(VNIC* vnic) {
-	vnic->stx.tail = vnic->nic->stx.tail;
-	return !queue_empty(&vnic->stx);
+	return !queue_empty(&vnic->nic->stx);
 }
 
 VNICError vnic_stx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context) {
 	if(!vnic_has_stx(vnic))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	if(!lock_trylock(&vnic->nic->stx.rlock))
-		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
-
 	bool transmitted	= false;
-
-	vnic->stx.tail		= vnic->nic->stx.tail;
-	Packet* packet		= queue_pop(vnic->nic, &vnic->stx);
-	vnic->nic->stx.head	= vnic->stx.head;
+	Packet* packet		= queue_pop(vnic->nic, &vnic->nic->stx);
 
 	if(packet) {
-		uint64_t packet_size = packet->end - packet->start;
+		uint64_t packet_size = packet_len(packet);
+		packet->meta.flags &= PACKET_META_OFFLOAD;		// Headers may have been rewritten since rx, offload requests stay
 
 		transmitted = transmitter(packet, transmitter_context);
-		if(transmitted) {
-			vnic->output_packets += 1;
-			vnic->output_bytes += packet_size;
-		} else {
-			vnic->output_drop_packets += 1;
-			vnic->output_drop_bytes += packet_size;
-		}
+		if(transmitted)
+			stats_output(vnic, 1, packet_size);
+		else
+			stats_output_drop(vnic, VNIC_DROP_TX_REJECTED, packet_size);
 	}
 
-	lock_unlock(&vnic->nic->stx.rlock);
 	return transmitted ? VNIC_ERROR_NOERROR : VNIC_ERROR_OPERATION_FAILED;
 }
@@ -64,7 +64,7 @@ static int vm_create(int argc, char* argv[]) {
 				;
 				// Suboptions for NIC
 				enum {
-					MAC, DEV, IBUF, OBUF, IBAND, OBAND, HPAD, TPAD, POOL, SLOWPATH,
+					MAC, DEV, IBUF, OBUF, IBAND, OBAND, HPAD, TPAD, POOL, PMODE, MIRROR, QUEUES, SLOWPATH,
 				};
 
 				char* const token[] = {
@@ -77,6 +77,10 @@ static int vm_create(int argc, char* argv[]) {
 					[HPAD]	= "hpad",
 					[TPAD]	= "tpad",
 					[POOL]	= "pool",
+					[PMODE]	= "pmode",
+					[MIRROR] = "mirror",
+					[QUEUES] = "queues",
+					NULL
 				};
 
 				// Default NIC configuration
@@ -122,6 +126,15 @@ static int vm_create(int argc, char* argv[]) {
 						case POOL:
 							nic->pool_size = strtol(value, NULL, 16);
 							break;
+						case PMODE:
+							nic->pool_mode = value && !strcmp(value, "class") ? NIC_POOL_CLASS : NIC_POOL_BITMAP;
+							break;
+						case MIRROR:
+							nic->mirror = true;
+							break;
+						case QUEUES:
+							nic->queue_count = atoi(value);
+							break;
 						default:
 							printf("No match found for token : /%s/\n", value);
 							help();